@@ -7,6 +7,8 @@
 #ifndef STHREAD_H
 #define STHREAD_H 1
 
+#include <stddef.h>
+
 /* Define the sthread_t type (a pointer to an _sthread structure)
  * without knowing how it is actually implemented (that detail is
  * hidden from the public API).
@@ -58,9 +60,143 @@ void sthread_yield(void);
  * start function.  Results are undefined if
  * if the thread was not created with the joinable
  * flag set or if it has already been joined.
+ * The caller sleeps until the thread exits, and
+ * the thread's stack and other resources are freed
+ * before sthread_join returns. (A thread created
+ * without the joinable flag is freed shortly after
+ * it exits, so its sthread_t must not be used after
+ * that.)
  */
 void* sthread_join( sthread_t t);
 
+/**********************************************************************/
+/* Thread-Local Storage                                               */
+/**********************************************************************/
+
+/* The number of keys that can be created */
+#define STHREAD_KEYS_MAX 64
+
+typedef int sthread_key_t;
+typedef void (*sthread_key_destructor_t)(void *);
+
+/* Create a new key for thread-specific data. Every thread's value for
+ * the new key starts out NULL. When a thread exits (by calling
+ * sthread_exit or returning from its start routine), destructor, if not
+ * NULL, is called with that thread's value for the key if the value is
+ * not NULL. Returns -1 if STHREAD_KEYS_MAX keys have been created. */
+sthread_key_t sthread_key_create(sthread_key_destructor_t destructor);
+
+/* Return the calling thread's value for key. */
+void *sthread_getspecific(sthread_key_t key);
+
+/* Set the calling thread's value for key. */
+void sthread_setspecific(sthread_key_t key, void *value);
+
+/**********************************************************************/
+/* Scheduling                                                         */
+/**********************************************************************/
+
+/* The highest priority a thread can be given */
+#define STHREAD_PRIO_MAX 31
+
+/* The weight that threads start with, and the largest allowed */
+#define STHREAD_DEFAULT_WEIGHT 1024
+#define STHREAD_MAX_WEIGHT (1 << 20)
+
+/* Return the calling thread. */
+sthread_t sthread_self(void);
+
+/* Set t's priority, from 0 (the default) up to STHREAD_PRIO_MAX.
+ * A ready thread always runs before any ready thread of lower
+ * priority. Threads of equal nonzero priority take turns round robin;
+ * threads at priority 0 share the CPU in proportion to their weights.
+ * New threads inherit their creator's priority and weight.
+ * Returns 0 on success, or -1 if the priority is out of range or
+ * could not be applied (the pthread implementation maps nonzero
+ * priorities onto SCHED_RR, which normally requires privileges). */
+int sthread_set_priority(sthread_t t, int priority);
+
+/* Set t's weight, from 1 to STHREAD_MAX_WEIGHT. Among threads at
+ * priority 0, one with twice the weight of another gets twice the CPU
+ * time. Returns 0 on success, or -1 if the weight is out of range or
+ * could not be applied (the pthread implementation maps weights onto
+ * nice values, and raising one normally requires privileges). */
+int sthread_set_weight(sthread_t t, int weight);
+
+/**********************************************************************/
+/* CPU Placement                                                      */
+/**********************************************************************/
+
+/* CPUs are numbered as the operating system numbers them, and grouped
+ * into NUMA nodes: sets of CPUs that share the same local memory. */
+
+/* Return the number of CPUs the process may run on, and the number of
+ * nodes they span. */
+int sthread_num_cpus(void);
+int sthread_num_nodes(void);
+
+/* Return the node that cpu belongs to, or -1 if the process may not
+ * run on it. */
+int sthread_cpu_node(int cpu);
+
+/* Restrict t to run only on cpu, or let it run on any CPU if cpu is
+ * -1. Returns 0 on success, or -1 if the process may not run on cpu or
+ * the system can't pin threads. In the user-level implementation all
+ * threads share one kernel thread, so this pins every one of them. */
+int sthread_set_affinity(sthread_t t, int cpu);
+
+typedef enum {
+  STHREAD_PLACE_NONE,     /* leave new threads to the OS (the default) */
+  STHREAD_PLACE_COMPACT,  /* fill each node's CPUs before the next node's */
+  STHREAD_PLACE_SCATTER,  /* spread threads across the nodes in turn */
+} sthread_placement_t;
+
+/* Pin each thread created from now on to a CPU, chosen round robin in
+ * the order that policy gives. A placed thread's stack is allocated on
+ * its CPU's node, and the thread is pinned before it starts running, so
+ * that the memory it touches first, such as its sthread_malloc cache,
+ * is allocated there too. Only the pthread implementation places
+ * threads; the user-level implementation runs every thread on one
+ * kernel thread, which sthread_set_affinity can pin. Returns 0 on
+ * success, or -1 if policy is not supported. */
+int sthread_set_placement(sthread_placement_t policy);
+
+/**********************************************************************/
+/* Statistics and Tracing                                             */
+/**********************************************************************/
+
+/* Per-thread counters, all since the thread was created. */
+typedef struct {
+  unsigned long long cpu_ns;   /* time spent running */
+  unsigned long long wait_ns;  /* time spent ready, waiting for a CPU */
+  unsigned long voluntary_switches;    /* gave up the CPU (yield, block) */
+  unsigned long involuntary_switches;  /* preempted */
+} sthread_stats_t;
+
+/* Fill in stats for thread t, which must not have been joined yet.
+ * Returns 0 on success, or -1 if the counters could not be read (the
+ * pthread implementation reads them from /proc, which drops a thread
+ * as soon as it exits). */
+int sthread_get_stats(sthread_t t, sthread_stats_t *stats);
+
+/* Start recording scheduler events (thread create, switch, block,
+ * wake, exit and preempt) into a ring buffer that keeps the most
+ * recent nevents of them, discarding any earlier trace. A trace may be
+ * started while another is running, without stopping it first; the
+ * earlier trace's buffer stays allocated until the program exits, as a
+ * thread may still be writing to it. Recording costs a few nanoseconds
+ * per event; while no trace is running it costs a single test. Returns
+ * 0 on success, -1 if out of memory. */
+int sthread_trace_start(int nevents);
+
+/* Stop recording. The recorded events are kept for sthread_trace_dump. */
+void sthread_trace_stop(void);
+
+/* Write the recorded events to the file path in the Chrome trace
+ * event JSON format, which chrome://tracing and the Perfetto UI
+ * (ui.perfetto.dev) can load. Returns 0 on success, -1 on error. */
+int sthread_trace_dump(const char *path);
+
 /**********************************************************************/
 /* Synchronization Primitives: Mutexs and Condition Variables         */
 /**********************************************************************/
@@ -96,7 +232,11 @@ void sthread_cond_free(sthread_cond_t cond);
 void sthread_cond_signal(sthread_cond_t cond);
 
 /* Signal that the condition has been met, awakening all waiting
- * threads. */
+ * threads. Only one of them is actually woken right away; the rest are
+ * moved onto the wait queue of the mutex they waited with, and each
+ * runs once the thread before it releases that mutex. (So all threads
+ * waiting on a condition variable at once should use the same mutex.)
+ */
 void sthread_cond_broadcast(sthread_cond_t cond);
 
 /* Block the calling thread until the condition has been signaled.
@@ -106,4 +246,168 @@ void sthread_cond_broadcast(sthread_cond_t cond);
  * 3. Sleeps thread until awoken. */
 void sthread_cond_wait(sthread_cond_t cond, sthread_mutex_t lock);
 
+/**********************************************************************/
+/* Synchronization Primitives: Reader-Writer Locks, Semaphores and    */
+/* Barriers                                                           */
+/**********************************************************************/
+
+typedef struct _sthread_rwlock *sthread_rwlock_t;
+
+/* Return a new, unlocked reader-writer lock. */
+sthread_rwlock_t sthread_rwlock_init(void);
+
+/* Free a no-longer needed reader-writer lock.
+ * Assume the lock is not held and has no waiters. */
+void sthread_rwlock_free(sthread_rwlock_t rwlock);
+
+/* Acquire the lock for reading, blocking while a writer holds it or
+ * is waiting for it (writers are preferred, so a steady stream of
+ * readers can't starve them). Any number of readers may hold the lock
+ * at once. */
+void sthread_rwlock_rdlock(sthread_rwlock_t rwlock);
+
+/* Acquire the lock for writing, blocking until there are no readers
+ * and no other writer. */
+void sthread_rwlock_wrlock(sthread_rwlock_t rwlock);
+
+/* Release the lock, which the calling thread holds for reading or
+ * for writing. */
+void sthread_rwlock_unlock(sthread_rwlock_t rwlock);
+
+
+typedef struct _sthread_sem *sthread_sem_t;
+
+/* Return a new counting semaphore with the given initial value. */
+sthread_sem_t sthread_sem_init(unsigned int value);
+
+/* Free a no-longer needed semaphore.
+ * Assume semaphore has no waiters. */
+void sthread_sem_free(sthread_sem_t sem);
+
+/* Decrement the semaphore, blocking while its value is 0. */
+void sthread_sem_wait(sthread_sem_t sem);
+
+/* Increment the semaphore, waking a waiting thread if there is one. */
+void sthread_sem_post(sthread_sem_t sem);
+
+
+typedef struct _sthread_barrier *sthread_barrier_t;
+
+/* Return a new barrier for count threads (count must be at least 1). */
+sthread_barrier_t sthread_barrier_init(unsigned int count);
+
+/* Free a no-longer needed barrier.
+ * Assume barrier has no waiters. */
+void sthread_barrier_free(sthread_barrier_t barrier);
+
+/* Block until count threads have called sthread_barrier_wait, then
+ * release them all; the barrier is then ready for reuse. Returns
+ * nonzero in exactly one of the released threads, and 0 in the rest. */
+int sthread_barrier_wait(sthread_barrier_t barrier);
+
+/**********************************************************************/
+/* Coroutines                                                         */
+/**********************************************************************/
+
+/* A coroutine is a function with its own (small) stack that runs only
+ * when some thread resumes it, and runs until it yields back to that
+ * thread. Switching between a thread and a coroutine doesn't involve
+ * the scheduler, so it is much cheaper than handing work between two
+ * threads. A coroutine must be resumed by one thread at a time, and
+ * must not block in sthread_join or exit with sthread_exit. One
+ * thread-local storage key is used to implement coroutines. */
+typedef struct _sthread_coro *sthread_coro_t;
+
+/* Default coroutine stack size, in bytes */
+#define STHREAD_CORO_STACK_SIZE (64 * 1024)
+
+/* Return a new coroutine that will run start_routine(arg) on a stack
+ * of stack_size bytes (or STHREAD_CORO_STACK_SIZE, if stack_size is
+ * 0) the first time it is resumed. Returns NULL if out of memory. */
+sthread_coro_t sthread_coro_create(sthread_start_func_t start_routine,
+                                   void *arg, size_t stack_size);
+
+/* Run coro until it next yields or returns. value is returned by the
+ * sthread_coro_yield call that coro is suspended in (and ignored when
+ * coro is first started). Returns the value passed to
+ * sthread_coro_yield, or the value returned by start_routine. Coroutines
+ * may resume other coroutines. Results are undefined if coro has
+ * returned (see sthread_coro_done) or is running. */
+void *sthread_coro_resume(sthread_coro_t coro, void *value);
+
+/* Suspend the calling coroutine, returning value from the
+ * sthread_coro_resume call that is running it. Returns the value
+ * passed to the next sthread_coro_resume of this coroutine. Must be
+ * called from inside a coroutine. */
+void *sthread_coro_yield(void *value);
+
+/* Return nonzero if coro's start_routine has returned. */
+int sthread_coro_done(sthread_coro_t coro);
+
+/* Free a coroutine that isn't running. A suspended coroutine may be
+ * freed, in which case its stack is discarded without unwinding. */
+void sthread_coro_free(sthread_coro_t coro);
+
+/**********************************************************************/
+/* Memory Allocation                                                  */
+/**********************************************************************/
+
+/* Allocate size bytes, aligned for any type, or return NULL if out of
+ * memory. Small blocks come from a cache private to the calling
+ * thread, refilled from and drained to a shared depot in batches, so
+ * most calls take no lock. In the user-level implementation a timer
+ * tick that lands in malloc has to wait for it to return to libsthread
+ * or the application, but sthread_malloc and sthread_free can be
+ * preempted anywhere. Must not be called before sthread_init. */
+void *sthread_malloc(size_t size);
+
+/* Free a block from sthread_malloc (in any thread). ptr may be NULL. */
+void sthread_free(void *ptr);
+
+/**********************************************************************/
+/* Tasks                                                              */
+/**********************************************************************/
+
+/* Tasks are short pieces of work run by a pool of worker threads that
+ * is started the first time a task is spawned, so they cost an
+ * allocation and a queue operation rather than a thread. Each worker
+ * keeps its own queue of tasks and runs the newest first; a worker
+ * that runs out steals the oldest task from another's queue. Tasks may
+ * spawn tasks and wait for them. Tasks use sthread_malloc, one
+ * thread-local storage key, and the threads of the pool. */
+
+typedef void (*sthread_task_func_t)(void *arg);
+typedef void (*sthread_range_func_t)(long begin, long end, void *arg);
+
+/* A set of tasks that can be waited for together */
+typedef struct _sthread_task_group *sthread_task_group_t;
+
+/* Set the number of worker threads (by default, sthread_num_cpus()).
+ * Returns 0 on success, or -1 if nworkers is less than 1 or the pool
+ * has already been started. */
+int sthread_task_set_workers(int nworkers);
+
+/* Return a new, empty task group, or NULL if out of memory. */
+sthread_task_group_t sthread_task_group_create(void);
+
+/* Free a task group. Assume it has no unfinished tasks. */
+void sthread_task_group_free(sthread_task_group_t group);
+
+/* Add a task to group that will run fn(arg) on some worker. If out of
+ * memory, fn(arg) is run by the caller before this returns. */
+void sthread_task_spawn(sthread_task_group_t group, sthread_task_func_t fn,
+                        void *arg);
+
+/* Wait until every task spawned in group (including ones spawned while
+ * waiting) has finished, running queued tasks in the meantime. */
+void sthread_task_wait(sthread_task_group_t group);
+
+/* Call fn(b, e, arg) on subranges [b, e) that together cover
+ * [begin, end), in parallel, and wait for them all to finish. Ranges
+ * are split in half until no longer than grain, as workers come free
+ * to take the halves; a grain of 0 or less picks one that gives each
+ * worker about eight pieces. */
+void sthread_parallel_for(long begin, long end, long grain,
+                          sthread_range_func_t fn, void *arg);
+
 #endif /* STHREAD_H */
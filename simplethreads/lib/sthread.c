@@ -14,6 +14,11 @@
 #include <sthread.h>
 #include <sthread_pthread.h>
 #include <sthread_user.h>
+#include <sthread_trace.h>
+#include <sthread_coro.h>
+#include <sthread_malloc.h>
+#include <sthread_numa.h>
+#include <sthread_task.h>
 
 #ifdef USE_PTHREADS
 #define IMPL_CHOOSE(pthread, user) pthread
@@ -22,7 +27,12 @@
 #endif
 
 void sthread_init(void) {
+  sthread_clock_init();
+  sthread_numa_init();
   IMPL_CHOOSE(sthread_pthread_init(), sthread_user_init());
+  sthread_coro_init();
+  sthread_malloc_init();
+  sthread_task_init();
 }
 
 sthread_t sthread_create(sthread_start_func_t start_routine, void *arg,
@@ -48,6 +58,75 @@ void* sthread_join(sthread_t t) {
   return retptr;
 }
 
+/**********************************************************************/
+/* Thread-Local Storage                                               */
+/**********************************************************************/
+
+sthread_key_t sthread_key_create(sthread_key_destructor_t destructor) {
+  sthread_key_t key;
+  IMPL_CHOOSE(key = sthread_pthread_key_create(destructor),
+              key = sthread_user_key_create(destructor));
+  return key;
+}
+
+void *sthread_getspecific(sthread_key_t key) {
+  void *value;
+  IMPL_CHOOSE(value = sthread_pthread_getspecific(key),
+              value = sthread_user_getspecific(key));
+  return value;
+}
+
+void sthread_setspecific(sthread_key_t key, void *value) {
+  IMPL_CHOOSE(sthread_pthread_setspecific(key, value),
+              sthread_user_setspecific(key, value));
+}
+
+/**********************************************************************/
+/* Scheduling                                                         */
+/**********************************************************************/
+
+sthread_t sthread_self(void) {
+  sthread_t self;
+  IMPL_CHOOSE(self = sthread_pthread_self(), self = sthread_user_self());
+  return self;
+}
+
+int sthread_set_priority(sthread_t t, int priority) {
+  int err;
+  IMPL_CHOOSE(err = sthread_pthread_set_priority(t, priority),
+              err = sthread_user_set_priority(t, priority));
+  return err;
+}
+
+int sthread_set_weight(sthread_t t, int weight) {
+  int err;
+  IMPL_CHOOSE(err = sthread_pthread_set_weight(t, weight),
+              err = sthread_user_set_weight(t, weight));
+  return err;
+}
+
+/**********************************************************************/
+/* CPU Placement                                                      */
+/**********************************************************************/
+
+int sthread_set_affinity(sthread_t t, int cpu) {
+  int err;
+  IMPL_CHOOSE(err = sthread_pthread_set_affinity(t, cpu),
+              err = sthread_user_set_affinity(t, cpu));
+  return err;
+}
+
+/**********************************************************************/
+/* Statistics and Tracing                                             */
+/**********************************************************************/
+
+int sthread_get_stats(sthread_t t, sthread_stats_t *stats) {
+  int err;
+  IMPL_CHOOSE(err = sthread_pthread_get_stats(t, stats),
+              err = sthread_user_get_stats(t, stats));
+  return err;
+}
+
 /**********************************************************************/
 /* Synchronization Primitives: Mutexs and Condition Variables         */
 /**********************************************************************/
@@ -102,3 +181,79 @@ void sthread_cond_wait(sthread_cond_t cond, sthread_mutex_t lock) {
   IMPL_CHOOSE(sthread_pthread_cond_wait(cond, lock),
               sthread_user_cond_wait(cond, lock));
 }
+
+
+/**********************************************************************/
+/* Synchronization Primitives: Reader-Writer Locks, Semaphores and    */
+/* Barriers                                                           */
+/**********************************************************************/
+
+sthread_rwlock_t sthread_rwlock_init(void) {
+  sthread_rwlock_t rwlock;
+  IMPL_CHOOSE(rwlock = sthread_pthread_rwlock_init(),
+              rwlock = sthread_user_rwlock_init());
+  return rwlock;
+}
+
+void sthread_rwlock_free(sthread_rwlock_t rwlock) {
+  IMPL_CHOOSE(sthread_pthread_rwlock_free(rwlock),
+              sthread_user_rwlock_free(rwlock));
+}
+
+void sthread_rwlock_rdlock(sthread_rwlock_t rwlock) {
+  IMPL_CHOOSE(sthread_pthread_rwlock_rdlock(rwlock),
+              sthread_user_rwlock_rdlock(rwlock));
+}
+
+void sthread_rwlock_wrlock(sthread_rwlock_t rwlock) {
+  IMPL_CHOOSE(sthread_pthread_rwlock_wrlock(rwlock),
+              sthread_user_rwlock_wrlock(rwlock));
+}
+
+void sthread_rwlock_unlock(sthread_rwlock_t rwlock) {
+  IMPL_CHOOSE(sthread_pthread_rwlock_unlock(rwlock),
+              sthread_user_rwlock_unlock(rwlock));
+}
+
+
+sthread_sem_t sthread_sem_init(unsigned int value) {
+  sthread_sem_t sem;
+  IMPL_CHOOSE(sem = sthread_pthread_sem_init(value),
+              sem = sthread_user_sem_init(value));
+  return sem;
+}
+
+void sthread_sem_free(sthread_sem_t sem) {
+  IMPL_CHOOSE(sthread_pthread_sem_free(sem),
+              sthread_user_sem_free(sem));
+}
+
+void sthread_sem_wait(sthread_sem_t sem) {
+  IMPL_CHOOSE(sthread_pthread_sem_wait(sem),
+              sthread_user_sem_wait(sem));
+}
+
+void sthread_sem_post(sthread_sem_t sem) {
+  IMPL_CHOOSE(sthread_pthread_sem_post(sem),
+              sthread_user_sem_post(sem));
+}
+
+
+sthread_barrier_t sthread_barrier_init(unsigned int count) {
+  sthread_barrier_t barrier;
+  IMPL_CHOOSE(barrier = sthread_pthread_barrier_init(count),
+              barrier = sthread_user_barrier_init(count));
+  return barrier;
+}
+
+void sthread_barrier_free(sthread_barrier_t barrier) {
+  IMPL_CHOOSE(sthread_pthread_barrier_free(barrier),
+              sthread_user_barrier_free(barrier));
+}
+
+int sthread_barrier_wait(sthread_barrier_t barrier) {
+  int serial;
+  IMPL_CHOOSE(serial = sthread_pthread_barrier_wait(barrier),
+              serial = sthread_user_barrier_wait(barrier));
+  return serial;
+}
@@ -0,0 +1,128 @@
+/*
+ * sthread_coro.c - Asymmetric coroutines, built directly on sthread_ctx.
+ *
+ *    Resuming a coroutine saves the resumer's registers into the
+ *    coroutine's caller context and switches to the coroutine's own
+ *    stack; yielding switches back. Neither involves the scheduler, so
+ *    the same code works under both implementations. The coroutine
+ *    that the calling thread is running (if any) is kept in a
+ *    thread-local storage key, so that sthread_coro_yield knows where to
+ *    return to; each coroutine remembers the one that was running when
+ *    it was resumed, so that coroutines can resume each other.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread.h>
+#include <sthread_ctx.h>
+#include <sthread_coro.h>
+
+/* Smallest stack we give a coroutine. Timer signals (with the user
+ * implementation) are delivered on whatever stack is running, and the
+ * kernel's signal frame alone can take a few kilobytes. */
+#define CORO_MIN_STACK_SIZE (16 * 1024)
+
+struct _sthread_coro {
+  sthread_ctx_t *ctx;      /* the coroutine's own context and stack */
+  sthread_ctx_t *caller;   /* saved context of whoever resumed it */
+  sthread_coro_t prev;     /* coroutine that resumed it, if any */
+  sthread_start_func_t start_routine;
+  void *arg;
+  void *value;             /* passed by resume and yield */
+  int running;
+  int done;
+};
+
+/* The coroutine the calling thread is currently running, or NULL */
+static sthread_key_t current_key = -1;
+
+static void sthread_coro_start(void);
+static void sthread_coro_leave(sthread_coro_t self);
+
+void sthread_coro_init(void) {
+  current_key = sthread_key_create(NULL);
+  assert(current_key != -1);
+}
+
+sthread_coro_t sthread_coro_create(sthread_start_func_t start_routine,
+                                   void *arg, size_t stack_size) {
+  sthread_coro_t coro;
+
+  if (stack_size == 0)
+    stack_size = STHREAD_CORO_STACK_SIZE;
+  if (stack_size < CORO_MIN_STACK_SIZE)
+    stack_size = CORO_MIN_STACK_SIZE;
+
+  coro = (sthread_coro_t)calloc(1, sizeof(struct _sthread_coro));
+  if (coro == NULL)
+    return NULL;
+  coro->ctx = sthread_new_ctx_size(sthread_coro_start, stack_size);
+  coro->caller = sthread_new_blank_ctx();
+  if (coro->ctx == NULL || coro->caller == NULL) {
+    if (coro->ctx != NULL)
+      sthread_free_ctx(coro->ctx);
+    if (coro->caller != NULL)
+      sthread_free_ctx(coro->caller);
+    free(coro);
+    return NULL;
+  }
+  coro->start_routine = start_routine;
+  coro->arg = arg;
+  return coro;
+}
+
+void *sthread_coro_resume(sthread_coro_t coro, void *value) {
+  assert(!coro->running && !coro->done);
+
+  coro->value = value;
+  coro->prev = (sthread_coro_t)sthread_getspecific(current_key);
+  coro->running = 1;
+  sthread_setspecific(current_key, coro);
+  sthread_switch(coro->caller, coro->ctx);
+
+  /* Back from sthread_coro_leave */
+  return coro->value;
+}
+
+void *sthread_coro_yield(void *value) {
+  sthread_coro_t self = (sthread_coro_t)sthread_getspecific(current_key);
+
+  assert(self != NULL);
+  self->value = value;
+  sthread_coro_leave(self);
+
+  /* Resumed again */
+  return self->value;
+}
+
+int sthread_coro_done(sthread_coro_t coro) {
+  return coro->done;
+}
+
+void sthread_coro_free(sthread_coro_t coro) {
+  assert(!coro->running);
+  sthread_free_ctx(coro->ctx);
+  sthread_free_ctx(coro->caller);
+  free(coro);
+}
+
+/* Every coroutine begins here, on its own stack, switched to from
+ * sthread_coro_resume. */
+static void sthread_coro_start(void) {
+  sthread_coro_t self = (sthread_coro_t)sthread_getspecific(current_key);
+
+  self->value = self->start_routine(self->arg);
+  self->done = 1;
+  sthread_coro_leave(self);
+  assert(0); /* a finished coroutine is never resumed */
+}
+
+/* Switch from the running coroutine back to whoever resumed it */
+static void sthread_coro_leave(sthread_coro_t self) {
+  self->running = 0;
+  sthread_setspecific(current_key, self->prev);
+  sthread_switch(self->ctx, self->caller);
+}
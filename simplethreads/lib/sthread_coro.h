@@ -0,0 +1,12 @@
+/*
+ * sthread_coro.h - Private interface to the coroutine implementation
+ *                  (see the Coroutines section of sthread.h).
+ */
+
+#ifndef STHREAD_CORO_H
+#define STHREAD_CORO_H 1
+
+/* Set up the coroutine package; called by sthread_init. */
+void sthread_coro_init(void);
+
+#endif /* STHREAD_CORO_H */
@@ -10,6 +10,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <sthread_ctx.h>
 
@@ -34,19 +35,53 @@
  */
 const size_t sthread_stack_size = 2 * 1024 * 1024;
 
+/* Freed contexts are kept, stack and all, for reuse by sthread_new_ctx,
+ * up to CTX_POOL_MAX of them. A stack this large is mmap()ed by malloc,
+ * so without the pool every thread created would cost an mmap, page
+ * faults on first touch, and an munmap when it is reaped. */
+#define CTX_POOL_MAX 64
+static sthread_ctx_t *ctx_pool[CTX_POOL_MAX];
+static int ctx_pool_size = 0;
+
+static sthread_ctx_t *sthread_alloc_ctx(sthread_ctx_start_func_t func,
+                                        size_t stack_size, int pooled);
 static void sthread_init_stack(sthread_ctx_t *ctx,
                                sthread_ctx_start_func_t func);
 
 sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func) {
   sthread_ctx_t *ctx;
 
+  if (ctx_pool_size > 0) {
+    ctx = ctx_pool[--ctx_pool_size];
+    ctx->sp = ctx->stackbase + ctx->stacksize - 16;
+    sthread_init_stack(ctx, func);
+    return ctx;
+  }
+  return sthread_alloc_ctx(func, sthread_stack_size, 1);
+}
+
+sthread_ctx_t *sthread_new_ctx_size(sthread_ctx_start_func_t func,
+                                    size_t stack_size) {
+  /* Keep the top of the stack 16-byte aligned (see below) */
+  stack_size = (stack_size + 15) & ~(size_t)15;
+  return sthread_alloc_ctx(func, stack_size, 0);
+}
+
+/* Allocate a context and its stack, which will be returned to the pool
+ * when freed if pooled is set. */
+static sthread_ctx_t *sthread_alloc_ctx(sthread_ctx_start_func_t func,
+                                        size_t stack_size, int pooled) {
+  sthread_ctx_t *ctx;
+
   ctx = (sthread_ctx_t*)malloc(sizeof(sthread_ctx_t));
   if (ctx == NULL) {
     fprintf(stderr, "Out of memory (sthread_new_ctx)\n");
     return NULL;
   }
 
-  ctx->stackbase = (char*)malloc(sthread_stack_size);
+  ctx->stacksize = stack_size;
+  ctx->pooled = pooled;
+  ctx->stackbase = (char*)malloc(stack_size);
   if (ctx->stackbase == NULL) {
     free(ctx);
     fprintf(stderr, "Out of memory (sthread_new_ctx)\n");
@@ -57,21 +92,34 @@ sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func) {
    * SP is at the top (highest memory address). The stack pointer is
    * decremented before an item is pushed onto the stack, and is
    * incremented after an item is popped from the stack.
-   * Why do we subtract 16 here? Not sure (this is left over from
-   * i386 code), but I don't think it makes any big difference, except
-   * for reducing the size of the stack by 16 bytes.
+   * Subtracting 16 keeps the top of the stack 16-byte aligned (malloc
+   * returns 16-byte aligned memory on x86_64), which sthread_init_stack
+   * relies on.
    */
-  ctx->sp = ctx->stackbase + sthread_stack_size - 16;
+  ctx->sp = ctx->stackbase + stack_size - 16;
 
   sthread_init_stack(ctx, func);
 
   return ctx;
 }
 
-/* Initialize a stack as if it had been saved by sthread_switch. */
+/* Initialize a stack as if it had been saved by sthread_switch. Only
+ * the initial frame is cleared; touching the rest of the stack would
+ * fault in pages the thread may never use. */
 static void sthread_init_stack(
     sthread_ctx_t *ctx, sthread_ctx_start_func_t func) {
-  memset(ctx->stackbase, 0, sthread_stack_size);
+  memset(ctx->sp - STHREAD_CONTEXT_SIZE - 64, 0, STHREAD_CONTEXT_SIZE + 64);
+
+#ifdef STHREAD_CPU_X86_64
+  /* The x86_64 ABI requires the stack pointer to be 16-byte aligned at
+   * a call instruction, so a function is entered with rsp 8 bytes past
+   * a 16-byte boundary, just below its return address. Push a NULL
+   * return address for the start function (which never returns) so
+   * that the start function is entered with that alignment; otherwise
+   * SSE code in the thread (printf("%f"), for example) faults. */
+  ctx->sp -= sizeof(void *);
+  *((void **)ctx->sp) = NULL;
+#endif
 
   /* Push the address of the thread's starting function onto the stack
    * (decrement the stack pointer, then store the item). This will
@@ -88,6 +136,18 @@ static void sthread_init_stack(
    * of _sthread_switch. The amount of room varies between CPUs, so we
    * get this value from the architecture-specific header file. */
   ctx->sp -= STHREAD_CONTEXT_SIZE;
+
+#ifdef STHREAD_CONTEXT_MXCSR_OFFSET
+  /* A new thread inherits the floating-point control settings (rounding
+   * mode, exception masks) of the thread that creates it, as with
+   * pthread_create(3). */
+  __asm__ __volatile__("stmxcsr %0"
+                       : "=m" (*(uint32_t *)(ctx->sp +
+                                             STHREAD_CONTEXT_MXCSR_OFFSET)));
+  __asm__ __volatile__("fnstcw %0"
+                       : "=m" (*(uint16_t *)(ctx->sp +
+                                             STHREAD_CONTEXT_FPUCW_OFFSET)));
+#endif
 }
 
 /* Create a new sthread_ctx_t, but don't initialize it.
@@ -106,11 +166,17 @@ sthread_ctx_t *sthread_new_blank_ctx() {
   /* Put some bogus values in */
   ctx->sp = (char*)0xbeefcafe;
   ctx->stackbase = NULL;
+  ctx->stacksize = 0;
+  ctx->pooled = 0;
   return ctx;
 }
 
 /* Free resources used by given (not currently running) context. */
 void sthread_free_ctx(sthread_ctx_t *ctx) {
+  if (ctx->pooled && ctx_pool_size < CTX_POOL_MAX) {
+    ctx_pool[ctx_pool_size++] = ctx;
+    return;
+  }
   if (ctx->stackbase) {
     free(ctx->stackbase);
   }
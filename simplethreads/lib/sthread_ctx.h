@@ -11,14 +11,20 @@
 #ifndef STHREAD_CTX_H
 #define STHREAD_CTX_H 1
 
+#include <stddef.h>
+
 #include <sthread.h>
 
 typedef struct _sthread_ctx {
   // Bottom of the stack
   char *stackbase;
+  // Size of the stack, in bytes
+  size_t stacksize;
   // Current stackpointer (if thread is not running).
   // Initialized to stackbase + sthread_stack_size.
   char *sp;
+  // Returned to the pool when freed (made by sthread_new_ctx)
+  int pooled;
 } sthread_ctx_t;
 
 typedef void (*sthread_ctx_start_func_t)(void);
@@ -26,9 +32,22 @@ typedef void (*sthread_ctx_start_func_t)(void);
 /* Make a new context. Note the sthread_ctx_start_func_t is not
  * the same as the sthread_start_func_t; the former takes no arguments
  * and returns nothing, while the later is takes/returns a void*.
+ *
+ * Contexts (and their stacks) are recycled through a pool that
+ * sthread_free_ctx fills, which isn't locked: calls to sthread_new_ctx
+ * and sthread_free_ctx must not run concurrently (for user threads,
+ * make them with interrupts disabled).
  */
 sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func);
 
+/* Make a new context with a stack of the given size, in bytes, rather
+ * than the default (which is large enough for any thread). These
+ * contexts never go through the pool, whatever their size, so they can
+ * be made and freed (by sthread_free_ctx) at any time, without a lock
+ * or interrupts disabled. */
+sthread_ctx_t *sthread_new_ctx_size(sthread_ctx_start_func_t func,
+                                    size_t stack_size);
+
 /* Create a new sthread_ctx_t, but don't initialize it.
  * This new sthread_ctx_t is suitable for use as 'old' in
  * a call to sthread_switch, since sthread_switch is defined to overwrite
@@ -0,0 +1,275 @@
+/*
+ * sthread_malloc.c - A thread-caching allocator for sthreads.
+ *
+ *    Small requests are rounded up to one of NCLASSES size classes.
+ *    Each thread keeps a free list per class in a cache reached through
+ *    a thread-local storage key, so allocating and freeing normally
+ *    touch nothing shared. When a thread's list for a class runs dry it
+ *    takes a batch of objects from the depot (or carves a new batch out
+ *    of a slab from malloc); when the list grows past twice the batch
+ *    size it returns a batch to the depot. Each depot class is protected
+ *    by an sthread mutex.
+ *
+ *    Unlike malloc, which the user-level implementation can't switch
+ *    out of (a tick that lands in libc is deferred), the allocator can
+ *    be preempted anywhere: a thread's cache is only ever touched by
+ *    that thread, and the depot's locks are ordinary sthread mutexes,
+ *    which a preempted holder keeps without anyone spinning on them.
+ *
+ *    Every block is preceded by a 16-byte header that records its size
+ *    class, which keeps blocks 16-byte aligned. Requests larger than
+ *    the biggest class go straight to malloc.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include <sthread.h>
+#include <sthread_malloc.h>
+
+/* Requests up to this size are served from size classes */
+#define MAX_SMALL 32768
+
+/* Size classes are spaced 16 bytes apart up to 128 bytes, then four
+ * per power of two up to MAX_SMALL, so no more than 25% is wasted. */
+#define NCLASSES 44
+#define LARGE_CLASS NCLASSES
+
+/* Bytes of objects moved between a thread cache and the depot at once */
+#define BATCH_BYTES (32 * 1024)
+#define BATCH_MIN 4
+#define BATCH_MAX 64
+
+#define HEADER_SIZE 16
+#define HEADER_MAGIC 0x57a110c5
+
+struct header {
+  uint32_t size_class;
+  uint32_t magic;
+  uint64_t batch_count;  /* in the depot, for the first object of a batch;
+                          * otherwise just keeps blocks 16-byte aligned */
+};
+
+/* Free objects are linked through their first word. In the depot,
+ * batches are linked through the second word of their first object. */
+struct free_obj {
+  struct free_obj *next;
+  struct free_obj *next_batch;
+};
+
+struct cache_bin {
+  struct free_obj *head;
+  int count;
+};
+
+struct thread_cache {
+  struct cache_bin bins[NCLASSES];
+};
+
+struct depot_bin {
+  sthread_mutex_t lock;
+  struct free_obj *batches;  /* at most class_batch[class] objects each */
+};
+
+static size_t class_size[NCLASSES];
+static int class_batch[NCLASSES];
+static int nclasses = 0;
+
+/* Size class for each request size up to 1024, in 16-byte steps */
+static unsigned char small_class[1024 / 16 + 1];
+
+static struct depot_bin depot[NCLASSES];
+
+static sthread_key_t cache_key = -1;
+
+static void sthread_malloc_flush(void *cache);
+
+void sthread_malloc_init(void) {
+  size_t size, step;
+  int c, i;
+
+  /* Build the size classes */
+  for (size = 16; size <= 128; size += 16)
+    class_size[nclasses++] = size;
+  for (size = 128, step = 32; size < MAX_SMALL; step *= 2)
+    for (i = 0; i < 4; i++) {
+      size += step;
+      class_size[nclasses++] = size;
+    }
+  assert(nclasses <= NCLASSES && class_size[nclasses - 1] == MAX_SMALL);
+
+  for (c = 0; c < nclasses; c++) {
+    class_batch[c] = BATCH_BYTES / (class_size[c] + HEADER_SIZE);
+    if (class_batch[c] < BATCH_MIN)
+      class_batch[c] = BATCH_MIN;
+    if (class_batch[c] > BATCH_MAX)
+      class_batch[c] = BATCH_MAX;
+    depot[c].lock = sthread_mutex_init();
+    depot[c].batches = NULL;
+  }
+
+  for (i = 0, c = 0; i <= 1024 / 16; i++) {
+    while (class_size[c] < (size_t)i * 16)
+      c++;
+    small_class[i] = c;
+  }
+
+  cache_key = sthread_key_create(sthread_malloc_flush);
+  assert(cache_key != -1);
+}
+
+/* Return the size class for a request of size bytes (<= MAX_SMALL) */
+static int size_to_class(size_t size) {
+  int c;
+
+  if (size <= 1024)
+    return small_class[(size + 15) / 16];
+  for (c = small_class[1024 / 16]; class_size[c] < size; c++)
+    ;
+  return c;
+}
+
+static struct thread_cache *get_cache(void) {
+  struct thread_cache *cache;
+
+  cache = (struct thread_cache *)sthread_getspecific(cache_key);
+  if (cache == NULL) {
+    cache = (struct thread_cache *)calloc(1, sizeof(struct thread_cache));
+    if (cache == NULL)
+      return NULL;
+    sthread_setspecific(cache_key, cache);
+  }
+  return cache;
+}
+
+/* Fill an empty bin with a batch from the depot, or a new one carved
+ * out of fresh memory. Returns 0 if out of memory. */
+static int refill(struct cache_bin *bin, int c) {
+  struct free_obj *batch;
+  size_t objsize;
+  char *slab;
+  int i;
+
+  sthread_mutex_lock(depot[c].lock);
+  batch = depot[c].batches;
+  if (batch != NULL)
+    depot[c].batches = batch->next_batch;
+  sthread_mutex_unlock(depot[c].lock);
+
+  if (batch != NULL) {
+    bin->head = batch;
+    bin->count = ((struct header *)batch - 1)->batch_count;
+    return 1;
+  }
+
+  objsize = HEADER_SIZE + class_size[c];
+  slab = (char *)malloc(objsize * class_batch[c]);
+  if (slab == NULL)
+    return 0;
+  for (i = 0; i < class_batch[c]; i++) {
+    struct header *h = (struct header *)(slab + i * objsize);
+    struct free_obj *obj = (struct free_obj *)(h + 1);
+    h->size_class = c;
+    h->magic = HEADER_MAGIC;
+    obj->next = bin->head;
+    bin->head = obj;
+  }
+  bin->count += class_batch[c];
+  return 1;
+}
+
+/* Move a batch of n objects (1 <= n <= class_batch[c]) from bin to
+ * the depot */
+static void drain(struct cache_bin *bin, int c, int n) {
+  struct free_obj *batch, *last;
+  int i;
+
+  batch = last = bin->head;
+  for (i = 1; i < n; i++)
+    last = last->next;
+  bin->head = last->next;
+  bin->count -= n;
+  last->next = NULL;
+  ((struct header *)batch - 1)->batch_count = n;
+
+  sthread_mutex_lock(depot[c].lock);
+  batch->next_batch = depot[c].batches;
+  depot[c].batches = batch;
+  sthread_mutex_unlock(depot[c].lock);
+}
+
+/* Key destructor: give an exiting thread's cached objects back to the
+ * depot, where other threads can use them. */
+static void sthread_malloc_flush(void *arg) {
+  struct thread_cache *cache = (struct thread_cache *)arg;
+  struct cache_bin *bin;
+  int c;
+
+  for (c = 0; c < nclasses; c++) {
+    bin = &cache->bins[c];
+    while (bin->count > 0)
+      drain(bin, c, bin->count < class_batch[c] ? bin->count
+                                                : class_batch[c]);
+  }
+  free(cache);
+}
+
+void *sthread_malloc(size_t size) {
+  struct thread_cache *cache;
+  struct cache_bin *bin;
+  struct free_obj *obj;
+  struct header *h;
+  int c;
+
+  if (size > MAX_SMALL) {
+    h = (struct header *)malloc(HEADER_SIZE + size);
+    if (h == NULL)
+      return NULL;
+    h->size_class = LARGE_CLASS;
+    h->magic = HEADER_MAGIC;
+    return h + 1;
+  }
+
+  cache = get_cache();
+  if (cache == NULL)
+    return NULL;
+  c = size_to_class(size);
+  bin = &cache->bins[c];
+  if (bin->head == NULL && !refill(bin, c))
+    return NULL;
+  obj = bin->head;
+  bin->head = obj->next;
+  bin->count--;
+  return obj;
+}
+
+void sthread_free(void *ptr) {
+  struct thread_cache *cache;
+  struct cache_bin *bin;
+  struct free_obj *obj;
+  struct header *h;
+  int c;
+
+  if (ptr == NULL)
+    return;
+  h = (struct header *)ptr - 1;
+  assert(h->magic == HEADER_MAGIC);
+  c = h->size_class;
+  if (c == LARGE_CLASS) {
+    free(h);
+    return;
+  }
+
+  cache = get_cache();
+  assert(cache != NULL);  /* out of memory for a thread cache */
+  bin = &cache->bins[c];
+  obj = (struct free_obj *)ptr;
+  obj->next = bin->head;
+  bin->head = obj;
+  bin->count++;
+  if (bin->count >= 2 * class_batch[c])
+    drain(bin, c, class_batch[c]);
+}
@@ -0,0 +1,12 @@
+/*
+ * sthread_malloc.h - Private interface to the thread-caching allocator
+ *                    (see the Memory Allocation section of sthread.h).
+ */
+
+#ifndef STHREAD_MALLOC_H
+#define STHREAD_MALLOC_H 1
+
+/* Set up the size classes and depot; called by sthread_init. */
+void sthread_malloc_init(void);
+
+#endif /* STHREAD_MALLOC_H */
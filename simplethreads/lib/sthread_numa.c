@@ -0,0 +1,237 @@
+/*
+ * sthread_numa.c - CPU and NUMA node topology, and thread placement.
+ *
+ *    The CPUs the process may run on are read at startup, along with
+ *    the node each belongs to (from /sys/devices/system/node; if that
+ *    isn't there, every CPU is taken to be on node 0). From these two
+ *    placement orders are built: compact, which fills up each node's
+ *    CPUs before moving to the next node, and scatter, which takes one
+ *    CPU from each node in turn. New threads are handed CPUs from the
+ *    current policy's order round robin.
+ *
+ *    Linux places a page on the node of the CPU that first touches it,
+ *    so a thread that is pinned before it starts running (as
+ *    sthread_create does under a placement policy) builds its
+ *    sthread_malloc cache on its own node. Its stack can't be left to
+ *    first touch: pthread_create writes the thread's descriptor and TLS
+ *    at the top of the stack from the creating thread, and glibc's own
+ *    stacks are reused from thread to thread. So a placed thread is
+ *    given a stack mapped here, with its pages bound to its CPU's node
+ *    (mbind) before anything touches them.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#include <sthread.h>
+#include <sthread_numa.h>
+
+/* Nodes beyond this are treated as node 0 */
+#define MAX_NODES 64
+
+/* From linux/mempolicy.h: prefer the given node, but fall back to
+ * others when it is full */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#ifdef STHREAD_HAVE_AFFINITY
+
+static cpu_set_t allowed;              /* CPUs the process may use */
+static int ncpus = 0;                  /* number of CPUs in allowed */
+static int nnodes = 1;                 /* nodes with an allowed CPU */
+static int node_of[CPU_SETSIZE];       /* node of each CPU, or -1 */
+static int compact_order[CPU_SETSIZE];
+static int scatter_order[CPU_SETSIZE];
+
+static volatile sthread_placement_t placement = STHREAD_PLACE_NONE;
+static volatile unsigned placed = 0;   /* threads placed so far */
+
+/* Mark the CPUs in a sysfs cpulist (such as "0-3,8-11") as on node */
+static void read_cpulist(FILE *f, int node) {
+  int lo, hi, cpu;
+
+  while (fscanf(f, "%d", &lo) == 1) {
+    hi = lo;
+    if (fscanf(f, "-%d", &hi) != 1)
+      hi = lo;
+    for (cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+      node_of[cpu] = node;
+    if (fgetc(f) != ',')
+      break;
+  }
+}
+
+void sthread_numa_init(void) {
+  int cpu, node, maxnode, i, n;
+  char path[64];
+  FILE *f;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    CPU_ZERO(&allowed);
+    CPU_SET(0, &allowed);
+  }
+
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    node_of[cpu] = 0;
+  maxnode = 0;
+  for (node = 0; node < MAX_NODES; node++) {
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (f == NULL)
+      continue;
+    read_cpulist(f, node);
+    fclose(f);
+    maxnode = node;
+  }
+
+  /* Compact: allowed CPUs in node order */
+  ncpus = 0;
+  nnodes = 0;
+  for (node = 0; node <= maxnode; node++) {
+    n = ncpus;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowed) && node_of[cpu] == node)
+        compact_order[ncpus++] = cpu;
+    if (ncpus > n)
+      nnodes++;
+  }
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (!CPU_ISSET(cpu, &allowed))
+      node_of[cpu] = -1;
+
+  /* Scatter: the first CPU of each node, then the second, and so on */
+  n = 0;
+  for (i = 0; n < ncpus; i++) {
+    for (node = 0; node <= maxnode; node++) {
+      int seen = 0;
+      for (cpu = 0; cpu < ncpus; cpu++) {
+        if (node_of[compact_order[cpu]] != node)
+          continue;
+        if (seen++ == i) {
+          scatter_order[n++] = compact_order[cpu];
+          break;
+        }
+      }
+    }
+  }
+}
+
+int sthread_numa_place(void) {
+  sthread_placement_t policy = placement;
+  unsigned i;
+
+  if (policy == STHREAD_PLACE_NONE)
+    return -1;
+  i = __sync_fetch_and_add(&placed, 1) % ncpus;
+  return (policy == STHREAD_PLACE_COMPACT) ? compact_order[i]
+                                           : scatter_order[i];
+}
+
+int sthread_numa_cpuset(int cpu, cpu_set_t *set) {
+  if (cpu == -1) {
+    memcpy(set, &allowed, sizeof(cpu_set_t));
+    return 0;
+  }
+  if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))
+    return -1;
+  CPU_ZERO(set);
+  CPU_SET(cpu, set);
+  return 0;
+}
+
+void *sthread_numa_stack_alloc(int cpu, size_t size) {
+  char *stack;
+#ifdef SYS_mbind
+  unsigned long nodemask;
+  int node = sthread_cpu_node(cpu);
+#endif
+
+  stack = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED)
+    return NULL;
+  if (mprotect(stack, getpagesize(), PROT_NONE) == -1) {
+    munmap(stack, size);
+    return NULL;
+  }
+#ifdef SYS_mbind
+  /* If this fails, the pages are placed by first touch, which still
+   * puts all but the top few (written by the creator) on the node */
+  if (node >= 0 && node < (int)(8 * sizeof(nodemask)) - 1) {
+    /* The kernel reads one bit fewer than the maxnode it is passed */
+    nodemask = 1UL << node;
+    syscall(SYS_mbind, stack, size, MPOL_PREFERRED, &nodemask,
+            8 * sizeof(nodemask), 0);
+  }
+#endif
+  return stack;
+}
+
+int sthread_num_cpus(void) {
+  return ncpus;
+}
+
+int sthread_num_nodes(void) {
+  return nnodes;
+}
+
+int sthread_cpu_node(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE)
+    return -1;
+  return node_of[cpu];
+}
+
+int sthread_set_placement(sthread_placement_t policy) {
+  if (policy != STHREAD_PLACE_NONE && policy != STHREAD_PLACE_COMPACT &&
+      policy != STHREAD_PLACE_SCATTER)
+    return -1;
+  placed = 0;
+  placement = policy;
+  return 0;
+}
+
+#else /* !STHREAD_HAVE_AFFINITY */
+
+/* No way to pin threads: one CPU on one node, and no policy applies */
+
+void sthread_numa_init(void) {
+}
+
+int sthread_numa_place(void) {
+  return -1;
+}
+
+void *sthread_numa_stack_alloc(int cpu, size_t size) {
+  return NULL;
+}
+
+int sthread_num_cpus(void) {
+  return 1;
+}
+
+int sthread_num_nodes(void) {
+  return 1;
+}
+
+int sthread_cpu_node(int cpu) {
+  return (cpu == 0) ? 0 : -1;
+}
+
+int sthread_set_placement(sthread_placement_t policy) {
+  return (policy == STHREAD_PLACE_NONE) ? 0 : -1;
+}
+
+#endif /* STHREAD_HAVE_AFFINITY */
+
+void sthread_numa_stack_free(void *stack, size_t size) {
+  munmap(stack, size);
+}
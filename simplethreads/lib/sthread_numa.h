@@ -0,0 +1,45 @@
+/*
+ * sthread_numa.h - CPU and NUMA node topology, and the thread placement
+ *                  policy, shared by both implementations (see the CPU
+ *                  Placement section of sthread.h).
+ */
+
+#ifndef STHREAD_NUMA_H
+#define STHREAD_NUMA_H 1
+
+#include <stddef.h>
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+/* cpu_set_t needs _GNU_SOURCE, which configure only defines on some
+ * CPUs; without it, affinity requests fail. */
+#if defined(HAVE_SCHED_GETAFFINITY) && defined(CPU_SETSIZE)
+#define STHREAD_HAVE_AFFINITY 1
+#endif
+
+/* Read the topology; called by sthread_init. */
+void sthread_numa_init(void);
+
+/* The CPU that the placement policy picks for the next new thread, or
+ * -1 if there is no policy. */
+int sthread_numa_place(void);
+
+#ifdef STHREAD_HAVE_AFFINITY
+/* Fill in set with just cpu, or every CPU the process may use if cpu
+ * is -1. Returns -1 if cpu is not one the process may use. */
+int sthread_numa_cpuset(int cpu, cpu_set_t *set);
+#endif
+
+/* Map a stack of size bytes (a multiple of the page size) for a thread
+ * that will run on cpu, with a guard page at the bottom. Its pages are
+ * bound to cpu's node, whichever thread touches them first, where the
+ * system allows that. Returns NULL if it can't be mapped. */
+void *sthread_numa_stack_alloc(int cpu, size_t size);
+
+/* Unmap a stack from sthread_numa_stack_alloc, once its thread has
+ * exited. */
+void sthread_numa_stack_free(void *stack, size_t size);
+
+#endif /* STHREAD_NUMA_H */
@@ -19,20 +19,20 @@
 
 #include <sys/time.h>
 #include <sys/timeb.h>
+#include <time.h>
 #include <signal.h>
 
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
 
-// #define ITIMER_REAL ITIMER_VIRTUAL
-// #define SIGALRM SIGVTALRM
-// #define ITIMER_REAL ITIMER_PROF
-// #define SIGALRM SIGPROF
-
 #define LOCK_UNLOCKED 0
 #define LOCK_LOCKED 1
 
+/* How long to wait before trying again when a timer interrupt arrives
+ * while the thread is somewhere it can't be preempted, in nanoseconds */
+#define RETRY_NSEC 100000L
+
 int good_interrupts = 0;
 int handled_interrupts = 0;
 int dropped_interrupts = 0;
@@ -40,18 +40,60 @@ int dropped_interrupts = 0;
 int inited = false;
 
 void timer_tick64(int signo, siginfo_t *siginfo, void *context);
-void vtimer_tick(int signo, siginfo_t *siginfo, void *context);
-void vtimer_reset(void);
 
 /* defined in the start.c and end.c files respectively */
 extern void proc_start();
 extern void proc_end();
 
+/* Preemption uses a one-shot POSIX timer on CLOCK_MONOTONIC, which has
+ * high-resolution (hrtimer) expiry; the per-thread CPU-time clocks are
+ * only sampled at the kernel's scheduler tick, which is too coarse for
+ * sub-millisecond slices. The scheduler arms the timer for a full slice
+ * whenever it dispatches a thread while others are waiting, and leaves
+ * it off otherwise, so a lone runnable thread takes no interrupts. */
 static sthread_ctx_start_func_t interruptHandler;
-static int sthread_interrupts_enabled;
-static struct itimerval sthread_period; // stores timer period
-static const int WD_PERIOD = 500000; // watchdog period in usec.
-static int sthread_watchdog_sleep;           // if 0, wd resets itimer_real
+static volatile sig_atomic_t sthread_interrupts_enabled;
+static timer_t sthread_timer;
+static struct timespec sthread_period;  // length of a time slice
+static int sthread_timer_armed;
+static struct timespec sthread_slice_start;  // when the current slice began
+
+/* Preemption state of the running thread. boot_state stands in until
+ * the scheduler dispatches its first thread. */
+static sthread_preempt_state_t boot_state;
+static sthread_preempt_state_t *cur_state = &boot_state;
+
+/* Every registered thread, for sthread_print_stats, plus the combined
+ * histograms of threads that have been unregistered */
+static sthread_preempt_state_t *all_states = NULL;
+static unsigned long exited_overruns[STHREAD_OVERRUN_BUCKETS];
+static int next_state_id = 0;
+
+/* Print how late each thread's preemptions were taken, by bucket */
+static void sthread_print_overrun_stats(void) {
+  static const char *labels[STHREAD_OVERRUN_BUCKETS] = {
+    "0", "<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms"
+  };
+  sthread_preempt_state_t *state;
+  int b;
+
+  if (next_state_id == 0)
+    return;  // no user-level threads
+  printf("slice overruns:\n%8s", "thread");
+  for (b = 0; b < STHREAD_OVERRUN_BUCKETS; b++)
+    printf(" %8s", labels[b]);
+  printf("\n");
+  for (state = all_states; state != NULL; state = state->next) {
+    printf("%8d", state->id);
+    for (b = 0; b < STHREAD_OVERRUN_BUCKETS; b++)
+      printf(" %8lu", state->overruns[b]);
+    printf("\n");
+  }
+  printf("%8s", "exited");
+  for (b = 0; b < STHREAD_OVERRUN_BUCKETS; b++)
+    printf(" %8lu", exited_overruns[b]);
+  printf("\n");
+}
 
 void sthread_print_stats() {
   printf("\ngood interrupts: %d\n", good_interrupts);
@@ -69,6 +111,7 @@ void sthread_print_stats() {
 #ifdef DEBUG_PREEMPT
   printf("handled interrupts: %d\n", handled_interrupts);
 #endif
+  sthread_print_overrun_stats();
 }
 
 void sthread_init_stats() {
@@ -94,156 +137,229 @@ void sthread_init_stats() {
 
 void debug_print_timer_val(const char *name) {
   int ret;
-  struct itimerval it;
+  struct itimerspec it;
 
-  ret = getitimer(ITIMER_REAL, &it);
+  ret = timer_gettime(sthread_timer, &it);
   if (ret != 0) {
-    perror("getitimer(ITIMER_REAL) failed");
+    perror("timer_gettime() failed");
     abort();
   }
-  fprintf(stderr, "TIMER %s:\n\tinterval sec=%ld, usec=%ld\n\tvalue sec=%ld, "
-          "usec=%ld\n", name, it.it_interval.tv_sec, it.it_interval.tv_usec,
-          it.it_value.tv_sec, it.it_value.tv_usec);
+  fprintf(stderr, "TIMER %s:\n\tvalue sec=%ld, nsec=%ld (%s)\n", name,
+          (long)it.it_value.tv_sec, it.it_value.tv_nsec,
+          sthread_timer_armed ? "armed" : "off");
 }
 
-/* Sets the timer value to the value saved in sthread_period, or, if it is 0,
- * then to the full interval. This function only makes sense after
- * sthread_timer_init() has first been called.
- *
- * According to setitimer(2), it seems like this function should be
- * unnecessary - if the itimer interval is set to non-zero, then the itimer
- * is supposed to reset infinitely as far as I can tell. However, I found
- * this to not be the case when the preemption period is set to a very small
- * value, which may cause SIGALRMs to be received repeatedly, e.g. while
- * the previous SIGALRM is still being handled or before interrupts can be
- * disabled or whatnot. Calling this function periodically seems to avoid
- * this problem. */
-void sthread_timer_reset(void) {
+/* Start the timer so that it expires once, after the given time; a
+ * zero time turns it off. */
+static void sthread_timer_set(const struct timespec *when) {
   int ret;
-
-  // Check that value isn't 0.  If it is, then do a full reset.  This
-  // situation occurs when the interval timer was turned off in
-  // timer_tick64() or if the interval timer wasn't properly reset.
-  if (sthread_period.it_value.tv_sec == 0 &&
-      sthread_period.it_value.tv_usec == 0) {
-    sthread_period.it_value.tv_sec = sthread_period.it_interval.tv_sec;
-    sthread_period.it_value.tv_usec = sthread_period.it_interval.tv_usec;
-  }
-
-  ret = setitimer(ITIMER_REAL, &sthread_period, NULL);
-  if (ret != 0) {
-    perror("setitimer(ITIMER_REAL) failed");
-    abort();
-  }
-}
-
-// See comments for sthread_timer_reset
-void vtimer_reset(void) {
-  int ret;
-  struct itimerval it;
+  struct itimerspec it;
 
   it.it_interval.tv_sec = 0;
-  it.it_interval.tv_usec = WD_PERIOD;
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = WD_PERIOD;
-  ret = setitimer(ITIMER_VIRTUAL, &it, NULL);
+  it.it_interval.tv_nsec = 0;
+  it.it_value = *when;
+  ret = timer_settime(sthread_timer, 0, &it, NULL);
   if (ret != 0) {
-    perror("setitimer(ITIMER_VIRTUAL) failed");
+    perror("timer_settime() failed");
     abort();
   }
-  return;
+  sthread_timer_armed = (when->tv_sec != 0 || when->tv_nsec != 0);
 }
 
 void sthread_timer_init(sthread_ctx_start_func_t func, int period) {
   int ret;
   struct sigaction sa;
-  struct sigaction virt_sa;
+  struct sigevent sev;
   sigset_t mask;
-  sigset_t virt_mask;
 
   sthread_init_stats();
   interruptHandler = func;
 
   // interrupts are initially off
   sthread_interrupts_enabled = 0;
-  sthread_watchdog_sleep = 0;
-
-  // Save these values
-  sthread_period.it_value.tv_sec = period/1000000;
-  sthread_period.it_value.tv_usec = period%1000000;
-  sthread_period.it_interval.tv_sec = period/1000000;
-  sthread_period.it_interval.tv_usec = period%1000000;
-
-  // Set up initial signal handler to just ignore SIGALRM.  This is needed in
-  // case the signal fires before splx(LOW) has been called at the end of
-  // sthread_preemption_init().
-  /* See detailed comments in splx(). */
-  // 1) register a system handler
-  sa.sa_flags = SA_SIGINFO|SA_RESTART;
+  sthread_timer_armed = 0;
+
+  sthread_period.tv_sec = period / 1000000;
+  sthread_period.tv_nsec = (period % 1000000) * 1000L;
+
+  // 1) register a system handler. SA_NODEFER leaves SIGALRM unblocked
+  // while the handler runs; the handler may switch to another thread
+  // and not return for a long time, and masking is done in software by
+  // sthread_interrupts_enabled instead (see timer_tick64()).
+  sa.sa_flags = SA_SIGINFO|SA_RESTART|SA_NODEFER;
   sa.sa_sigaction = timer_tick64;
   sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM); // ignore sigvtalarm while handling alarm
   sa.sa_mask = mask;
   ret = sigaction(SIGALRM, &sa, NULL);
   if (ret != 0) {
     perror("sigaction(SIGALRM) failed");
     abort();
   }
-  // 2) Start the interval timer
-  sthread_timer_reset();
-
-  // We'll use the virtual interval timer as a watchdog aganst anything funny
-  // happening with the real (wall time) timer.
-  // 1) Register a signal handler
-  virt_sa.sa_flags = SA_SIGINFO|SA_RESTART;
-  virt_sa.sa_sigaction = vtimer_tick;
-  sigemptyset(&virt_mask);
-  sigaddset(&virt_mask, SIGALRM); // ignore sigalarm while handling vtalarm
-  virt_sa.sa_mask = virt_mask;
-  ret = sigaction(SIGVTALRM, &virt_sa, NULL);
+
+  // 2) Create the timer, disarmed. The scheduler starts it when there
+  // is more than one thread to run.
+  sev.sigev_notify = SIGEV_SIGNAL;
+  sev.sigev_signo = SIGALRM;
+  sev.sigev_value.sival_ptr = NULL;
+  ret = timer_create(CLOCK_MONOTONIC, &sev, &sthread_timer);
   if (ret != 0) {
-    perror("sigaction(SIGVTALRM) failed");
+    perror("timer_create(CLOCK_MONOTONIC) failed");
     abort();
   }
-  // 2) Activate the virtual timer to fire every 100ms
-  vtimer_reset();
 }
 
-void vtimer_tick(int signo, siginfo_t *siginfo, void *context) {
-  if (sthread_watchdog_sleep) {
-    sthread_watchdog_sleep = 0; // wake up next time if not reset
-  } else {
-    fprintf(stderr,
-            ".-------------------------------------------------------------------.\n"
-            "| Warning: The watchdog timer has gone off.  You may have disabled  |\n"
-            "| interrupts for longer than you should.  If you are 100%% sure your |\n"
-            "| code works, then this may indicate a preemption error, so please  |\n"
-            "| contact the TAs.                                                  |\n"
-            "'-------------------------------------------------------------------'\n"
-            );
-    // Force a full reset
-    sthread_period.it_value.tv_sec = sthread_period.it_interval.tv_sec;
-    sthread_period.it_value.tv_sec = sthread_period.it_interval.tv_usec;
-    sthread_timer_reset();
+void sthread_preempt_state_register(sthread_preempt_state_t *state) {
+  int old = sthread_interrupts_enabled;
+
+  sthread_interrupts_enabled = 0;
+  state->id = next_state_id++;
+  state->prev = NULL;
+  state->next = all_states;
+  if (all_states != NULL)
+    all_states->prev = state;
+  all_states = state;
+  sthread_interrupts_enabled = old;
+}
+
+void sthread_preempt_state_unregister(sthread_preempt_state_t *state) {
+  int old = sthread_interrupts_enabled;
+  int b;
+
+  sthread_interrupts_enabled = 0;
+  for (b = 0; b < STHREAD_OVERRUN_BUCKETS; b++)
+    exited_overruns[b] += state->overruns[b];
+  if (state->prev != NULL)
+    state->prev->next = state->next;
+  else
+    all_states = state->next;
+  if (state->next != NULL)
+    state->next->prev = state->prev;
+  sthread_interrupts_enabled = old;
+}
+
+/* Note that the running thread can't be preempted right now, so that
+ * its next safe point preempts it instead. */
+static void sthread_preempt_defer(void) {
+  if (!cur_state->pending) {
+    clock_gettime(CLOCK_MONOTONIC, &cur_state->deferred_at);
+    cur_state->pending = 1;
+  }
+}
+
+/* Record in the running thread's histogram how long past the end of
+ * its slice it ran, and clear any deferred preemption. */
+static void sthread_preempt_account(void) {
+  struct timespec now;
+  long us, limit;
+  int b = 0;
+
+  if (cur_state->pending) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - cur_state->deferred_at.tv_sec) * 1000000L +
+         (now.tv_nsec - cur_state->deferred_at.tv_nsec) / 1000;
+    for (b = 1, limit = 10; b < STHREAD_OVERRUN_BUCKETS - 1 && us >= limit;
+         b++, limit *= 10)
+      ;
+    cur_state->pending = 0;
+  }
+  cur_state->overruns[b]++;
+}
+
+/* Take a deferred preemption from a safe point. Interrupts stay off
+ * while the handler runs, so a tick can't preempt us a second time. */
+static void sthread_preempt_take(void) {
+  sthread_interrupts_enabled = 0;
+  sthread_preempt_account();
+  good_interrupts++;
+  interruptHandler();
+  handled_interrupts++;
+  sthread_interrupts_enabled = 1;
+}
+
+/* Returns nonzero if the current time slice is over; otherwise stores
+ * the time left in it in left. */
+static int sthread_slice_expired(struct timespec *left) {
+  struct timespec now;
+  long ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ns = (sthread_slice_start.tv_sec + sthread_period.tv_sec - now.tv_sec) *
+       1000000000L +
+       (sthread_slice_start.tv_nsec + sthread_period.tv_nsec - now.tv_nsec);
+  if (ns <= 0)
+    return 1;
+  left->tv_sec = ns / 1000000000L;
+  left->tv_nsec = ns % 1000000000L;
+  return 0;
+}
+
+/* Begin a new time slice for the thread being dispatched. contended
+ * says whether any other thread is waiting to run; if not, the timer
+ * stays off until sthread_preemption_contended() is called. Must be
+ * called with interrupts disabled.
+ *
+ * This runs on every context switch, so it avoids system calls: the slice
+ * start is read from the vDSO clock, and a timer that is already
+ * running is left alone. When it expires early, timer_tick64() sees
+ * that the slice has time left and sets the timer again for the rest. */
+void sthread_preemption_new_slice(sthread_preempt_state_t *state,
+                                  int contended) {
+  static const struct timespec off = { 0, 0 };
+
+  // A thread that blocked with a preemption pending has served its overrun
+  if (cur_state->pending)
+    sthread_preempt_account();
+  cur_state = state;
+  cur_state->pending = 0;
+
+#ifndef DISABLE_PREEMPTION
+  if (!inited)
+    return;
+  if (contended) {
+    clock_gettime(CLOCK_MONOTONIC, &sthread_slice_start);
+    if (!sthread_timer_armed)
+      sthread_timer_set(&sthread_period);
+  } else if (sthread_timer_armed) {
+    sthread_timer_set(&off);
   }
+#endif
+}
+
+/* Another thread has become ready to run. If the current thread had
+ * the CPU to itself, start timing its slice now. Must be called with
+ * interrupts disabled. */
+void sthread_preemption_contended(void) {
+#ifndef DISABLE_PREEMPTION
+  if (inited && !sthread_timer_armed && !cur_state->pending) {
+    clock_gettime(CLOCK_MONOTONIC, &sthread_slice_start);
+    sthread_timer_set(&sthread_period);
+  }
+#endif
+}
+
+void sthread_preempt_point(void) {
+#ifndef DISABLE_PREEMPTION
+  while (sthread_interrupts_enabled && cur_state->pending)
+    sthread_preempt_take();
+#endif
 }
 
 #ifdef STHREAD_CPU_X86_64
 void timer_tick64(int signo, siginfo_t *siginfo, void *context) {
-  int ret;
-  sigset_t mask;
+  struct timespec left;
+
+  // The timer is one-shot, so it is off now
+  sthread_timer_armed = 0;
 
-  // Put the watchdog timer back to sleep
-  sthread_watchdog_sleep = 1;
+  // The timer was set for an earlier slice; wait out the rest of this one
+  if (!cur_state->pending && !sthread_slice_expired(&left)) {
+    sthread_timer_set(&left);
+    return;
+  }
 
   if (!sthread_interrupts_enabled) {
-    // Turn off the timer
-    struct itimerval it;
-    it.it_interval.tv_sec = 0;
-    it.it_interval.tv_usec = 0;
-    it.it_value.tv_sec = 0;
-    it.it_value.tv_usec = 0;
-    setitimer(ITIMER_REAL, &it, NULL);
+    // Preempt the thread as soon as it turns interrupts back on
+    sthread_preempt_defer();
     return;
   }
 
@@ -264,46 +380,19 @@ void timer_tick64(int signo, siginfo_t *siginfo, void *context) {
       ip < (uint64_t) proc_end &&
       !(ip >= (uint64_t) Xsthread_switch &&
         ip < (uint64_t) Xsthread_switch_end)) {
-    good_interrupts++;
-
 #ifdef DEBUG_PREEMPT
     sthread_print_stats();
 #endif
 
-    /* Allow SIGALRM to be delivered during interruptHandler() if timer goes
-     * off again - it was automatically set to blocked when this signal
-     * handler was called.
-     *
-     * (PJH: I believe that this is done because it requires students to
-     *  explicitly disable interrupts inside of their own interrupt handler
-     *  function. This creates a race condition between the SIGALRM re-
-     *  enabling here and the interrupt disabling in the interrupt handler
-     *  function, but the effect of this should just be that timer_tick64()
-     *  is called again. If the preemption period is set too low, then this
-     *  could seemingly happen frequently; with a larger preemption period
-     *  it should happen rarely, but the possibility is still present.)
-     *
-     * (jay: I think it's because their interrupt handler switches threads
-     * and so this handler wouldn't return to re-enable SIGALRM and it
-     * would just be disabled for the entire process.) */
-    ret = sigemptyset(&mask);
-    if (ret != 0) {
-      perror("sigemptyset() failed");
-      abort();
-    }
-    ret = sigaddset(&mask, SIGALRM);
-    ret += sigaddset(&mask, SIGVTALRM);
-    if (ret != 0) {
-      perror("sigaddset() failed");
-      abort();
-    }
-    ret = sigprocmask(SIG_UNBLOCK, &mask, NULL);
-    if (ret != 0) {
-      perror("sigprocmask() failed");
-      abort();
-    }
-    interruptHandler();
-    handled_interrupts++;
+    /* The kernel didn't block SIGALRM for this handler (SA_NODEFER),
+     * so there is no signal mask to restore with sigprocmask(), which
+     * used to cost a system call on every preemption; that mattered
+     * because interruptHandler() switches threads and so this handler
+     * might not return to re-enable SIGALRM for a long time.
+     * sthread_preempt_take() turns interrupts off in software while
+     * the interrupt handler runs, so a tick that arrives meanwhile is
+     * deferred rather than nested. */
+    sthread_preempt_take();
   } else {
     /* PJH: I ran test-preempt with a tiny preemption interval and printed
      * out the ip here, then used gdb to check what functions tend to be
@@ -320,15 +409,15 @@ void timer_tick64(int signo, siginfo_t *siginfo, void *context) {
     sthread_print_stats();
 #endif
 
-    /* NOTE: adding debugging printf statements right here seemed to
-     * greatly exacerbate problems with the itimer not being reset when
-     * the preemption period is very small. This would seem to suggest that
-     * these problems are caused by SIGALRM being delivered AGAIN while this
-     * signal handling function is still running, which perhaps causes the
-     * itimer to not be reset as expected.
-     *
-     * Adding calls to sthread_timer_reset() seems to have eliminated these
-     * problems, but keep this in mind for future debugging. */
+    /* The thread is in libc or in the middle of a context switch, where
+     * it can't safely be switched out. Leave the preemption pending for
+     * its next safe point, and try again shortly in case it spends a
+     * long time in libc without reaching one. */
+    sthread_preempt_defer();
+    {
+      static const struct timespec retry = { 0, RETRY_NSEC };
+      sthread_timer_set(&retry);
+    }
   }
 }
 
@@ -374,30 +463,30 @@ void debug_print_sigaction(struct sigaction *sa, const char *name) {
  * HIGH = interrupts OFF
  */
 int splx(int splval) {
-  struct itimerval it;
   int ret = sthread_interrupts_enabled;
 
+#ifdef DISABLE_PREEMPTION
+  // No timer is running, so there is nothing to turn on or off.
+  return LOW;
+#endif
+
   if (!inited) {
     fprintf(stderr, "splx() called before inited set to true!\n");
     abort();
   }
 
   if (splval == HIGH) {
-    // Turn off interrupts.
-    // First save the currentf value on the timer so that when interrupts
-    // are turned back on, this time is used.  Then, flag that they should
-    // be disabled next time SIGALRM is delivered.
-    getitimer(ITIMER_REAL, &it);
-    sthread_period.it_value.tv_sec = it.it_value.tv_sec;
-    sthread_period.it_value.tv_usec = it.it_value.tv_usec;
+    // Turn off interrupts. The timer keeps running; if it expires before
+    // interrupts are turned back on, timer_tick64() leaves the preemption
+    // pending, so no thread can hog all the time by abusing functions
+    // that use splx internally.
     sthread_interrupts_enabled = 0;
   } else {
-    // Turn on interrupts.
-    // Set the enabled flag high and reset the timer.  Reset here will use
-    // the values saved above so that no thread can hog all the time by
-    // abusing functions that use splx internally.
+    // Turn on interrupts, then take any preemption that came due while
+    // they were off.
     sthread_interrupts_enabled = 1;
-    sthread_timer_reset();
+    while (cur_state->pending)
+      sthread_preempt_take();
   }
   return ret;
 }
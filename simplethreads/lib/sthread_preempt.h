@@ -3,6 +3,8 @@
 
 #include <sthread_ctx.h>
 #include <stdint.h>
+#include <signal.h>
+#include <time.h>
 
 #define HIGH 0
 #define LOW  1
@@ -14,9 +16,43 @@
 typedef uint32_t lock_t;
 
 
-/* start preemption - func will be called every period microseconds */
+/* start preemption - func will be called when a thread has run for
+ * period microseconds while other threads were waiting to run */
 void sthread_preemption_init(sthread_ctx_start_func_t func, int period);
 
+/* Number of buckets in a slice-overrun histogram. Bucket 0 counts
+ * preemptions taken as soon as the slice ran out; bucket i > 0 counts
+ * those deferred by less than 10^i microseconds, and the last bucket
+ * everything longer. */
+#define STHREAD_OVERRUN_BUCKETS 7
+
+/* Per-thread preemption state, embedded in each thread by the
+ * scheduler. A timer tick that lands where the thread can't safely be
+ * switched out (in libc, or with interrupts off) sets pending, and the
+ * preemption is taken at the thread's next safe point. */
+typedef struct sthread_preempt_state {
+  volatile sig_atomic_t pending;
+  struct timespec deferred_at;  /* when pending was set */
+  int id;
+  unsigned long overruns[STHREAD_OVERRUN_BUCKETS];
+  struct sthread_preempt_state *next, *prev;  /* list of all threads */
+} sthread_preempt_state_t;
+
+/* Add or remove a thread's state from the list reported by
+ * sthread_print_stats. Registering assigns state->id. */
+void sthread_preempt_state_register(sthread_preempt_state_t *state);
+void sthread_preempt_state_unregister(sthread_preempt_state_t *state);
+
+/* Tell the preemption timer that the thread owning state was dispatched;
+ * contended is nonzero if other threads are waiting to run. Call with
+ * interrupts off. */
+void sthread_preemption_new_slice(sthread_preempt_state_t *state,
+                                  int contended);
+
+/* Tell the preemption timer that a thread other than the current one
+ * became ready to run. Call with interrupts off. */
+void sthread_preemption_contended(void);
+
 /* Turns inturrupts ON and off 
  * Returns the last state of the inturrupts
  * LOW = inturrupts ON
@@ -24,6 +60,10 @@ void sthread_preemption_init(sthread_ctx_start_func_t func, int period);
  */
 int splx(int splval);
 
+/* A library safe point: if interrupts are on and a preemption of the
+ * current thread was deferred, take it now. */
+void sthread_preempt_point(void);
+
 /*
  * atomic_test_and_set - using the native compare and exchange on the 
  * Intel x86.
@@ -42,7 +82,8 @@ void atomic_clear(lock_t *l);
 
 /*
  * sthread_print_stats - prints out the number of drupped interrupts
- *   and "successful" interrupts
+ *   and "successful" interrupts, and each thread's slice-overrun
+ *   histogram
  */
 void sthread_print_stats();
 
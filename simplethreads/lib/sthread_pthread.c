@@ -21,20 +21,70 @@
 #endif
 
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #include <stdlib.h>
 #include <assert.h>
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #endif
+#include <semaphore.h>
 #include <stdio.h>
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 
 #include <sthread.h>
+#include <sthread_pthread.h>
+#include <sthread_trace.h>
+#include <sthread_numa.h>
+
+/* Number of passes made over a thread's keys at exit, in case
+ * destructors set new values */
+#define DESTRUCTOR_ITERATIONS 4
 
 struct _sthread {
   pthread_t pth;
+  sthread_start_func_t start_routine;
+  void *arg;
+  void *specific[STHREAD_KEYS_MAX];  /* thread-local storage slots */
+  volatile int tid;     /* kernel thread id, once the thread has started */
+  volatile int weight;  /* last weight requested by sthread_set_weight */
+  int creator_tid;      /* tid of the thread that created this one */
+  int joinable;
+  void *stack;          /* the stack mapped for a placed thread, or NULL */
+  size_t stack_size;
+  struct _sthread *next_dead;  /* on the dead list (see below) */
 };
 
+/* The calling thread's struct _sthread. Threads not started by
+ * sthread_create (i.e. the main thread) get one on first use. */
+static __thread sthread_t self = NULL;
+
+/* Threads created detached, but with a stack of our own, are really
+ * left joinable, and put themselves on this list when they exit; the
+ * next sthread_create joins them and frees their stacks, which they
+ * are still running on until the very end. */
+static sthread_t volatile dead = NULL;
+
+/* Thread-local storage keys; key_destructors[k] is valid for k < nkeys */
+static int nkeys = 0;
+static sthread_key_destructor_t key_destructors[STHREAD_KEYS_MAX];
+
+static void *sthread_pthread_start(void *arg);
+static void sthread_pthread_retire(sthread_t t);
+static void sthread_pthread_reap(void);
+static void sthread_pthread_run_destructors(sthread_t t);
+static int sthread_pthread_gettid(void);
+static int sthread_pthread_apply_weight(sthread_t t);
+
 #if !defined(HAVE_SCHED_YIELD) && defined(HAVE_SELECT)
 const int sthread_select_sec_timeout = 0;
 const int sthread_select_usec_timeout = 1;
@@ -47,19 +97,111 @@ void sthread_pthread_init(void) {
 sthread_t sthread_pthread_create(
     sthread_start_func_t start_routine, void *arg, int joinable) {
   sthread_t sth;
+  pthread_attr_t attr;
+#ifdef STHREAD_HAVE_AFFINITY
+  cpu_set_t set;
+  size_t size;
+  int cpu;
+#endif
   int err;
 
-  sth = malloc(sizeof(struct _sthread));
+  sthread_pthread_reap();
 
-  err = pthread_create(&(sth->pth), NULL, start_routine, arg);
-  if (!err && !joinable) {
-    err = pthread_detach(sth->pth);
+  sth = calloc(1, sizeof(struct _sthread));
+  if (sth == NULL)
+    return NULL;
+  sth->start_routine = start_routine;
+  sth->arg = arg;
+  sth->creator_tid = sthread_pthread_self()->tid;
+  sth->joinable = joinable;
+
+  pthread_attr_init(&attr);
+#ifdef STHREAD_HAVE_AFFINITY
+  /* Pin the thread before it runs, so that the memory it first touches
+   * (its sthread_malloc cache) is allocated on its own node, and give it
+   * a stack on that node too, the size glibc would have used */
+  cpu = sthread_numa_place();
+  if (cpu >= 0 && sthread_numa_cpuset(cpu, &set) == 0) {
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    if (pthread_attr_getstacksize(&attr, &size) == 0 &&
+        (sth->stack = sthread_numa_stack_alloc(cpu, size)) != NULL) {
+      sth->stack_size = size;
+      pthread_attr_setstack(&attr, sth->stack, size);
+    }
+  }
+#endif
+  /* A detached thread frees sth itself when it exits, possibly before
+   * pthread_create returns, so it must be created detached rather than
+   * detached afterwards. */
+  if (!joinable && sth->stack == NULL)
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create(&(sth->pth), &attr, sthread_pthread_start, sth);
+  pthread_attr_destroy(&attr);
+  if (err) {
+    if (sth->stack != NULL)
+      sthread_numa_stack_free(sth->stack, sth->stack_size);
+    free(sth);
+    return NULL;
   }
 
   return sth;
 }
 
+/* All threads created by sthread_pthread_create begin here */
+static void *sthread_pthread_start(void *arg) {
+  void *ret;
+
+  self = (sthread_t)arg;
+  self->tid = sthread_pthread_gettid();
+  __sync_synchronize();
+  if (self->weight != 0)
+    sthread_pthread_apply_weight(self);
+  STHREAD_TRACE(STHREAD_TRACE_CREATE, self->creator_tid, self->tid);
+
+  ret = self->start_routine(self->arg);
+  sthread_pthread_run_destructors(self);
+  STHREAD_TRACE(STHREAD_TRACE_EXIT, self->tid, 0);
+  if (!self->joinable)
+    sthread_pthread_retire(self);
+  return ret;
+}
+
+/* Finish with a detached thread that is exiting: free t now, or leave
+ * it to be reaped if it is running on a stack of ours. */
+static void sthread_pthread_retire(sthread_t t) {
+  sthread_t head;
+
+  if (t->stack == NULL) {
+    free(t);
+    return;
+  }
+  do {
+    head = dead;
+    t->next_dead = head;
+  } while (!__sync_bool_compare_and_swap(&dead, head, t));
+}
+
+/* Join the threads on the dead list, and free them and their stacks */
+static void sthread_pthread_reap(void) {
+  sthread_t t, next;
+
+  if (dead == NULL)
+    return;
+  for (t = __sync_lock_test_and_set(&dead, NULL); t != NULL; t = next) {
+    next = t->next_dead;
+    pthread_join(t->pth, NULL);
+    sthread_numa_stack_free(t->stack, t->stack_size);
+    free(t);
+  }
+}
+
 void sthread_pthread_exit(void *ret) {
+  sthread_pthread_run_destructors(sthread_pthread_self());
+  STHREAD_TRACE(STHREAD_TRACE_EXIT, self->tid, 0);
+  /* Threads not started by sthread_create (e.g. main) aren't joinable
+   * through us either, so their struct is never needed again */
+  if (!self->joinable)
+    sthread_pthread_retire(self);
   pthread_exit(ret);
   assert(0); /* pthread_exit should never return */
 }
@@ -83,82 +225,496 @@ void* sthread_pthread_join(sthread_t t) {
   if ( pthread_join(t->pth, &result) ) {
     result = NULL;
   }
+  if (t->stack != NULL)
+    sthread_numa_stack_free(t->stack, t->stack_size);
+  free(t);
   return result;
 }
 
+
+/**********************************************************************/
+/* Thread-Local Storage                                               */
+/**********************************************************************/
+
+sthread_key_t sthread_pthread_key_create(sthread_key_destructor_t destructor) {
+  sthread_key_t key;
+
+  key = __sync_fetch_and_add(&nkeys, 1);
+  if (key >= STHREAD_KEYS_MAX) {
+    __sync_fetch_and_sub(&nkeys, 1);
+    return -1;
+  }
+  key_destructors[key] = destructor;
+  return key;
+}
+
+void *sthread_pthread_getspecific(sthread_key_t key) {
+  assert(key >= 0 && key < STHREAD_KEYS_MAX);
+  return sthread_pthread_self()->specific[key];
+}
+
+void sthread_pthread_setspecific(sthread_key_t key, void *value) {
+  assert(key >= 0 && key < STHREAD_KEYS_MAX);
+  sthread_pthread_self()->specific[key] = value;
+}
+
+/**********************************************************************/
+/* Scheduling                                                         */
+/**********************************************************************/
+
+sthread_t sthread_pthread_self(void) {
+  if (self == NULL) {
+    self = calloc(1, sizeof(struct _sthread));
+    assert(self != NULL);
+    self->pth = pthread_self();
+    self->tid = sthread_pthread_gettid();
+  }
+  return self;
+}
+
+int sthread_pthread_set_affinity(sthread_t t, int cpu) {
+#ifdef STHREAD_HAVE_AFFINITY
+  cpu_set_t set;
+
+  if (sthread_numa_cpuset(cpu, &set) < 0)
+    return -1;
+  return pthread_setaffinity_np(t->pth, sizeof(set), &set) ? -1 : 0;
+#else
+  return -1;
+#endif
+}
+
+/* Nonzero priorities become SCHED_RR priorities, in the same order */
+int sthread_pthread_set_priority(sthread_t t, int priority) {
+  struct sched_param param;
+  int policy;
+
+  if (priority < 0 || priority > STHREAD_PRIO_MAX)
+    return -1;
+
+  memset(&param, 0, sizeof(param));
+  if (priority == 0) {
+    policy = SCHED_OTHER;
+  } else {
+    policy = SCHED_RR;
+    param.sched_priority = sched_get_priority_min(SCHED_RR) + priority - 1;
+  }
+  return pthread_setschedparam(t->pth, policy, &param) == 0 ? 0 : -1;
+}
+
+/* Weights become nice values, the way Linux maps them the other way:
+ * each nice level is worth 25% more or less CPU than the next, and
+ * nice 0 is STHREAD_DEFAULT_WEIGHT. */
+int sthread_pthread_set_weight(sthread_t t, int weight) {
+  if (weight < 1 || weight > STHREAD_MAX_WEIGHT)
+    return -1;
+
+  /* If t hasn't started yet it doesn't have a tid; it will apply the
+   * weight itself when it starts (sthread_pthread_start checks weight
+   * after publishing tid, and we check tid after publishing weight, so
+   * at least one of us sees the other). */
+  t->weight = weight;
+  __sync_synchronize();
+  if (t->tid == 0)
+    return 0;
+  return sthread_pthread_apply_weight(t);
+}
+
+static int sthread_pthread_apply_weight(sthread_t t) {
+#if defined(HAVE_SYS_RESOURCE_H) && defined(SYS_gettid)
+  long w = STHREAD_DEFAULT_WEIGHT;
+  int nice = 0;
+
+  /* Step towards the nice level whose weight is nearest */
+  while (nice < 19 && t->weight < w * 9 / 10) {
+    w = w * 4 / 5;
+    nice++;
+  }
+  while (nice > -20 && t->weight > w * 11 / 10) {
+    w = w * 5 / 4;
+    nice--;
+  }
+  return setpriority(PRIO_PROCESS, t->tid, nice) == 0 ? 0 : -1;
+#else
+  return -1;
+#endif
+}
+
+/* Counters come from the kernel: /proc/self/task/<tid>/schedstat holds
+ * the time the thread has spent on a CPU and waiting on a run queue, in
+ * nanoseconds, and .../status the number of context switches. */
+int sthread_pthread_get_stats(sthread_t t, sthread_stats_t *stats) {
+  char path[64], line[128];
+  FILE *f;
+  int n;
+
+  memset(stats, 0, sizeof(*stats));
+  if (t->tid == 0)
+    return 0;  /* hasn't started running yet */
+  if (t->tid < 0)
+    return -1;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", t->tid);
+  f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  n = fscanf(f, "%llu %llu", &stats->cpu_ns, &stats->wait_ns);
+  fclose(f);
+  if (n != 2)
+    return -1;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%d/status", t->tid);
+  f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    sscanf(line, "voluntary_ctxt_switches: %lu", &stats->voluntary_switches);
+    sscanf(line, "nonvoluntary_ctxt_switches: %lu",
+           &stats->involuntary_switches);
+  }
+  fclose(f);
+  return 0;
+}
+
+/* Return the kernel's id for the calling thread, or -1 if unknown */
+static int sthread_pthread_gettid(void) {
+#ifdef SYS_gettid
+  return (int)syscall(SYS_gettid);
+#else
+  return -1;
+#endif
+}
+
+/* Call the destructor for each of t's non-NULL keys */
+static void sthread_pthread_run_destructors(sthread_t t) {
+  sthread_key_destructor_t destructor;
+  void *value;
+  int i, key, again;
+
+  for (i = 0; i < DESTRUCTOR_ITERATIONS; i++) {
+    again = 0;
+    for (key = 0; key < nkeys && key < STHREAD_KEYS_MAX; key++) {
+      destructor = key_destructors[key];
+      value = t->specific[key];
+      if (value != NULL && destructor != NULL) {
+        t->specific[key] = NULL;
+        destructor(value);
+        again = 1;
+      }
+    }
+    if (!again)
+      break;
+  }
+}
+
+
 /**********************************************************************/
 /* Synchronization Primitives: Mutexs and Condition Variables         */
 /**********************************************************************/
 
-/* In the pthreads implementation, sthread_mutex_t is just
- * a wrapper for pthread_mutext_t. (And similarly for sthread_cond_t.)
+/* Mutexes and condition variables are built directly on futexes (on
+ * Linux; elsewhere sthread_futex_wait just yields, which futex users
+ * must tolerate anyway as a spurious wakeup). This lets a contended
+ * lock spin briefly in user space before sleeping, and lets an
+ * uncontended lock or unlock complete with a single atomic instruction.
  */
+
+/* Number of times sthread_pthread_mutex_lock retries the lock word
+ * before sleeping in the kernel. */
+static const int MUTEX_SPIN_COUNT = 100;
+
+#if defined(STHREAD_CPU_I386) || defined(STHREAD_CPU_X86_64)
+#define CPU_RELAX() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define CPU_RELAX() ((void)0)
+#endif
+
+/* Sleep as long as *addr still contains val. May return spuriously. */
+static void sthread_futex_wait(volatile int *addr, int val) {
+  STHREAD_TRACE(STHREAD_TRACE_BLOCK, sthread_pthread_self()->tid, 0);
+#ifdef HAVE_LINUX_FUTEX_H
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+  sthread_pthread_yield();
+#endif
+}
+
+/* Wake up to nwake threads sleeping on addr */
+static void sthread_futex_wake(volatile int *addr, int nwake) {
+  /* The kernel doesn't tell us which threads it woke */
+  STHREAD_TRACE(STHREAD_TRACE_WAKE, sthread_pthread_self()->tid, -1);
+#ifdef HAVE_LINUX_FUTEX_H
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nwake, NULL, NULL, 0);
+#endif
+}
+
+/* Wake up to nwake threads sleeping on addr, and move the rest to sleep
+ * on addr2 instead, provided *addr still contains val. Returns -1 if
+ * it didn't (nothing is done then), 0 otherwise. */
+static int sthread_futex_requeue(volatile int *addr, int nwake, int val,
+                                 volatile int *addr2) {
+  STHREAD_TRACE(STHREAD_TRACE_WAKE, sthread_pthread_self()->tid, -1);
+#ifdef HAVE_LINUX_FUTEX_H
+  return syscall(SYS_futex, addr, FUTEX_CMP_REQUEUE_PRIVATE, nwake,
+                 (void *)(long)INT_MAX, addr2, val) < 0 ? -1 : 0;
+#else
+  return 0;
+#endif
+}
+
+/* Mutex states */
+#define MUTEX_UNLOCKED  0
+#define MUTEX_LOCKED    1  /* locked, no thread sleeping on it */
+#define MUTEX_CONTENDED 2  /* locked, threads may be sleeping on it */
+
 struct _sthread_mutex {
-  pthread_mutex_t plock;
+  volatile int state;
 };
 
 sthread_mutex_t sthread_pthread_mutex_init() {
   sthread_mutex_t lock;
   lock = (sthread_mutex_t)malloc(sizeof(struct _sthread_mutex));
   assert(lock != NULL);
-  pthread_mutex_init(&(lock->plock), NULL);
+  lock->state = MUTEX_UNLOCKED;
   return lock;
 }
 
 void sthread_pthread_mutex_free(sthread_mutex_t lock) {
-  if (pthread_mutex_destroy(&(lock->plock)) != 0) {
-    fprintf(stderr, "pthread_mutex_destroy failed: mutex not unlocked\n");
+  if (lock->state != MUTEX_UNLOCKED) {
+    fprintf(stderr, "sthread_mutex_free failed: mutex not unlocked\n");
     abort();
   }
   free(lock);
 }
 
+/* Sleep until the mutex can be taken. Leaves it marked contended, since
+ * we can't tell whether other sleepers remain. */
+static void sthread_pthread_mutex_lock_slow(sthread_mutex_t lock, int c) {
+  if (c != MUTEX_CONTENDED)
+    c = __sync_lock_test_and_set(&lock->state, MUTEX_CONTENDED);
+  while (c != MUTEX_UNLOCKED) {
+    sthread_futex_wait(&lock->state, MUTEX_CONTENDED);
+    c = __sync_lock_test_and_set(&lock->state, MUTEX_CONTENDED);
+  }
+}
+
 void sthread_pthread_mutex_lock(sthread_mutex_t lock) {
-  int err;
-  if ((err = pthread_mutex_lock(&(lock->plock))) != 0) {
-    fprintf(stderr, "pthred_mutex_lock error: %s", strerror(err));
-    abort();
+  int c, i;
+
+  for (i = 0; i < MUTEX_SPIN_COUNT; i++) {
+    c = __sync_val_compare_and_swap(&lock->state, MUTEX_UNLOCKED,
+                                    MUTEX_LOCKED);
+    if (c == MUTEX_UNLOCKED)
+      return;
+    if (c == MUTEX_CONTENDED)
+      break;  /* others are already asleep; don't jump the queue */
+    CPU_RELAX();
   }
+
+  sthread_pthread_mutex_lock_slow(lock, c);
 }
 
 void sthread_pthread_mutex_unlock(sthread_mutex_t lock) {
-  int err;
-  if ((err = pthread_mutex_unlock(&(lock->plock))) != 0) {
-    fprintf(stderr, "pthred_mutex_unlock error: %s\n", strerror(err));
-    abort();
+  if (__sync_fetch_and_sub(&lock->state, 1) != MUTEX_LOCKED) {
+    __sync_lock_release(&lock->state);
+    sthread_futex_wake(&lock->state, 1);
   }
 }
 
 
+/* A condition variable is a sequence number that is bumped on every
+ * signal; waiters sleep until it changes.
+ *
+ * A broadcast wakes only one waiter and requeues the rest onto the
+ * mutex they waited with ("wait morphing"), since all but one would
+ * just go back to sleep on the mutex anyway. The woken waiter takes
+ * the mutex in the contended state, so its unlock wakes the next of
+ * them, and so on down the line. */
 struct _sthread_cond {
-  pthread_cond_t pcond;
+  volatile int seq;
+  sthread_mutex_t volatile lock;  /* the mutex waiters last waited with */
 };
 
 sthread_cond_t sthread_pthread_cond_init(void) {
   sthread_cond_t cond;
   cond = (sthread_cond_t)malloc(sizeof(struct _sthread_cond));
   assert(cond != NULL);
-  pthread_cond_init(&(cond->pcond), NULL);
+  cond->seq = 0;
+  cond->lock = NULL;
   return cond;
 }
 
 void sthread_pthread_cond_free(sthread_cond_t cond) {
-  if (pthread_cond_destroy(&(cond->pcond)) != 0) {
-    fprintf(stderr, "pthread_cond_destroy failed: cond has waiters\n");
-    abort();
-  }
   free(cond);
 }
 
 void sthread_pthread_cond_signal(sthread_cond_t cond) {
-  pthread_cond_signal(&(cond->pcond));
+  __sync_fetch_and_add(&cond->seq, 1);
+  sthread_futex_wake(&cond->seq, 1);
 }
 
 void sthread_pthread_cond_broadcast(sthread_cond_t cond) {
-  pthread_cond_broadcast(&(cond->pcond));
+  sthread_mutex_t lock;
+  int seq;
+
+  seq = __sync_add_and_fetch(&cond->seq, 1);
+  lock = cond->lock;
+  if (lock == NULL)
+    return;  /* nobody has ever waited */
+
+  /* If another signal got in first, requeueing would fail; wake
+   * everyone rather than retry. */
+  if (sthread_futex_requeue(&cond->seq, 1, seq, &lock->state) < 0)
+    sthread_futex_wake(&cond->seq, INT_MAX);
 }
 
 void sthread_pthread_cond_wait(sthread_cond_t cond,
                                sthread_mutex_t lock) {
-  pthread_cond_wait(&(cond->pcond), &(lock->plock));
+  int seq;
+
+  /* Publish the mutex before reading seq, so a broadcast that we sleep
+   * through sees it. */
+  cond->lock = lock;
+  __sync_synchronize();
+  seq = cond->seq;
+
+  sthread_pthread_mutex_unlock(lock);
+  sthread_futex_wait(&cond->seq, seq);
+
+  /* Other waiters may have been woken with us, so take the lock in the
+   * contended state to make sure our unlock wakes the next of them. */
+  sthread_pthread_mutex_lock_slow(lock, MUTEX_LOCKED);
+}
+
+/**********************************************************************/
+/* Synchronization Primitives: Reader-Writer Locks, Semaphores and    */
+/* Barriers                                                           */
+/**********************************************************************/
+
+/* These map directly onto the native primitives, which already sleep
+ * on futexes and take uncontended operations in user space. */
+
+struct _sthread_rwlock {
+  pthread_rwlock_t prwlock;
+};
+
+sthread_rwlock_t sthread_pthread_rwlock_init(void) {
+  sthread_rwlock_t rwlock;
+  pthread_rwlockattr_t attr;
+
+  rwlock = (sthread_rwlock_t)malloc(sizeof(struct _sthread_rwlock));
+  assert(rwlock != NULL);
+  pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+  /* glibc prefers readers by default, which can starve writers */
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(&(rwlock->prwlock), &attr);
+  pthread_rwlockattr_destroy(&attr);
+  return rwlock;
+}
+
+void sthread_pthread_rwlock_free(sthread_rwlock_t rwlock) {
+  if (pthread_rwlock_destroy(&(rwlock->prwlock)) != 0) {
+    fprintf(stderr, "pthread_rwlock_destroy failed: rwlock not unlocked\n");
+    abort();
+  }
+  free(rwlock);
+}
+
+void sthread_pthread_rwlock_rdlock(sthread_rwlock_t rwlock) {
+  int err;
+  if ((err = pthread_rwlock_rdlock(&(rwlock->prwlock))) != 0) {
+    fprintf(stderr, "pthread_rwlock_rdlock error: %s\n", strerror(err));
+    abort();
+  }
+}
+
+void sthread_pthread_rwlock_wrlock(sthread_rwlock_t rwlock) {
+  int err;
+  if ((err = pthread_rwlock_wrlock(&(rwlock->prwlock))) != 0) {
+    fprintf(stderr, "pthread_rwlock_wrlock error: %s\n", strerror(err));
+    abort();
+  }
+}
+
+void sthread_pthread_rwlock_unlock(sthread_rwlock_t rwlock) {
+  int err;
+  if ((err = pthread_rwlock_unlock(&(rwlock->prwlock))) != 0) {
+    fprintf(stderr, "pthread_rwlock_unlock error: %s\n", strerror(err));
+    abort();
+  }
+}
+
+
+struct _sthread_sem {
+  sem_t psem;
+};
+
+sthread_sem_t sthread_pthread_sem_init(unsigned int value) {
+  sthread_sem_t sem;
+  sem = (sthread_sem_t)malloc(sizeof(struct _sthread_sem));
+  assert(sem != NULL);
+  if (sem_init(&(sem->psem), 0, value) != 0) {
+    perror("sem_init failed");
+    abort();
+  }
+  return sem;
+}
+
+void sthread_pthread_sem_free(sthread_sem_t sem) {
+  sem_destroy(&(sem->psem));
+  free(sem);
+}
+
+void sthread_pthread_sem_wait(sthread_sem_t sem) {
+  while (sem_wait(&(sem->psem)) != 0) {
+    if (errno != EINTR) {
+      perror("sem_wait error");
+      abort();
+    }
+  }
+}
+
+void sthread_pthread_sem_post(sthread_sem_t sem) {
+  if (sem_post(&(sem->psem)) != 0) {
+    perror("sem_post error");
+    abort();
+  }
+}
+
+
+struct _sthread_barrier {
+  pthread_barrier_t pbarrier;
+};
+
+sthread_barrier_t sthread_pthread_barrier_init(unsigned int count) {
+  sthread_barrier_t barrier;
+  barrier = (sthread_barrier_t)malloc(sizeof(struct _sthread_barrier));
+  assert(barrier != NULL);
+  if (pthread_barrier_init(&(barrier->pbarrier), NULL, count) != 0) {
+    fprintf(stderr, "pthread_barrier_init failed\n");
+    abort();
+  }
+  return barrier;
+}
+
+void sthread_pthread_barrier_free(sthread_barrier_t barrier) {
+  if (pthread_barrier_destroy(&(barrier->pbarrier)) != 0) {
+    fprintf(stderr, "pthread_barrier_destroy failed: barrier has waiters\n");
+    abort();
+  }
+  free(barrier);
+}
+
+int sthread_pthread_barrier_wait(sthread_barrier_t barrier) {
+  int err = pthread_barrier_wait(&(barrier->pbarrier));
+  if (err == PTHREAD_BARRIER_SERIAL_THREAD)
+    return 1;
+  if (err != 0) {
+    fprintf(stderr, "pthread_barrier_wait error: %s\n", strerror(err));
+    abort();
+  }
+  return 0;
 }
@@ -15,6 +15,14 @@ sthread_t sthread_pthread_create(
 void sthread_pthread_exit(void *ret);
 void sthread_pthread_yield(void);
 void* sthread_pthread_join(sthread_t t);
+sthread_key_t sthread_pthread_key_create(sthread_key_destructor_t destructor);
+void *sthread_pthread_getspecific(sthread_key_t key);
+void sthread_pthread_setspecific(sthread_key_t key, void *value);
+sthread_t sthread_pthread_self(void);
+int sthread_pthread_set_priority(sthread_t t, int priority);
+int sthread_pthread_set_weight(sthread_t t, int weight);
+int sthread_pthread_set_affinity(sthread_t t, int cpu);
+int sthread_pthread_get_stats(sthread_t t, sthread_stats_t *stats);
 
 sthread_mutex_t sthread_pthread_mutex_init(void);
 void sthread_pthread_mutex_free(sthread_mutex_t lock);
@@ -27,4 +35,17 @@ void sthread_pthread_cond_broadcast(sthread_cond_t cond);
 void sthread_pthread_cond_wait(
     sthread_cond_t cond, sthread_mutex_t lock);
 
+sthread_rwlock_t sthread_pthread_rwlock_init(void);
+void sthread_pthread_rwlock_free(sthread_rwlock_t rwlock);
+void sthread_pthread_rwlock_rdlock(sthread_rwlock_t rwlock);
+void sthread_pthread_rwlock_wrlock(sthread_rwlock_t rwlock);
+void sthread_pthread_rwlock_unlock(sthread_rwlock_t rwlock);
+sthread_sem_t sthread_pthread_sem_init(unsigned int value);
+void sthread_pthread_sem_free(sthread_sem_t sem);
+void sthread_pthread_sem_wait(sthread_sem_t sem);
+void sthread_pthread_sem_post(sthread_sem_t sem);
+sthread_barrier_t sthread_pthread_barrier_init(unsigned int count);
+void sthread_pthread_barrier_free(sthread_barrier_t barrier);
+int sthread_pthread_barrier_wait(sthread_barrier_t barrier);
+
 #endif /* STHREAD_PTHREAD_H */
@@ -8,40 +8,171 @@
 
 #include <sthread.h>
 #include <sthread_queue.h>
+#ifndef USE_PTHREADS
+#include <sthread_preempt.h>
+#endif
 
+/* Links for ordinary (non-intrusive) queues. */
 struct _sthread_queue_elem {
+  sthread_queue_link_t link;  /* must be first */
   sthread_t sth;
-  struct _sthread_queue_elem *next;
 };
 typedef struct _sthread_queue_elem* sthread_queue_elem_t;
 
-static sthread_queue_elem_t free_list = NULL;
+/* Free links are kept in a per-thread cache, so that enqueue and
+ * dequeue normally touch no shared state. A thread whose cache grows
+ * past CACHE_MAX spills CACHE_SPILL links onto the global free list,
+ * and a thread whose cache runs dry takes the whole global list.
+ *
+ * The global free list is a Treiber stack. Pushes CAS the new chain
+ * onto the head; the only pop is an exchange that takes every link at
+ * once, so it can't be fooled by a head that was popped and pushed
+ * back in the meantime (the ABA problem) the way a single-link pop can.
+ *
+ * The user-level implementation runs all its threads on one kernel
+ * thread, so its "per-thread" cache is shared by all of them. A timer
+ * tick could switch threads in the middle of taking a link from it, so
+ * there the cache is only used with interrupts disabled.
+ */
+#define CACHE_MAX 64
+#define CACHE_SPILL 32
+
+struct elem_cache {
+  sthread_queue_elem_t head;
+  int count;
+  int registered;  /* cache destructor installed for this thread */
+};
+
+static sthread_queue_elem_t global_free_list = NULL;
+static __thread struct elem_cache cache;
 
 #ifdef USE_PTHREADS
-/* We need to lock the free_list, but can't depend on the user
- * having implemented locks. So we use pthread locks when available,
- * and depend on the non-preemptive nature of user threads otherwise.
- */
-static pthread_mutex_t free_list_lock;
+/* Hands a thread's cached links back to the global free list when the
+ * thread exits. */
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
 
-#define LOCK_FREE_LIST pthread_mutex_lock(&free_list_lock)
-#define UNLOCK_FREE_LIST pthread_mutex_unlock(&free_list_lock)
+static void cache_destroy(void *arg);
+
+static void cache_make_key(void) {
+  pthread_key_create(&cache_key, cache_destroy);
+}
 
+static void cache_register(void) {
+  pthread_once(&cache_key_once, cache_make_key);
+  pthread_setspecific(cache_key, &cache);
+  cache.registered = 1;
+}
 #else /* USE_PTHREADS */
 
-#define LOCK_FREE_LIST ((void)0)
-#define UNLOCK_FREE_LIST ((void)0)
+static void cache_register(void) {
+  cache.registered = 1;
+}
 
 #endif /* USE_PTHREADS */
 
-struct _sthread_queue {
+/* Start and finish using the calling thread's cache */
+static int cache_enter(void) {
+#ifdef USE_PTHREADS
+  return 0;
+#else
+  return splx(HIGH);
+#endif
+}
+
+static void cache_leave(int old) {
+#ifndef USE_PTHREADS
+  splx(old);
+#endif
+}
+
+/* Push the chain first..last onto the global free list */
+static void global_push(sthread_queue_elem_t first,
+                        sthread_queue_elem_t last) {
   sthread_queue_elem_t head;
-  sthread_queue_elem_t tail;
+  do {
+    head = global_free_list;
+    last->link.next = (sthread_queue_link_t *)head;
+  } while (!__sync_bool_compare_and_swap(&global_free_list, head, first));
+}
+
+#ifdef USE_PTHREADS
+static void cache_destroy(void *arg) {
+  struct elem_cache *c = (struct elem_cache *)arg;
+  sthread_queue_elem_t last;
+
+  if (c->head != NULL) {
+    for (last = c->head; last->link.next != NULL;
+         last = (sthread_queue_elem_t)last->link.next)
+      ;
+    global_push(c->head, last);
+  }
+  c->head = NULL;
+  c->count = 0;
+  c->registered = 0;
+}
+#endif /* USE_PTHREADS */
+
+static sthread_queue_elem_t elem_alloc(void) {
+  sthread_queue_elem_t elem;
+  int old = cache_enter();
+
+  if (cache.head == NULL) {
+    /* Refill from the global free list; count what we got. */
+    cache.head = __sync_lock_test_and_set(&global_free_list,
+                                          (sthread_queue_elem_t)NULL);
+    for (elem = cache.head; elem != NULL;
+         elem = (sthread_queue_elem_t)elem->link.next)
+      cache.count++;
+  }
+
+  elem = cache.head;
+  if (elem != NULL) {
+    cache.head = (sthread_queue_elem_t)elem->link.next;
+    cache.count--;
+  }
+  cache_leave(old);
+
+  if (elem == NULL) {
+    elem = (sthread_queue_elem_t)malloc(sizeof(struct _sthread_queue_elem));
+    assert(elem != NULL);
+  }
+  return elem;
+}
+
+static void elem_free(sthread_queue_elem_t elem) {
+  sthread_queue_elem_t first, last;
+  int old = cache_enter();
+  int i;
+
+  if (!cache.registered)
+    cache_register();
+
+  elem->link.next = (sthread_queue_link_t *)cache.head;
+  cache.head = elem;
+  cache.count++;
+
+  if (cache.count > CACHE_MAX) {
+    first = last = cache.head;
+    for (i = 1; i < CACHE_SPILL; i++)
+      last = (sthread_queue_elem_t)last->link.next;
+    cache.head = (sthread_queue_elem_t)last->link.next;
+    cache.count -= CACHE_SPILL;
+    global_push(first, last);
+  }
+  cache_leave(old);
+}
+
+struct _sthread_queue {
+  sthread_queue_link_t *head;
+  sthread_queue_link_t *tail;
   int size;
+  int intrusive;
+  size_t link_offset;  /* for intrusive queues */
 };
 
-/* Create a new, empty queue. Asserts against error. */
-sthread_queue_t sthread_new_queue() {
+static sthread_queue_t sthread_alloc_queue(int intrusive,
+                                           size_t link_offset) {
   sthread_queue_t queue;
 
   queue = (sthread_queue_t)malloc(sizeof(struct _sthread_queue));
@@ -49,14 +180,22 @@ sthread_queue_t sthread_new_queue() {
 
   queue->head = queue->tail = NULL;
   queue->size = 0;
-
-#ifdef USE_PTHREADS
-  pthread_mutex_init(&free_list_lock, NULL);
-#endif
+  queue->intrusive = intrusive;
+  queue->link_offset = link_offset;
 
   return queue;
 }
 
+/* Create a new, empty queue. Asserts against error. */
+sthread_queue_t sthread_new_queue() {
+  return sthread_alloc_queue(0, 0);
+}
+
+/* Create a new, empty intrusive queue. Asserts against error. */
+sthread_queue_t sthread_new_intrusive_queue(size_t link_offset) {
+  return sthread_alloc_queue(1, link_offset);
+}
+
 /* Destroy the given queue. Asserts that the queue is empty. */
 void sthread_free_queue(sthread_queue_t queue) {
   assert(queue->size == 0);
@@ -65,27 +204,26 @@ void sthread_free_queue(sthread_queue_t queue) {
 
 /* Add the given thread to the end of the queue */
 void sthread_enqueue(sthread_queue_t queue, sthread_t sth) {
+  sthread_queue_link_t *link;
   sthread_queue_elem_t elem;
-  LOCK_FREE_LIST;
-  elem = free_list;
-  if (elem == NULL)
-    elem = (sthread_queue_elem_t)malloc(sizeof(struct _sthread_queue_elem));
-  else
-    free_list = free_list->next;
-  UNLOCK_FREE_LIST;
 
-  assert(elem != NULL);
+  if (queue->intrusive) {
+    link = (sthread_queue_link_t *)((char *)sth + queue->link_offset);
+  } else {
+    elem = elem_alloc();
+    elem->sth = sth;
+    link = &elem->link;
+  }
 
-  elem->next = NULL;
-  elem->sth = sth;
+  link->next = NULL;
 
   if (queue->tail != NULL) {
-    queue->tail->next = elem;
+    queue->tail->next = link;
   } else {
     assert(queue->head == NULL);
-    queue->head = elem;
+    queue->head = link;
   }
-  queue->tail = elem;
+  queue->tail = link;
 
   queue->size++;
 }
@@ -93,7 +231,7 @@ void sthread_enqueue(sthread_queue_t queue, sthread_t sth) {
 /* Return, and remove, the next thread from the queue, or NULL
  * if queue is empty */
 sthread_t sthread_dequeue(sthread_queue_t queue) {
-  sthread_queue_elem_t head;
+  sthread_queue_link_t *head;
   sthread_t sth;
 
   if (queue->head == NULL)
@@ -101,7 +239,6 @@ sthread_t sthread_dequeue(sthread_queue_t queue) {
 
   head = queue->head;
 
-  sth = head->sth;
   if (head->next == NULL) {
     assert(queue->size == 1);
     assert(head == queue->tail);
@@ -109,13 +246,13 @@ sthread_t sthread_dequeue(sthread_queue_t queue) {
   }
   queue->head = head->next;
 
-  /* Return to free list */
-  LOCK_FREE_LIST;
-  head->next = free_list;
-  free_list = head;
-  UNLOCK_FREE_LIST;
-
-  head = NULL;
+  if (queue->intrusive) {
+    sth = (sthread_t)((char *)head - queue->link_offset);
+  } else {
+    /* Return to free list */
+    sth = ((sthread_queue_elem_t)head)->sth;
+    elem_free((sthread_queue_elem_t)head);
+  }
 
   queue->size--;
 
@@ -132,16 +269,27 @@ int sthread_queue_is_empty(sthread_queue_t queue) {
   return (queue->size == 0);
 }
 
+static void free_chain(sthread_queue_elem_t current) {
+  while (current != NULL) {
+    sthread_queue_elem_t previous = current;
+    current = (sthread_queue_elem_t)current->link.next;
+    free(previous);
+  }
+}
+
 /* Clear the global free list associated with the sthread
  * queue library. In order to maintain efficiency of queue
  * insertions, this should be called a single time when
  * the sthread library has no further use for queues. */
 void sthread_queue_clear_free_list(void) {
-  sthread_queue_elem_t current = free_list;
-  while (current != NULL) {
-    sthread_queue_elem_t previous = current;
-    current = current->next;
-    free(previous);
-  }
-  free_list = NULL;
+  sthread_queue_elem_t head;
+  int old = cache_enter();
+
+  head = cache.head;
+  cache.head = NULL;
+  cache.count = 0;
+  cache_leave(old);
+  free_chain(__sync_lock_test_and_set(&global_free_list,
+                                      (sthread_queue_elem_t)NULL));
+  free_chain(head);
 }
@@ -1,24 +1,42 @@
 /* Note: sthread_queue_t is not synchronized. If used from multiple
  * threads, it is the users responsibility to provide suitable mutual
- * exclusion. The sthread queue library maintains a global free list
- * from which it allocates links, so even if all queues are freed via
- * sthread_free_queue(), Valgrind will still report memory as "in use
- * at exit". Applications or libraries building on the sthread library
- * may use sthread_queue_clear_free_list() to free the memory associated
- * with this free list prior to exit in order to avoid such reports.
+ * exclusion. The sthread queue library recycles links through a
+ * per-thread cache backed by a global free list, so even if all queues
+ * are freed via sthread_free_queue(), Valgrind will still report memory
+ * as "in use at exit". Applications or libraries building on the
+ * sthread library may use sthread_queue_clear_free_list() to free the
+ * memory associated with this free list prior to exit in order to
+ * avoid such reports.
+ *
+ * Intrusive queues (see sthread_new_intrusive_queue) don't allocate
+ * links at all; instead each thread embeds its own link.
  */
 
 #ifndef STHREAD_QUEUE_H
 #define STHREAD_QUEUE_H
 
+#include <stddef.h>
+
 #include <sthread.h>
 
 struct _sthread_queue;
 typedef struct _sthread_queue* sthread_queue_t;
 
+/* A link that an implementation can embed in its struct _sthread so
+ * that the thread can be put on an intrusive queue. */
+typedef struct _sthread_queue_link {
+  struct _sthread_queue_link *next;
+} sthread_queue_link_t;
+
 /* Create a new, empty queue */
 sthread_queue_t sthread_new_queue();
 
+/* Create a new, empty intrusive queue. Threads are chained through the
+ * sthread_queue_link_t that lies link_offset bytes into their struct
+ * _sthread (use offsetof), so enqueueing never allocates. A thread can
+ * be on only one queue per embedded link at a time. */
+sthread_queue_t sthread_new_intrusive_queue(size_t link_offset);
+
 /* Destroy the given queue. Asserts that the queue is empty. */
 void sthread_free_queue(sthread_queue_t queue);
 
@@ -36,9 +54,9 @@ int sthread_queue_size(sthread_queue_t queue);
 int sthread_queue_is_empty(sthread_queue_t queue);
 
 /* Clear the global free list associated with the sthread
- * queue library. In order to maintain efficiency of queue
- * insertions, this should be called a single time when
- * the sthread library has no further use for queues. */
+ * queue library, along with the calling thread's cache. In order to
+ * maintain efficiency of queue insertions, this should be called a
+ * single time when the sthread library has no further use for queues. */
 void sthread_queue_clear_free_list(void);
 
 #endif /* STHREAD_QUEUE_H */
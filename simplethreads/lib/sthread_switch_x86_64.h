@@ -6,12 +6,14 @@
  * void Xsthread_switch(char **old_sp, char *new_sp)
  *   Save the currently running thread's context on its stack, switch to
  *   the new thread by swapping in its stack pointer, then pop that thread's
- *   context off of the stack and return. The state that we store on the
- *   stack includes all of the general-purpose registers; note that we
- *   DON'T store other state that makes up "context" such as the floating-
- *   point registers, MMX registers, and so on. So, this means that this
- *   code may not work (may cause mysterious bugs) for threads in a program
- *   that uses these floating-point / SIMD registers.
+ *   context off of the stack and return. Xsthread_switch is only ever
+ *   reached by an ordinary function call (from sthread_switch), so the
+ *   caller has already saved any caller-saved ("scratch") registers it
+ *   still needs; we only have to preserve what the System V ABI says a
+ *   function must preserve: the callee-saved general-purpose registers
+ *   rbx, rbp and r12-r15, and the control bits of MXCSR and the x87 FPU
+ *   control word. The floating-point and SIMD data registers are all
+ *   caller-saved, so they don't need to be stored either.
  *
  * We put this code in a .S file, instead of using the gcc 'asm (...)' syntax,
  * to make it more robust (this way, the compiler won't change _anything_, and
@@ -51,15 +53,21 @@ void Xsthread_switch(char **old_sp, char *new_sp);
 void Xsthread_switch_end();
 
 /* This value tells the stack-setup code (sthread_new_ctx(), sthread_init_stack())
- * how much space (in bytes) we need on the stack to store the general-purpose
- * registers that make up a thread's context. On x86_64 architectures, there
- * are 16 64-bit (8-byte) general-purpose registers; however, we don't store
- * the stack pointer register on the stack, because we store it separately in
- * the thread context structures and pass it as an argument to this function.
- * Therefore, we only need room for 15 registers in our stack context (and so
- * there are 15 pushes and 15 pops in the code below).
+ * how much space (in bytes) we need on the stack to store the registers
+ * that make up a thread's context: 6 callee-saved 64-bit (8-byte)
+ * general-purpose registers, plus one 8-byte slot holding MXCSR (in its
+ * low 4 bytes) and the x87 control word (in the 2 bytes above that).
+ * We don't store the stack pointer register on the stack, because we
+ * store it separately in the thread context structures and pass it as
+ * an argument to this function.
  */
-#define STHREAD_CONTEXT_SIZE (15*8)
+#define STHREAD_CONTEXT_SIZE (7*8)
+
+/* Offsets of the floating-point control state within the saved context,
+ * which is at the lowest address (it is pushed last). sthread_init_stack()
+ * fills these in for a new thread. */
+#define STHREAD_CONTEXT_MXCSR_OFFSET 0
+#define STHREAD_CONTEXT_FPUCW_OFFSET 4
 
 #else  /* in assembly mode */
 
@@ -70,17 +78,12 @@ void Xsthread_switch_end();
 
     /* in C terms: void Xsthread_switch(char **old_sp, char *new_sp) */
     Xsthread_switch:
-    /* Push register state onto our current (old) stack. The i386 pusha
-     * and popa instructions no longer work in 64-bit mode, so instead
-     * we explicitly push all of the general-purpose registers here.
-     * We don't push any of the floating-point or special purpose
-     * registers (e.g. MMX, SSE, and other SIMD registers). Also, we
-     * ignore the stack pointer register RSP, because we store it directly
-     * in our thread context structures and pass it as an argument to this
-     * code (see the documentation for the i386 POPA instruction: it also
-     * ignores the ESP register when restoring the register state).
-     * Specifying the 64-bit registers as operands causes the stack pointer
-     * to be decremented by 8 bytes.
+    /* Push register state onto our current (old) stack. Only the
+     * callee-saved registers are pushed; see the comment at the top of
+     * this file. We ignore the stack pointer register RSP, because we
+     * store it directly in our thread context structures and pass it as
+     * an argument to this code. Specifying the 64-bit registers as
+     * operands causes the stack pointer to be decremented by 8 bytes.
      *
      * The amount of data pushed onto the stack here (and popped off later
      * on) must match STHREAD_CONTEXT_SIZE!
@@ -88,27 +91,24 @@ void Xsthread_switch_end();
      * The Linux kernel files arch/x86/kernel/entry_[32,64].S shed some
      * light on how context switching is done for _processes_ in Linux;
      * this code is similar, but we don't bother with some of the complexity
-     * (e.g. saving segment registers) and we don't have to follow any
-     * specific calling conventions; the only convention we have to follow
-     * is that the registers are popped in the opposite order that they
-     * were pushed.
+     * (e.g. saving segment registers). The only convention we have to
+     * follow is that the registers are popped in the opposite order that
+     * they were pushed.
      */
-    push %rax
     push %rbx
-    push %rcx
-    push %rdx
-    push %rdi
-    push %rsi
     push %rbp
-    push %r8
-    push %r9
-    push %r10
-    push %r11
     push %r12
     push %r13
     push %r14
     push %r15
 
+    /* Make room for one more slot and store MXCSR and the x87 control
+     * word into it (see STHREAD_CONTEXT_MXCSR_OFFSET and
+     * STHREAD_CONTEXT_FPUCW_OFFSET). */
+    sub $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+
     /* Save old stack into memory at *old_sp; old_sp is passed to us in
      * register rdi. The stack pointer on x86_64 is rsp, rather than esp;
      * the Intel documentation for the PUSH instruction says that "in
@@ -120,22 +120,16 @@ void Xsthread_switch_end();
     /* Load new stack from new_sp, which is passed to us in register rsi. */
     movq %rsi, %rsp
 
-    /* Pop saved registers off new stack: */
+    /* Pop saved state off new stack: */
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    add $8, %rsp
     pop %r15
     pop %r14
     pop %r13
     pop %r12
-    pop %r11
-    pop %r10
-    pop %r9
-    pop %r8
     pop %rbp
-    pop %rsi
-    pop %rdi
-    pop %rdx
-    pop %rcx
     pop %rbx
-    pop %rax
 
     /* Return to whatever PC the current (new) stack tells us to: */
     ret
@@ -0,0 +1,339 @@
+/*
+ * sthread_task.c - Tasks and parallel loops on a work-stealing pool.
+ *
+ *    Each worker thread owns a double-ended queue of tasks. A worker
+ *    pushes the tasks it spawns onto the head of its own queue and
+ *    takes work from there too, newest first, which keeps the data of
+ *    recently split work in its cache; when its queue is empty it
+ *    steals from the tail of the others', where the oldest (and, for
+ *    recursively split work, biggest) tasks are. Threads outside the
+ *    pool share one more queue, the injector, in the same way. Queues
+ *    are protected by sthread mutexes, which are only contended when a
+ *    thief picks the same queue as its owner or another thief.
+ *
+ *    A thread that finds no task anywhere sleeps on idle_cond. Both
+ *    sides avoid a lost wakeup by updating their own counter before
+ *    reading the other's: a sleeper bumps nidle and then checks that
+ *    queued is still 0, and a spawner bumps queued and then signals if
+ *    nidle is nonzero.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread.h>
+#include <sthread_task.h>
+
+#define MAX_WORKERS 256
+
+struct task {
+  sthread_task_func_t fn;
+  void *arg;
+  sthread_task_group_t group;
+  struct task *next, *prev;
+};
+
+struct deque {
+  sthread_mutex_t lock;
+  struct task *volatile head;  /* the owner's end */
+  struct task *tail;           /* the thieves' end */
+};
+
+struct _sthread_task_group {
+  volatile long pending;  /* spawned tasks that have not finished */
+};
+
+/* deques[nworkers] is the injector */
+static struct deque deques[MAX_WORKERS + 1];
+static int nworkers = 0;
+static volatile int started = 0;
+
+/* Worker i's value for this key is i + 1 */
+static sthread_key_t worker_key = -1;
+
+static sthread_mutex_t idle_lock;
+static sthread_cond_t idle_cond;
+static volatile int nidle = 0;     /* threads asleep on idle_cond */
+static volatile long queued = 0;   /* tasks on all the deques */
+
+static void *sthread_task_worker(void *arg);
+
+void sthread_task_init(void) {
+  worker_key = sthread_key_create(NULL);
+  assert(worker_key != -1);
+  idle_lock = sthread_mutex_init();
+  idle_cond = sthread_cond_init();
+}
+
+int sthread_task_set_workers(int n) {
+  int err = -1;
+
+  if (n < 1 || n > MAX_WORKERS)
+    return -1;
+  sthread_mutex_lock(idle_lock);
+  if (!started) {
+    nworkers = n;
+    err = 0;
+  }
+  sthread_mutex_unlock(idle_lock);
+  return err;
+}
+
+static void start_workers(void) {
+  sthread_t t;
+  int i;
+
+  sthread_mutex_lock(idle_lock);
+  if (!started) {
+    if (nworkers == 0)
+      nworkers = sthread_num_cpus();
+    if (nworkers > MAX_WORKERS)
+      nworkers = MAX_WORKERS;
+    for (i = 0; i <= nworkers; i++) {
+      deques[i].lock = sthread_mutex_init();
+      deques[i].head = deques[i].tail = NULL;
+    }
+    for (i = 0; i < nworkers; i++) {
+      t = sthread_create(sthread_task_worker, (void *)(long)i, 0);
+      assert(t != NULL);
+    }
+    __sync_synchronize();
+    started = 1;
+  }
+  sthread_mutex_unlock(idle_lock);
+}
+
+/* The deque the calling thread pushes to and pops from */
+static int my_deque(void) {
+  long id = (long)sthread_getspecific(worker_key);
+  return (id == 0) ? nworkers : id - 1;
+}
+
+static void push(int self, struct task *t) {
+  struct deque *d = &deques[self];
+
+  sthread_mutex_lock(d->lock);
+  t->prev = NULL;
+  t->next = d->head;
+  if (d->head != NULL)
+    d->head->prev = t;
+  else
+    d->tail = t;
+  d->head = t;
+  sthread_mutex_unlock(d->lock);
+
+  __sync_fetch_and_add(&queued, 1);
+  if (nidle > 0) {
+    sthread_mutex_lock(idle_lock);
+    sthread_cond_signal(idle_cond);
+    sthread_mutex_unlock(idle_lock);
+  }
+}
+
+/* Take a task from the head (if own) or tail of deque i, or NULL */
+static struct task *take(int i, int own) {
+  struct deque *d = &deques[i];
+  struct task *t;
+
+  if (d->head == NULL)
+    return NULL;  /* don't bother locking an empty deque */
+  sthread_mutex_lock(d->lock);
+  t = own ? d->head : d->tail;
+  if (t != NULL) {
+    if (t->prev != NULL)
+      t->prev->next = t->next;
+    else
+      d->head = t->next;
+    if (t->next != NULL)
+      t->next->prev = t->prev;
+    else
+      d->tail = t->prev;
+  }
+  sthread_mutex_unlock(d->lock);
+  if (t != NULL)
+    __sync_fetch_and_sub(&queued, 1);
+  return t;
+}
+
+/* Find a task for the thread that owns deque self: its own newest, or
+ * else the oldest of another deque, starting from a different victim
+ * each time so that thieves spread out. */
+static struct task *find_task(int self) {
+  static volatile unsigned next_victim = 0;
+  struct task *t;
+  int i, start;
+
+  if ((t = take(self, 1)) != NULL)
+    return t;
+  if (queued == 0)
+    return NULL;
+  start = __sync_fetch_and_add(&next_victim, 1) % (nworkers + 1);
+  for (i = 0; i <= nworkers; i++) {
+    int victim = (start + i) % (nworkers + 1);
+    if (victim != self && (t = take(victim, 0)) != NULL)
+      return t;
+  }
+  return NULL;
+}
+
+static void wake_all(void) {
+  __sync_synchronize();
+  if (nidle > 0) {
+    sthread_mutex_lock(idle_lock);
+    sthread_cond_broadcast(idle_cond);
+    sthread_mutex_unlock(idle_lock);
+  }
+}
+
+static void run_task(struct task *t) {
+  sthread_task_group_t group = t->group;
+
+  t->fn(t->arg);
+  sthread_free(t);
+  if (__sync_sub_and_fetch(&group->pending, 1) == 0)
+    wake_all();  /* someone may be waiting for the group */
+}
+
+/* Sleep until a task is queued, or (if group isn't NULL) until group
+ * has no unfinished tasks. May return early. */
+static void idle_wait(sthread_task_group_t group) {
+  sthread_mutex_lock(idle_lock);
+  nidle++;
+  __sync_synchronize();
+  if (queued == 0 && (group == NULL || group->pending > 0))
+    sthread_cond_wait(idle_cond, idle_lock);
+  nidle--;
+  sthread_mutex_unlock(idle_lock);
+}
+
+static void *sthread_task_worker(void *arg) {
+  long id = (long)arg;
+  struct task *t;
+
+  sthread_setspecific(worker_key, (void *)(id + 1));
+  for (;;) {
+    t = find_task(id);
+    if (t != NULL)
+      run_task(t);
+    else
+      idle_wait(NULL);
+  }
+  return NULL;
+}
+
+sthread_task_group_t sthread_task_group_create(void) {
+  sthread_task_group_t group;
+
+  group = (sthread_task_group_t)sthread_malloc(
+      sizeof(struct _sthread_task_group));
+  if (group == NULL)
+    return NULL;
+  group->pending = 0;
+  return group;
+}
+
+void sthread_task_group_free(sthread_task_group_t group) {
+  assert(group->pending == 0);
+  sthread_free(group);
+}
+
+void sthread_task_spawn(sthread_task_group_t group, sthread_task_func_t fn,
+                        void *arg) {
+  struct task *t;
+
+  if (!started)
+    start_workers();
+  t = (struct task *)sthread_malloc(sizeof(struct task));
+  if (t == NULL) {
+    fn(arg);
+    return;
+  }
+  t->fn = fn;
+  t->arg = arg;
+  t->group = group;
+  __sync_fetch_and_add(&group->pending, 1);
+  push(my_deque(), t);
+}
+
+void sthread_task_wait(sthread_task_group_t group) {
+  struct task *t;
+  int self;
+
+  if (group->pending == 0)
+    return;
+  self = my_deque();
+  while (group->pending > 0) {
+    t = find_task(self);
+    if (t != NULL)
+      run_task(t);
+    else
+      idle_wait(group);
+  }
+}
+
+/* A piece of a parallel_for loop */
+struct range {
+  long begin, end, grain;
+  sthread_range_func_t fn;
+  void *arg;
+  sthread_task_group_t group;
+};
+
+/* Split off the upper half of the range as a new task until what is
+ * left is small enough to run. The halves go to the head of our own
+ * deque, so thieves get the biggest ones. */
+static void range_task(void *arg) {
+  struct range *r = (struct range *)arg, *upper;
+  long mid;
+
+  while (r->end - r->begin > r->grain) {
+    upper = (struct range *)sthread_malloc(sizeof(struct range));
+    if (upper == NULL)
+      break;
+    mid = r->begin + (r->end - r->begin) / 2;
+    *upper = *r;
+    upper->begin = mid;
+    r->end = mid;
+    sthread_task_spawn(r->group, range_task, upper);
+  }
+  r->fn(r->begin, r->end, r->arg);
+  sthread_free(r);
+}
+
+void sthread_parallel_for(long begin, long end, long grain,
+                          sthread_range_func_t fn, void *arg) {
+  sthread_task_group_t group;
+  struct range *r;
+
+  if (begin >= end)
+    return;
+  if (!started)
+    start_workers();
+  if (grain <= 0) {
+    grain = (end - begin) / (8 * nworkers);
+    if (grain < 1)
+      grain = 1;
+  }
+
+  r = (struct range *)sthread_malloc(sizeof(struct range));
+  if (r == NULL) {
+    fn(begin, end, arg);
+    return;
+  }
+  r->begin = begin;
+  r->end = end;
+  r->grain = grain;
+  r->fn = fn;
+  r->arg = arg;
+  r->group = group = sthread_task_group_create();
+  if (group == NULL) {
+    sthread_free(r);
+    fn(begin, end, arg);
+    return;
+  }
+  range_task(r);  /* frees r */
+  sthread_task_wait(group);
+  sthread_task_group_free(group);
+}
@@ -0,0 +1,13 @@
+/*
+ * sthread_task.h - Private interface to the task runtime (see the
+ *                  Tasks section of sthread.h).
+ */
+
+#ifndef STHREAD_TASK_H
+#define STHREAD_TASK_H 1
+
+/* Set up the task runtime; called by sthread_init. The worker pool
+ * itself is only started when first needed. */
+void sthread_task_init(void);
+
+#endif /* STHREAD_TASK_H */
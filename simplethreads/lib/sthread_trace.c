@@ -0,0 +1,164 @@
+/*
+ * sthread_trace.c - Scheduler event tracing and the Chrome trace
+ *                   exporter (see sthread_trace.h).
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+#include <sthread_trace.h>
+
+struct trace_event {
+  uint64_t tsc;
+  int type;
+  int tid;
+  int arg;
+};
+
+/* A trace's ring of events. The ring is published through a single
+ * pointer, so a recorder always sees a mask that matches the events it
+ * indexes. */
+struct trace_buf {
+  struct trace_buf *retired;      /* the trace before this one */
+  unsigned long mask;             /* ring size - 1 */
+  volatile unsigned long head;    /* events ever recorded */
+  uint64_t start_tsc;             /* clock at the start of the trace */
+  struct trace_event events[];
+};
+
+volatile int sthread_tracing = 0;
+
+static struct trace_buf *volatile trace_buf = NULL;
+
+/* sthread_clock() and CLOCK_MONOTONIC when sthread_clock_init ran */
+static uint64_t clock_base_ticks;
+static uint64_t clock_base_ns;
+
+static const char *event_names[] = {
+  "create", "switch", "block", "wake", "exit", "preempt"
+};
+
+uint64_t sthread_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sthread_clock_init(void) {
+  clock_base_ns = sthread_clock_ns();
+  clock_base_ticks = sthread_clock();
+}
+
+/* Clock ticks per nanosecond, measured since sthread_clock_init */
+static double sthread_clock_rate(void) {
+  uint64_t ns = sthread_clock_ns() - clock_base_ns;
+  uint64_t ticks = sthread_clock() - clock_base_ticks;
+  if (ns == 0 || ticks == 0)
+    return 1.0;
+  return (double)ticks / (double)ns;
+}
+
+uint64_t sthread_clock_to_ns(uint64_t ticks) {
+  return (uint64_t)(ticks / sthread_clock_rate());
+}
+
+void sthread_trace_record(sthread_trace_event_t type, int tid, int arg) {
+  struct trace_buf *buf = trace_buf;
+  unsigned long i = __sync_fetch_and_add(&buf->head, 1);
+  struct trace_event *ev = &buf->events[i & buf->mask];
+
+  ev->tsc = sthread_clock();
+  ev->type = type;
+  ev->tid = tid;
+  ev->arg = arg;
+}
+
+int sthread_trace_start(int nevents) {
+  struct trace_buf *buf;
+  unsigned long size = 1;
+
+  while (size < (unsigned long)nevents)
+    size <<= 1;
+  buf = (struct trace_buf *)calloc(1, sizeof(struct trace_buf) +
+                                   size * sizeof(struct trace_event));
+  if (buf == NULL)
+    return -1;
+  buf->mask = size - 1;
+  buf->start_tsc = sthread_clock();
+
+  /* A thread that was already past the test of sthread_tracing may
+   * still write an event into the old buffer at any time, so it is
+   * never freed, only kept on the new one's list. */
+  buf->retired = trace_buf;
+  __sync_synchronize();
+  trace_buf = buf;
+  __sync_synchronize();
+  sthread_tracing = 1;
+  return 0;
+}
+
+void sthread_trace_stop(void) {
+  sthread_tracing = 0;
+}
+
+/* Write one Chrome trace event. ts is in microseconds. */
+static void trace_write_event(FILE *f, int *first, const char *name,
+                              const char *ph, int tid, double ts,
+                              int arg) {
+  fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":1,\"tid\":%d,"
+          "\"ts\":%.3f", *first ? "" : ",", name, ph, tid, ts);
+  if (ph[0] == 'i')
+    fprintf(f, ",\"s\":\"t\",\"args\":{\"thread\":%d}", arg);
+  fprintf(f, "}");
+  *first = 0;
+}
+
+int sthread_trace_dump(const char *path) {
+  struct trace_buf *buf = trace_buf;
+  FILE *f;
+  struct trace_event *ev;
+  unsigned long i, head, count;
+  double ticks_per_us;
+  int was_tracing, first = 1;
+
+  if (buf == NULL)
+    return -1;
+  f = fopen(path, "w");
+  if (f == NULL)
+    return -1;
+
+  /* Don't trace our own I/O */
+  was_tracing = sthread_tracing;
+  sthread_tracing = 0;
+
+  ticks_per_us = sthread_clock_rate() * 1000.0;
+
+  head = buf->head;
+  count = head < buf->mask + 1 ? head : buf->mask + 1;
+
+  /* A switch ends the "running" slice of one thread and begins that of
+   * another; everything else is an instant event on its thread. */
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (i = head - count; i != head; i++) {
+    double ts;
+    ev = &buf->events[i & buf->mask];
+    ts = (double)(int64_t)(ev->tsc - buf->start_tsc) / ticks_per_us;
+    if (ev->type == STHREAD_TRACE_SWITCH) {
+      trace_write_event(f, &first, "running", "E", ev->tid, ts, 0);
+      trace_write_event(f, &first, "running", "B", ev->arg, ts, 0);
+    } else {
+      trace_write_event(f, &first, event_names[ev->type], "i", ev->tid, ts,
+                        ev->arg);
+    }
+  }
+  fprintf(f, "\n]}\n");
+
+  sthread_tracing = was_tracing;
+  return fclose(f) == 0 ? 0 : -1;
+}
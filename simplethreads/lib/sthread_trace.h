@@ -0,0 +1,62 @@
+/*
+ * sthread_trace.h - Scheduler event tracing, shared by both
+ *                   implementations.
+ *
+ * Events go into a single ring buffer, overwriting the oldest once it
+ * is full. Slots are claimed with an atomic increment, so threads of
+ * the pthread implementation can record concurrently. Timestamps are
+ * read from the TSC and converted to microseconds when the trace is
+ * written out by sthread_trace_dump().
+ */
+
+#ifndef STHREAD_TRACE_H
+#define STHREAD_TRACE_H
+
+#include <stdint.h>
+
+typedef enum {
+  STHREAD_TRACE_CREATE,   /* tid created thread arg */
+  STHREAD_TRACE_SWITCH,   /* tid switched to thread arg */
+  STHREAD_TRACE_BLOCK,    /* tid went to sleep */
+  STHREAD_TRACE_WAKE,     /* tid made thread arg ready */
+  STHREAD_TRACE_EXIT,     /* tid exited */
+  STHREAD_TRACE_PREEMPT,  /* tid's time slice was taken away */
+} sthread_trace_event_t;
+
+/* CLOCK_MONOTONIC, in nanoseconds */
+uint64_t sthread_clock_ns(void);
+
+/* A cheap timestamp: the TSC on x86, a nanosecond clock elsewhere.
+ * Used for trace events and for the user implementation's per-thread
+ * time accounting, which runs on every context switch. */
+static inline uint64_t sthread_clock(void) {
+#if defined(STHREAD_CPU_I386) || defined(STHREAD_CPU_X86_64)
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+#else
+  return sthread_clock_ns();
+#endif
+}
+
+/* Record the clock's starting point; called by sthread_init. */
+void sthread_clock_init(void);
+
+/* Convert an interval of sthread_clock() ticks to nanoseconds. The
+ * tick rate is measured against CLOCK_MONOTONIC since
+ * sthread_clock_init, so it is only approximate very early on. */
+uint64_t sthread_clock_to_ns(uint64_t ticks);
+
+/* Nonzero while a trace is being recorded */
+extern volatile int sthread_tracing;
+
+void sthread_trace_record(sthread_trace_event_t type, int tid, int arg);
+
+/* Record an event if tracing is on; otherwise costs a single test. */
+#define STHREAD_TRACE(type, tid, arg)             \
+  do {                                            \
+    if (sthread_tracing)                          \
+      sthread_trace_record((type), (tid), (arg)); \
+  } while (0)
+
+#endif /* STHREAD_TRACE_H */
@@ -1,15 +1,24 @@
 /* Simplethreads Instructional Thread Package
- * 
+ *
  * sthread_user.c - Implements the sthread API using user-level threads.
  *
- *    You need to implement the routines in this file.
+ *    Ready threads with a nonzero priority run strictly by priority,
+ *    round robin within a level; the rest are stride scheduled by
+ *    weight. The timer in sthread_preempt.c forces a yield once a
+ *    thread has run for STHREAD_TIME_SLICE microseconds while others
+ *    were waiting. Scheduler state is protected by disabling
+ *    interrupts with splx(HIGH).
  *
  * Change Log:
  * 2002-04-15        rick
  *   - Initial version.
  */
 
+#include <config.h>
+
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
@@ -18,13 +27,102 @@
 #include <sthread_queue.h>
 #include <sthread_user.h>
 #include <sthread_ctx.h>
-#include <sthread_user.h>
+#include <sthread_preempt.h>
+#include <sthread_trace.h>
+#include <sthread_numa.h>
+
+/* Length of a time slice, in microseconds */
+static const int STHREAD_TIME_SLICE = 10000;
+
+/* Number of passes made over a thread's keys at exit, in case
+ * destructors set new values */
+#define DESTRUCTOR_ITERATIONS 4
+
+/* A fair-class thread's pass advances by STRIDE1 / weight each time it
+ * is dispatched */
+#define STRIDE1 STHREAD_MAX_WEIGHT
 
 struct _sthread {
   sthread_ctx_t *saved_ctx;
-  /* Add your fields to the thread data structure here */
+  sthread_queue_link_t link;  /* for whichever queue we're waiting on */
+  sthread_start_func_t start_routine;
+  void *arg;
+  void *ret;            /* value passed to sthread_exit */
+  int joinable;
+  int finished;         /* set once the thread has called sthread_exit */
+  sthread_t joiner;     /* thread blocked in sthread_join on us, if any */
+  void *specific[STHREAD_KEYS_MAX];  /* thread-local storage slots */
+  int priority;
+  int weight;
+  uint64_t pass;        /* stride scheduling virtual time */
+  uint64_t ready_seq;   /* orders fair threads with equal pass */
+  sthread_preempt_state_t preempt;  /* deferred preemption, overrun stats */
+  uint64_t cpu_ticks;    /* sthread_clock() ticks spent running */
+  uint64_t wait_ticks;   /* ... and spent ready to run */
+  unsigned long voluntary_switches;
+  unsigned long involuntary_switches;
+  uint64_t run_since;    /* sthread_clock() when last dispatched */
+  uint64_t ready_since;  /* sthread_clock() when last made ready */
 };
 
+/* The thread that is currently running */
+static sthread_t current_thread = NULL;
+
+/* Ready threads at priority p > 0 wait in prio_queues[p], in FIFO
+ * order. Bit p of prio_bitmap is set whenever prio_queues[p] is
+ * nonempty, so the highest ready level is found with one instruction. */
+static sthread_queue_t prio_queues[STHREAD_PRIO_MAX + 1];
+static uint32_t prio_bitmap = 0;
+
+/* Ready threads at priority 0, as a binary min-heap ordered by pass.
+ * Each dispatch charges the thread one time slice worth of pass
+ * (STRIDE1 / weight), so the lowest pass is always the thread furthest
+ * behind its share of the CPU. */
+static sthread_t *fair_heap = NULL;
+static int fair_size = 0;
+static int fair_capacity = 0;
+static uint64_t fair_seq = 0;
+
+/* Pass of the most recently dispatched fair thread. A thread that
+ * becomes ready starts no earlier than this, so that time spent
+ * blocked can't be banked and later used to starve other threads. */
+static uint64_t global_pass = 0;
+
+/* Set when a thread of higher priority than the running one becomes
+ * ready; sthread_user_restore() then switches to it. */
+static int need_resched = 0;
+
+/* Set when the next switch is forced on the running thread (by the
+ * timer, or by a higher priority thread), for its statistics */
+static int involuntary = 0;
+
+/* Detached threads that have exited. An exiting thread can't free its
+ * own stack, so the next thread to run frees it for them. */
+static sthread_queue_t dead_queue = NULL;
+
+/* Number of threads that have not yet exited */
+static int live_threads = 0;
+
+/* Thread-local storage keys; key_destructors[k] is valid for k < nkeys */
+static int nkeys = 0;
+static sthread_key_destructor_t key_destructors[STHREAD_KEYS_MAX];
+
+static sthread_queue_t sthread_user_new_queue(void);
+static void sthread_user_start(void);
+static void sthread_user_preempt(void);
+static void sthread_user_ready(sthread_t t);
+static sthread_t sthread_user_pick_next(void);
+static void sthread_user_schedule(void);
+static void sthread_user_restore(int old);
+static void sthread_user_sleep_on(sthread_queue_t queue);
+static int sthread_user_wakeup(sthread_queue_t queue);
+static void sthread_user_wakeup_all(sthread_queue_t queue);
+static void sthread_user_reap(void);
+static void sthread_user_free(sthread_t t);
+static void sthread_user_run_destructors(sthread_t t);
+
+/* Threads are identified in traces by their preemption state's id */
+#define TID(t) ((t)->preempt.id)
 
 
 /*********************************************************************/
@@ -32,65 +130,730 @@ struct _sthread {
 /*********************************************************************/
 
 void sthread_user_init(void) {
+  sthread_t main_thread;
+  int p;
+
+  /* prio_queues[0] is unused; priority 0 threads go in fair_heap */
+  for (p = 1; p <= STHREAD_PRIO_MAX; p++)
+    prio_queues[p] = sthread_user_new_queue();
+  dead_queue = sthread_user_new_queue();
+
+  /* The main thread is already running on the process stack, so it
+   * only needs a blank context to be saved into. */
+  main_thread = (sthread_t)malloc(sizeof(struct _sthread));
+  assert(main_thread != NULL);
+  memset(main_thread, 0, sizeof(struct _sthread));
+  main_thread->saved_ctx = sthread_new_blank_ctx();
+  assert(main_thread->saved_ctx != NULL);
+  main_thread->weight = STHREAD_DEFAULT_WEIGHT;
+
+  current_thread = main_thread;
+  live_threads = 1;
+  sthread_preempt_state_register(&main_thread->preempt);
+  sthread_preemption_new_slice(&main_thread->preempt, 0);
+  main_thread->run_since = sthread_clock();
+
+  sthread_preemption_init(sthread_user_preempt, STHREAD_TIME_SLICE);
 }
 
 sthread_t sthread_user_create(sthread_start_func_t start_routine, void *arg,
                               int joinable) {
-  return NULL;
+  sthread_t t;
+  int old;
+
+  t = (sthread_t)malloc(sizeof(struct _sthread));
+  if (t == NULL)
+    return NULL;
+  memset(t, 0, sizeof(struct _sthread));
+  t->start_routine = start_routine;
+  t->arg = arg;
+  t->joinable = joinable;
+
+  /* The context pool is shared with sthread_user_free */
+  old = splx(HIGH);
+  t->saved_ctx = sthread_new_ctx(sthread_user_start);
+  if (t->saved_ctx == NULL) {
+    splx(old);
+    free(t);
+    return NULL;
+  }
+  sthread_preempt_state_register(&t->preempt);
+  t->priority = current_thread->priority;
+  t->weight = current_thread->weight;
+  live_threads++;
+  STHREAD_TRACE(STHREAD_TRACE_CREATE, TID(current_thread), TID(t));
+  sthread_user_ready(t);
+  splx(old);
+
+  return t;
 }
 
 void sthread_user_exit(void *ret) {
+  sthread_user_run_destructors(current_thread);
+
+  splx(HIGH);
+
+  current_thread->ret = ret;
+  current_thread->finished = 1;
+  STHREAD_TRACE(STHREAD_TRACE_EXIT, TID(current_thread), 0);
+
+  if (current_thread->joinable) {
+    /* The joiner frees us once it has collected ret */
+    if (current_thread->joiner != NULL)
+      sthread_user_ready(current_thread->joiner);
+  } else {
+    sthread_enqueue(dead_queue, current_thread);
+  }
+
+  if (--live_threads == 0) {
+    /* Last thread out; behave like returning from main(). */
+    exit(0);
+  }
+
+  sthread_user_schedule();
+  assert(0); /* a finished thread is never scheduled again */
 }
 
 void* sthread_user_join(sthread_t t) {
-  return NULL;
+  void *ret;
+  int old;
+
+  old = splx(HIGH);
+  assert(t->joinable);
+  assert(t->joiner == NULL);
+
+  if (!t->finished) {
+    /* Sleep until sthread_user_exit puts us back on the run queue */
+    t->joiner = current_thread;
+    STHREAD_TRACE(STHREAD_TRACE_BLOCK, TID(current_thread), 0);
+    sthread_user_schedule();
+    assert(t->finished);
+  }
+  ret = t->ret;
+  sthread_user_free(t);
+  splx(old);
+
+  return ret;
 }
 
 void sthread_user_yield(void) {
+  int old;
+
+  old = splx(HIGH);
+  sthread_user_ready(current_thread);
+  sthread_user_schedule();
+  splx(old);
+}
+
+sthread_key_t sthread_user_key_create(sthread_key_destructor_t destructor) {
+  sthread_key_t key = -1;
+  int old;
+
+  old = splx(HIGH);
+  if (nkeys < STHREAD_KEYS_MAX) {
+    key = nkeys++;
+    key_destructors[key] = destructor;
+  }
+  splx(old);
+  return key;
+}
+
+void *sthread_user_getspecific(sthread_key_t key) {
+  assert(key >= 0 && key < nkeys);
+  return current_thread->specific[key];
+}
+
+void sthread_user_setspecific(sthread_key_t key, void *value) {
+  assert(key >= 0 && key < nkeys);
+  current_thread->specific[key] = value;
+}
+
+sthread_t sthread_user_self(void) {
+  return current_thread;
+}
+
+int sthread_user_set_priority(sthread_t t, int priority) {
+  int old;
+
+  if (priority < 0 || priority > STHREAD_PRIO_MAX)
+    return -1;
+
+  /* A thread that is already ready moves to its new class the next
+   * time it is made ready. If we changed our own priority, let the
+   * scheduler take another look. */
+  old = splx(HIGH);
+  t->priority = priority;
+  if (t == current_thread)
+    need_resched = 1;
+  sthread_user_restore(old);
+  return 0;
+}
+
+int sthread_user_set_weight(sthread_t t, int weight) {
+  if (weight < 1 || weight > STHREAD_MAX_WEIGHT)
+    return -1;
+  t->weight = weight;
+  return 0;
+}
+
+/* Every thread runs on the one kernel thread, so pin that */
+int sthread_user_set_affinity(sthread_t t, int cpu) {
+#ifdef STHREAD_HAVE_AFFINITY
+  cpu_set_t set;
+
+  if (sthread_numa_cpuset(cpu, &set) < 0)
+    return -1;
+  return sched_setaffinity(0, sizeof(set), &set) < 0 ? -1 : 0;
+#else
+  return -1;
+#endif
+}
+
+int sthread_user_get_stats(sthread_t t, sthread_stats_t *stats) {
+  uint64_t cpu_ticks;
+  int old;
+
+  old = splx(HIGH);
+  cpu_ticks = t->cpu_ticks;
+  if (t == current_thread)
+    cpu_ticks += sthread_clock() - t->run_since;
+  stats->cpu_ns = sthread_clock_to_ns(cpu_ticks);
+  stats->wait_ns = sthread_clock_to_ns(t->wait_ticks);
+  stats->voluntary_switches = t->voluntary_switches;
+  stats->involuntary_switches = t->involuntary_switches;
+  splx(old);
+  return 0;
+}
+
+/* All new threads begin here, on their own stack, having been switched
+ * to from sthread_user_schedule() with interrupts disabled. */
+static void sthread_user_start(void) {
+  sthread_user_reap();
+  splx(LOW);
+  sthread_user_exit(current_thread->start_routine(current_thread->arg));
+}
+
+/* Called from the timer signal handler at the end of each time slice */
+static void sthread_user_preempt(void) {
+  STHREAD_TRACE(STHREAD_TRACE_PREEMPT, TID(current_thread), 0);
+  involuntary = 1;
+  sthread_user_yield();
+}
+
+/* Does fair_heap[a] come before fair_heap[b]? */
+static int fair_before(int a, int b) {
+  sthread_t ta = fair_heap[a], tb = fair_heap[b];
+  if (ta->pass != tb->pass)
+    return ta->pass < tb->pass;
+  return ta->ready_seq < tb->ready_seq;
+}
+
+static void fair_swap(int a, int b) {
+  sthread_t tmp = fair_heap[a];
+  fair_heap[a] = fair_heap[b];
+  fair_heap[b] = tmp;
+}
+
+static void fair_push(sthread_t t) {
+  int i;
+
+  if (fair_size == fair_capacity) {
+    fair_capacity = fair_capacity ? 2 * fair_capacity : 64;
+    fair_heap = (sthread_t *)realloc(fair_heap,
+                                     fair_capacity * sizeof(sthread_t));
+    assert(fair_heap != NULL);
+  }
+
+  i = fair_size++;
+  fair_heap[i] = t;
+  while (i > 0 && fair_before(i, (i - 1) / 2)) {
+    fair_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static sthread_t fair_pop(void) {
+  sthread_t t;
+  int i, child;
+
+  if (fair_size == 0)
+    return NULL;
+
+  t = fair_heap[0];
+  fair_heap[0] = fair_heap[--fair_size];
+  i = 0;
+  while ((child = 2 * i + 1) < fair_size) {
+    if (child + 1 < fair_size && fair_before(child + 1, child))
+      child++;
+    if (!fair_before(child, i))
+      break;
+    fair_swap(i, child);
+    i = child;
+  }
+  return t;
+}
+
+/* Put t where sthread_user_pick_next will find it. Must be called with
+ * interrupts disabled. */
+static void sthread_user_ready(sthread_t t) {
+  if (t->priority > 0) {
+    sthread_enqueue(prio_queues[t->priority], t);
+    prio_bitmap |= 1U << t->priority;
+  } else {
+    if (t->pass < global_pass)
+      t->pass = global_pass;
+    t->ready_seq = fair_seq++;
+    fair_push(t);
+  }
+  t->ready_since = sthread_clock();
+
+  if (t != current_thread) {
+    STHREAD_TRACE(STHREAD_TRACE_WAKE, TID(current_thread), TID(t));
+    sthread_preemption_contended();
+    if (t->priority > current_thread->priority)
+      need_resched = 1;
+  }
+}
+
+/* Remove and return the thread that should run next: the first thread
+ * at the highest nonempty priority level, or, if there is none, the
+ * fair thread with the lowest pass. Returns NULL if nothing is ready. */
+static sthread_t sthread_user_pick_next(void) {
+  sthread_t t;
+  int p;
+
+  if (prio_bitmap != 0) {
+    p = 31 - __builtin_clz(prio_bitmap);
+    t = sthread_dequeue(prio_queues[p]);
+    if (sthread_queue_is_empty(prio_queues[p]))
+      prio_bitmap &= ~(1U << p);
+    return t;
+  }
+
+  t = fair_pop();
+  if (t != NULL) {
+    global_pass = t->pass;
+    t->pass += STRIDE1 / t->weight;
+  }
+  return t;
 }
 
-/* Add any new part 1 functions here */
+/* Switch from the current thread to the next ready thread. The caller
+ * must have disabled interrupts, and must already have put the current
+ * thread wherever it should wait (back on the ready queues, for a
+ * yield, or some wait queue, for a blocking call). Returns when the
+ * current thread is next scheduled. */
+static void sthread_user_schedule(void) {
+  sthread_t old_thread, next_thread;
+  uint64_t now;
+
+  need_resched = 0;
+  old_thread = current_thread;
+  next_thread = sthread_user_pick_next();
+  if (next_thread == NULL) {
+    fprintf(stderr, "sthread: deadlock, no runnable threads\n");
+    abort();
+  }
+
+  now = sthread_clock();
+  old_thread->cpu_ticks += now - old_thread->run_since;
+  next_thread->wait_ticks += now - next_thread->ready_since;
+  next_thread->run_since = now;
+  if (next_thread != old_thread) {
+    if (involuntary)
+      old_thread->involuntary_switches++;
+    else
+      old_thread->voluntary_switches++;
+    STHREAD_TRACE(STHREAD_TRACE_SWITCH, TID(old_thread), TID(next_thread));
+  }
+  involuntary = 0;
+
+  /* Only time the slice if someone else is waiting for the CPU */
+  sthread_preemption_new_slice(&next_thread->preempt,
+                               prio_bitmap != 0 || fair_size > 0);
+
+  current_thread = next_thread;
+  sthread_switch(old_thread->saved_ctx, next_thread->saved_ctx);
+
+  sthread_user_reap();
+}
+
+/* Every thread queue is intrusive: a thread waits on at most one queue
+ * at a time (the run queue, the dead queue, or a single wait queue), so
+ * it can use its own embedded link and queueing never allocates. */
+static sthread_queue_t sthread_user_new_queue(void) {
+  return sthread_new_intrusive_queue(offsetof(struct _sthread, link));
+}
+
+/* Restore the interrupt level saved in old (from splx(HIGH)). If that
+ * turns interrupts back on, and a higher-priority thread was made ready
+ * while they were off, switch to it first. */
+static void sthread_user_restore(int old) {
+  if (old == LOW && need_resched) {
+    involuntary = 1;
+    sthread_user_ready(current_thread);
+    sthread_user_schedule();
+  }
+  splx(old);
+}
+
+/* Block the current thread on the given wait queue until another thread
+ * wakes it. Must be called with interrupts disabled. */
+static void sthread_user_sleep_on(sthread_queue_t queue) {
+  STHREAD_TRACE(STHREAD_TRACE_BLOCK, TID(current_thread), 0);
+  sthread_enqueue(queue, current_thread);
+  sthread_user_schedule();
+}
+
+/* Make the first thread waiting on queue, if any, ready to run.
+ * Returns nonzero if a thread was woken. Must be called with interrupts
+ * disabled. */
+static int sthread_user_wakeup(sthread_queue_t queue) {
+  sthread_t waiter = sthread_dequeue(queue);
+  if (waiter == NULL)
+    return 0;
+  sthread_user_ready(waiter);
+  return 1;
+}
+
+/* Make every thread waiting on queue ready to run. Must be called
+ * with interrupts disabled. */
+static void sthread_user_wakeup_all(sthread_queue_t queue) {
+  while (sthread_user_wakeup(queue))
+    ;
+}
+
+/* Free any detached threads that have exited. Must be called with
+ * interrupts disabled, from a thread that is not in the dead queue. */
+static void sthread_user_reap(void) {
+  sthread_t t;
+  while ((t = sthread_dequeue(dead_queue)) != NULL)
+    sthread_user_free(t);
+}
+
+/* Call the destructor for each of t's non-NULL keys. Runs with
+ * interrupts enabled, since destructors are application code. */
+static void sthread_user_run_destructors(sthread_t t) {
+  sthread_key_destructor_t destructor;
+  void *value;
+  int i, key, again;
+
+  for (i = 0; i < DESTRUCTOR_ITERATIONS; i++) {
+    again = 0;
+    for (key = 0; key < nkeys; key++) {
+      destructor = key_destructors[key];
+      value = t->specific[key];
+      if (value != NULL && destructor != NULL) {
+        t->specific[key] = NULL;
+        destructor(value);
+        again = 1;
+      }
+    }
+    if (!again)
+      break;
+  }
+}
+
+/* Release the memory of a thread that has exited. Its context goes
+ * back to the pool for the next sthread_user_create. Must be called
+ * with interrupts disabled. */
+static void sthread_user_free(sthread_t t) {
+  sthread_preempt_state_unregister(&t->preempt);
+  sthread_free_ctx(t->saved_ctx);
+  free(t);
+}
 
 
 /*********************************************************************/
 /* Part 2: Synchronization Primitives                                */
 /*********************************************************************/
 
+/* Mutexes are adaptive: the lock word is taken with atomic_test_and_set,
+ * so an uncontended lock or unlock never disables interrupts. A thread
+ * that finds the lock held retries for MUTEX_SPIN_COUNT iterations and
+ * then parks itself on the mutex's wait queue.
+ *
+ * Only one user thread runs at a time, so the holder can only release
+ * the lock while we are preempted; the spin is kept short enough that
+ * it catches a release by a timer switch landing in the middle of our
+ * attempt without burning a time slice.
+ */
+static const int MUTEX_SPIN_COUNT = 64;
+
 struct _sthread_mutex {
-  /* Fill in mutex data structure */
+  lock_t held;               /* 0 if unlocked, 1 if locked */
+  sthread_t owner;
+  sthread_queue_t waiters;   /* threads parked in sthread_user_mutex_lock */
 };
 
 sthread_mutex_t sthread_user_mutex_init() {
-  return NULL;
+  sthread_mutex_t lock;
+  lock = (sthread_mutex_t)malloc(sizeof(struct _sthread_mutex));
+  assert(lock != NULL);
+  lock->held = 0;
+  lock->owner = NULL;
+  lock->waiters = sthread_user_new_queue();
+  return lock;
 }
 
 void sthread_user_mutex_free(sthread_mutex_t lock) {
+  assert(!lock->held);
+  sthread_free_queue(lock->waiters);
+  free(lock);
 }
 
 void sthread_user_mutex_lock(sthread_mutex_t lock) {
+  int i, old;
+
+  for (i = 0; i < MUTEX_SPIN_COUNT; i++) {
+    if (!lock->held && !atomic_test_and_set(&lock->held)) {
+      lock->owner = current_thread;
+      return;
+    }
+  }
+
+  /* With interrupts off the test-and-set and the enqueue are atomic
+   * with respect to sthread_user_mutex_unlock, so a wakeup can't be
+   * lost between them. A woken thread competes for the lock again. */
+  old = splx(HIGH);
+  while (atomic_test_and_set(&lock->held))
+    sthread_user_sleep_on(lock->waiters);
+  lock->owner = current_thread;
+  sthread_user_restore(old);
 }
 
 void sthread_user_mutex_unlock(sthread_mutex_t lock) {
+  int old;
+
+  assert(lock->owner == current_thread);
+  lock->owner = NULL;
+  atomic_clear(&lock->held);
+
+  /* Any thread that parks after this point will see the lock free
+   * first, so an empty queue here means nobody needs waking. */
+  if (!sthread_queue_is_empty(lock->waiters)) {
+    old = splx(HIGH);
+    sthread_user_wakeup(lock->waiters);
+    sthread_user_restore(old);
+  } else {
+    /* Releasing a lock is a safe point for a deferred preemption */
+    sthread_preempt_point();
+  }
 }
 
 
+/* A broadcast makes only one waiter ready and moves the rest straight
+ * onto the wait queue of the mutex they waited with ("wait morphing"),
+ * since all but one would just park there anyway. Each unlock then
+ * wakes the next of them. */
 struct _sthread_cond {
-  /* Fill in condition variable structure */
+  sthread_queue_t waiters;
+  sthread_mutex_t lock;  /* the mutex the waiters last waited with */
 };
 
 sthread_cond_t sthread_user_cond_init(void) {
-  return NULL;
+  sthread_cond_t cond;
+  cond = (sthread_cond_t)malloc(sizeof(struct _sthread_cond));
+  assert(cond != NULL);
+  cond->waiters = sthread_user_new_queue();
+  cond->lock = NULL;
+  return cond;
 }
 
 void sthread_user_cond_free(sthread_cond_t cond) {
+  sthread_free_queue(cond->waiters);
+  free(cond);
 }
 
 void sthread_user_cond_signal(sthread_cond_t cond) {
+  int old;
+
+  old = splx(HIGH);
+  sthread_user_wakeup(cond->waiters);
+  sthread_user_restore(old);
 }
 
 void sthread_user_cond_broadcast(sthread_cond_t cond) {
+  sthread_t t;
+  int old;
+
+  old = splx(HIGH);
+  sthread_user_wakeup(cond->waiters);
+  while ((t = sthread_dequeue(cond->waiters)) != NULL)
+    sthread_enqueue(cond->lock->waiters, t);
+  sthread_user_restore(old);
 }
 
 void sthread_user_cond_wait(sthread_cond_t cond,
                             sthread_mutex_t lock) {
+  int old;
+
+  /* Queue ourselves before releasing the lock, with interrupts off, so
+   * a signal sent right after the unlock still finds us. */
+  old = splx(HIGH);
+  sthread_enqueue(cond->waiters, current_thread);
+  cond->lock = lock;
+  sthread_user_mutex_unlock(lock);
+  sthread_user_schedule();
+  sthread_user_restore(old);
+
+  sthread_user_mutex_lock(lock);
+}
+
+
+/* Reader-writer locks prefer writers: once a writer is waiting, new
+ * readers queue up behind it instead of joining the current readers. */
+struct _sthread_rwlock {
+  int readers;                   /* number of threads holding read locks */
+  int writer;                    /* nonzero if a thread holds the write lock */
+  int waiting_writers;
+  sthread_queue_t read_waiters;
+  sthread_queue_t write_waiters;
+};
+
+sthread_rwlock_t sthread_user_rwlock_init(void) {
+  sthread_rwlock_t rwlock;
+  rwlock = (sthread_rwlock_t)malloc(sizeof(struct _sthread_rwlock));
+  assert(rwlock != NULL);
+  rwlock->readers = 0;
+  rwlock->writer = 0;
+  rwlock->waiting_writers = 0;
+  rwlock->read_waiters = sthread_user_new_queue();
+  rwlock->write_waiters = sthread_user_new_queue();
+  return rwlock;
+}
+
+void sthread_user_rwlock_free(sthread_rwlock_t rwlock) {
+  assert(rwlock->readers == 0 && !rwlock->writer);
+  sthread_free_queue(rwlock->read_waiters);
+  sthread_free_queue(rwlock->write_waiters);
+  free(rwlock);
+}
+
+void sthread_user_rwlock_rdlock(sthread_rwlock_t rwlock) {
+  int old;
+
+  old = splx(HIGH);
+  while (rwlock->writer || rwlock->waiting_writers > 0)
+    sthread_user_sleep_on(rwlock->read_waiters);
+  rwlock->readers++;
+  sthread_user_restore(old);
+}
+
+void sthread_user_rwlock_wrlock(sthread_rwlock_t rwlock) {
+  int old;
+
+  old = splx(HIGH);
+  while (rwlock->writer || rwlock->readers > 0) {
+    /* Still counted as waiting after being woken, until we run again,
+     * so readers can't slip in ahead of us. */
+    rwlock->waiting_writers++;
+    sthread_user_sleep_on(rwlock->write_waiters);
+    rwlock->waiting_writers--;
+  }
+  rwlock->writer = 1;
+  sthread_user_restore(old);
+}
+
+void sthread_user_rwlock_unlock(sthread_rwlock_t rwlock) {
+  int old;
+
+  old = splx(HIGH);
+  if (rwlock->writer) {
+    rwlock->writer = 0;
+  } else {
+    assert(rwlock->readers > 0);
+    rwlock->readers--;
+  }
+
+  if (rwlock->readers == 0) {
+    if (!sthread_user_wakeup(rwlock->write_waiters))
+      sthread_user_wakeup_all(rwlock->read_waiters);
+  }
+  sthread_user_restore(old);
+}
+
+
+struct _sthread_sem {
+  unsigned int value;
+  sthread_queue_t waiters;
+};
+
+sthread_sem_t sthread_user_sem_init(unsigned int value) {
+  sthread_sem_t sem;
+  sem = (sthread_sem_t)malloc(sizeof(struct _sthread_sem));
+  assert(sem != NULL);
+  sem->value = value;
+  sem->waiters = sthread_user_new_queue();
+  return sem;
+}
+
+void sthread_user_sem_free(sthread_sem_t sem) {
+  sthread_free_queue(sem->waiters);
+  free(sem);
+}
+
+void sthread_user_sem_wait(sthread_sem_t sem) {
+  int old;
+
+  old = splx(HIGH);
+  while (sem->value == 0)
+    sthread_user_sleep_on(sem->waiters);
+  sem->value--;
+  sthread_user_restore(old);
+}
+
+void sthread_user_sem_post(sthread_sem_t sem) {
+  int old;
+
+  old = splx(HIGH);
+  sem->value++;
+  sthread_user_wakeup(sem->waiters);
+  sthread_user_restore(old);
+}
+
+
+struct _sthread_barrier {
+  unsigned int count;        /* threads needed to open the barrier */
+  unsigned int arrived;      /* threads waiting in this generation */
+  unsigned int generation;   /* bumped each time the barrier opens */
+  sthread_queue_t waiters;
+};
+
+sthread_barrier_t sthread_user_barrier_init(unsigned int count) {
+  sthread_barrier_t barrier;
+  assert(count > 0);
+  barrier = (sthread_barrier_t)malloc(sizeof(struct _sthread_barrier));
+  assert(barrier != NULL);
+  barrier->count = count;
+  barrier->arrived = 0;
+  barrier->generation = 0;
+  barrier->waiters = sthread_user_new_queue();
+  return barrier;
+}
+
+void sthread_user_barrier_free(sthread_barrier_t barrier) {
+  sthread_free_queue(barrier->waiters);
+  free(barrier);
+}
+
+int sthread_user_barrier_wait(sthread_barrier_t barrier) {
+  unsigned int generation;
+  int serial = 0;
+  int old;
+
+  old = splx(HIGH);
+  generation = barrier->generation;
+  if (++barrier->arrived == barrier->count) {
+    barrier->arrived = 0;
+    barrier->generation++;
+    sthread_user_wakeup_all(barrier->waiters);
+    serial = 1;
+  } else {
+    while (generation == barrier->generation)
+      sthread_user_sleep_on(barrier->waiters);
+  }
+  sthread_user_restore(old);
+
+  return serial;
 }
@@ -16,6 +16,16 @@ void sthread_user_exit(void *ret);
 void sthread_user_yield(void);
 void* sthread_user_join(sthread_t t);
 
+sthread_key_t sthread_user_key_create(sthread_key_destructor_t destructor);
+void *sthread_user_getspecific(sthread_key_t key);
+void sthread_user_setspecific(sthread_key_t key, void *value);
+
+sthread_t sthread_user_self(void);
+int sthread_user_set_priority(sthread_t t, int priority);
+int sthread_user_set_weight(sthread_t t, int weight);
+int sthread_user_set_affinity(sthread_t t, int cpu);
+int sthread_user_get_stats(sthread_t t, sthread_stats_t *stats);
+
 /* Part 2: Synchronization Primitives */
 sthread_mutex_t sthread_user_mutex_init(void);
 void sthread_user_mutex_free(sthread_mutex_t lock);
@@ -29,4 +39,19 @@ void sthread_user_cond_broadcast(sthread_cond_t cond);
 void sthread_user_cond_wait(sthread_cond_t cond,
                             sthread_mutex_t lock);
 
+sthread_rwlock_t sthread_user_rwlock_init(void);
+void sthread_user_rwlock_free(sthread_rwlock_t rwlock);
+void sthread_user_rwlock_rdlock(sthread_rwlock_t rwlock);
+void sthread_user_rwlock_wrlock(sthread_rwlock_t rwlock);
+void sthread_user_rwlock_unlock(sthread_rwlock_t rwlock);
+
+sthread_sem_t sthread_user_sem_init(unsigned int value);
+void sthread_user_sem_free(sthread_sem_t sem);
+void sthread_user_sem_wait(sthread_sem_t sem);
+void sthread_user_sem_post(sthread_sem_t sem);
+
+sthread_barrier_t sthread_user_barrier_init(unsigned int count);
+void sthread_user_barrier_free(sthread_barrier_t barrier);
+int sthread_user_barrier_wait(sthread_barrier_t barrier);
+
 #endif /* STHREAD_USER_H */
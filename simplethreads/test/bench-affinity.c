@@ -0,0 +1,142 @@
+/*
+ * bench-affinity.c - Thread placement benchmark.
+ *
+ * Each thread allocates and fills a private buffer (so the pages are
+ * placed on the node it is running on at that point), then streams
+ * over it repeatedly. After each pass the thread checks which CPU it
+ * is on: a pass that ends on a different node from the one the buffer
+ * was filled on approximates one pass of cross-node memory traffic.
+ * The run is repeated with no placement policy, then with compact and
+ * scatter placement. Reports memory throughput, the share of passes
+ * that ran off the buffer's node, and CPU migrations per thread.
+ *
+ * usage: bench-affinity [threads [buffer-kb [passes]]]
+ */
+
+#define _GNU_SOURCE  /* for sched_getcpu */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+
+#include <sthread.h>
+
+#define MAXTHREADS 256
+
+static int nthreads;
+static size_t buffer_kb = 8192;
+static int passes = 40;
+
+/* Summed over all threads */
+static volatile long remote_passes;
+static volatile long migrations;
+
+/* Keeps the sums from being optimized away */
+static volatile long sink;
+
+void *thread_start(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run(const char *name, sthread_placement_t policy) {
+  sthread_t child[MAXTHREADS];
+  uint64_t start, elapsed;
+  double mb;
+  int i;
+
+  if (sthread_set_placement(policy) < 0) {
+    printf("%10s (not supported)\n", name);
+    return;
+  }
+  remote_passes = 0;
+  migrations = 0;
+
+  start = now_ns();
+  for (i = 0; i < nthreads; i++) {
+    child[i] = sthread_create(thread_start, NULL, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(child[i]);
+  elapsed = now_ns() - start;
+
+  mb = (double)nthreads * passes * buffer_kb / 1024;
+  printf("%10s %12.0f %12.1f %16.2f\n", name, mb * 1e9 / elapsed,
+         100.0 * remote_passes / ((long)nthreads * passes),
+         (double)migrations / nthreads);
+}
+
+int main(int argc, char **argv) {
+  int cpu, n;
+
+  printf("Benchmarking thread placement, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  nthreads = sthread_num_cpus();
+  if (argc > 1)
+    nthreads = atoi(argv[1]);
+  if (argc > 2)
+    buffer_kb = atoi(argv[2]);
+  if (argc > 3)
+    passes = atoi(argv[3]);
+  assert(nthreads > 0 && nthreads <= MAXTHREADS && buffer_kb > 0 &&
+         passes > 0);
+
+  printf("%d CPUs on %d nodes:", sthread_num_cpus(), sthread_num_nodes());
+  for (cpu = 0, n = 0; n < sthread_num_cpus(); cpu++) {
+    if (sthread_cpu_node(cpu) >= 0) {
+      printf(" %d@%d", cpu, sthread_cpu_node(cpu));
+      n++;
+    }
+  }
+  printf("\n");
+
+  printf("%10s %12s %12s %16s\n", "placement", "MB/sec", "remote %",
+         "migrations/thr");
+  run("none", STHREAD_PLACE_NONE);
+  run("compact", STHREAD_PLACE_COMPACT);
+  run("scatter", STHREAD_PLACE_SCATTER);
+  sthread_set_placement(STHREAD_PLACE_NONE);
+
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  size_t n = buffer_kb * 1024 / sizeof(long), i;
+  int p, home, cpu, last_cpu;
+  long *buf, sum = 0;
+
+  buf = (long *)malloc(n * sizeof(long));
+  assert(buf != NULL);
+  memset(buf, 1, n * sizeof(long));
+  last_cpu = sched_getcpu();
+  home = sthread_cpu_node(last_cpu);
+
+  for (p = 0; p < passes; p++) {
+    for (i = 0; i < n; i++)
+      sum += buf[i];
+    cpu = sched_getcpu();
+    if (sthread_cpu_node(cpu) != home)
+      __sync_fetch_and_add(&remote_passes, 1);
+    if (cpu != last_cpu)
+      __sync_fetch_and_add(&migrations, 1);
+    last_cpu = cpu;
+  }
+
+  sink += sum;
+  free(buf);
+  return 0;
+}
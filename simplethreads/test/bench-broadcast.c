@@ -0,0 +1,144 @@
+/*
+ * bench-broadcast.c - Condition variable broadcast benchmark.
+ *
+ * A set of waiter threads sleep on one condition variable. The main
+ * thread repeatedly starts a new round and broadcasts; each waiter
+ * wakes, takes the mutex, checks in and goes back to waiting, and the
+ * last one in wakes the main thread for the next round. Reports rounds
+ * per second, the time per waiter woken, and the waiters' voluntary
+ * context switches per wakeup: close to 1 if a broadcast hands the
+ * mutex from one waiter to the next, higher if the waiters stampede
+ * for it and most of them have to sleep again.
+ *
+ * usage: bench-broadcast [waiters [rounds]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+
+#define MAXTHREADS 256
+
+static int nwaiters = 32;
+static int rounds = 5000;
+
+static sthread_mutex_t lock;
+static sthread_cond_t round_start, round_done;
+
+/* Protected by lock */
+static int round_no;     /* -1 tells the waiters to exit */
+static int checked_in;   /* waiters that have seen round_no */
+
+void *thread_start(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Wait until every waiter has checked in for the current round */
+static void wait_for_waiters(void) {
+  while (checked_in < nwaiters)
+    sthread_cond_wait(round_done, lock);
+}
+
+static unsigned long total_switches(sthread_t *child) {
+  sthread_stats_t stats;
+  unsigned long total = 0;
+  int i;
+
+  for (i = 0; i < nwaiters; i++) {
+    if (sthread_get_stats(child[i], &stats) < 0)
+      return 0;
+    total += stats.voluntary_switches;
+  }
+  return total;
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[MAXTHREADS];
+  unsigned long switches;
+  uint64_t start, elapsed;
+  int i;
+
+  if (argc > 1)
+    nwaiters = atoi(argv[1]);
+  if (argc > 2)
+    rounds = atoi(argv[2]);
+  assert(nwaiters > 0 && nwaiters <= MAXTHREADS && rounds > 0);
+
+  printf("Benchmarking condition variable broadcast, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  lock = sthread_mutex_init();
+  round_start = sthread_cond_init();
+  round_done = sthread_cond_init();
+
+  for (i = 0; i < nwaiters; i++) {
+    child[i] = sthread_create(thread_start, NULL, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+  }
+
+  /* Round 0 just gets everyone waiting */
+  sthread_mutex_lock(lock);
+  wait_for_waiters();
+  sthread_mutex_unlock(lock);
+  switches = total_switches(child);
+
+  start = now_ns();
+  for (i = 1; i <= rounds; i++) {
+    sthread_mutex_lock(lock);
+    round_no = i;
+    checked_in = 0;
+    sthread_cond_broadcast(round_start);
+    wait_for_waiters();
+    sthread_mutex_unlock(lock);
+  }
+  elapsed = now_ns() - start;
+  switches = total_switches(child) - switches;
+
+  printf("%10s %10s %12s %12s %16s\n", "waiters", "rounds", "rounds/sec",
+         "ns/wakeup", "switches/wakeup");
+  printf("%10d %10d %12.0f %12.1f %16.2f\n", nwaiters, rounds,
+         rounds * 1e9 / elapsed, (double)elapsed / rounds / nwaiters,
+         (double)switches / rounds / nwaiters);
+
+  sthread_mutex_lock(lock);
+  round_no = -1;
+  sthread_cond_broadcast(round_start);
+  sthread_mutex_unlock(lock);
+  for (i = 0; i < nwaiters; i++)
+    sthread_join(child[i]);
+
+  sthread_cond_free(round_done);
+  sthread_cond_free(round_start);
+  sthread_mutex_free(lock);
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  int seen = -1;
+
+  sthread_mutex_lock(lock);
+  for (;;) {
+    while (round_no == seen)
+      sthread_cond_wait(round_start, lock);
+    seen = round_no;
+    if (seen < 0)
+      break;
+    if (++checked_in == nwaiters)
+      sthread_cond_signal(round_done);
+  }
+  sthread_mutex_unlock(lock);
+  return 0;
+}
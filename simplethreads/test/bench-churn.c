@@ -0,0 +1,96 @@
+/*
+ * bench-churn.c - Thread create/exit churn benchmark.
+ *
+ * Creates short-lived threads that exit immediately, a batch at a
+ * time, first detached (the main thread yields until the whole batch
+ * has run) and then joinable (the main thread joins each one).
+ * Reports threads created per second and the process's peak resident
+ * set size, which stays flat only if exited threads' stacks are
+ * reclaimed promptly.
+ *
+ * usage: bench-churn [threads [batch-size]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <sthread.h>
+
+#define MAXBATCH 1024
+
+static int nthreads = 200000;
+static int batch = 100;
+
+static volatile int finished;
+
+void *thread_start(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long peak_rss_kb(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+static void run(int joinable) {
+  sthread_t child[MAXBATCH];
+  uint64_t start, elapsed;
+  int created, i;
+
+  start = now_ns();
+  for (created = 0; created < nthreads; created += batch) {
+    finished = 0;
+    for (i = 0; i < batch; i++) {
+      child[i] = sthread_create(thread_start, NULL, joinable);
+      if (child[i] == NULL) {
+        printf("sthread_create failed\n");
+        exit(1);
+      }
+    }
+    if (joinable) {
+      for (i = 0; i < batch; i++)
+        sthread_join(child[i]);
+    } else {
+      while (finished < batch)
+        sthread_yield();
+    }
+  }
+  elapsed = now_ns() - start;
+
+  printf("%10s %10d %14.0f %14ld\n", joinable ? "joinable" : "detached",
+         created, created * 1e9 / elapsed, peak_rss_kb());
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    nthreads = atoi(argv[1]);
+  if (argc > 2)
+    batch = atoi(argv[2]);
+  assert(batch > 0 && batch <= MAXBATCH);
+
+  printf("Benchmarking thread create/exit churn, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  printf("%10s %10s %14s %14s\n", "mode", "threads", "threads/sec",
+         "peak_rss_kb");
+  run(0);
+  run(1);
+
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  __sync_fetch_and_add(&finished, 1);
+  return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * bench-coro.c - Coroutine vs. thread pipeline benchmark.
+ *
+ * Feeds a stream of HTTP requests, in fixed-size chunks, to a request
+ * parser written in the natural "pull" style (it asks for the next
+ * character, and the next chunk when the current one runs out). The
+ * parser runs once as a coroutine that the feeding loop resumes with
+ * each chunk, and once as a separate thread that receives each chunk
+ * through a one-slot mailbox (a mutex and two condition variables).
+ * Reports requests parsed per second and the cost per chunk handed
+ * over.
+ *
+ * usage: bench-coro [requests [chunk-size]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+
+static int nrequests = 200000;
+static int chunk_size = 64;
+
+static char *input;
+static size_t input_len;
+
+/* Results of a parse */
+static long requests;
+static long headers;
+
+/* Where the parser gets its input from */
+struct source {
+  const char *p, *end;         /* the rest of the current chunk */
+  int (*fill)(struct source *);  /* get the next chunk; 0 at the end */
+};
+
+/* A chunk of input handed to the parser */
+struct chunk {
+  const char *data;
+  size_t len;
+};
+
+static sthread_mutex_t mailbox_lock;
+static sthread_cond_t mailbox_full, mailbox_empty;
+static struct chunk *mailbox;
+static int mailbox_used;
+
+void *parser_thread(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int next_char(struct source *src) {
+  if (src->p == src->end && !src->fill(src))
+    return -1;
+  return *src->p++;
+}
+
+/* Count requests (ended by an empty line) and their header lines
+ * until the input runs out. */
+static void parse_requests(struct source *src) {
+  int c, line_len = 0, lines = 0;
+
+  while ((c = next_char(src)) != -1) {
+    if (c == '\n') {
+      if (line_len == 0) {
+        requests++;
+        headers += lines - 1;  /* not counting the request line */
+        lines = 0;
+      } else {
+        lines++;
+      }
+      line_len = 0;
+    } else if (c != '\r') {
+      line_len++;
+    }
+  }
+}
+
+static int coro_fill(struct source *src) {
+  struct chunk *chunk = (struct chunk *)sthread_coro_yield(NULL);
+  if (chunk == NULL)
+    return 0;
+  src->p = chunk->data;
+  src->end = chunk->data + chunk->len;
+  return 1;
+}
+
+static void *parser_coro(void *arg) {
+  struct source src = { NULL, NULL, coro_fill };
+  parse_requests(&src);
+  return NULL;
+}
+
+static int mailbox_fill(struct source *src) {
+  struct chunk *chunk;
+
+  sthread_mutex_lock(mailbox_lock);
+  while (!mailbox_used)
+    sthread_cond_wait(mailbox_full, mailbox_lock);
+  chunk = mailbox;
+  mailbox_used = 0;
+  sthread_cond_signal(mailbox_empty);
+  sthread_mutex_unlock(mailbox_lock);
+
+  if (chunk == NULL)
+    return 0;
+  src->p = chunk->data;
+  src->end = chunk->data + chunk->len;
+  return 1;
+}
+
+static void mailbox_put(struct chunk *chunk) {
+  sthread_mutex_lock(mailbox_lock);
+  while (mailbox_used)
+    sthread_cond_wait(mailbox_empty, mailbox_lock);
+  mailbox = chunk;
+  mailbox_used = 1;
+  sthread_cond_signal(mailbox_full);
+  sthread_mutex_unlock(mailbox_lock);
+}
+
+void *parser_thread(void *arg) {
+  struct source src = { NULL, NULL, mailbox_fill };
+  parse_requests(&src);
+  return NULL;
+}
+
+static void report(const char *name, uint64_t elapsed) {
+  size_t nchunks = (input_len + chunk_size - 1) / chunk_size;
+
+  if (requests != nrequests || headers != 2L * nrequests) {
+    printf("%s: parsed %ld requests and %ld headers, expected %d and %d\n",
+           name, requests, headers, nrequests, 2 * nrequests);
+    exit(1);
+  }
+  printf("%10s %12ld %14.0f %14.1f\n", name, requests,
+         requests * 1e9 / elapsed, (double)elapsed / nchunks);
+}
+
+int main(int argc, char **argv) {
+  struct chunk *chunks;
+  sthread_coro_t coro;
+  sthread_t thread;
+  size_t nchunks, off, i;
+  uint64_t start;
+  char *p;
+  int r;
+
+  if (argc > 1)
+    nrequests = atoi(argv[1]);
+  if (argc > 2)
+    chunk_size = atoi(argv[2]);
+  assert(nrequests > 0 && chunk_size > 0);
+
+  printf("Benchmarking coroutine vs. thread pipeline, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  /* Build the input and cut it into chunks */
+  input = malloc((size_t)nrequests * 128);
+  assert(input != NULL);
+  p = input;
+  for (r = 0; r < nrequests; r++)
+    p += sprintf(p, "GET /page%d.html HTTP/1.0\r\nHost: localhost\r\n"
+                 "User-Agent: bench-coro\r\n\r\n", r % 1000);
+  input_len = p - input;
+  nchunks = (input_len + chunk_size - 1) / chunk_size;
+  chunks = malloc(nchunks * sizeof(struct chunk));
+  assert(chunks != NULL);
+  for (i = 0, off = 0; i < nchunks; i++, off += chunk_size) {
+    chunks[i].data = input + off;
+    chunks[i].len = input_len - off < (size_t)chunk_size ?
+                    input_len - off : (size_t)chunk_size;
+  }
+
+  printf("%10s %12s %14s %14s\n", "parser", "requests", "requests/sec",
+         "ns/chunk");
+
+  /* Coroutine: resume the parser once per chunk */
+  requests = headers = 0;
+  start = now_ns();
+  coro = sthread_coro_create(parser_coro, NULL, 0);
+  assert(coro != NULL);
+  sthread_coro_resume(coro, NULL);  /* runs up to its first yield */
+  for (i = 0; i < nchunks; i++)
+    sthread_coro_resume(coro, &chunks[i]);
+  sthread_coro_resume(coro, NULL);
+  assert(sthread_coro_done(coro));
+  sthread_coro_free(coro);
+  report("coroutine", now_ns() - start);
+
+  /* Thread per stage: hand each chunk to the parser thread */
+  requests = headers = 0;
+  mailbox_lock = sthread_mutex_init();
+  mailbox_full = sthread_cond_init();
+  mailbox_empty = sthread_cond_init();
+  mailbox_used = 0;
+  start = now_ns();
+  thread = sthread_create(parser_thread, NULL, 1);
+  assert(thread != NULL);
+  for (i = 0; i < nchunks; i++)
+    mailbox_put(&chunks[i]);
+  mailbox_put(NULL);
+  sthread_join(thread);
+  report("thread", now_ns() - start);
+
+  sthread_cond_free(mailbox_empty);
+  sthread_cond_free(mailbox_full);
+  sthread_mutex_free(mailbox_lock);
+  free(chunks);
+  free(input);
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * bench-malloc.c - Allocator benchmark.
+ *
+ * Each thread repeatedly allocates a handful of small blocks of the
+ * sizes a web server's request path uses (a connection record, a
+ * header buffer, a few strings), touches them and frees them again,
+ * first with malloc/free and then with sthread_malloc/sthread_free.
+ * Reports allocations per second for each.
+ *
+ * usage: bench-malloc [threads [iterations]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+
+#define MAXTHREADS 64
+#define PER_ITER 6
+
+static const size_t sizes[PER_ITER] = { 48, 512, 24, 80, 2048, 200 };
+
+static int nthreads = 4;
+static int iterations = 500000;
+
+static void *(*alloc_fn)(size_t);
+static void (*free_fn)(void *);
+
+void *thread_start(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run(const char *name, void *(*a)(size_t), void (*f)(void *)) {
+  sthread_t child[MAXTHREADS];
+  uint64_t start, elapsed;
+  long total;
+  int i;
+
+  alloc_fn = a;
+  free_fn = f;
+  start = now_ns();
+  for (i = 0; i < nthreads; i++) {
+    child[i] = sthread_create(thread_start, NULL, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(child[i]);
+  elapsed = now_ns() - start;
+
+  total = (long)nthreads * iterations * PER_ITER;
+  printf("%14s %12ld %14.0f %10.1f\n", name, total, total * 1e9 / elapsed,
+         (double)elapsed / total);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    nthreads = atoi(argv[1]);
+  if (argc > 2)
+    iterations = atoi(argv[2]);
+  assert(nthreads > 0 && nthreads <= MAXTHREADS && iterations > 0);
+
+  printf("Benchmarking malloc vs. sthread_malloc, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  printf("%14s %12s %14s %10s\n", "allocator", "allocs", "allocs/sec",
+         "ns/alloc");
+  run("malloc", malloc, free);
+  run("sthread_malloc", sthread_malloc, sthread_free);
+
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  void *p[PER_ITER];
+  int i, j;
+
+  for (i = 0; i < iterations; i++) {
+    for (j = 0; j < PER_ITER; j++) {
+      p[j] = alloc_fn(sizes[j]);
+      assert(p[j] != NULL);
+      *(volatile char *)p[j] = (char)i;
+    }
+    for (j = PER_ITER - 1; j >= 0; j--)
+      free_fn(p[j]);
+  }
+  return 0;
+}
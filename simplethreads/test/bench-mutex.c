@@ -0,0 +1,124 @@
+/*
+ * bench-mutex.c - Mutex contention benchmark.
+ *
+ * Runs every combination of thread count and critical-section length
+ * below. Each thread repeatedly takes a shared mutex, spins for the
+ * critical-section length, and releases it. Reports throughput
+ * (critical sections per second) and the average lock hand-off
+ * latency: the time from one thread's unlock to a different thread
+ * acquiring the lock.
+ *
+ * usage: bench-mutex [iterations-per-thread]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+
+#define MAXTHREADS 16
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+static const int cs_lengths[] = { 0, 100, 1000 };
+
+static int iterations = 20000;
+static int cs_length;
+static sthread_mutex_t mutex;
+
+/* Protected by mutex */
+static long last_owner;
+static uint64_t release_ns;
+static uint64_t handoff_ns;
+static long handoffs;
+
+/* Keeps the critical-section spin from being optimized away */
+static volatile int sink;
+
+void *thread_start(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spin(int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    sink++;
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[MAXTHREADS];
+  uint64_t start, elapsed;
+  unsigned t, c;
+  int i, nthreads;
+
+  if (argc > 1)
+    iterations = atoi(argv[1]);
+
+  printf("Benchmarking sthread_mutex_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  printf("%8s %8s %14s %10s %14s\n",
+         "threads", "cs_len", "ops/sec", "handoffs", "handoff_ns");
+
+  for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+    for (c = 0; c < sizeof(cs_lengths) / sizeof(cs_lengths[0]); c++) {
+      nthreads = thread_counts[t];
+      assert(nthreads <= MAXTHREADS);
+      cs_length = cs_lengths[c];
+      last_owner = -1;
+      handoff_ns = 0;
+      handoffs = 0;
+      mutex = sthread_mutex_init();
+
+      start = now_ns();
+      for (i = 0; i < nthreads; i++) {
+        child[i] = sthread_create(thread_start, (void *)(long)i, 1);
+        if (child[i] == NULL) {
+          printf("sthread_create failed\n");
+          exit(1);
+        }
+      }
+      for (i = 0; i < nthreads; i++)
+        sthread_join(child[i]);
+      elapsed = now_ns() - start;
+
+      printf("%8d %8d %14.0f %10ld %14.0f\n", nthreads, cs_length,
+             (double)nthreads * iterations * 1e9 / elapsed, handoffs,
+             handoffs ? (double)handoff_ns / handoffs : 0.0);
+
+      sthread_mutex_free(mutex);
+    }
+  }
+
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  long id = (long)arg;
+  int i;
+
+  for (i = 0; i < iterations; i++) {
+    sthread_mutex_lock(mutex);
+    if (last_owner != -1 && last_owner != id) {
+      handoff_ns += now_ns() - release_ns;
+      handoffs++;
+    }
+    spin(cs_length);
+    last_owner = id;
+    release_ns = now_ns();
+    sthread_mutex_unlock(mutex);
+
+    /* Some work outside the lock, so waiters get a chance at it */
+    spin(cs_length / 4 + 10);
+  }
+
+  return 0;
+}
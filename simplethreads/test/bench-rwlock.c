@@ -0,0 +1,131 @@
+/*
+ * bench-rwlock.c - Reader-writer lock scaling benchmark.
+ *
+ * Threads perform lookups (reads) and updates (writes) on a shared
+ * table, protected either by a single mutex or by a reader-writer lock.
+ * For each read/write mix and thread count, reports total operations
+ * per second with each kind of lock.
+ *
+ * usage: bench-rwlock [operations-per-thread]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+
+#define MAXTHREADS 16
+#define TABLE_SIZE 256
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+static const int read_percents[] = { 100, 99, 90, 50 };
+
+static int operations = 20000;
+static int read_percent;
+static int use_rwlock;
+static sthread_mutex_t mutex;
+static sthread_rwlock_t rwlock;
+
+static int table[TABLE_SIZE];
+static volatile int sink;
+
+void *thread_start(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double run(int nthreads) {
+  sthread_t child[MAXTHREADS];
+  uint64_t start;
+  int i;
+
+  assert(nthreads <= MAXTHREADS);
+  start = now_ns();
+  for (i = 0; i < nthreads; i++) {
+    child[i] = sthread_create(thread_start, (void *)(long)(i + 1), 1);
+    if (child[i] == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(child[i]);
+
+  return (double)nthreads * operations * 1e9 / (now_ns() - start);
+}
+
+int main(int argc, char **argv) {
+  unsigned t, r;
+  double mutex_ops, rwlock_ops;
+
+  if (argc > 1)
+    operations = atoi(argv[1]);
+
+  printf("Benchmarking sthread_rwlock_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  mutex = sthread_mutex_init();
+  rwlock = sthread_rwlock_init();
+
+  printf("%8s %8s %14s %14s %8s\n",
+         "threads", "reads%", "mutex ops/s", "rwlock ops/s", "speedup");
+
+  for (r = 0; r < sizeof(read_percents) / sizeof(read_percents[0]); r++) {
+    for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+      read_percent = read_percents[r];
+      use_rwlock = 0;
+      mutex_ops = run(thread_counts[t]);
+      use_rwlock = 1;
+      rwlock_ops = run(thread_counts[t]);
+      printf("%8d %8d %14.0f %14.0f %8.2f\n", thread_counts[t],
+             read_percent, mutex_ops, rwlock_ops, rwlock_ops / mutex_ops);
+    }
+  }
+
+  sthread_mutex_free(mutex);
+  sthread_rwlock_free(rwlock);
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  unsigned int seed = (unsigned int)(long)arg;
+  int i, j, sum, is_read;
+
+  for (i = 0; i < operations; i++) {
+    is_read = (rand_r(&seed) % 100) < read_percent;
+
+    if (use_rwlock) {
+      if (is_read)
+        sthread_rwlock_rdlock(rwlock);
+      else
+        sthread_rwlock_wrlock(rwlock);
+    } else {
+      sthread_mutex_lock(mutex);
+    }
+
+    if (is_read) {
+      /* A lookup scans the table */
+      sum = 0;
+      for (j = 0; j < TABLE_SIZE; j++)
+        sum += table[j];
+      sink = sum;
+    } else {
+      table[rand_r(&seed) % TABLE_SIZE]++;
+    }
+
+    if (use_rwlock)
+      sthread_rwlock_unlock(rwlock);
+    else
+      sthread_mutex_unlock(mutex);
+  }
+
+  return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * bench-sched.c - Scheduling latency benchmark.
+ *
+ * Several CPU-bound background threads spin at priority 0. One of them
+ * also posts an event to a semaphore every millisecond or so, and a
+ * responder thread waits on it and measures how long it took to get
+ * the CPU after the post. The run is repeated with the responder at
+ * priority 0 (sharing the CPU with the background load) and at
+ * STHREAD_PRIO_MAX, and the average and worst wakeup latencies are
+ * reported along with background throughput.
+ *
+ * usage: bench-sched [background-threads [events]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+
+#define MAXTHREADS 16
+
+/* Minimum time between events, in nanoseconds */
+static const uint64_t event_interval_ns = 1000000;
+
+static int nbackground = 4;
+static int nevents = 200;
+static int responder_priority;
+
+static sthread_sem_t event;
+static volatile int pending;
+static volatile uint64_t post_ns;
+static volatile int stop;
+static volatile long background_iterations;
+
+static uint64_t total_latency_ns;
+static uint64_t max_latency_ns;
+static int priority_failed;
+
+void *background_start(void *arg);
+void *responder_start(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run(int priority) {
+  sthread_t child[MAXTHREADS + 1];
+  uint64_t start, elapsed;
+  int i;
+
+  responder_priority = priority;
+  pending = 0;
+  stop = 0;
+  background_iterations = 0;
+  total_latency_ns = 0;
+  max_latency_ns = 0;
+  priority_failed = 0;
+  event = sthread_sem_init(0);
+
+  start = now_ns();
+  child[0] = sthread_create(responder_start, NULL, 1);
+  for (i = 1; i <= nbackground; i++)
+    child[i] = sthread_create(background_start, (void *)(long)i, 1);
+  for (i = 0; i <= nbackground; i++) {
+    if (child[i] == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i <= nbackground; i++)
+    sthread_join(child[i]);
+  elapsed = now_ns() - start;
+
+  printf("%9d %14.1f %14.1f %16.0f%s\n", priority,
+         (double)total_latency_ns / nevents / 1000.0,
+         (double)max_latency_ns / 1000.0,
+         background_iterations * 1e9 / elapsed,
+         priority_failed ? "  (sthread_set_priority failed)" : "");
+
+  sthread_sem_free(event);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    nbackground = atoi(argv[1]);
+  if (argc > 2)
+    nevents = atoi(argv[2]);
+  if (nbackground < 1)
+    nbackground = 1;
+  if (nbackground > MAXTHREADS)
+    nbackground = MAXTHREADS;
+
+  printf("Benchmarking scheduling latency, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+  printf("%d background threads, %d events\n", nbackground, nevents);
+
+  sthread_init();
+
+  printf("%9s %14s %14s %16s\n",
+         "priority", "avg_lat_us", "max_lat_us", "background it/s");
+  run(0);
+  run(STHREAD_PRIO_MAX);
+
+  return 0;
+}
+
+/* Spin until the responder has seen every event. Thread 1 also posts
+ * the events. */
+void *background_start(void *arg) {
+  long id = (long)arg;
+  uint64_t last = 0, now;
+  long iterations = 0;
+
+  while (!stop) {
+    iterations++;
+    if (id == 1 && !pending) {
+      now = now_ns();
+      if (now - last >= event_interval_ns) {
+        last = now;
+        pending = 1;
+        post_ns = now;
+        sthread_sem_post(event);
+      }
+    }
+  }
+
+  __sync_fetch_and_add(&background_iterations, iterations);
+  return 0;
+}
+
+void *responder_start(void *arg) {
+  uint64_t latency;
+  int i;
+
+  if (sthread_set_priority(sthread_self(), responder_priority) != 0)
+    priority_failed = 1;
+
+  for (i = 0; i < nevents; i++) {
+    sthread_sem_wait(event);
+    latency = now_ns() - post_ns;
+    total_latency_ns += latency;
+    if (latency > max_latency_ns)
+      max_latency_ns = latency;
+    pending = 0;
+  }
+
+  stop = 1;
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * bench-switch.c - Context switch cost benchmark.
+ *
+ * Two (or more) threads yield to each other in a loop with nothing
+ * else to run, so every sthread_yield is a switch to another thread.
+ * Reports the average cost of one yield-and-switch in TSC cycles and
+ * in nanoseconds, along with the number of switches actually observed
+ * (a yield that returns to the same thread isn't counted as a switch).
+ *
+ * usage: bench-switch [yields-per-thread [threads]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+
+#define MAXTHREADS 16
+
+static int iterations = 1000000;
+static int nthreads = 2;
+
+static volatile long last_thread = -1;
+static volatile long switches;
+
+void *thread_start(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+#else
+  return now_ns();
+#endif
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[MAXTHREADS];
+  uint64_t start_ns, start_cycles, elapsed_ns, elapsed_cycles;
+  double yields;
+  int i;
+
+  if (argc > 1)
+    iterations = atoi(argv[1]);
+  if (argc > 2)
+    nthreads = atoi(argv[2]);
+  assert(nthreads >= 2 && nthreads <= MAXTHREADS);
+
+  printf("Benchmarking context switches, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  start_ns = now_ns();
+  start_cycles = now_cycles();
+  for (i = 0; i < nthreads; i++) {
+    child[i] = sthread_create(thread_start, (void *)(long)i, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(child[i]);
+  elapsed_cycles = now_cycles() - start_cycles;
+  elapsed_ns = now_ns() - start_ns;
+
+  yields = (double)nthreads * iterations;
+  printf("%8s %12s %12s %14s %10s\n",
+         "threads", "yields", "switches", "cycles/switch", "ns/switch");
+  printf("%8d %12.0f %12ld %14.1f %10.1f\n", nthreads, yields, switches,
+         elapsed_cycles / yields, elapsed_ns / yields);
+
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  long id = (long)arg;
+  int i;
+
+  for (i = 0; i < iterations; i++) {
+    if (last_thread != id) {
+      last_thread = id;
+      switches++;
+    }
+    sthread_yield();
+  }
+
+  return 0;
+}
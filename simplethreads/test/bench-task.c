@@ -0,0 +1,155 @@
+/*
+ * bench-task.c - Task runtime benchmark.
+ *
+ * Sums an array in chunks two ways: by creating and joining one thread
+ * per chunk, and with sthread_parallel_for at the same grain. Then
+ * measures the fixed cost of an empty piece of work both ways: thread
+ * create and join, and task spawn and wait. Reports the time per loop
+ * and per piece of work.
+ *
+ * usage: bench-task [elements [chunks [rounds]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+
+#define MAXCHUNKS 4096
+
+static long nelements = 4 * 1024 * 1024;
+static int nchunks = 256;
+static int rounds = 20;
+
+static long *array;
+static volatile long total;
+
+struct chunk {
+  long begin, end;
+};
+
+void *chunk_thread(void *arg);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sum_range(long begin, long end, void *arg) {
+  long i, sum = 0;
+
+  for (i = begin; i < end; i++)
+    sum += array[i];
+  __sync_fetch_and_add(&total, sum);
+}
+
+void *chunk_thread(void *arg) {
+  struct chunk *c = (struct chunk *)arg;
+  sum_range(c->begin, c->end, NULL);
+  return 0;
+}
+
+static void *empty_thread(void *arg) {
+  return 0;
+}
+
+static void empty_task(void *arg) {
+}
+
+static void check_total(const char *name) {
+  if (total != nelements) {
+    printf("%s: sum is %ld, expected %ld\n", name, total, nelements);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  static struct chunk chunks[MAXCHUNKS];
+  static sthread_t child[MAXCHUNKS];
+  sthread_task_group_t group;
+  uint64_t start, threads_ns, tasks_ns;
+  long grain, i;
+  int r, c;
+
+  if (argc > 1)
+    nelements = atol(argv[1]);
+  if (argc > 2)
+    nchunks = atoi(argv[2]);
+  if (argc > 3)
+    rounds = atoi(argv[3]);
+  assert(nelements > 0 && nchunks > 0 && nchunks <= MAXCHUNKS && rounds > 0);
+
+  printf("Benchmarking tasks vs. threads, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  array = (long *)malloc(nelements * sizeof(long));
+  assert(array != NULL);
+  for (i = 0; i < nelements; i++)
+    array[i] = 1;
+  grain = (nelements + nchunks - 1) / nchunks;
+  for (c = 0; c < nchunks; c++) {
+    chunks[c].begin = c * grain < nelements ? c * grain : nelements;
+    chunks[c].end = (c + 1) * grain < nelements ? (c + 1) * grain : nelements;
+  }
+
+  printf("%14s %14s %14s\n", "", "threads", "tasks");
+
+  /* Parallel sum, one thread or task per chunk */
+  start = now_ns();
+  for (r = 0; r < rounds; r++) {
+    total = 0;
+    for (c = 0; c < nchunks; c++) {
+      child[c] = sthread_create(chunk_thread, &chunks[c], 1);
+      assert(child[c] != NULL);
+    }
+    for (c = 0; c < nchunks; c++)
+      sthread_join(child[c]);
+    check_total("threads");
+  }
+  threads_ns = now_ns() - start;
+
+  sthread_parallel_for(0, 1, 1, sum_range, NULL);  /* start the pool */
+  start = now_ns();
+  for (r = 0; r < rounds; r++) {
+    total = 0;
+    sthread_parallel_for(0, nelements, grain, sum_range, NULL);
+    check_total("tasks");
+  }
+  tasks_ns = now_ns() - start;
+  printf("%14s %14.0f %14.0f\n", "us/loop", threads_ns / 1e3 / rounds,
+         tasks_ns / 1e3 / rounds);
+
+  /* Empty work: the fixed cost of each */
+  start = now_ns();
+  for (r = 0; r < rounds; r++) {
+    for (c = 0; c < nchunks; c++) {
+      child[c] = sthread_create(empty_thread, NULL, 1);
+      assert(child[c] != NULL);
+    }
+    for (c = 0; c < nchunks; c++)
+      sthread_join(child[c]);
+  }
+  threads_ns = now_ns() - start;
+
+  group = sthread_task_group_create();
+  assert(group != NULL);
+  start = now_ns();
+  for (r = 0; r < rounds; r++) {
+    for (c = 0; c < nchunks; c++)
+      sthread_task_spawn(group, empty_task, NULL);
+    sthread_task_wait(group);
+  }
+  tasks_ns = now_ns() - start;
+  sthread_task_group_free(group);
+  printf("%14s %14.0f %14.0f\n", "ns/empty", (double)threads_ns /
+         rounds / nchunks, (double)tasks_ns / rounds / nchunks);
+
+  free(array);
+  return 0;
+}
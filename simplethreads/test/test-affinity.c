@@ -0,0 +1,164 @@
+/*
+ * test-affinity.c - Simple test of CPU placement. Checks that the
+ *                   topology is consistent, that threads can be pinned
+ *                   to each CPU in turn (and run there), that CPUs the
+ *                   process can't use are refused, and that threads
+ *                   created under each placement policy run, joinable
+ *                   or detached, with their stacks on their own node.
+ *
+ */
+
+#define _GNU_SOURCE  /* for sched_getcpu */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <sthread.h>
+
+#define NTHREADS 8
+
+/* From linux/mempolicy.h: get_mempolicy returns the node of the page
+ * at an address */
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+
+static int errors = 0;
+static int finished = 0;  /* threads that have run */
+
+void *thread_start(void *arg);
+
+static void check_pinned(int cpu) {
+  int i;
+
+  /* The move may not be immediate; give it a few yields */
+  for (i = 0; i < 10 && sched_getcpu() != cpu; i++)
+    sthread_yield();
+  if (sched_getcpu() != cpu) {
+    printf("pinned to CPU %d but running on %d\n", cpu, sched_getcpu());
+    __sync_fetch_and_add(&errors, 1);
+  }
+}
+
+int main(int argc, char **argv) {
+  sthread_placement_t policies[] = { STHREAD_PLACE_COMPACT,
+                                     STHREAD_PLACE_SCATTER,
+                                     STHREAD_PLACE_NONE };
+  sthread_t child[NTHREADS];
+  int cpu, n, p, i;
+
+  printf("Testing sthread_set_affinity, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  if (sthread_num_cpus() < 1 || sthread_num_nodes() < 1 ||
+      sthread_num_nodes() > sthread_num_cpus()) {
+    printf("%d CPUs on %d nodes\n", sthread_num_cpus(), sthread_num_nodes());
+    return 1;
+  }
+
+  /* Pin the main thread to each usable CPU in turn */
+  for (cpu = 0, n = 0; n < sthread_num_cpus(); cpu++) {
+    if (sthread_cpu_node(cpu) < 0)
+      continue;
+    n++;
+    if (sthread_cpu_node(cpu) >= sthread_num_nodes()) {
+      printf("CPU %d is on node %d, but there are only %d nodes\n", cpu,
+             sthread_cpu_node(cpu), sthread_num_nodes());
+      errors++;
+    }
+    if (sthread_set_affinity(sthread_self(), cpu) < 0) {
+      printf("sthread_set_affinity(%d) failed\n", cpu);
+      errors++;
+      continue;
+    }
+    check_pinned(cpu);
+  }
+  if (sthread_set_affinity(sthread_self(), -1) < 0) {
+    printf("sthread_set_affinity(-1) failed\n");
+    errors++;
+  }
+  if (sthread_set_affinity(sthread_self(), -2) == 0 ||
+      sthread_set_affinity(sthread_self(), 1 << 20) == 0) {
+    printf("sthread_set_affinity accepted a bad CPU\n");
+    errors++;
+  }
+
+  /* Each child pins itself to the CPU it was told to */
+  for (p = 0; p < 3; p++) {
+    if (sthread_set_placement(policies[p]) < 0) {
+      printf("sthread_set_placement(%d) failed\n", (int)policies[p]);
+      errors++;
+      continue;
+    }
+    for (i = 0; i < NTHREADS; i++) {
+      child[i] = sthread_create(thread_start, (void *)(long)policies[p], 1);
+      if (child[i] == NULL) {
+        printf("sthread_create %d failed\n", i);
+        exit(1);
+      }
+    }
+    for (i = 0; i < NTHREADS; i++)
+      sthread_join(child[i]);
+
+    /* Detached threads; the next ones created free their stacks */
+    for (i = 0; i < NTHREADS; i++) {
+      if (sthread_create(thread_start, (void *)(long)policies[p], 0) ==
+          NULL) {
+        printf("sthread_create %d (detached) failed\n", i);
+        exit(1);
+      }
+    }
+    while (finished < (p + 1) * 2 * NTHREADS)
+      sthread_yield();
+  }
+
+  if (errors) {
+    printf("sthread_set_affinity failed\n");
+    return 1;
+  }
+  printf("sthread_set_affinity passed\n");
+  return 0;
+}
+
+/* Check that the page at addr, on the stack of a thread placed on cpu,
+ * is on cpu's node */
+static void check_stack_node(void *addr, int cpu) {
+#ifdef SYS_get_mempolicy
+  int node = -1;
+
+  if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+              MPOL_F_NODE | MPOL_F_ADDR) == 0 &&
+      node != sthread_cpu_node(cpu)) {
+    printf("stack of a thread on CPU %d (node %d) is on node %d\n", cpu,
+           sthread_cpu_node(cpu), node);
+    __sync_fetch_and_add(&errors, 1);
+  }
+#endif
+}
+
+void *thread_start(void *arg) {
+  sthread_placement_t policy = (sthread_placement_t)(long)arg;
+  int cpu = sched_getcpu();
+
+  if (policy != STHREAD_PLACE_NONE &&
+      sthread_get_impl() == STHREAD_PTHREAD_IMPL)
+    check_stack_node(&cpu, cpu);
+
+  if (sthread_cpu_node(cpu) < 0) {
+    printf("thread running on CPU %d, which the process can't use\n", cpu);
+    __sync_fetch_and_add(&errors, 1);
+  }
+  if (sthread_set_affinity(sthread_self(), cpu) < 0) {
+    printf("thread: sthread_set_affinity(%d) failed\n", cpu);
+    __sync_fetch_and_add(&errors, 1);
+  } else {
+    check_pinned(cpu);
+  }
+  sthread_set_affinity(sthread_self(), -1);
+  __sync_fetch_and_add(&finished, 1);
+  return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * test-barrier.c - Simple test of barriers. Several threads run a
+ *                  number of rounds, meeting at a barrier after each;
+ *                  no thread may start a round before every thread has
+ *                  finished the previous one.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread.h>
+
+#define NTHREADS 4
+#define ROUNDS 20
+
+static int arrived[ROUNDS];
+static int serial_count = 0;
+static int errors = 0;
+static sthread_barrier_t barrier;
+
+void *thread_start(void *arg);
+
+int main(int argc, char **argv) {
+  sthread_t child[NTHREADS];
+  int i;
+
+  printf("Testing sthread_barrier_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  barrier = sthread_barrier_init(NTHREADS);
+
+  for (i = 0; i < NTHREADS; i++) {
+    child[i] = sthread_create(thread_start, NULL, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < NTHREADS; i++)
+    sthread_join(child[i]);
+
+  sthread_barrier_free(barrier);
+
+  /* Exactly one thread per round should be told it was the last in */
+  if (serial_count != ROUNDS)
+    errors++;
+
+  if (errors == 0)
+    printf("sthread_barrier passed\n");
+  else
+    printf("*** sthread_barrier failed (%d errors)\n", errors);
+  return errors != 0;
+}
+
+void *thread_start(void *arg) {
+  int round;
+
+  for (round = 0; round < ROUNDS; round++) {
+    __sync_fetch_and_add(&arrived[round], 1);
+    sthread_yield();
+    if (sthread_barrier_wait(barrier))
+      __sync_fetch_and_add(&serial_count, 1);
+    if (arrived[round] != NTHREADS)
+      errors++;
+  }
+  return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * test-coro.c - Simple test of coroutines. Each thread runs a generator
+ *               coroutine that yields a sequence of numbers, and resumes
+ *               it with values that the generator checks. The generator
+ *               itself resumes a nested coroutine to compute each number,
+ *               and runs long enough that the threads are preempted in
+ *               the middle.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread.h>
+
+#define NTHREADS 3
+#define COUNT 200000
+
+static int errors = 0;
+
+void *thread_start(void *arg);
+
+/* Yields its argument doubled, forever */
+static void *doubler(void *arg) {
+  long n = (long)arg;
+  for (;;)
+    n = (long)sthread_coro_yield((void *)(n * 2));
+  return NULL;
+}
+
+/* Yields 0, 2, 4, ... (2 * (COUNT - 1)), then returns -1. Each resume
+ * must pass in the value just yielded, plus one. */
+static void *generator(void *arg) {
+  sthread_coro_t inner;
+  long i, got, expect;
+
+  inner = sthread_coro_create(doubler, NULL, 0);
+  assert(inner != NULL);
+  sthread_coro_resume(inner, NULL);  /* runs doubler up to its first yield */
+
+  for (i = 0; i < COUNT; i++) {
+    expect = (long)sthread_coro_resume(inner, (void *)i);
+    got = (long)sthread_coro_yield((void *)expect);
+    if (got != expect + 1) {
+      printf("generator: resumed with %ld, expected %ld\n", got, expect + 1);
+      __sync_fetch_and_add(&errors, 1);
+    }
+  }
+
+  sthread_coro_free(inner);
+  return (void *)-1L;
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[NTHREADS];
+  int i;
+
+  printf("Testing sthread_coro_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  for (i = 0; i < NTHREADS; i++) {
+    child[i] = sthread_create(thread_start, (void *)(long)i, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+  for (i = 0; i < NTHREADS; i++)
+    sthread_join(child[i]);
+
+  if (errors) {
+    printf("sthread_coro_* failed\n");
+    return 1;
+  }
+  printf("sthread_coro_* passed\n");
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  sthread_coro_t gen;
+  long i, value, id = (long)arg;
+
+  gen = sthread_coro_create(generator, NULL, 0);
+  if (gen == NULL) {
+    printf("thread %ld: sthread_coro_create failed\n", id);
+    __sync_fetch_and_add(&errors, 1);
+    return 0;
+  }
+
+  value = (long)sthread_coro_resume(gen, NULL);
+  for (i = 0; i < COUNT; i++) {
+    if (value != 2 * i || sthread_coro_done(gen)) {
+      printf("thread %ld: got %ld, expected %ld\n", id, value, 2 * i);
+      __sync_fetch_and_add(&errors, 1);
+      break;
+    }
+    value = (long)sthread_coro_resume(gen, (void *)(value + 1));
+  }
+  if (value != -1 || !sthread_coro_done(gen)) {
+    printf("thread %ld: generator didn't finish\n", id);
+    __sync_fetch_and_add(&errors, 1);
+  }
+
+  sthread_coro_free(gen);
+  return 0;
+}
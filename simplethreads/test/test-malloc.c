@@ -0,0 +1,159 @@
+/*
+ * test-malloc.c - Simple test of sthread_malloc and sthread_free. Each
+ *                 thread allocates blocks of random sizes (including a
+ *                 few too big for the size classes), fills each with a
+ *                 pattern, and checks the pattern before freeing it.
+ *                 Some blocks are handed to the next thread to free, so
+ *                 objects travel between thread caches, and the threads
+ *                 run long enough to be preempted in the middle.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#define NTHREADS 4
+#define ROUNDS 20000
+#define SLOTS 64
+#define MAXSIZE 40000
+
+/* Blocks passed to the next thread to free */
+#define HANDOFF 16
+
+struct block {
+  unsigned char *p;
+  size_t size;
+  unsigned char pattern;
+};
+
+static int errors = 0;
+
+static sthread_mutex_t handoff_lock;
+static struct block handoff[NTHREADS][HANDOFF];
+static int handoff_count[NTHREADS];
+
+void *thread_start(void *arg);
+
+static size_t random_size(unsigned *seed) {
+  int r = rand_r(seed);
+  if (r % 100 == 0)
+    return MAXSIZE / 2 + r % (MAXSIZE / 2);  /* large */
+  if (r % 10 == 0)
+    return r % 4096;
+  return r % 256;
+}
+
+static int fill(struct block *b, size_t size, unsigned char pattern) {
+  b->p = (unsigned char *)sthread_malloc(size);
+  if (b->p == NULL)
+    return -1;
+  if (((uintptr_t)b->p & 15) != 0) {
+    printf("sthread_malloc(%lu) returned misaligned %p\n",
+           (unsigned long)size, b->p);
+    __sync_fetch_and_add(&errors, 1);
+  }
+  b->size = size;
+  b->pattern = pattern;
+  memset(b->p, pattern, size);
+  return 0;
+}
+
+static void check_and_free(struct block *b) {
+  size_t i;
+
+  for (i = 0; i < b->size; i++) {
+    if (b->p[i] != b->pattern) {
+      printf("block %p of %lu bytes corrupted at offset %lu\n",
+             b->p, (unsigned long)b->size, (unsigned long)i);
+      __sync_fetch_and_add(&errors, 1);
+      break;
+    }
+  }
+  sthread_free(b->p);
+  b->p = NULL;
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[NTHREADS];
+  int i, j;
+
+  printf("Testing sthread_malloc, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  handoff_lock = sthread_mutex_init();
+  sthread_free(NULL);
+
+  for (i = 0; i < NTHREADS; i++) {
+    child[i] = sthread_create(thread_start, (void *)(long)i, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+  for (i = 0; i < NTHREADS; i++)
+    sthread_join(child[i]);
+
+  /* Blocks left for threads that had already exited */
+  for (i = 0; i < NTHREADS; i++)
+    for (j = 0; j < handoff_count[i]; j++)
+      check_and_free(&handoff[i][j]);
+
+  if (errors) {
+    printf("sthread_malloc failed\n");
+    return 1;
+  }
+  printf("sthread_malloc passed\n");
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  struct block slot[SLOTS];
+  struct block mine[HANDOFF];
+  long id = (long)arg;
+  int next = (id + 1) % NTHREADS;
+  unsigned seed = id + 1;
+  int round, i, n;
+
+  memset(slot, 0, sizeof(slot));
+  for (round = 0; round < ROUNDS; round++) {
+    i = rand_r(&seed) % SLOTS;
+    if (slot[i].p != NULL) {
+      /* Hand some blocks to the next thread instead of freeing them */
+      sthread_mutex_lock(handoff_lock);
+      if (handoff_count[next] < HANDOFF && round % 3 == 0) {
+        handoff[next][handoff_count[next]++] = slot[i];
+        slot[i].p = NULL;
+      }
+      sthread_mutex_unlock(handoff_lock);
+      if (slot[i].p != NULL)
+        check_and_free(&slot[i]);
+    }
+    if (fill(&slot[i], random_size(&seed), (unsigned char)(id * 64 + round))) {
+      printf("thread %ld: sthread_malloc failed\n", id);
+      __sync_fetch_and_add(&errors, 1);
+      return 0;
+    }
+
+    /* Free the blocks other threads handed us */
+    if (round % 64 == 0) {
+      sthread_mutex_lock(handoff_lock);
+      n = handoff_count[id];
+      memcpy(mine, handoff[id], n * sizeof(struct block));
+      handoff_count[id] = 0;
+      sthread_mutex_unlock(handoff_lock);
+      for (i = 0; i < n; i++)
+        check_and_free(&mine[i]);
+    }
+  }
+
+  for (i = 0; i < SLOTS; i++)
+    if (slot[i].p != NULL)
+      check_and_free(&slot[i]);
+  return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * test-queue.c - Test of ordinary (non-intrusive) sthread queues used
+ *                from several threads at once. Each thread fills and
+ *                drains a queue of its own, in batches bigger than the
+ *                links a thread keeps cached, and also passes entries
+ *                to the others through a shared queue, so links are
+ *                allocated in one thread and freed in another. Then a
+ *                second set of threads starts with empty caches, and
+ *                takes back the links the first set left when it
+ *                exited. Every entry must come out of a queue once, in
+ *                the order it went in. Under the user-level
+ *                implementation, the threads share one cache and take
+ *                timer ticks in the middle of queue calls.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+#include <sthread_queue.h>
+
+#define NTHREADS 4
+#define GENERATIONS 2
+#define ROUNDS 2000
+
+/* Most entries put on a queue at once: a few times the number of free
+ * links a thread caches before handing some to the others */
+#define BATCH 200
+
+/* One entry in every SHARE goes through the shared queue */
+#define SHARE 4
+
+static int errors = 0;
+
+static sthread_queue_t shared;
+static sthread_mutex_t shared_lock;
+static long shared_last[GENERATIONS * NTHREADS];
+
+void *thread_start(void *arg);
+
+/* Entries are made up from the thread that queued them and a sequence
+ * number; they are never used as threads */
+static sthread_t entry(long id, long seq) {
+  return (sthread_t)(uintptr_t)(((id + 1) << 24) | seq);
+}
+
+static long entry_id(sthread_t sth) {
+  return ((long)(uintptr_t)sth >> 24) - 1;
+}
+
+static long entry_seq(sthread_t sth) {
+  return (long)(uintptr_t)sth & 0xffffff;
+}
+
+/* Take everything off the shared queue, checking that each thread's
+ * entries come off in the order they went on */
+static void drain_shared(void) {
+  sthread_t sth;
+  long id;
+
+  sthread_mutex_lock(shared_lock);
+  while ((sth = sthread_dequeue(shared)) != NULL) {
+    id = entry_id(sth);
+    if (id < 0 || id >= GENERATIONS * NTHREADS ||
+        entry_seq(sth) <= shared_last[id]) {
+      printf("shared queue returned %p out of order\n", (void *)sth);
+      __sync_fetch_and_add(&errors, 1);
+      continue;
+    }
+    shared_last[id] = entry_seq(sth);
+  }
+  sthread_mutex_unlock(shared_lock);
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[NTHREADS];
+  int g, i;
+
+  printf("Testing sthread_new_queue, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  shared = sthread_new_queue();
+  shared_lock = sthread_mutex_init();
+  for (i = 0; i < GENERATIONS * NTHREADS; i++)
+    shared_last[i] = -1;
+
+  for (g = 0; g < GENERATIONS; g++) {
+    for (i = 0; i < NTHREADS; i++) {
+      child[i] = sthread_create(thread_start, (void *)(long)(g * NTHREADS + i),
+                                1);
+      if (child[i] == NULL) {
+        printf("sthread_create %d failed\n", i);
+        exit(1);
+      }
+    }
+    for (i = 0; i < NTHREADS; i++)
+      sthread_join(child[i]);
+  }
+
+  drain_shared();
+  if (!sthread_queue_is_empty(shared)) {
+    printf("shared queue not empty at the end\n");
+    errors++;
+  }
+  sthread_free_queue(shared);
+  sthread_queue_clear_free_list();
+
+  if (errors) {
+    printf("sthread_new_queue failed\n");
+    return 1;
+  }
+  printf("sthread_new_queue passed\n");
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  long id = (long)arg;
+  unsigned seed = id + 1;
+  sthread_queue_t queue;
+  sthread_t sth;
+  long seq = 0, expect;
+  int round, i, n;
+
+  queue = sthread_new_queue();
+
+  for (round = 0; round < ROUNDS; round++) {
+    n = 1 + rand_r(&seed) % BATCH;
+    expect = seq;
+
+    for (i = 0; i < n; i++)
+      sthread_enqueue(queue, entry(id, seq++));
+    if (sthread_queue_size(queue) != n) {
+      printf("thread %ld: queue holds %d, not %d\n", id,
+             sthread_queue_size(queue), n);
+      __sync_fetch_and_add(&errors, 1);
+    }
+
+    /* Pass some entries on through the shared queue, and free the
+     * rest's links here */
+    for (i = 0; i < n; i++) {
+      sth = sthread_dequeue(queue);
+      if (sth == NULL || entry_id(sth) != id || entry_seq(sth) != expect) {
+        printf("thread %ld: got %p, expected entry %ld\n", id,
+               (void *)sth, expect);
+        __sync_fetch_and_add(&errors, 1);
+        break;
+      }
+      expect++;
+      if (entry_seq(sth) % SHARE == 0) {
+        sthread_mutex_lock(shared_lock);
+        sthread_enqueue(shared, sth);
+        sthread_mutex_unlock(shared_lock);
+      }
+    }
+    if (!sthread_queue_is_empty(queue)) {
+      printf("thread %ld: queue not empty after draining\n", id);
+      __sync_fetch_and_add(&errors, 1);
+      while (sthread_dequeue(queue) != NULL)
+        ;
+    }
+
+    if (round % 16 == id % 16)
+      drain_shared();
+  }
+
+  sthread_free_queue(queue);
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * test-rwlock.c - Simple test of reader-writer locks. Checks that
+ *                 readers never overlap a writer, and that writers
+ *                 exclude each other.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread.h>
+
+#define NREADERS 4
+#define NWRITERS 2
+static const int rounds = 50;
+
+static int readers_in = 0;
+static int writers_in = 0;
+static int errors = 0;
+static sthread_rwlock_t rwlock;
+
+void *reader_start(void *arg);
+void *writer_start(void *arg);
+
+int main(int argc, char **argv) {
+  sthread_t child[NREADERS + NWRITERS];
+  int i;
+
+  printf("Testing sthread_rwlock_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  rwlock = sthread_rwlock_init();
+
+  /* Hold the lock for writing while the children start, so they all
+   * pile up behind it. */
+  sthread_rwlock_wrlock(rwlock);
+
+  for (i = 0; i < NREADERS + NWRITERS; i++) {
+    child[i] = sthread_create(i < NREADERS ? reader_start : writer_start,
+                              NULL, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < 10; i++)
+    sthread_yield();
+  if (readers_in != 0)
+    errors++;
+
+  sthread_rwlock_unlock(rwlock);
+
+  for (i = 0; i < NREADERS + NWRITERS; i++)
+    sthread_join(child[i]);
+
+  sthread_rwlock_free(rwlock);
+
+  if (errors == 0)
+    printf("sthread_rwlock passed\n");
+  else
+    printf("*** sthread_rwlock failed (%d errors)\n", errors);
+  return errors != 0;
+}
+
+void *reader_start(void *arg) {
+  int i;
+  for (i = 0; i < rounds; i++) {
+    sthread_rwlock_rdlock(rwlock);
+    __sync_fetch_and_add(&readers_in, 1);
+    if (writers_in != 0)
+      errors++;
+    sthread_yield();
+    if (writers_in != 0)
+      errors++;
+    __sync_fetch_and_sub(&readers_in, 1);
+    sthread_rwlock_unlock(rwlock);
+    sthread_yield();
+  }
+  return 0;
+}
+
+void *writer_start(void *arg) {
+  int i;
+  for (i = 0; i < rounds; i++) {
+    sthread_rwlock_wrlock(rwlock);
+    if (__sync_fetch_and_add(&writers_in, 1) != 0 || readers_in != 0)
+      errors++;
+    sthread_yield();
+    if (readers_in != 0)
+      errors++;
+    __sync_fetch_and_sub(&writers_in, 1);
+    sthread_rwlock_unlock(rwlock);
+    sthread_yield();
+  }
+  return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * test-sem.c - Simple test of semaphores.
+ *
+ * Implements a bounded buffer with two counting semaphores, and
+ * transfers 100 items through it from main to 2 consumer threads.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread.h>
+
+#define NCONSUMERS 2
+#define BUFFER_SLOTS 4
+static const int max_transfer = 100;
+
+static int buffer[BUFFER_SLOTS];
+static int head = 0, tail = 0;
+static int received_sum = 0;
+static sthread_mutex_t mutex;
+static sthread_sem_t empty_slots;
+static sthread_sem_t full_slots;
+
+void *thread_start(void *arg);
+
+int main(int argc, char **argv) {
+  sthread_t child[NCONSUMERS];
+  int i, expected_sum = 0;
+
+  printf("Testing sthread_sem_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  mutex = sthread_mutex_init();
+  empty_slots = sthread_sem_init(BUFFER_SLOTS);
+  full_slots = sthread_sem_init(0);
+
+  for (i = 0; i < NCONSUMERS; i++) {
+    child[i] = sthread_create(thread_start, NULL, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+
+  /* Items are 1..max_transfer; a 0 tells a consumer to exit. */
+  for (i = 1; i <= max_transfer + NCONSUMERS; i++) {
+    int item = (i <= max_transfer) ? i : 0;
+    expected_sum += item;
+
+    sthread_sem_wait(empty_slots);
+    sthread_mutex_lock(mutex);
+    buffer[tail] = item;
+    tail = (tail + 1) % BUFFER_SLOTS;
+    sthread_mutex_unlock(mutex);
+    sthread_sem_post(full_slots);
+  }
+
+  for (i = 0; i < NCONSUMERS; i++)
+    sthread_join(child[i]);
+
+  sthread_sem_free(empty_slots);
+  sthread_sem_free(full_slots);
+  sthread_mutex_free(mutex);
+
+  if (received_sum == expected_sum) {
+    printf("sthread_sem passed\n");
+    return 0;
+  }
+  printf("*** sthread_sem failed (got %d, expected %d)\n",
+         received_sum, expected_sum);
+  return 1;
+}
+
+/* Consumer thread - take items out of the buffer until we get a 0 */
+void *thread_start(void *arg) {
+  int item;
+
+  do {
+    sthread_sem_wait(full_slots);
+    sthread_mutex_lock(mutex);
+    item = buffer[head];
+    head = (head + 1) % BUFFER_SLOTS;
+    received_sum += item;
+    sthread_mutex_unlock(mutex);
+    sthread_sem_post(empty_slots);
+  } while (item != 0);
+
+  return 0;
+}
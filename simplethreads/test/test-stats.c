@@ -0,0 +1,160 @@
+/*
+ * test-stats.c - Simple test of per-thread statistics and tracing.
+ *                Two threads each burn a fixed amount of CPU time,
+ *                measured by sthread_get_stats, yielding to each other
+ *                along the way. The recorded trace must then dump as
+ *                Chrome trace JSON containing their create and exit
+ *                events. Then threads restart the trace over and over,
+ *                with rings of different sizes, while others record
+ *                into it.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <sthread.h>
+
+#define NTHREADS 2
+
+/* CPU time each thread uses before exiting, in nanoseconds */
+#define CPU_NS 20000000ULL
+
+/* Times each thread restarts the trace */
+#define RESTARTS 200
+
+static int errors = 0;
+
+void *thread_start(void *arg);
+void *restart_start(void *arg);
+
+int main(int argc, char **argv) {
+  sthread_t child[NTHREADS];
+  char path[] = "/tmp/test-stats-XXXXXX";
+  char *json;
+  FILE *f;
+  long len;
+  int i, fd;
+
+  printf("Testing sthread_get_stats and sthread_trace_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  if (sthread_trace_start(4096) != 0) {
+    printf("sthread_trace_start failed\n");
+    exit(1);
+  }
+
+  for (i = 0; i < NTHREADS; i++) {
+    child[i] = sthread_create(thread_start, (void *)(long)i, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+  for (i = 0; i < NTHREADS; i++)
+    sthread_join(child[i]);
+
+  sthread_trace_stop();
+
+  fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  if (sthread_trace_dump(path) != 0) {
+    printf("sthread_trace_dump failed\n");
+    exit(1);
+  }
+
+  f = fopen(path, "r");
+  assert(f != NULL);
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  rewind(f);
+  json = malloc(len + 1);
+  assert(json != NULL);
+  json[fread(json, 1, len, f)] = '\0';
+  fclose(f);
+  unlink(path);
+
+  if (strncmp(json, "{\"displayTimeUnit\"", 18) != 0 ||
+      strstr(json, "\"traceEvents\":[") == NULL ||
+      strstr(json, "\"name\":\"create\"") == NULL ||
+      strstr(json, "\"name\":\"exit\"") == NULL) {
+    printf("trace is missing events:\n%s\n", json);
+    errors++;
+  }
+  free(json);
+
+  for (i = 0; i < NTHREADS; i++) {
+    child[i] = sthread_create(restart_start, (void *)(long)i, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+  for (i = 0; i < NTHREADS; i++)
+    sthread_join(child[i]);
+  sthread_trace_stop();
+
+  strcpy(path, "/tmp/test-stats-XXXXXX");
+  fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  if (sthread_trace_dump(path) != 0) {
+    printf("sthread_trace_dump after restarts failed\n");
+    errors++;
+  }
+  unlink(path);
+
+  if (errors) {
+    printf("sthread_get_stats/sthread_trace_* failed\n");
+    return 1;
+  }
+  printf("sthread_get_stats/sthread_trace_* passed\n");
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  sthread_stats_t stats;
+  unsigned long long next_yield = 0;
+  long id = (long)arg;
+
+  /* Yield once per millisecond of CPU time */
+  do {
+    if (sthread_get_stats(sthread_self(), &stats) != 0) {
+      printf("thread %ld: sthread_get_stats failed\n", id);
+      errors++;
+      return 0;
+    }
+    if (stats.cpu_ns >= next_yield) {
+      next_yield = stats.cpu_ns + CPU_NS / 20;
+      sthread_yield();
+    }
+  } while (stats.cpu_ns < CPU_NS);
+
+  if (stats.voluntary_switches + stats.involuntary_switches == 0) {
+    printf("thread %ld: no switches counted\n", id);
+    errors++;
+  }
+
+  return 0;
+}
+
+void *restart_start(void *arg) {
+  long id = (long)arg;
+  int i;
+
+  for (i = 0; i < RESTARTS; i++) {
+    if (sthread_trace_start(((i + id) % 2) ? 16 : 4096) != 0) {
+      printf("thread %ld: sthread_trace_start failed\n", id);
+      errors++;
+      return 0;
+    }
+    sthread_yield();
+  }
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * test-task.c - Simple test of tasks. Computes Fibonacci numbers with
+ *               recursively nested task groups, and runs parallel_for
+ *               loops of assorted sizes and grains, checking that every
+ *               index is visited exactly once. Several threads outside
+ *               the worker pool do this at the same time.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sthread.h>
+
+#define NTHREADS 3
+#define FIB_N 18
+#define FIB_RESULT 2584
+#define LOOP_SIZE 100000
+
+static int errors = 0;
+
+void *thread_start(void *arg);
+
+struct fib {
+  int n;
+  long result;
+};
+
+static void fib_task(void *arg) {
+  struct fib *f = (struct fib *)arg;
+  struct fib a, b;
+  sthread_task_group_t group;
+
+  if (f->n < 2) {
+    f->result = f->n;
+    return;
+  }
+  a.n = f->n - 1;
+  b.n = f->n - 2;
+  group = sthread_task_group_create();
+  if (group == NULL) {
+    printf("sthread_task_group_create failed\n");
+    __sync_fetch_and_add(&errors, 1);
+    return;
+  }
+  sthread_task_spawn(group, fib_task, &a);
+  fib_task(&b);
+  sthread_task_wait(group);
+  sthread_task_group_free(group);
+  f->result = a.result + b.result;
+}
+
+static void count_range(long begin, long end, void *arg) {
+  unsigned char *visits = (unsigned char *)arg;
+  long i;
+
+  if (begin >= end) {
+    printf("parallel_for passed empty range [%ld, %ld)\n", begin, end);
+    __sync_fetch_and_add(&errors, 1);
+  }
+  for (i = begin; i < end; i++)
+    visits[i]++;
+}
+
+static void check_loop(long begin, long end, long grain) {
+  unsigned char *visits;
+  long i;
+
+  visits = (unsigned char *)calloc(LOOP_SIZE, 1);
+  if (visits == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  sthread_parallel_for(begin, end, grain, count_range, visits);
+  for (i = 0; i < LOOP_SIZE; i++) {
+    if (visits[i] != (i >= begin && i < end)) {
+      printf("parallel_for(%ld, %ld, %ld) visited %ld %d times\n", begin,
+             end, grain, i, visits[i]);
+      __sync_fetch_and_add(&errors, 1);
+      break;
+    }
+  }
+  free(visits);
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[NTHREADS];
+  int i;
+
+  printf("Testing sthread_task_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  if (sthread_task_set_workers(0) == 0) {
+    printf("sthread_task_set_workers accepted 0 workers\n");
+    return 1;
+  }
+  if (sthread_task_set_workers(4) != 0) {
+    printf("sthread_task_set_workers failed\n");
+    return 1;
+  }
+
+  for (i = 0; i < NTHREADS; i++) {
+    child[i] = sthread_create(thread_start, (void *)(long)i, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+  thread_start((void *)(long)NTHREADS);
+  for (i = 0; i < NTHREADS; i++)
+    sthread_join(child[i]);
+
+  if (sthread_task_set_workers(2) == 0) {
+    printf("sthread_task_set_workers worked after the pool started\n");
+    errors++;
+  }
+
+  if (errors) {
+    printf("sthread_task_* failed\n");
+    return 1;
+  }
+  printf("sthread_task_* passed\n");
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  long id = (long)arg;
+  struct fib f;
+  int round;
+
+  for (round = 0; round < 5; round++) {
+    f.n = FIB_N;
+    fib_task(&f);
+    if (f.result != FIB_RESULT) {
+      printf("thread %ld: fib(%d) = %ld, expected %d\n", id, FIB_N,
+             f.result, FIB_RESULT);
+      __sync_fetch_and_add(&errors, 1);
+    }
+
+    check_loop(0, LOOP_SIZE, 0);
+    check_loop(0, LOOP_SIZE, 1000);
+    check_loop(17, LOOP_SIZE - 3, 1);
+    check_loop(5, 6, 0);
+    check_loop(10, 10, 0);
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * test-tls.c - Simple test of thread-local storage. Each thread stores
+ *              its own value under a shared key and checks that no
+ *              other thread's value shows through, then exits and lets
+ *              the key's destructor free the value.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread.h>
+
+#define NTHREADS 5
+
+static sthread_key_t key;
+static sthread_key_t plain_key;
+static int destroyed = 0;
+static int errors = 0;
+
+void *thread_start(void *arg);
+
+static void destructor(void *value) {
+  free(value);
+  __sync_fetch_and_add(&destroyed, 1);
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[NTHREADS];
+  int i;
+
+  printf("Testing sthread_key_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  key = sthread_key_create(destructor);
+  plain_key = sthread_key_create(NULL);
+  if (key == -1 || plain_key == -1 || key == plain_key) {
+    printf("sthread_key_create failed\n");
+    exit(1);
+  }
+
+  sthread_setspecific(plain_key, &errors);
+
+  for (i = 0; i < NTHREADS; i++) {
+    child[i] = sthread_create(thread_start, (void *)(long)i, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < NTHREADS; i++)
+    sthread_join(child[i]);
+
+  /* The children's values must not have replaced ours */
+  if (sthread_getspecific(key) != NULL ||
+      sthread_getspecific(plain_key) != &errors)
+    errors++;
+  if (destroyed != NTHREADS)
+    errors++;
+
+  if (errors == 0)
+    printf("sthread_key passed\n");
+  else
+    printf("*** sthread_key failed (%d errors)\n", errors);
+  return errors != 0;
+}
+
+void *thread_start(void *arg) {
+  long id = (long)arg;
+  long *value;
+  int i;
+
+  /* New threads start with every key NULL */
+  if (sthread_getspecific(key) != NULL ||
+      sthread_getspecific(plain_key) != NULL)
+    __sync_fetch_and_add(&errors, 1);
+
+  value = malloc(sizeof(*value));
+  assert(value != NULL);
+  *value = id;
+  sthread_setspecific(key, value);
+  sthread_setspecific(plain_key, (void *)arg);
+
+  for (i = 0; i < 10; i++) {
+    sthread_yield();
+    if (sthread_getspecific(key) != value ||
+        *(long *)sthread_getspecific(key) != id ||
+        sthread_getspecific(plain_key) != arg)
+      __sync_fetch_and_add(&errors, 1);
+  }
+
+  /* Odd threads leave through sthread_exit, even ones by returning */
+  if (id % 2)
+    sthread_exit(0);
+  return 0;
+}
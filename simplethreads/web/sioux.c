@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <signal.h>
 
 #include <sthread.h>
 
@@ -26,15 +27,85 @@ static const int PORT_MAX_INCR = 8000;
 /* The directory to look for files in */
 static const char DEFAULT_DOCROOT[] = "./docs";
 
+/* Default size of the worker pool, and of the queue feeding it */
+static const int DEFAULT_WORKERS = 16;
+static const int DEFAULT_QUEUE_DEPTH = 64;
+
+/* Default size of the docroot cache, in megabytes */
+static const int DEFAULT_CACHE_MB = 64;
+
+/* Default limits on persistent connections */
+static const int DEFAULT_MAX_REQUESTS = 1000;
+static const int DEFAULT_TIMEOUT = 5;
+
+/* By default, every request is logged (if there is an access log) */
+static const int DEFAULT_LOG_SAMPLE = 1;
+
 static int web_getport(void);
 static const char *web_gethostname(void);
 static const char *web_getdocroot(void);
 static void web_printurl(const char *host, int port);
+static void web_usage(void);
 
 int main(int argc, char **argv) {
   int port;
   const char *host;
   const char *docroot;
+  web_options_t options;
+  int opt;
+
+  options.nworkers = DEFAULT_WORKERS;
+  options.queue_depth = DEFAULT_QUEUE_DEPTH;
+  options.nreactors = 0;
+  options.cache_size = (size_t)DEFAULT_CACHE_MB << 20;
+  options.max_requests = DEFAULT_MAX_REQUESTS;
+  options.timeout = DEFAULT_TIMEOUT;
+  options.log_path = NULL;
+  options.log_format = WEB_LOG_TEXT;
+  options.log_sample = DEFAULT_LOG_SAMPLE;
+  while ((opt = getopt(argc, argv, "w:q:e:c:k:t:l:bs:")) != -1) {
+    switch (opt) {
+    case 'w':
+      options.nworkers = atoi(optarg);
+      break;
+    case 'q':
+      options.queue_depth = atoi(optarg);
+      break;
+    case 'e':
+      options.nreactors = atoi(optarg);
+      break;
+    case 'c':
+      if (atoi(optarg) < 0)
+        web_usage();
+      options.cache_size = (size_t)atoi(optarg) << 20;
+      break;
+    case 'k':
+      options.max_requests = atoi(optarg);
+      break;
+    case 't':
+      options.timeout = atoi(optarg);
+      break;
+    case 'l':
+      options.log_path = optarg;
+      break;
+    case 'b':
+      options.log_format = WEB_LOG_BINARY;
+      break;
+    case 's':
+      options.log_sample = atoi(optarg);
+      break;
+    default:
+      web_usage();
+    }
+  }
+  if (optind != argc || options.nworkers < 0 || options.queue_depth < 1 ||
+      options.nreactors < 0 || options.max_requests < 1 ||
+      options.timeout < 1 || options.log_sample < 1)
+    web_usage();
+
+  /* A client that hangs up early shouldn't kill the server; the failed
+   * write is reported instead. */
+  signal(SIGPIPE, SIG_IGN);
 
   sthread_init();
 
@@ -47,10 +118,34 @@ int main(int argc, char **argv) {
   web_printurl(host, port);
 
   /* Handle requests forever */
-  web_runloop(host, port, docroot);
+  web_runloop(host, port, docroot, &options);
   return 0;
 }
 
+void web_usage(void) {
+  fprintf(stderr, "usage: sioux [-w workers] [-q queue-depth] "
+          "[-e reactors] [-c cache-mb]\n"
+          "             [-k requests] [-t timeout] [-l log-file [-b] "
+          "[-s sample]]\n"
+          "  -w  number of worker threads (default %d; 0 handles one\n"
+          "      connection at a time in the accept loop)\n"
+          "  -q  connections that can wait for a worker (default %d)\n"
+          "  -e  run this many event-driven reactors, one per CPU,\n"
+          "      instead of worker threads\n"
+          "  -c  megabytes of files to cache in memory (default %d)\n"
+          "  -k  requests answered on a connection before closing it\n"
+          "      (default %d; 1 closes each after one response)\n"
+          "  -t  seconds to wait for a client before closing its\n"
+          "      connection (default %d)\n"
+          "  -l  write an access log to this file (- for the standard\n"
+          "      output)\n"
+          "  -b  write the access log as binary records, not text\n"
+          "  -s  log one request in this many (default %d)\n",
+          DEFAULT_WORKERS, DEFAULT_QUEUE_DEPTH, DEFAULT_CACHE_MB,
+          DEFAULT_MAX_REQUESTS, DEFAULT_TIMEOUT, DEFAULT_LOG_SAMPLE);
+  exit(1);
+}
+
 /* Try to guess a unique port (if there are lots of students
  * on the same machine, this helps avoid conflicts) */
 int web_getport() {
@@ -7,87 +7,458 @@
 #include <config.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <unistd.h>
 
 #include <sthread.h>
 
 #include <sioux_run.h>
+#include <web_cache.h>
+#include <web_conn.h>
+#include <web_log.h>
+#include <web_queue.h>
 
 
 #ifndef HAVE_SOCKLEN_T
 typedef int socklen_t;
 #endif
 
-/* Every http response includes a numeric status code indicating,
- * to the browser, what the result was. These are the codes we are
- * interested in.
- */
-typedef enum _status {
-  STATUS_200_OK = 200,
-  STATUS_400_BAD_REQUEST = 400,
-  STATUS_404_NOT_FOUND = 404,
-  STATUS_405_METHOD_NOT_ALLOWED = 405
-} status_t;
-
 /* How many connections can be waiting, but not accepted,
- * before the kernel starts refusing new connections.
+ * before the kernel starts refusing new connections. With a worker
+ * pool, this is where clients wait once the pool's queue is full.
  */
-static const int BACKLOG = 5;
-
-/* Requests really do get this big: */
-static const int REQUEST_MAX_SIZE = 4096;
-
-/* How much of the file to read at a time. */
-static const int BUFFER_SIZE = 4096;
-
-static const char CRLF[] = "\r\n";
-static const char REQUEST_TERMINATOR[] = "\r\n\r\n";
-static const char REQUEST_TERMINATOR_LOOSE[] = "\n\n";
-static const char SERVER[] = "Sioux/1.0 (Unix)";
-static const char HTTP_VERSION[] = "HTTP/1.1";
-static const char INDEX_FILE[] = "index.html";
-
-static int web_setup_socket(int port);
+static const int BACKLOG = 128;
+
+/* Most events a reactor takes from epoll_wait at once */
+#define MAX_EVENTS 64
+
+/* What a worker thread needs to know */
+typedef struct {
+  web_queue_t *queue;
+  const web_server_t *server;
+} web_worker_args_t;
+
+/* A connection waiting in a reactor's epoll set */
+typedef struct _web_waiting {
+  web_conn_t *conn;
+  time_t since;                       /* when it last made progress */
+  struct _web_waiting *prev, *next;   /* longest waiting first */
+} web_waiting_t;
+
+/* What a reactor thread needs to know */
+typedef struct {
+  int listen_socket;
+  const web_server_t *server;
+  int epoll_fd;
+  web_waiting_t *oldest, *newest;
+} web_reactor_args_t;
+
+/* A thread waiting for a socket under user-level threads */
+typedef struct _web_parked {
+  struct pollfd pfd;
+  long long deadline;                 /* in ms, or -1 for none */
+  int ready;                          /* 0 if the deadline passed first */
+  sthread_sem_t wake;
+  struct _web_parked *prev, *next;
+} web_parked_t;
+
+/* The thread that polls for them, and the threads it polls for */
+typedef struct {
+  const web_server_t *server;
+  sthread_mutex_t lock;
+  sthread_cond_t parked_cond;         /* signalled when one is parked */
+  web_parked_t *parked;
+  int nparked;
+} web_poller_t;
+
+static web_poller_t poller;
+
+static void web_run_pool(int listen_socket, const web_server_t *server,
+                         const web_options_t *options);
+static void *web_worker(void *arg);
+static void web_run_reactors(int port, const web_server_t *server,
+                             const web_options_t *options);
+#ifdef HAVE_SYS_EPOLL_H
+static void *web_reactor(void *arg);
+static void web_reactor_accept(web_reactor_args_t *reactor, time_t now);
+static void web_reactor_run(web_reactor_args_t *reactor,
+                            web_waiting_t *waiting, time_t now);
+static void web_reactor_wait(web_reactor_args_t *reactor,
+                             web_waiting_t *waiting, time_t now);
+static void web_reactor_unlink(web_reactor_args_t *reactor,
+                               web_waiting_t *waiting);
+static void web_reactor_done(web_reactor_args_t *reactor,
+                             web_waiting_t *waiting);
+#endif
+static int web_set_nonblocking(int fd);
+static int web_setup_socket(int port, int reuseport);
 static int web_next_connection(int listen_socket);
-static void web_handle_connection(int conn, const char *docroot);
-static int web_read_request(int conn, char *request_buf, size_t size);
-static status_t web_parse_request(char *request_buf, char *filename,
-                                  size_t filename_len, const char *docroot);
-static void web_send_headers(FILE* stream, status_t status);
-static const char *web_get_status_string(status_t status);
-static status_t web_open_file(const char *filename, FILE **file);
-static void web_send_file(FILE *stream, FILE *file);
-static void web_send_error_doc(FILE *stream, status_t status);
+static int web_helpers_busy(const web_server_t *server);
+static void web_poller_start(const web_server_t *server);
+static void *web_poller(void *arg);
+static int web_run_others(void);
+static long long web_now_ms(void);
+static int web_wait(int fd, short events, int timeout);
+static void web_handle_connection(int conn, const web_server_t *server);
 
 
 /* Run the webserver. Our host is given, as well as the port to listen
  * on, and the directory that the documents can be found in.
  * Runs forever.
  */
-void web_runloop(const char *host, int port, const char *docroot) {
+void web_runloop(const char *host, int port, const char *docroot,
+                 const web_options_t *options) {
+  web_server_t server;
   int listen_socket, next_conn;
 
-  listen_socket = web_setup_socket(port);
+  server.docroot = docroot;
+  server.cache = web_cache_create(options->cache_size,
+                                  web_conn_file_headers);
+  server.max_requests = options->max_requests;
+  server.timeout = options->timeout;
+  server.log = NULL;
+  if (options->log_path != NULL) {
+    server.log = web_log_create(options->log_path, options->log_format,
+                                options->log_sample);
+    if (server.log == NULL)
+      exit(1);
+  }
+
+  if (sthread_get_impl() == STHREAD_USER_IMPL)
+    web_poller_start(&server);
 
-  while ((next_conn = web_next_connection(listen_socket)) >= 0) {
-    web_handle_connection(next_conn, docroot);
+  if (options->nreactors > 0) {
+    web_run_reactors(port, &server, options);
+    web_cache_free(server.cache);
+    if (server.log != NULL)
+      web_log_free(server.log);
+    return;
+  }
+
+  listen_socket = web_setup_socket(port, 0);
+
+  /* While a connection is kept open between requests, whoever is
+   * handling it can't handle another, so with a single thread only
+   * event-driven mode keeps connections open. */
+  if (options->nworkers == 0)
+    server.max_requests = 1;
+
+  if (options->nworkers > 0) {
+    web_run_pool(listen_socket, &server, options);
+  } else {
+    for (;;) {
+      web_wait(listen_socket, POLLIN, -1);
+      if ((next_conn = web_next_connection(listen_socket)) < 0)
+        break;
+      web_handle_connection(next_conn, &server);
+    }
+    web_cache_free(server.cache);
+    if (server.log != NULL)
+      web_log_free(server.log);
   }
 
   close(listen_socket);
 }
 
+/* Accept connections in this thread and hand them to a pool of worker
+ * threads through a bounded queue. Once the queue is full, this thread
+ * stops accepting until a worker frees a slot, and further clients wait
+ * in the kernel's listen backlog. Returns if accepting fails.
+ *
+ * User-level threads all share one kernel thread, so a blocking accept
+ * would stop the workers too. Under that implementation the listening
+ * socket is made nonblocking, and this thread waits for it with
+ * web_wait. */
+static void web_run_pool(int listen_socket, const web_server_t *server,
+                         const web_options_t *options) {
+  web_worker_args_t args;
+  int user_threads, next_conn, i;
+
+  user_threads = (sthread_get_impl() == STHREAD_USER_IMPL);
+  if (user_threads && web_set_nonblocking(listen_socket) == -1)
+    return;
+
+  args.queue = web_queue_create(options->queue_depth);
+  args.server = server;
+  for (i = 0; i < options->nworkers; i++) {
+    if (sthread_create(web_worker, &args, 0) == NULL) {
+      fprintf(stderr, "sioux: failed to create worker thread\n");
+      abort();
+    }
+  }
+
+  for (;;) {
+    next_conn = accept(listen_socket, NULL, NULL);
+    if (next_conn >= 0) {
+      web_queue_put(args.queue, next_conn);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      web_wait(listen_socket, POLLIN, -1);
+    } else if (errno != EINTR && errno != ECONNABORTED) {
+      perror("sioux: error accepting connections");
+      break;
+    }
+  }
+
+  /* The workers are left running; we only get here if the server is
+   * about to exit anyway. */
+}
+
+/* Worker threads handle connections from the queue forever */
+static void *web_worker(void *arg) {
+  web_worker_args_t *args = (web_worker_args_t *)arg;
+
+  for (;;)
+    web_handle_connection(web_queue_get(args->queue), args->server);
+  return NULL;
+}
+
+
+/* Run options->nreactors event-driven reactor threads, each pinned to
+ * its own CPU with its own epoll set and its own listening socket; the
+ * kernel spreads incoming connections across the sockets (with
+ * SO_REUSEPORT), so a connection stays on the CPU that accepted it and
+ * the reactors share nothing. Where SO_REUSEPORT isn't available they
+ * all accept from one socket instead. Returns if the reactors fail.
+ *
+ * User-level threads all share one kernel thread, so more than one
+ * reactor couldn't run in parallel, and one blocked in epoll_wait would
+ * stall the rest; under that implementation only one is run. */
+static void web_run_reactors(int port, const web_server_t *server,
+                             const web_options_t *options) {
+#ifdef HAVE_SYS_EPOLL_H
+  web_reactor_args_t *args;
+  sthread_t *reactors;
+  int nreactors = options->nreactors, reuseport = 1, i;
+
+  if (sthread_get_impl() == STHREAD_USER_IMPL && nreactors > 1) {
+    fprintf(stderr, "sioux: user-level threads share one CPU; "
+            "running 1 reactor\n");
+    nreactors = 1;
+  }
+
+  args = (web_reactor_args_t *)malloc(nreactors * sizeof(*args));
+  reactors = (sthread_t *)malloc(nreactors * sizeof(sthread_t));
+  assert(args != NULL && reactors != NULL);
+  for (i = 0; i < nreactors; i++) {
+    args[i].server = server;
+    args[i].oldest = args[i].newest = NULL;
+    args[i].listen_socket = reuseport ? web_setup_socket(port, 1) : -1;
+    if (args[i].listen_socket == -1) {
+      reuseport = 0;
+      args[i].listen_socket = (i == 0) ? web_setup_socket(port, 0)
+                                       : args[0].listen_socket;
+    }
+  }
+
+  sthread_set_placement(STHREAD_PLACE_COMPACT);
+  for (i = 0; i < nreactors; i++) {
+    reactors[i] = sthread_create(web_reactor, &args[i], 1);
+    if (reactors[i] == NULL) {
+      fprintf(stderr, "sioux: failed to create reactor thread\n");
+      abort();
+    }
+  }
+  sthread_set_placement(STHREAD_PLACE_NONE);
+
+  for (i = 0; i < nreactors; i++)
+    sthread_join(reactors[i]);
+  free(reactors);
+  free(args);
+#else
+  fprintf(stderr, "sioux: event-driven mode needs epoll\n");
+#endif
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* A reactor waits for events on its listening socket and on every
+ * connection it has accepted, and runs each connection's state machine
+ * as far as it will go whenever its socket is ready. Connections are
+ * registered once, edge-triggered for both reading and writing, since
+ * web_conn_run always goes on until the socket would block. Those that
+ * make no progress for server->timeout seconds, such as connections
+ * kept open that the client hasn't used again, are closed. Under
+ * user-level threads, the reactor waits for the epoll set with web_wait
+ * rather than sleeping in epoll_wait. Returns only if epoll fails. */
+static void *web_reactor(void *arg) {
+  web_reactor_args_t *args = (web_reactor_args_t *)arg;
+  struct epoll_event ev, events[MAX_EVENTS];
+  time_t now;
+  int timeout, n, i;
+
+  args->epoll_fd = epoll_create(MAX_EVENTS);
+  if (args->epoll_fd == -1) {
+    perror("sioux: epoll_create failed");
+    return NULL;
+  }
+  if (web_set_nonblocking(args->listen_socket) == -1)
+    return NULL;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;  /* the listening socket */
+  if (epoll_ctl(args->epoll_fd, EPOLL_CTL_ADD, args->listen_socket,
+                &ev) == -1) {
+    perror("sioux: epoll_ctl failed");
+    return NULL;
+  }
+
+  for (;;) {
+    /* Wake up once a second to look for connections that timed out */
+    timeout = args->oldest != NULL ? 1000 : -1;
+    if (sthread_get_impl() == STHREAD_USER_IMPL) {
+      web_wait(args->epoll_fd, POLLIN, timeout);
+      timeout = 0;
+    }
+    n = epoll_wait(args->epoll_fd, events, MAX_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("sioux: epoll_wait failed");
+      break;
+    }
+    now = time(NULL);
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL)
+        web_reactor_accept(args, now);
+      else
+        web_reactor_run(args, (web_waiting_t *)events[i].data.ptr, now);
+    }
+    while (args->oldest != NULL &&
+           now - args->oldest->since >= args->server->timeout)
+      web_reactor_done(args, args->oldest);
+  }
+
+  close(args->epoll_fd);
+  return NULL;
+}
+
+/* Accept every pending connection, start each one running, and add
+ * those that have to wait to the epoll set. */
+static void web_reactor_accept(web_reactor_args_t *reactor, time_t now) {
+  struct epoll_event ev;
+  web_waiting_t *waiting;
+  web_conn_t *conn;
+  int fd;
+
+  for (;;) {
+    fd = accept(reactor->listen_socket, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("sioux: error accepting connections");
+      return;
+    }
+    if (web_set_nonblocking(fd) == -1) {
+      close(fd);
+      continue;
+    }
+    conn = web_conn_create(fd, reactor->server);
+    if (conn == NULL) {
+      fprintf(stderr, "sioux: out of memory\n");
+      close(fd);
+      continue;
+    }
+
+    /* The request has usually arrived with the connection */
+    if (web_conn_run(conn) == WEB_CONN_DONE) {
+      web_conn_free(conn);
+      continue;
+    }
+    waiting = (web_waiting_t *)sthread_malloc(sizeof(web_waiting_t));
+    if (waiting == NULL) {
+      fprintf(stderr, "sioux: out of memory\n");
+      web_conn_free(conn);
+      continue;
+    }
+    waiting->conn = conn;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = waiting;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      perror("sioux: epoll_ctl failed");
+      sthread_free(waiting);
+      web_conn_free(conn);
+      continue;
+    }
+    web_reactor_wait(reactor, waiting, now);
+  }
+}
+
+/* Continue a connection whose socket is ready. */
+static void web_reactor_run(web_reactor_args_t *reactor, web_waiting_t *waiting,
+                            time_t now) {
+  if (web_conn_run(waiting->conn) == WEB_CONN_DONE) {
+    web_reactor_done(reactor, waiting);
+    return;
+  }
+  web_reactor_unlink(reactor, waiting);
+  web_reactor_wait(reactor, waiting, now);
+}
+
+/* Put a connection on the end of the list of those waiting, as of
+ * now. */
+static void web_reactor_wait(web_reactor_args_t *reactor,
+                             web_waiting_t *waiting, time_t now) {
+  waiting->since = now;
+  waiting->next = NULL;
+  waiting->prev = reactor->newest;
+  if (reactor->newest != NULL)
+    reactor->newest->next = waiting;
+  else
+    reactor->oldest = waiting;
+  reactor->newest = waiting;
+}
+
+/* Take a connection off the list of those waiting */
+static void web_reactor_unlink(web_reactor_args_t *reactor,
+                               web_waiting_t *waiting) {
+  if (waiting->prev != NULL)
+    waiting->prev->next = waiting->next;
+  else
+    reactor->oldest = waiting->next;
+  if (waiting->next != NULL)
+    waiting->next->prev = waiting->prev;
+  else
+    reactor->newest = waiting->prev;
+}
+
+/* Finish with a waiting connection. Closing its socket also takes it
+ * out of the epoll set. */
+static void web_reactor_done(web_reactor_args_t *reactor,
+                             web_waiting_t *waiting) {
+  web_reactor_unlink(reactor, waiting);
+  web_conn_free(waiting->conn);
+  sthread_free(waiting);
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+/* Make fd nonblocking. Returns -1 (and reports why) on failure. */
+static int web_set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("sioux: failed to make socket nonblocking");
+    return -1;
+  }
+  return 0;
+}
 
 /* Create a new socket that is bound to the given port, ready
- * to accpet connections. Aborts on failure. */
-int web_setup_socket(int port) {
-  int listen_socket;
+ * to accpet connections. If reuseport is set, other sockets may be
+ * bound to the same port with SO_REUSEPORT; if that isn't supported,
+ * returns -1. Aborts on other failures. */
+static int web_setup_socket(int port, int reuseport) {
+  int listen_socket, on = 1;
   struct sockaddr_in listen_addr;
 
   listen_socket = socket(PF_INET, SOCK_STREAM, 0);
@@ -96,6 +467,22 @@ int web_setup_socket(int port) {
     abort();
   }
 
+  /* Let a restarted server bind while old connections are in TIME_WAIT */
+  setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  if (reuseport) {
+#ifdef SO_REUSEPORT
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &on,
+                   sizeof(on)) == -1) {
+      close(listen_socket);
+      return -1;
+    }
+#else
+    close(listen_socket);
+    return -1;
+#endif
+  }
+
   listen_addr.sin_family = AF_INET;
   listen_addr.sin_port = htons((uint16_t) port);
   listen_addr.sin_addr.s_addr = INADDR_ANY;
@@ -121,7 +508,7 @@ int web_setup_socket(int port) {
  * -1 on error, 0 or greater on success.
  * This function is not thread safe - multiple threads should
  * not invoke it simultaneously. */
-int web_next_connection(int listen_socket) {
+static int web_next_connection(int listen_socket) {
   int next_conn;
   struct sockaddr_in addr;
   socklen_t len = sizeof(struct sockaddr_in);
@@ -133,196 +520,190 @@ int web_next_connection(int listen_socket) {
   return next_conn;
 }
 
-/* Do all the actual request handling.
- * Read in the request, parse it, and send the requested file
- * back (or send an error back) */
-void web_handle_connection(int conn, const char *docroot) {
-  FILE *stream = NULL, *file = NULL;
-  char *request_buf, *filename;
-  status_t status;
-  request_buf = malloc(REQUEST_MAX_SIZE);
-  assert(request_buf != NULL);
-  filename = malloc(REQUEST_MAX_SIZE);
-  assert(filename != NULL);
-
-  if (web_read_request(conn, request_buf, REQUEST_MAX_SIZE) == -1) {
-    fprintf(stderr, "error reading request");
-    goto done;
-  }
-
-  stream = fdopen(conn, "w");
-  if (stream == NULL) {
-    /* Couldn't open a stream; no way to send a response to the client. */
-    perror("sioux: stream fdopen error");
-    goto done;
-  }
-
-  /* Get the filename out of the request. */
-  status = web_parse_request(request_buf, filename, REQUEST_MAX_SIZE, docroot);
-
-  if (status != STATUS_200_OK) {
-    fprintf(stderr, "request error %d\n", status);
-    web_send_headers(stream, status);
-    web_send_error_doc(stream, status);
-    goto done;
-  }
-
-  /* See if we can find this file */
-  status = web_open_file(filename, &file);
+/* Return nonzero if the threads working for the server in the
+ * background, the cache's compressor and the access log's writer, have
+ * anything to do. */
+static int web_helpers_busy(const web_server_t *server) {
+  return web_cache_busy(server->cache) ||
+      (server->log != NULL && web_log_busy(server->log));
+}
 
-  if (status != STATUS_200_OK) {
-    fprintf(stderr, "request error %d\n", status);
-    web_send_headers(stream, status);
-    web_send_error_doc(stream, status);
-    goto done;
+/* User-level threads all share one kernel thread, so a thread that
+ * sleeps in the kernel waiting for its socket stops every other thread
+ * too. Under that implementation, threads that have to wait for a
+ * socket park here instead, and a single poller thread polls for all
+ * of them at once. */
+static void web_poller_start(const web_server_t *server) {
+  poller.server = server;
+  poller.lock = sthread_mutex_init();
+  poller.parked_cond = sthread_cond_init();
+  poller.parked = NULL;
+  poller.nparked = 0;
+  if (sthread_create(web_poller, NULL, 0) == NULL) {
+    fprintf(stderr, "sioux: failed to create poller thread\n");
+    abort();
   }
-
-  /* Finally - send the file */
-  web_send_headers(stream, status);
-  web_send_file(stream, file);
-  fflush(stream);
-  fclose(file);
-
- done:
-  if (stream != NULL)
-    fclose(stream);
-  free(request_buf);
-  free(filename);
 }
 
-/* Read a request from the conn into request_buf, not more than
- * size bytes long. Return 0 on success, -1 on error.
- */
-int web_read_request(int conn, char *request_buf, size_t size) {
-  ssize_t count = 0, rd;
-  /* save 1 char for the '\0' terminator */
-  while ((rd = read(conn, request_buf + count, size-1 - count))) {
-    if (rd == -1) {
-      perror("sioux: read error");
-      return -1;
+/* The poller checks the parked threads' sockets, and wakes those that
+ * are ready or whose deadline has passed. While any other thread can
+ * run, including the background threads, it only checks between
+ * yields; once none can, it sleeps in poll until a socket is ready or
+ * the nearest deadline. */
+static void *web_poller(void *arg) {
+  struct pollfd *pfds = NULL;
+  web_parked_t **parked = NULL, *p;
+  long long now, first;
+  int size = 0, n, i, timeout;
+
+  for (;;) {
+    sthread_mutex_lock(poller.lock);
+    while (poller.parked == NULL)
+      sthread_cond_wait(poller.parked_cond, poller.lock);
+    if (poller.nparked > size) {
+      size = 2 * poller.nparked;
+      pfds = (struct pollfd *)realloc(pfds, size * sizeof(*pfds));
+      parked = (web_parked_t **)realloc(parked, size * sizeof(*parked));
+      assert(pfds != NULL && parked != NULL);
     }
-    count += rd;
-    if (count >= (size-1)) {
-      request_buf[count] = '\0';
-      fprintf(stderr, "request: %s\n", request_buf);
-      fprintf(stderr, "sioux: request too large\n");
-      return -1;
+    n = 0;
+    first = -1;
+    for (p = poller.parked; p != NULL; p = p->next) {
+      pfds[n] = p->pfd;
+      parked[n++] = p;
+      if (p->deadline != -1 && (first == -1 || p->deadline < first))
+        first = p->deadline;
+    }
+    sthread_mutex_unlock(poller.lock);
+
+    /* Only the poller takes threads off the list, so those gathered
+     * stay parked until it wakes them. Any thread that parks after
+     * this has run, so is picked up next time around. */
+    timeout = 0;
+    if (!web_run_others() && !web_helpers_busy(poller.server)) {
+      timeout = -1;
+      if (first != -1) {
+        now = web_now_ms();
+        timeout = first > now ? (int)(first - now) : 0;
+      }
+    }
+    if (poll(pfds, n, timeout) == -1 && errno != EINTR) {
+      perror("sioux: poll failed");
+      abort();
     }
 
-    request_buf[count] = '\0';
-    if (strstr(request_buf, REQUEST_TERMINATOR) != 0 ||
-        strstr(request_buf, REQUEST_TERMINATOR_LOOSE) != 0) {
-      return 0;
+    now = web_now_ms();
+    sthread_mutex_lock(poller.lock);
+    for (i = 0; i < n; i++) {
+      p = parked[i];
+      if (pfds[i].revents == 0 && (p->deadline == -1 || now < p->deadline))
+        continue;
+      p->ready = (pfds[i].revents != 0);
+      if (p->prev != NULL)
+        p->prev->next = p->next;
+      else
+        poller.parked = p->next;
+      if (p->next != NULL)
+        p->next->prev = p->prev;
+      poller.nparked--;
+      sthread_sem_post(p->wake);
     }
+    sthread_mutex_unlock(poller.lock);
   }
-  /* End-of-file without a blank line; bad request */
-  return -1;
+  return NULL;
 }
 
-/* Parse the given request, possibly modifying it.
- * Return a the actual filename to be fetched from disk */
-status_t web_parse_request(char *request, char *filename,
-                           size_t filename_len,
-                           const char *docroot) {
-  char *end_of_name;
-  char *tmp;
-
-  /* look for "GET" at the very beginning of the request */
-  if (strstr(request, "GET ") != request)
-    /* We only support GET requests
-     * (not POST, nor any of the stranger types) */
-    return STATUS_405_METHOD_NOT_ALLOWED;
-  request += strlen("GET ");
-
-  /* Requests may or may not include "http://servername:port/";
-   * if they do, take it off here. */
-  if ((tmp = strstr(request, "http://")) != NULL) {
-    request = tmp;
-    request += strlen("http://");
-    request = strchr(request, '/');
-    if (request == NULL)
-      return STATUS_400_BAD_REQUEST;
-  }
-
-  /* request is now advanced to what should be the filename itself,
-   * search for the end of it */
-  end_of_name = strchr(request, ' ');
-  if (end_of_name == NULL)
-    return STATUS_400_BAD_REQUEST;
-  *end_of_name = '\0';
-
-  /* If filename ends in '/', tack on the "index.html"
-   * This is a poor heuristic - should really check if the filename
-   * is a directory. */
-  snprintf(filename, filename_len, "%s%s%s", docroot, request,
-           request[strlen(request) - 1] == '/' ? INDEX_FILE : "");
-
-  return STATUS_200_OK;
+/* Yield to any other thread that is ready to run. Returns nonzero if
+ * one ran. Waiting threads are ahead of the yielding one in the run
+ * queue, so a yield that comes straight back means none were ready. */
+static int web_run_others(void) {
+  sthread_stats_t before, after;
+
+  sthread_get_stats(sthread_self(), &before);
+  sthread_yield();
+  sthread_get_stats(sthread_self(), &after);
+  return after.voluntary_switches + after.involuntary_switches !=
+      before.voluntary_switches + before.involuntary_switches;
 }
 
-/* Every http response must begin with a set of headers, indicating
- * at least the version of the protocol and code for what happened
- */
-void web_send_headers(FILE *stream, status_t status) {
-  fprintf(stream, "%s %d %s\r\n", HTTP_VERSION, status,
-          web_get_status_string(status));
-  fprintf(stream, "Server: %s\r\n", SERVER);
-  fprintf(stream, "Content-Type: text/html\r\n");
-  fprintf(stream, "Connection: close\r\n");
-  fprintf(stream, CRLF);
+/* Return a monotonic clock reading in milliseconds */
+static long long web_now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-/* Open a file. Return a status code indicating success (200) or failure
- * (anything else) */
-status_t web_open_file(const char *filename, FILE **file) {
-  *file = fopen(filename, "r");
-  if (*file == NULL)
-    return STATUS_404_NOT_FOUND;
-  printf("sending file: %s\n", filename);
-  return STATUS_200_OK;
+/* Wait up to timeout milliseconds (forever if -1) for fd to be ready
+ * for events. Returns 0 if it timed out, nonzero otherwise. Under
+ * user-level threads, the thread parks with the poller rather than
+ * waiting in the kernel. */
+static int web_wait(int fd, short events, int timeout) {
+  web_parked_t self;
+
+  self.pfd.fd = fd;
+  self.pfd.events = events;
+  if (sthread_get_impl() != STHREAD_USER_IMPL)
+    return poll(&self.pfd, 1, timeout) != 0;
+
+  self.deadline = (timeout == -1) ? -1 : web_now_ms() + timeout;
+  self.ready = 0;
+  self.wake = sthread_sem_init(0);
+  sthread_mutex_lock(poller.lock);
+  self.prev = NULL;
+  self.next = poller.parked;
+  if (poller.parked != NULL)
+    poller.parked->prev = &self;
+  poller.parked = &self;
+  poller.nparked++;
+  sthread_cond_signal(poller.parked_cond);
+  sthread_mutex_unlock(poller.lock);
+
+  sthread_sem_wait(self.wake);
+  sthread_sem_free(self.wake);
+  return self.ready;
 }
 
-/* Given an open stream to send to, and an open file to read from,
- * transfer the file. */
-void web_send_file(FILE *stream, FILE *file) {
-  size_t count;
-  char *buf;
-  buf = (char*)malloc(BUFFER_SIZE);
-  assert(buf != NULL);
-
-  while ((count = fread(buf, 1, BUFFER_SIZE, file)) != 0) {
-    //    fprintf(stderr, "sending file: %d\n", (int)count);
-    count = fwrite(buf, 1, count, stream);
-    if (count == 0) {
-      fprintf(stderr, "error sending file\n");
-      break;
+/* Do all the actual request handling.
+ * Read in each request, parse it, and send the requested file
+ * back (or send an error back), until the connection is closed.
+ * A client that makes no progress for server->timeout seconds is given
+ * up on, where that can be done without blocking the other threads. */
+static void web_handle_connection(int fd, const web_server_t *server) {
+  web_conn_status_t status;
+  web_conn_t *conn;
+  int timeout = -1;
+
+  /* A connection that is kept open has to be given up on if the client
+   * doesn't come back, so wait for it here, with a timeout, rather than
+   * blocking in read. User-level threads all share one kernel thread,
+   * so there a thread blocked on its client would stop every other
+   * thread; under that implementation the socket is always made
+   * nonblocking. */
+  if (server->max_requests > 1 ||
+      sthread_get_impl() == STHREAD_USER_IMPL) {
+    if (web_set_nonblocking(fd) == -1) {
+      close(fd);
+      return;
     }
+    timeout = server->timeout * 1000;
   }
 
-  free(buf);
-}
-
-/* Send an html document describing the error that occurred. */
-void web_send_error_doc(FILE *stream, status_t status) {
-  fprintf(stream, "<html><head><title>Error %d</title></head>\n", status);
-  fprintf(stream, "<body><h1>Error %d: %s</h1></body></html>\n", status,
-          web_get_status_string(status));
-}
+  conn = web_conn_create(fd, server);
+  if (conn == NULL) {
+    fprintf(stderr, "sioux: out of memory\n");
+    close(fd);
+    return;
+  }
 
-/* Each status number has an associated string. Return it. */
-const char *web_get_status_string(status_t status) {
-  switch (status) {
-  case STATUS_200_OK:
-    return "OK";
-  case STATUS_400_BAD_REQUEST:
-    return "Bad Request";
-  case STATUS_404_NOT_FOUND:
-    return "Not Found";
-  case STATUS_405_METHOD_NOT_ALLOWED:
-    return "Method Not Allowed";
+  /* Otherwise, accepted sockets are normally blocking, so this runs to
+   * the end in one go; but on some systems they inherit O_NONBLOCK
+   * from the listening socket, so wait for the socket if it would
+   * block. */
+  while ((status = web_conn_run(conn)) != WEB_CONN_DONE) {
+    if (!web_wait(fd, status == WEB_CONN_WANT_READ ? POLLIN : POLLOUT,
+                  timeout))
+      break;  /* timed out */
   }
-  abort();
-  return NULL;
+  web_conn_free(conn);
 }
-
-
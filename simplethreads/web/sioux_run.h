@@ -1,6 +1,38 @@
 #ifndef SIOUX_RUN_H
 #define SIOUX_RUN_H 1
 
-void web_runloop(const char *host, int port, const char *docroot);
+#include <stddef.h>
+
+#include <web_log.h>
+
+/* Tunable server settings */
+typedef struct {
+  /* Number of worker threads handling connections; 0 handles each
+   * connection in the accept loop itself, one at a time */
+  int nworkers;
+  /* Number of accepted connections that can wait for a worker before
+   * the accept thread stops accepting more */
+  int queue_depth;
+  /* Number of event-driven reactor threads, each on its own CPU; if
+   * nonzero, used instead of the worker pool */
+  int nreactors;
+  /* Bytes of files to keep in the docroot cache; 0 caches nothing */
+  size_t cache_size;
+  /* Requests answered on one connection before it is closed; 1 closes
+   * each after one response */
+  int max_requests;
+  /* Seconds before a connection that isn't making progress, such as one
+   * kept open but not used again, is closed */
+  int timeout;
+  /* File to write the access log to ("-" for the standard output), or
+   * NULL for none; how it is written; and how many requests to log one
+   * of */
+  const char *log_path;
+  web_log_format_t log_format;
+  int log_sample;
+} web_options_t;
+
+void web_runloop(const char *host, int port, const char *docroot,
+                 const web_options_t *options);
 
 #endif /* SIOUX_RUN_H */
@@ -0,0 +1,376 @@
+/*
+ * test-webparse.c - Test of sioux's HTTP request parser. Each request
+ *                   is parsed whole, and then again as it would arrive
+ *                   a piece at a time, with the parser stopping at
+ *                   every byte (so inside each CRLF, too); both must
+ *                   find the same method, target, version and headers.
+ *                   Lines with their ends at every offset from a
+ *                   16-byte boundary check the fast search for them.
+ *                   Then Range and If-None-Match values are checked,
+ *                   around the edges of the file and of the lists.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <web_parse.h>
+
+#define BUF_SIZE 8192
+
+static int errors = 0;
+
+/* What a request should parse as: its fields, and its headers as
+ * "Name=value" */
+typedef struct {
+  const char *method, *target, *version;
+  int nheaders;
+  const char *headers[4];
+} expected_t;
+
+static int span_equals(const char *buf, web_span_t span, const char *str) {
+  return span.len == strlen(str) && memcmp(buf + span.off, str, span.len) == 0;
+}
+
+/* Check that a parsed request holds what want says, and that it ends
+ * (before anything pipelined after it) at end. */
+static void check_request(const char *name, const web_request_t *req,
+                          const char *buf, const expected_t *want,
+                          size_t end) {
+  char header[256];
+  int i;
+
+  if (!span_equals(buf, req->method, want->method) ||
+      !span_equals(buf, req->target, want->target) ||
+      !span_equals(buf, req->version, want->version)) {
+    printf("%s: request line parsed as \"%.*s\" \"%.*s\" \"%.*s\"\n", name,
+           (int)req->method.len, buf + req->method.off,
+           (int)req->target.len, buf + req->target.off,
+           (int)req->version.len, buf + req->version.off);
+    errors++;
+  }
+  if (req->nheaders != want->nheaders) {
+    printf("%s: %d headers, not %d\n", name, req->nheaders,
+           want->nheaders);
+    errors++;
+    return;
+  }
+  for (i = 0; i < req->nheaders; i++) {
+    snprintf(header, sizeof(header), "%.*s=%.*s",
+             (int)req->names[i].len, buf + req->names[i].off,
+             (int)req->values[i].len, buf + req->values[i].off);
+    if (strcmp(header, want->headers[i]) != 0) {
+      printf("%s: header %d parsed as \"%s\", not \"%s\"\n", name, i,
+             header, want->headers[i]);
+      errors++;
+    }
+  }
+  if (req->end != end) {
+    printf("%s: request ends at %lu, not %lu\n", name,
+           (unsigned long)req->end, (unsigned long)end);
+    errors++;
+  }
+}
+
+/* Parse request, followed by next (the start of the request after
+ * it), all at once and then a byte more at a time, expecting want. The
+ * text is put offset bytes past a 16-byte boundary. */
+static void check_parse(const char *name, int offset, const char *request,
+                        const char *next, const expected_t *want) {
+  static char storage[BUF_SIZE + 16] __attribute__((aligned(16)));
+  char *text = storage + offset;
+  web_request_t req;
+  web_parse_status_t status;
+  size_t end = strlen(request), len, n;
+
+  len = snprintf(text, BUF_SIZE, "%s%s", request, next);
+
+  web_parse_init(&req);
+  if (web_parse(&req, text, len) != WEB_PARSE_DONE) {
+    printf("%s: not parsed whole\n", name);
+    errors++;
+  } else {
+    check_request(name, &req, text, want, end);
+  }
+
+  web_parse_init(&req);
+  for (n = 0; n <= len; n++) {
+    status = web_parse(&req, text, n);
+    if (status == WEB_PARSE_DONE)
+      break;
+    if (status != WEB_PARSE_INCOMPLETE) {
+      printf("%s: error after %lu bytes\n", name, (unsigned long)n);
+      errors++;
+      return;
+    }
+    /* Everything so far has been looked at, and won't be again */
+    if (req.scanned != n) {
+      printf("%s: %lu of %lu bytes scanned\n", name,
+             (unsigned long)req.scanned, (unsigned long)n);
+      errors++;
+      return;
+    }
+  }
+  if (n != end) {
+    printf("%s: done after %lu bytes, not %lu\n", name, (unsigned long)n,
+           (unsigned long)end);
+    errors++;
+    return;
+  }
+  check_request(name, &req, text, want, end);
+}
+
+/* Parse text, whole and in pieces, expecting it to be malformed */
+static void check_error(const char *name, const char *text) {
+  web_request_t req;
+  web_parse_status_t status;
+  size_t len = strlen(text), n;
+
+  web_parse_init(&req);
+  if (web_parse(&req, text, len) != WEB_PARSE_ERROR) {
+    printf("%s: malformed request not refused\n", name);
+    errors++;
+  }
+
+  web_parse_init(&req);
+  for (n = 0; n <= len; n++) {
+    status = web_parse(&req, text, n);
+    if (status != WEB_PARSE_INCOMPLETE)
+      break;
+  }
+  if (status != WEB_PARSE_ERROR) {
+    printf("%s: malformed request not refused when parsed in pieces\n",
+           name);
+    errors++;
+  }
+}
+
+/* Requests with every line length from 1 to 80, starting at every
+ * offset from a 16-byte boundary, so that the end of the request line
+ * and of a header (and the colon and spaces in it) fall in every
+ * position within the 16 bytes searched at once. */
+static void check_alignments(void) {
+  char target[128], value[128], header[160], request[512], name[64];
+  expected_t want;
+  int pad, n;
+
+  for (n = 1; n <= 80; n++) {
+    target[0] = '/';
+    memset(target + 1, 'a' + n % 26, n - 1);
+    target[n] = '\0';
+    memset(value, 'v', n);
+    value[n] = '\0';
+    snprintf(header, sizeof(header), "X-Test=%s", value);
+    want.method = "GET";
+    want.target = target;
+    want.version = "HTTP/1.1";
+    want.nheaders = 1;
+    want.headers[0] = header;
+
+    snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\n"
+             "X-Test:  %s \r\n\r\n", target, value);
+    for (pad = 0; pad < 16; pad++) {
+      snprintf(name, sizeof(name), "line length %d at offset %d", n, pad);
+      check_parse(name, pad, request, "", &want);
+    }
+  }
+}
+
+/* Exactly WEB_MAX_HEADERS headers are fine; one more is refused */
+static void check_max_headers(void) {
+  static char text[BUF_SIZE];
+  web_request_t req;
+  size_t len;
+  int i;
+
+  len = snprintf(text, sizeof(text), "GET / HTTP/1.1\r\n");
+  for (i = 0; i < WEB_MAX_HEADERS; i++)
+    len += snprintf(text + len, sizeof(text) - len, "H%d: %d\r\n", i, i);
+  strcpy(text + len, "\r\n");
+
+  web_parse_init(&req);
+  if (web_parse(&req, text, strlen(text)) != WEB_PARSE_DONE ||
+      req.nheaders != WEB_MAX_HEADERS) {
+    printf("request with %d headers not parsed\n", WEB_MAX_HEADERS);
+    errors++;
+  } else if (web_parse_header(&req, text, "h7") != 7 ||
+             web_parse_header(&req, text, "H99") != -1) {
+    printf("headers not looked up by name\n");
+    errors++;
+  }
+
+  strcpy(text + len, "One-Too-Many: 1\r\n\r\n");
+  check_error("too many headers", text);
+}
+
+/* Parse value as a Range header for a file of size bytes, expecting
+ * want ranges (-1 for an ignored header), given as first, last pairs */
+static void check_range(const char *value, off_t size, int want,
+                        const long *expect) {
+  web_range_t ranges[WEB_MAX_RANGES];
+  int n, i;
+
+  n = web_parse_range(value, strlen(value), size, ranges);
+  if (n != want) {
+    printf("Range \"%s\" of %ld bytes: %d ranges, not %d\n", value,
+           (long)size, n, want);
+    errors++;
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if (ranges[i].first != expect[2 * i] ||
+        ranges[i].last != expect[2 * i + 1]) {
+      printf("Range \"%s\" of %ld bytes: range %d is %ld-%ld, not "
+             "%ld-%ld\n", value, (long)size, i, (long)ranges[i].first,
+             (long)ranges[i].last, expect[2 * i], expect[2 * i + 1]);
+      errors++;
+    }
+  }
+}
+
+static void check_ranges(void) {
+  static const long first10[] = { 0, 9 };
+  static const long last10[] = { 90, 99 };
+  static const long whole5[] = { 0, 4 };
+  static const long from50[] = { 50, 99 };
+  static const long overlapping[] = { 0, 10, 5, 15, 0, 99 };
+  static const long two[] = { 0, 1, 3, 4 };
+  static const long no_ranges[] = { 0 };
+  char value[512];
+  long many[2 * WEB_MAX_RANGES];
+  size_t len;
+  int i;
+
+  check_range("bytes=0-9", 100, 1, first10);
+  check_range("Bytes=0-9", 100, 1, first10);
+  check_range("bytes=-10", 100, 1, last10);
+  check_range("bytes=90-", 100, 1, last10);
+  check_range("bytes=90-1000", 100, 1, last10);
+  check_range("bytes=-10", 5, 1, whole5);
+  check_range("bytes=0-", 5, 1, whole5);
+  check_range("bytes=50-99", 100, 1, from50);
+  check_range("bytes= 0-1 ,\t3-4 ", 100, 2, two);
+
+  /* Ranges are kept as asked for, overlapping or not */
+  check_range("bytes=0-10,5-15,0-", 100, 3, overlapping);
+
+  /* Nothing that can be sent: an unsatisfiable request, not an error */
+  check_range("bytes=-0", 100, 0, no_ranges);
+  check_range("bytes=100-", 100, 0, no_ranges);
+  check_range("bytes=150-200", 100, 0, no_ranges);
+  check_range("bytes=0-", 0, 0, no_ranges);
+  check_range("bytes=-5", 0, 0, no_ranges);
+  check_range("bytes=0-9", 0, 0, no_ranges);
+
+  /* Ranges past the end are dropped, leaving the rest */
+  check_range("bytes=200-300,0-9", 100, 1, first10);
+
+  /* Malformed, so the whole file is sent */
+  check_range("bytes=", 100, -1, no_ranges);
+  check_range("bytes=5", 100, -1, no_ranges);
+  check_range("bytes=9-0", 100, -1, no_ranges);
+  check_range("bytes=a-b", 100, -1, no_ranges);
+  check_range("bytes=--5", 100, -1, no_ranges);
+  check_range("bytes=-", 100, -1, no_ranges);
+  check_range("bytes=0-1,", 100, -1, no_ranges);
+  check_range("bytes=0-1;2-3", 100, -1, no_ranges);
+  check_range("items=0-9", 100, -1, no_ranges);
+  check_range("bytes=1234567890123456789-", 100, -1, no_ranges);
+
+  /* WEB_MAX_RANGES ranges are fine, one more is too many; ranges that
+   * are dropped don't count */
+  len = snprintf(value, sizeof(value), "bytes=");
+  for (i = 0; i < WEB_MAX_RANGES; i++) {
+    len += snprintf(value + len, sizeof(value) - len, "%s%d-%d",
+                    (i > 0) ? "," : "", 2 * i, 2 * i);
+    many[2 * i] = many[2 * i + 1] = 2 * i;
+  }
+  check_range(value, 100, WEB_MAX_RANGES, many);
+  strcpy(value + len, ",500-600");
+  check_range(value, 100, WEB_MAX_RANGES, many);
+  strcpy(value + len, ",90-99");
+  check_range(value, 100, -1, no_ranges);
+}
+
+/* Check whether etag is in the If-None-Match list value */
+static void check_etag(const char *value, const char *etag, int want) {
+  if (!web_parse_etag_listed(value, strlen(value), etag) != !want) {
+    printf("If-None-Match \"%s\" %s %s\n", value,
+           want ? "doesn't list" : "lists", etag);
+    errors++;
+  }
+}
+
+static void check_etags(void) {
+  const char *etag = "\"5f3a-1b2c\"";
+
+  check_etag("\"5f3a-1b2c\"", etag, 1);
+  check_etag("W/\"5f3a-1b2c\"", etag, 1);
+  check_etag("*", etag, 1);
+  check_etag(" * ", etag, 1);
+  check_etag("\"other\", W/\"5f3a-1b2c\"", etag, 1);
+  check_etag("\"other\",\t\"5f3a-1b2c\" ", etag, 1);
+  check_etag("\"other\" , *", etag, 1);
+
+  check_etag("", etag, 0);
+  check_etag("\"other\"", etag, 0);
+  check_etag("\"5f3a-1b2\"", etag, 0);
+  check_etag("\"5f3a-1b2cd\"", etag, 0);
+  check_etag("5f3a-1b2c", etag, 0);
+  check_etag("w/\"5f3a-1b2c\"", etag, 0);
+  check_etag("W/", etag, 0);
+  check_etag("**", etag, 0);
+  check_etag(",,", etag, 0);
+}
+
+int main(int argc, char **argv) {
+  static const expected_t get = {
+    "GET", "/index.html", "HTTP/1.1", 2,
+    { "Host=localhost", "Accept-Encoding=gzip, br" }
+  };
+  static const expected_t bare = { "HEAD", "/", "HTTP/1.0", 0, { NULL } };
+
+  printf("Testing the sioux request parser\n");
+
+  check_parse("CRLF", 0,
+              "GET /index.html HTTP/1.1\r\nHost: localhost\r\n"
+              "Accept-Encoding: gzip, br\r\n\r\n", "", &get);
+  check_parse("bare LF", 0,
+              "GET /index.html HTTP/1.1\nHost: localhost\n"
+              "Accept-Encoding: gzip, br\n\n", "", &get);
+  check_parse("mixed line ends", 0,
+              "GET /index.html HTTP/1.1\r\nHost: localhost\n"
+              "Accept-Encoding: gzip, br\r\n\n", "", &get);
+  check_parse("white space around values", 0,
+              "GET /index.html HTTP/1.1\r\nHost:localhost \t\r\n"
+              "Accept-Encoding: \t gzip, br\r\n\r\n", "", &get);
+  check_parse("pipelined", 0,
+              "GET /index.html HTTP/1.1\r\nHost: localhost\r\n"
+              "Accept-Encoding: gzip, br\r\n\r\n",
+              "GET /next HTTP/1.1\r\n", &get);
+  check_parse("leading blank lines", 0,
+              "\r\n\n\r\nHEAD / HTTP/1.0\r\n\r\n", "", &bare);
+  check_parse("no headers", 0, "HEAD / HTTP/1.0\n\n", "", &bare);
+
+  check_error("no version", "GET /\r\n\r\n");
+  check_error("not HTTP", "GET / FTP/1.0\r\n\r\n");
+  check_error("empty method", " / HTTP/1.1\r\n\r\n");
+  check_error("empty target", "GET  HTTP/1.1\r\n\r\n");
+  check_error("no colon", "GET / HTTP/1.1\r\nHost\r\n\r\n");
+  check_error("empty name", "GET / HTTP/1.1\r\n: x\r\n\r\n");
+  check_error("continued header",
+              "GET / HTTP/1.1\r\nHost: a\r\n b\r\n\r\n");
+
+  check_max_headers();
+  check_alignments();
+  check_ranges();
+  check_etags();
+
+  if (errors) {
+    printf("sioux request parser failed\n");
+    return 1;
+  }
+  printf("sioux request parser passed\n");
+  return 0;
+}
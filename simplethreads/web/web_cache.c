@@ -0,0 +1,673 @@
+/*
+ * web_cache.c - A cache of the files under the docroot: a hash table
+ *               keyed by path, with the entries on an LRU list, all
+ *               protected by one sthread mutex.
+ *
+ *    Each entry holds what it takes to send the file: small files are
+ *    mapped into memory, so that they go out with the headers in a
+ *    single writev; bigger ones are kept open, for sendfile. Each
+ *    entry also holds the response headers, formatted when the file
+ *    is loaded, and the ETag and Last-Modified date that conditional
+ *    requests are checked against.
+ *
+ *    The mutex is only held to look a path up and move its entry to
+ *    the front of the LRU list; files are opened, mapped and closed
+ *    outside it. Entries are reference counted, so one that is evicted
+ *    or replaced while a thread is still sending it lives on until that
+ *    thread releases it.
+ *
+ *    Once the files cached take up more than the budget, or too many
+ *    are held open, the least recently used are evicted. A file that
+ *    changes is noticed by stat'ing it again, at most once every
+ *    CHECK_INTERVAL seconds; until then the old contents are served.
+ *    (A mapped file that is truncated in place, rather than replaced,
+ *    can crash the server, as with any server that maps files.)
+ *
+ *    An entry also holds the file compressed, in each encoding there
+ *    is. Where the file has been compressed ahead of time, as a.css.gz
+ *    beside a.css, that is loaded with it (unless it is older, and so
+ *    out of date), and checked along with it. Otherwise a file of a
+ *    type that compresses well is compressed the first time a client
+ *    that could take it asks for it: not by that client's thread,
+ *    which sends the file as it is, but by a compressor thread that
+ *    adds the result to the entry for those that come after. Either
+ *    way the compressed files count against the budget, as part of
+ *    the entry, and are dropped with it.
+ *
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sthread.h>
+
+#include <web_cache.h>
+#include <web_compress.h>
+#include <web_mime.h>
+
+/* Number of hash buckets; a power of two */
+#define NBUCKETS 1024
+
+/* Files up to this size are mapped; bigger ones are kept open */
+#define MMAP_MAX (256 * 1024)
+
+/* Most files the cache keeps open at once */
+#define MAX_OPEN_FILES 256
+
+/* Seconds between checks of whether a cached file has changed */
+#define CHECK_INTERVAL 1
+
+/* Room for an entry's headers */
+#define HEADER_MAX 1024
+
+/* Files that are compressed on the fly: no smaller than this, as the
+ * savings would be lost in the headers, and no bigger than this */
+#define COMPRESS_MIN 256
+#define COMPRESS_MAX (8 * 1024 * 1024)
+
+struct entry {
+  web_cache_entry_t pub;       /* must be first */
+  char *path;
+  unsigned int hash;
+  dev_t dev;
+  ino_t ino;
+  time_t checked;              /* when the file was last stat'ed */
+  size_t cost;                 /* bytes counted against the budget,
+                                * its variants' included */
+  int files;                   /* files held open, its variants'
+                                * included */
+  int refs;                    /* holders, plus one while cached */
+  int cached;
+  struct entry *variants[WEB_NENCODINGS];  /* the file compressed with
+                                            * each encoding, or NULL */
+  unsigned int siblings;       /* the encodings read from files */
+  unsigned int to_compress;    /* those it could still be compressed
+                                * with here */
+  int queued;                  /* waiting to be compressed, or being */
+  char *buffer;                /* the data, if it was compressed here */
+  struct entry *hash_next;
+  struct entry *lru_prev, *lru_next;  /* most recently used first */
+  struct entry *job_next;      /* next to be compressed */
+};
+
+struct _web_cache {
+  sthread_mutex_t lock;
+  web_cache_header_fn header;
+  size_t budget, used;
+  int open_files;
+  struct entry *buckets[NBUCKETS];
+  struct entry *lru_head, *lru_tail;
+  unsigned int can_compress;   /* the encodings sioux can compress with */
+  sthread_t compressor;        /* compresses queued entries, if it can */
+  sthread_cond_t jobs_ready;
+  struct entry *jobs_head, *jobs_tail;
+  int jobs;                    /* queued or being done */
+  int stopping;
+};
+
+static unsigned int hash_path(const char *path);
+static struct entry *cache_lookup(web_cache_t *cache, const char *path,
+                                  unsigned int hash);
+static void cache_touch(web_cache_t *cache, struct entry *e);
+static void cache_insert(web_cache_t *cache, struct entry *e);
+static int cache_remove(web_cache_t *cache, struct entry *e);
+static struct entry *cache_evict(web_cache_t *cache);
+static struct entry *entry_load(web_cache_t *cache, const char *path,
+                                unsigned int hash, time_t now);
+static struct entry *entry_open(web_cache_t *cache, const char *path,
+                                const char *file, const char *encoding);
+static struct entry *entry_new(const char *path, const char *encoding,
+                               time_t mtime, off_t size);
+static void entry_format(web_cache_t *cache, struct entry *e);
+static int entry_current(struct entry *e);
+static int entry_is(struct entry *e, const struct stat *st);
+static char *sibling_path(const char *path, web_encoding_t encoding);
+static void *compressor_main(void *arg);
+static void entry_compress(web_cache_t *cache, struct entry *e);
+static void entry_free(web_cache_t *cache, struct entry *e);
+
+
+web_cache_t *web_cache_create(size_t budget, web_cache_header_fn header) {
+  web_cache_t *cache;
+  int i;
+
+  cache = (web_cache_t *)calloc(1, sizeof(web_cache_t));
+  assert(cache != NULL);
+  cache->lock = sthread_mutex_init();
+  cache->header = header;
+  cache->budget = budget;
+  for (i = 0; i < WEB_NENCODINGS; i++)
+    if (web_can_compress(i))
+      cache->can_compress |= 1u << i;
+  if (cache->can_compress != 0) {
+    cache->jobs_ready = sthread_cond_init();
+    cache->compressor = sthread_create(compressor_main, cache, 1);
+  }
+  return cache;
+}
+
+void web_cache_free(web_cache_t *cache) {
+  struct entry *e;
+
+  if (cache->can_compress != 0) {
+    sthread_mutex_lock(cache->lock);
+    cache->stopping = 1;
+    sthread_cond_signal(cache->jobs_ready);
+    sthread_mutex_unlock(cache->lock);
+    sthread_join(cache->compressor);
+    sthread_cond_free(cache->jobs_ready);
+  }
+  while ((e = cache->lru_head) != NULL) {
+    assert(e->refs == 1);
+    cache_remove(cache, e);
+    entry_free(cache, e);
+  }
+  sthread_mutex_free(cache->lock);
+  free(cache);
+}
+
+web_cache_entry_t *web_cache_get(web_cache_t *cache, const char *path) {
+  unsigned int hash = hash_path(path);
+  time_t now = time(NULL);
+  struct entry *e, *fresh, *dead;
+  int check = 0;
+
+  sthread_mutex_lock(cache->lock);
+  e = cache_lookup(cache, path, hash);
+  if (e != NULL) {
+    cache_touch(cache, e);
+    e->refs++;
+    if (now - e->checked >= CHECK_INTERVAL) {
+      e->checked = now;
+      check = 1;
+    }
+  }
+  sthread_mutex_unlock(cache->lock);
+
+  if (e != NULL) {
+    if (!check || entry_current(e))
+      return &e->pub;
+
+    /* It has changed, or gone; drop it and load it again */
+    sthread_mutex_lock(cache->lock);
+    if (e->cached)
+      cache_remove(cache, e);
+    sthread_mutex_unlock(cache->lock);
+    web_cache_release(cache, &e->pub);
+  }
+
+  fresh = entry_load(cache, path, hash, now);
+  if (fresh == NULL)
+    return NULL;
+
+  sthread_mutex_lock(cache->lock);
+  e = cache_lookup(cache, path, hash);
+  if (e != NULL) {
+    /* Another thread loaded it first; use theirs */
+    cache_touch(cache, e);
+    e->refs++;
+    sthread_mutex_unlock(cache->lock);
+    entry_free(cache, fresh);
+    return &e->pub;
+  }
+  dead = NULL;
+  if (fresh->cost <= cache->budget) {
+    cache_insert(cache, fresh);
+    dead = cache_evict(cache);
+  }
+  sthread_mutex_unlock(cache->lock);
+
+  while (dead != NULL) {
+    e = dead;
+    dead = dead->hash_next;
+    entry_free(cache, e);
+  }
+  return &fresh->pub;
+}
+
+web_cache_entry_t *web_cache_encode(web_cache_t *cache,
+                                    web_cache_entry_t *entry,
+                                    unsigned int accept) {
+  struct entry *e = (struct entry *)entry, *v = NULL;
+  int i;
+
+  accept &= (1u << WEB_NENCODINGS) - 1;
+  if (!entry->vary || entry->encoding != NULL || accept == 0)
+    return entry;
+
+  sthread_mutex_lock(cache->lock);
+  for (i = 0; i < WEB_NENCODINGS && v == NULL; i++)
+    if ((accept & (1u << i)) && e->variants[i] != NULL)
+      v = e->variants[i];
+  if (v != NULL)
+    v->refs++;
+  /* Compress it, if this client would take something we could make */
+  if ((e->to_compress & accept) != 0 && !e->queued && e->cached) {
+    e->queued = 1;
+    e->refs++;
+    e->job_next = NULL;
+    if (cache->jobs_tail != NULL)
+      cache->jobs_tail->job_next = e;
+    else
+      cache->jobs_head = e;
+    cache->jobs_tail = e;
+    cache->jobs++;
+    sthread_cond_signal(cache->jobs_ready);
+  }
+  sthread_mutex_unlock(cache->lock);
+
+  if (v == NULL)
+    return entry;
+  web_cache_release(cache, entry);
+  return &v->pub;
+}
+
+int web_cache_busy(web_cache_t *cache) {
+  int busy;
+
+  sthread_mutex_lock(cache->lock);
+  busy = (cache->jobs > 0);
+  sthread_mutex_unlock(cache->lock);
+  return busy;
+}
+
+void web_cache_release(web_cache_t *cache, web_cache_entry_t *entry) {
+  struct entry *e = (struct entry *)entry;
+  int last;
+
+  sthread_mutex_lock(cache->lock);
+  last = (--e->refs == 0);
+  sthread_mutex_unlock(cache->lock);
+  if (last)
+    entry_free(cache, e);
+}
+
+/* FNV-1a */
+static unsigned int hash_path(const char *path) {
+  unsigned int hash = 2166136261u;
+
+  while (*path != '\0') {
+    hash ^= (unsigned char)*path++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Return the cached entry for path, or NULL. Call with the lock held. */
+static struct entry *cache_lookup(web_cache_t *cache, const char *path,
+                                  unsigned int hash) {
+  struct entry *e;
+
+  for (e = cache->buckets[hash & (NBUCKETS - 1)]; e != NULL;
+       e = e->hash_next)
+    if (e->hash == hash && strcmp(e->path, path) == 0)
+      return e;
+  return NULL;
+}
+
+/* Move e to the front of the LRU list. Call with the lock held. */
+static void cache_touch(web_cache_t *cache, struct entry *e) {
+  if (cache->lru_head == e)
+    return;
+  e->lru_prev->lru_next = e->lru_next;
+  if (e->lru_next != NULL)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    cache->lru_tail = e->lru_prev;
+  e->lru_prev = NULL;
+  e->lru_next = cache->lru_head;
+  cache->lru_head->lru_prev = e;
+  cache->lru_head = e;
+}
+
+/* Add e, which the caller holds, to the cache. Call with the lock
+ * held. */
+static void cache_insert(web_cache_t *cache, struct entry *e) {
+  struct entry **bucket = &cache->buckets[e->hash & (NBUCKETS - 1)];
+
+  e->hash_next = *bucket;
+  *bucket = e;
+  e->lru_prev = NULL;
+  e->lru_next = cache->lru_head;
+  if (cache->lru_head != NULL)
+    cache->lru_head->lru_prev = e;
+  else
+    cache->lru_tail = e;
+  cache->lru_head = e;
+
+  cache->used += e->cost;
+  cache->open_files += e->files;
+  e->cached = 1;
+  e->refs++;
+}
+
+/* Take e out of the cache, dropping the cache's reference to it.
+ * Returns nonzero if that was the last one, and e should be freed.
+ * Call with the lock held. */
+static int cache_remove(web_cache_t *cache, struct entry *e) {
+  struct entry **p;
+
+  for (p = &cache->buckets[e->hash & (NBUCKETS - 1)]; *p != e;
+       p = &(*p)->hash_next)
+    ;
+  *p = e->hash_next;
+  if (e->lru_prev != NULL)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    cache->lru_head = e->lru_next;
+  if (e->lru_next != NULL)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    cache->lru_tail = e->lru_prev;
+
+  cache->used -= e->cost;
+  cache->open_files -= e->files;
+  e->cached = 0;
+  return --e->refs == 0;
+}
+
+/* Evict the least recently used entries until the cache is within its
+ * limits. Returns those that nobody holds, linked through hash_next,
+ * to be freed once the lock is dropped. Call with the lock held. */
+static struct entry *cache_evict(web_cache_t *cache) {
+  struct entry *e, *dead = NULL;
+
+  while (cache->used > cache->budget || cache->open_files > MAX_OPEN_FILES) {
+    e = cache->lru_tail;
+    if (cache_remove(cache, e)) {
+      e->hash_next = dead;
+      dead = e;
+    }
+  }
+  return dead;
+}
+
+/* Open path and make a new entry for it, with the files compressed
+ * ahead of time beside it, held by the caller. Returns NULL if it
+ * can't be opened or isn't a regular file. */
+static struct entry *entry_load(web_cache_t *cache, const char *path,
+                                unsigned int hash, time_t now) {
+  struct entry *e, *v;
+  char *sibling;
+  int i;
+
+  e = entry_open(cache, path, path, NULL);
+  if (e == NULL)
+    return NULL;
+  e->hash = hash;
+  e->checked = now;
+
+  for (i = 0; i < WEB_NENCODINGS; i++) {
+    sibling = sibling_path(path, i);
+    v = entry_open(cache, path, sibling, web_encoding_name(i));
+    free(sibling);
+    if (v == NULL)
+      continue;
+    if (v->pub.mtime < e->pub.mtime) {
+      entry_free(cache, v);
+      continue;
+    }
+    entry_format(cache, v);
+    e->variants[i] = v;
+    e->siblings |= 1u << i;
+    e->cost += v->cost;
+    e->files += v->files;
+  }
+  if (web_mime_compressible(path) && e->pub.size >= COMPRESS_MIN &&
+      e->pub.size <= COMPRESS_MAX)
+    e->to_compress = cache->can_compress & ~e->siblings;
+  e->pub.vary = (e->siblings | e->to_compress) != 0;
+  entry_format(cache, e);
+  return e;
+}
+
+/* Open file, which holds path's contents compressed with encoding (or
+ * as they are, if that is NULL), and make a new entry for it, held by
+ * the caller, without its headers. Returns NULL if it can't be opened
+ * or isn't a regular file. */
+static struct entry *entry_open(web_cache_t *cache, const char *path,
+                                const char *file, const char *encoding) {
+  struct entry *e;
+  struct stat st;
+  void *data;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    /* Most likely a directory */
+    close(fd);
+    return NULL;
+  }
+
+  e = entry_new(path, encoding, st.st_mtime, st.st_size);
+  e->dev = st.st_dev;
+  e->ino = st.st_ino;
+  e->pub.fd = fd;
+  e->files = 1;
+
+  /* Map small files, unless they won't be cached anyway */
+  if (st.st_size <= MMAP_MAX && (size_t)st.st_size <= cache->budget) {
+    if (st.st_size == 0) {
+      e->pub.data = "";
+    } else {
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED)
+        e->pub.data = (const char *)data;
+    }
+    if (e->pub.data != NULL) {
+      close(fd);
+      e->pub.fd = -1;
+      e->files = 0;
+    }
+  }
+  return e;
+}
+
+/* Return a new entry, held by the caller, for path's contents
+ * compressed with encoding (or NULL), with no data. Its ETag and date
+ * are those of a file with the given mtime and size. */
+static struct entry *entry_new(const char *path, const char *encoding,
+                               time_t mtime, off_t size) {
+  struct entry *e;
+  struct tm tm;
+
+  e = (struct entry *)calloc(1, sizeof(struct entry));
+  assert(e != NULL);
+  e->path = strdup(path);
+  assert(e->path != NULL);
+  e->refs = 1;
+  e->pub.path = e->path;
+  e->pub.encoding = encoding;
+  e->pub.vary = (encoding != NULL);
+  e->pub.fd = -1;
+  e->pub.size = size;
+  e->pub.mtime = mtime;
+
+  /* The ETag changes whenever the size or mtime does, as nginx's do;
+   * each encoding has its own */
+  if (encoding == NULL)
+    snprintf(e->pub.etag, WEB_ETAG_SIZE, "\"%llx-%llx\"",
+             (unsigned long long)mtime, (unsigned long long)size);
+  else
+    snprintf(e->pub.etag, WEB_ETAG_SIZE, "\"%llx-%llx-%s\"",
+             (unsigned long long)mtime, (unsigned long long)size, encoding);
+  gmtime_r(&mtime, &tm);
+  strftime(e->pub.last_modified, WEB_DATE_SIZE,
+           "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return e;
+}
+
+/* Format e's headers, and count them and its data against the
+ * budget. */
+static void entry_format(web_cache_t *cache, struct entry *e) {
+  char header[HEADER_MAX];
+
+  e->pub.header_len = cache->header(header, HEADER_MAX, &e->pub);
+  e->pub.header = (char *)malloc(e->pub.header_len);
+  assert(e->pub.header != NULL);
+  memcpy((char *)e->pub.header, header, e->pub.header_len);
+  e->cost += e->pub.size + e->pub.header_len;
+}
+
+/* Return nonzero if e's file, and the compressed files beside it, are
+ * still the ones it was loaded from. */
+static int entry_current(struct entry *e) {
+  struct stat st;
+  char *sibling;
+  int i, current;
+
+  if (stat(e->path, &st) != 0 || !entry_is(e, &st))
+    return 0;
+  current = 1;
+  for (i = 0; i < WEB_NENCODINGS && current; i++) {
+    sibling = sibling_path(e->path, i);
+    if (stat(sibling, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_mtime >= e->pub.mtime)
+      current = (e->siblings & (1u << i)) && entry_is(e->variants[i], &st);
+    else
+      current = !(e->siblings & (1u << i));
+    free(sibling);
+  }
+  return current;
+}
+
+/* Return nonzero if st is of the file that e was loaded from, as it
+ * was. */
+static int entry_is(struct entry *e, const struct stat *st) {
+  return S_ISREG(st->st_mode) && st->st_dev == e->dev &&
+         st->st_ino == e->ino && st->st_size == e->pub.size &&
+         st->st_mtime == e->pub.mtime;
+}
+
+/* Return the path of the file beside path that holds it compressed
+ * with encoding, malloc'd. */
+static char *sibling_path(const char *path, web_encoding_t encoding) {
+  const char *suffix = web_encoding_suffix(encoding);
+  char *sibling;
+
+  sibling = (char *)malloc(strlen(path) + strlen(suffix) + 1);
+  assert(sibling != NULL);
+  strcpy(sibling, path);
+  strcat(sibling, suffix);
+  return sibling;
+}
+
+/* The compressor thread: compresses each entry queued by
+ * web_cache_encode in turn, until the cache is freed. */
+static void *compressor_main(void *arg) {
+  web_cache_t *cache = (web_cache_t *)arg;
+  struct entry *e;
+  int stopping;
+
+  sthread_mutex_lock(cache->lock);
+  for (;;) {
+    while (cache->jobs_head == NULL && !cache->stopping)
+      sthread_cond_wait(cache->jobs_ready, cache->lock);
+    e = cache->jobs_head;
+    if (e == NULL)
+      break;
+    cache->jobs_head = e->job_next;
+    if (cache->jobs_head == NULL)
+      cache->jobs_tail = NULL;
+    stopping = cache->stopping;
+    sthread_mutex_unlock(cache->lock);
+
+    if (!stopping)
+      entry_compress(cache, e);
+    web_cache_release(cache, &e->pub);
+    sthread_mutex_lock(cache->lock);
+    cache->jobs--;
+  }
+  sthread_mutex_unlock(cache->lock);
+  return NULL;
+}
+
+/* Compress e's file with each encoding it still could be, and add the
+ * results to e, if it is still cached and they fit in the budget. */
+static void entry_compress(web_cache_t *cache, struct entry *e) {
+  struct entry *made[WEB_NENCODINGS], *v, *dead;
+  const char *data = e->pub.data;
+  void *mapped = NULL;
+  size_t len;
+  char *out;
+  int i;
+
+  /* A file too big to keep mapped is mapped just while it is
+   * compressed */
+  if (data == NULL) {
+    mapped = mmap(NULL, e->pub.size, PROT_READ, MAP_SHARED, e->pub.fd, 0);
+    if (mapped == MAP_FAILED)
+      mapped = NULL;
+    data = (const char *)mapped;
+  }
+  for (i = 0; i < WEB_NENCODINGS; i++) {
+    made[i] = NULL;
+    if (data == NULL || !(e->to_compress & (1u << i)))
+      continue;
+    out = web_compress(i, data, e->pub.size, &len);
+    if (out == NULL)
+      continue;
+    v = entry_new(e->path, web_encoding_name(i), e->pub.mtime, e->pub.size);
+    v->pub.size = len;
+    v->pub.data = v->buffer = out;
+    entry_format(cache, v);
+    made[i] = v;
+  }
+  if (mapped != NULL)
+    munmap(mapped, e->pub.size);
+
+  sthread_mutex_lock(cache->lock);
+  for (i = 0; i < WEB_NENCODINGS; i++) {
+    v = made[i];
+    if (v != NULL && e->cached && e->cost + v->cost <= cache->budget) {
+      e->variants[i] = v;
+      e->cost += v->cost;
+      cache->used += v->cost;
+      made[i] = NULL;
+    }
+  }
+  e->to_compress = 0;
+  e->queued = 0;
+  dead = cache_evict(cache);
+  sthread_mutex_unlock(cache->lock);
+
+  while (dead != NULL) {
+    v = dead;
+    dead = dead->hash_next;
+    entry_free(cache, v);
+  }
+  for (i = 0; i < WEB_NENCODINGS; i++)
+    if (made[i] != NULL)
+      entry_free(cache, made[i]);
+}
+
+/* Free e, and let go of its variants (which some thread may still be
+ * sending). */
+static void entry_free(web_cache_t *cache, struct entry *e) {
+  int i;
+
+  for (i = 0; i < WEB_NENCODINGS; i++)
+    if (e->variants[i] != NULL)
+      web_cache_release(cache, &e->variants[i]->pub);
+  if (e->buffer != NULL)
+    free(e->buffer);
+  else if (e->pub.data != NULL && e->pub.size > 0)
+    munmap((void *)e->pub.data, e->pub.size);
+  if (e->pub.fd != -1)
+    close(e->pub.fd);
+  free((char *)e->pub.header);
+  free(e->path);
+  free(e);
+}
@@ -0,0 +1,74 @@
+/*
+ * web_cache.h - A cache of the files under the docroot, shared by all
+ *               of the server's threads.
+ *
+ */
+
+#ifndef WEB_CACHE_H
+#define WEB_CACHE_H 1
+
+#include <sys/types.h>
+#include <time.h>
+
+typedef struct _web_cache web_cache_t;
+
+/* Room for a quoted ETag, and for an HTTP date */
+#define WEB_ETAG_SIZE 40
+#define WEB_DATE_SIZE 32
+
+/* A cached file, or the file compressed. Small files are mapped into
+ * memory (data is non-NULL); bigger ones are kept open instead (fd is
+ * not -1). Either way, the fields don't change while the caller holds
+ * the entry. */
+typedef struct _web_cache_entry {
+  const char *path;      /* of the file, even when compressed */
+  const char *encoding;  /* how it is compressed (Content-Encoding),
+                          * or NULL */
+  int vary;              /* there are (or may be) other encodings */
+  const char *data;      /* the whole file, or NULL */
+  int fd;                /* the open file, or -1 */
+  off_t size;
+  time_t mtime;
+  char etag[WEB_ETAG_SIZE];            /* from the size and mtime */
+  char last_modified[WEB_DATE_SIZE];   /* mtime, as an HTTP date */
+  const char *header;    /* the 200 response's headers, all but the
+                          * Connection header that ends them */
+  size_t header_len;
+} web_cache_entry_t;
+
+/* Formats the headers for entry into buf, returning their length */
+typedef size_t (*web_cache_header_fn)(char *buf, size_t size,
+                                      const web_cache_entry_t *entry);
+
+/* Return a new, empty cache that holds at most budget bytes of files
+ * (their size, and their compressed copies', plus their headers), with
+ * headers formatted by header. Starts a thread to compress files, if
+ * sioux can. */
+web_cache_t *web_cache_create(size_t budget, web_cache_header_fn header);
+
+/* Free a cache. None of its entries may be held. */
+void web_cache_free(web_cache_t *cache);
+
+/* Return the entry for the file at path, loading it if it isn't
+ * cached or has changed since it was. Returns NULL if it can't be
+ * opened, or isn't a regular file. The entry stays valid, even if it
+ * is evicted, until it is passed to web_cache_release. */
+web_cache_entry_t *web_cache_get(web_cache_t *cache, const char *path);
+
+/* Return the best version of entry that is compressed with one of the
+ * encodings in accept (bit 1 << e set for each web_encoding_t e),
+ * in place of entry, which is released. If there is none, returns
+ * entry itself; and if the file is worth compressing, it is queued to
+ * be compressed in the background, for next time. */
+web_cache_entry_t *web_cache_encode(web_cache_t *cache,
+                                    web_cache_entry_t *entry,
+                                    unsigned int accept);
+
+/* Return nonzero if there are files waiting to be compressed, or being
+ * compressed. */
+int web_cache_busy(web_cache_t *cache);
+
+/* Let go of an entry returned by web_cache_get or web_cache_encode. */
+void web_cache_release(web_cache_t *cache, web_cache_entry_t *entry);
+
+#endif /* WEB_CACHE_H */
@@ -0,0 +1,207 @@
+/*
+ * web_compress.c - Compresses files with gzip (zlib) and brotli, when
+ *                  sioux is built with those libraries.
+ *
+ *    Files are compressed once and the result kept, so it is worth
+ *    compressing them harder than a server that compresses every
+ *    response would.
+ *
+ *    The input is fed to the compressor a piece at a time, yielding
+ *    in between. With user-level threads, a timer tick that lands in
+ *    the compression library has to wait for it to return (as for
+ *    libc), so without the yields one thread compressing a big file
+ *    would hold up all the others until it was done.
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define WEB_HAVE_GZIP 1
+#include <zlib.h>
+#endif
+#if defined(HAVE_BROTLI_ENCODE_H) && defined(HAVE_LIBBROTLIENC)
+#define WEB_HAVE_BROTLI 1
+#include <brotli/encode.h>
+#endif
+
+#include <sthread.h>
+
+#include <web_compress.h>
+
+/* How much of the input to compress between yields */
+#define CHUNK_SIZE 16384
+
+/* How hard to compress: the most for gzip. For brotli, a middling
+ * level, with a 256K window and 64K blocks; it compresses the input
+ * fed to it in blocks, and at the highest levels, or with bigger
+ * blocks or window, one call can take tens of milliseconds, for only a
+ * few percent smaller files. */
+#define GZIP_LEVEL 9
+#define BROTLI_QUALITY 7
+#define BROTLI_LGWIN 18
+#define BROTLI_LGBLOCK 16
+
+static const char *const names[WEB_NENCODINGS] = { "br", "gzip" };
+static const char *const suffixes[WEB_NENCODINGS] = { ".br", ".gz" };
+
+#ifdef WEB_HAVE_GZIP
+static char *compress_gzip(const char *data, size_t len, size_t *out_len);
+#endif
+#ifdef WEB_HAVE_BROTLI
+static char *compress_brotli(const char *data, size_t len,
+                             size_t *out_len);
+#endif
+#if defined(WEB_HAVE_GZIP) || defined(WEB_HAVE_BROTLI)
+static char *compress_done(char *out, size_t compressed, size_t len,
+                           size_t *out_len);
+#endif
+
+
+const char *web_encoding_name(web_encoding_t encoding) {
+  return names[encoding];
+}
+
+const char *web_encoding_suffix(web_encoding_t encoding) {
+  return suffixes[encoding];
+}
+
+int web_can_compress(web_encoding_t encoding) {
+  switch (encoding) {
+#ifdef WEB_HAVE_BROTLI
+  case WEB_ENCODING_BR:
+    return 1;
+#endif
+#ifdef WEB_HAVE_GZIP
+  case WEB_ENCODING_GZIP:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+char *web_compress(web_encoding_t encoding, const char *data, size_t len,
+                   size_t *out_len) {
+  switch (encoding) {
+#ifdef WEB_HAVE_BROTLI
+  case WEB_ENCODING_BR:
+    return compress_brotli(data, len, out_len);
+#endif
+#ifdef WEB_HAVE_GZIP
+  case WEB_ENCODING_GZIP:
+    return compress_gzip(data, len, out_len);
+#endif
+  default:
+    return NULL;
+  }
+}
+
+#ifdef WEB_HAVE_GZIP
+static char *compress_gzip(const char *data, size_t len, size_t *out_len) {
+  size_t left = len, chunk;
+  z_stream z;
+  char *out;
+  int ret;
+
+  memset(&z, 0, sizeof(z));
+  /* 16 more bits of window asks for a gzip header, not a zlib one */
+  if (deflateInit2(&z, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+  z.avail_out = deflateBound(&z, len);
+  out = (char *)malloc(z.avail_out);
+  if (out == NULL) {
+    deflateEnd(&z);
+    return NULL;
+  }
+  z.next_out = (Bytef *)out;
+  z.next_in = (Bytef *)data;
+
+  /* With room for all of the output, each call takes all of its input */
+  do {
+    chunk = (left < CHUNK_SIZE) ? left : CHUNK_SIZE;
+    z.avail_in = chunk;
+    left -= chunk;
+    ret = deflate(&z, (left == 0) ? Z_FINISH : Z_NO_FLUSH);
+    sthread_yield();
+  } while (ret == Z_OK && z.avail_in == 0 && left > 0);
+  deflateEnd(&z);
+
+  if (ret != Z_STREAM_END) {
+    free(out);
+    return NULL;
+  }
+  return compress_done(out, z.total_out, len, out_len);
+}
+#endif
+
+#ifdef WEB_HAVE_BROTLI
+static char *compress_brotli(const char *data, size_t len, size_t *out_len) {
+  BrotliEncoderState *state;
+  const uint8_t *next_in = (const uint8_t *)data;
+  size_t left = len, chunk, avail_in, avail_out, size;
+  uint8_t *next_out;
+  char *out;
+  int ok;
+
+  size = BrotliEncoderMaxCompressedSize(len);
+  if (size == 0)
+    return NULL;
+  state = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+  if (state == NULL)
+    return NULL;
+  out = (char *)malloc(size);
+  if (out == NULL) {
+    BrotliEncoderDestroyInstance(state);
+    return NULL;
+  }
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, BROTLI_QUALITY);
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_LGWIN, BROTLI_LGWIN);
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_LGBLOCK, BROTLI_LGBLOCK);
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_SIZE_HINT,
+                            (len < (1u << 30)) ? len : (1u << 30));
+  next_out = (uint8_t *)out;
+  avail_out = size;
+
+  do {
+    chunk = (left < CHUNK_SIZE) ? left : CHUNK_SIZE;
+    avail_in = chunk;
+    left -= chunk;
+    ok = BrotliEncoderCompressStream(state, (left == 0) ?
+                                     BROTLI_OPERATION_FINISH :
+                                     BROTLI_OPERATION_PROCESS,
+                                     &avail_in, &next_in, &avail_out,
+                                     &next_out, NULL);
+    sthread_yield();
+  } while (ok && avail_in == 0 && left > 0);
+  ok = ok && BrotliEncoderIsFinished(state);
+  BrotliEncoderDestroyInstance(state);
+
+  if (!ok) {
+    free(out);
+    return NULL;
+  }
+  return compress_done(out, size - avail_out, len, out_len);
+}
+#endif
+
+#if defined(WEB_HAVE_GZIP) || defined(WEB_HAVE_BROTLI)
+/* Finish with out, which holds compressed bytes of the len bytes of
+ * input: return it, trimmed to fit, or NULL (freeing it) if it isn't
+ * any smaller. */
+static char *compress_done(char *out, size_t compressed, size_t len,
+                           size_t *out_len) {
+  char *trimmed;
+
+  if (compressed >= len) {
+    free(out);
+    return NULL;
+  }
+  trimmed = (char *)realloc(out, compressed);
+  *out_len = compressed;
+  return (trimmed != NULL) ? trimmed : out;
+}
+#endif
@@ -0,0 +1,37 @@
+/*
+ * web_compress.h - The content codings sioux can send files in, and
+ *                  compressing files into them.
+ *
+ */
+
+#ifndef WEB_COMPRESS_H
+#define WEB_COMPRESS_H 1
+
+#include <stddef.h>
+
+/* Best first: brotli files are smaller than gzip ones */
+typedef enum {
+  WEB_ENCODING_BR,
+  WEB_ENCODING_GZIP,
+  WEB_NENCODINGS
+} web_encoding_t;
+
+/* Return encoding's name, as in Accept-Encoding and Content-Encoding */
+const char *web_encoding_name(web_encoding_t encoding);
+
+/* Return the suffix of a file already compressed with encoding (as
+ * "a.css.gz" is a.css compressed with gzip) */
+const char *web_encoding_suffix(web_encoding_t encoding);
+
+/* Return nonzero if sioux was built with the library that compresses
+ * with encoding. */
+int web_can_compress(web_encoding_t encoding);
+
+/* Compress the len bytes at data with encoding, returning the result,
+ * malloc'd, and setting *out_len to its length. Returns NULL if it
+ * can't, or if the result would be no smaller. Yields between pieces of
+ * the input, so that it never holds up the other threads for long. */
+char *web_compress(web_encoding_t encoding, const char *data, size_t len,
+                   size_t *out_len);
+
+#endif /* WEB_COMPRESS_H */
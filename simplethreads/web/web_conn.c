@@ -0,0 +1,1030 @@
+/*
+ * web_conn.c - Handles one connection: reads in each request, parses
+ *              it, and sends the requested file back (or an error
+ *              document).
+ *
+ *    This is written as a state machine, so that it can run on a
+ *    nonblocking socket: web_conn_run does as much as it can, and when
+ *    the socket would block it returns what it is waiting for, to be
+ *    called again once that is ready. On a blocking socket it simply
+ *    runs to the end.
+ *
+ *    Connections are kept open for more requests, which clients may
+ *    pipeline. Files come from the docroot cache (see web_cache.c),
+ *    whole or in ranges, compressed for clients that take that, and
+ *    go out without being copied through user space where the system
+ *    allows; a connection only ever holds its fixed buffers, however
+ *    big the file. Answers may be recorded in the access log (see
+ *    web_log.c).
+ *
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include <sthread.h>
+
+#include <web_cache.h>
+#include <web_compress.h>
+#include <web_conn.h>
+#include <web_log.h>
+#include <web_mime.h>
+#include <web_parse.h>
+
+/* Every http response includes a numeric status code indicating,
+ * to the browser, what the result was. These are the codes we are
+ * interested in.
+ */
+typedef enum _status {
+  STATUS_200_OK = 200,
+  STATUS_206_PARTIAL_CONTENT = 206,
+  STATUS_304_NOT_MODIFIED = 304,
+  STATUS_400_BAD_REQUEST = 400,
+  STATUS_404_NOT_FOUND = 404,
+  STATUS_405_METHOD_NOT_ALLOWED = 405,
+  STATUS_416_RANGE_NOT_SATISFIABLE = 416
+} status_t;
+
+/* Requests really do get this big: */
+#define REQUEST_MAX_SIZE 4096
+
+/* How much of the file to read at a time, when it has to be copied.
+ * Also holds the headers and the whole of an error document. */
+#define BUFFER_SIZE 4096
+
+/* Room for the header of one part of a multipart/byteranges response */
+#define PART_MAX 256
+
+/* How much of the file to splice into the pipe at a time; the default
+ * capacity of a pipe. */
+#define SPLICE_SIZE 65536
+
+/* splice and its flags need _GNU_SOURCE, which configure only defines
+ * on some CPUs. */
+#if defined(HAVE_SPLICE) && defined(SPLICE_F_MOVE)
+#define WEB_HAVE_SPLICE 1
+#endif
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+#ifndef HAVE_SOCKLEN_T
+typedef int socklen_t;
+#endif
+
+static const char SERVER[] = "Sioux/1.0 (Unix)";
+static const char HTTP_VERSION[] = "HTTP/1.1";
+static const char INDEX_FILE[] = "index.html";
+
+/* The end of the headers, for a connection that stays open, and for
+ * one that doesn't */
+static const char KEEP_ALIVE_END[] = "Connection: keep-alive\r\n\r\n";
+static const char CLOSE_END[] = "Connection: close\r\n\r\n";
+
+typedef enum {
+  STATE_READ_REQUEST,  /* reading the request into request */
+  STATE_SEND,          /* sending out, then the rest of file if any */
+  STATE_DONE
+} conn_state_t;
+
+/* How the rest of the file is sent, once the headers are, best first.
+ * (A mapped file doesn't need any of these; it goes out with them.) */
+typedef enum {
+  SEND_SENDFILE,  /* sendfile from the file to the socket */
+  SEND_SPLICE,    /* splice from the file into a pipe, and on to the socket */
+  SEND_COPY       /* read into buf, and write that */
+} send_method_t;
+
+/* The first way to try */
+#if defined(HAVE_SENDFILE)
+#define SEND_FIRST SEND_SENDFILE
+#elif defined(WEB_HAVE_SPLICE)
+#define SEND_FIRST SEND_SPLICE
+#else
+#define SEND_FIRST SEND_COPY
+#endif
+
+/* What one of the ways of sending the file stopped for */
+typedef enum {
+  SENT_ALL,        /* all of the file has been sent */
+  SENT_BLOCKED,    /* the socket would block */
+  SENT_UNSUPPORTED,  /* this method doesn't work here; try the next one */
+  SENT_ERROR
+} send_result_t;
+
+struct _web_conn {
+  int fd;
+  const web_server_t *server;
+  conn_state_t state;
+  int nrequests;               /* requests answered, or being answered */
+  int keep_alive;              /* read another request after this one */
+  int more;                    /* another response follows right away */
+  int malformed;               /* the request couldn't be parsed */
+  size_t request_len;          /* bytes of request read so far */
+  size_t request_end;          /* where the current request ends */
+  web_request_t req;           /* the request, as parsed so far */
+  web_cache_entry_t *entry;    /* file being sent, or NULL */
+  int file;                    /* its fd, or -1 */
+  off_t file_off, file_end;    /* the part of the file left to send */
+  send_method_t method;
+  int pipe[2];                 /* for splice, once it is used */
+  size_t pipe_len;             /* bytes in the pipe */
+  struct iovec out[3];         /* headers, their end, and the body if it
+                                * is in memory; left to send */
+  int out_first, out_count;
+  web_range_t ranges[WEB_MAX_RANGES];  /* the ranges asked for */
+  int nranges;                 /* parts of a multipart response; 0 once
+                                * the last boundary is queued */
+  int next_range;              /* the next part to queue */
+  char boundary[WEB_ETAG_SIZE + 8];  /* between the parts */
+  char part[PART_MAX];         /* the header of the part being sent */
+  int logging;                 /* the response is to be logged */
+  int addr_known;              /* the client's address is in addr */
+  uint32_t addr;
+  web_log_entry_t log;         /* what is logged, once it is sent */
+  char request[REQUEST_MAX_SIZE];
+  char buf[BUFFER_SIZE];
+};
+
+static web_conn_status_t web_read_request(web_conn_t *conn);
+static void web_start_response(web_conn_t *conn);
+static void web_finish_response(web_conn_t *conn);
+static status_t web_parse_request(const web_request_t *req,
+                                  const char *request, char *filename,
+                                  size_t filename_len, const char *docroot,
+                                  int *keep_alive);
+static int web_not_modified(const web_request_t *req, const char *request,
+                            const web_cache_entry_t *entry);
+static unsigned int web_accepted_encodings(const web_request_t *req,
+                                           const char *request);
+static int web_get_ranges(const web_request_t *req, const char *request,
+                          const web_cache_entry_t *entry,
+                          web_range_t *ranges);
+static off_t web_start_ranges(web_conn_t *conn, web_cache_entry_t *entry,
+                              int nranges);
+static int web_queue_range(web_conn_t *conn, const web_range_t *range,
+                           struct iovec *iov);
+static void web_queue_part(web_conn_t *conn);
+static size_t web_format_part(web_conn_t *conn, int i);
+static void web_start_log(web_conn_t *conn, status_t status, off_t length);
+static size_t web_format_headers(char *buf, size_t size, status_t status,
+                                 off_t content_length);
+static size_t web_format_not_modified(char *buf, size_t size,
+                                      const web_cache_entry_t *entry);
+static size_t web_format_encoding(char *buf, size_t size,
+                                  const web_cache_entry_t *entry);
+static const char *web_get_status_string(status_t status);
+static web_conn_status_t web_send_response(web_conn_t *conn);
+static send_result_t web_send_out(web_conn_t *conn);
+static send_result_t web_send_sendfile(web_conn_t *conn);
+static send_result_t web_send_splice(web_conn_t *conn);
+static send_result_t web_send_copy(web_conn_t *conn);
+static size_t web_format_error_doc(char *buf, size_t size, status_t status);
+
+
+web_conn_t *web_conn_create(int fd, const web_server_t *server) {
+  web_conn_t *conn;
+
+  conn = (web_conn_t *)sthread_malloc(sizeof(web_conn_t));
+  if (conn == NULL)
+    return NULL;
+  conn->fd = fd;
+  conn->server = server;
+  conn->state = STATE_READ_REQUEST;
+  conn->nrequests = 0;
+  conn->keep_alive = 0;
+  conn->more = 0;
+  conn->malformed = 0;
+  conn->request_len = 0;
+  conn->request_end = 0;
+  web_parse_init(&conn->req);
+  conn->entry = NULL;
+  conn->file = -1;
+  conn->file_off = conn->file_end = 0;
+  conn->method = SEND_FIRST;
+  conn->pipe[0] = conn->pipe[1] = -1;
+  conn->pipe_len = 0;
+  conn->out[2].iov_base = NULL;
+  conn->out_first = conn->out_count = 0;
+  conn->nranges = 0;
+  conn->next_range = 0;
+  conn->logging = 0;
+  conn->addr_known = 0;
+  return conn;
+}
+
+int web_conn_fd(web_conn_t *conn) {
+  return conn->fd;
+}
+
+void web_conn_free(web_conn_t *conn) {
+  if (conn->entry != NULL)
+    web_cache_release(conn->server->cache, conn->entry);
+  if (conn->pipe[0] >= 0) {
+    close(conn->pipe[0]);
+    close(conn->pipe[1]);
+  }
+  close(conn->fd);
+  sthread_free(conn);
+}
+
+web_conn_status_t web_conn_run(web_conn_t *conn) {
+  web_conn_status_t status;
+
+  for (;;) {
+    switch (conn->state) {
+    case STATE_READ_REQUEST:
+      status = web_read_request(conn);
+      if (status != WEB_CONN_DONE)
+        return status;
+      if (conn->state == STATE_READ_REQUEST)
+        web_start_response(conn);
+      break;
+    case STATE_SEND:
+      status = web_send_response(conn);
+      if (status != WEB_CONN_DONE)
+        return status;
+      web_finish_response(conn);
+      break;
+    case STATE_DONE:
+      return WEB_CONN_DONE;
+    }
+  }
+}
+
+/* Read until conn->request holds a whole request; it may already,
+ * if the client sent it along with the last one. The request is
+ * parsed as it arrives, by the incremental parser in web_parse.c,
+ * straight out of the buffer. Returns
+ * WEB_CONN_DONE once it does, or once it is clear that it is
+ * malformed; or (with conn->state set to STATE_DONE) if the request
+ * can't be read or the client is done. */
+static web_conn_status_t web_read_request(web_conn_t *conn) {
+  size_t size = REQUEST_MAX_SIZE;
+  ssize_t rd;
+
+  for (;;) {
+    switch (web_parse(&conn->req, conn->request, conn->request_len)) {
+    case WEB_PARSE_DONE:
+      conn->request_end = conn->req.end;
+      return WEB_CONN_DONE;
+    case WEB_PARSE_ERROR:
+      conn->malformed = 1;
+      conn->request_end = conn->request_len;
+      return WEB_CONN_DONE;
+    case WEB_PARSE_INCOMPLETE:
+      break;
+    }
+    if (conn->request_len == size) {
+      conn->malformed = 1;
+      conn->request_end = conn->request_len;
+      return WEB_CONN_DONE;
+    }
+
+    rd = read(conn->fd, conn->request + conn->request_len,
+              size - conn->request_len);
+    if (rd == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return WEB_CONN_WANT_READ;
+      perror("sioux: read error");
+      break;
+    }
+    if (rd == 0) {
+      /* End-of-file. Between requests, the client has just finished
+       * with the connection; otherwise it is a bad request. */
+      if (conn->request_len == 0) {
+        conn->state = STATE_DONE;
+        return WEB_CONN_DONE;
+      }
+      break;
+    }
+    conn->request_len += rd;
+  }
+
+  fprintf(stderr, "error reading request\n");
+  conn->state = STATE_DONE;
+  return WEB_CONN_DONE;
+}
+
+/* Parse the request, and queue up the headers and the start of the
+ * response to be sent. Then move on to the next request, in case the
+ * client has sent it already (pipelining): whatever was read past the
+ * end of this one is kept for it, and while it is complete, the end
+ * of this response is sent with MSG_MORE so that the two share
+ * packets. */
+static void web_start_response(web_conn_t *conn) {
+  const web_server_t *server = conn->server;
+  char filename[REQUEST_MAX_SIZE];
+  web_cache_entry_t *entry = NULL;
+  status_t status;
+  off_t length = 0;
+  size_t len;
+  int nranges = -1;
+
+  /* Get the filename out of the request. */
+  if (conn->malformed)
+    status = STATUS_400_BAD_REQUEST;
+  else
+    status = web_parse_request(&conn->req, conn->request, filename,
+                               REQUEST_MAX_SIZE, server->docroot,
+                               &conn->keep_alive);
+
+  /* See if we can find this file, and if the client has it already */
+  if (status == STATUS_200_OK) {
+    entry = web_cache_get(server->cache, filename);
+    if (entry != NULL && entry->vary)
+      entry = web_cache_encode(server->cache, entry,
+                               web_accepted_encodings(&conn->req,
+                                                      conn->request));
+    if (entry == NULL)
+      status = STATUS_404_NOT_FOUND;
+    else if (web_not_modified(&conn->req, conn->request, entry))
+      status = STATUS_304_NOT_MODIFIED;
+    else if ((nranges = web_get_ranges(&conn->req, conn->request, entry,
+                                       conn->ranges)) == 0)
+      status = STATUS_416_RANGE_NOT_SATISFIABLE;
+    else if (nranges > 0)
+      status = STATUS_206_PARTIAL_CONTENT;
+  }
+
+  /* A bad request might not have ended where we think it did */
+  conn->nrequests++;
+  if (status == STATUS_400_BAD_REQUEST ||
+      status == STATUS_405_METHOD_NOT_ALLOWED ||
+      conn->nrequests >= server->max_requests)
+    conn->keep_alive = 0;
+
+  if (status == STATUS_200_OK) {
+    conn->entry = entry;
+    conn->out[0].iov_base = (char *)entry->header;
+    conn->out[0].iov_len = entry->header_len;
+    conn->file = entry->fd;
+    conn->file_end = entry->size;
+    length = entry->size;
+    if (entry->data != NULL) {
+      /* It all goes out with the headers */
+      conn->out[2].iov_base = (char *)entry->data;
+      conn->out[2].iov_len = entry->size;
+      conn->file_off = entry->size;
+    }
+  } else if (status == STATUS_206_PARTIAL_CONTENT) {
+    length = web_start_ranges(conn, entry, nranges);
+  } else if (status == STATUS_304_NOT_MODIFIED) {
+    conn->entry = entry;
+    conn->out[0].iov_base = conn->buf;
+    conn->out[0].iov_len = web_format_not_modified(conn->buf, BUFFER_SIZE,
+                                                   entry);
+  } else {
+    len = web_format_error_doc(conn->buf + BUFFER_SIZE / 2,
+                               BUFFER_SIZE / 2, status);
+    length = len;
+    conn->out[2].iov_base = conn->buf + BUFFER_SIZE / 2;
+    conn->out[2].iov_len = len;
+    conn->out[0].iov_base = conn->buf;
+    conn->out[0].iov_len = web_format_headers(conn->buf, BUFFER_SIZE / 2,
+                                              status, len);
+    if (status == STATUS_416_RANGE_NOT_SATISFIABLE) {
+      /* Say how big the file is, so the client can ask again */
+      conn->out[0].iov_len +=
+          snprintf(conn->buf + conn->out[0].iov_len,
+                   BUFFER_SIZE / 2 - conn->out[0].iov_len,
+                   "Content-Range: bytes */%lld\r\n",
+                   (long long)entry->size);
+      conn->entry = entry;
+    }
+  }
+  if (conn->keep_alive) {
+    conn->out[1].iov_base = (char *)KEEP_ALIVE_END;
+    conn->out[1].iov_len = strlen(KEEP_ALIVE_END);
+  } else {
+    conn->out[1].iov_base = (char *)CLOSE_END;
+    conn->out[1].iov_len = strlen(CLOSE_END);
+  }
+  conn->out_first = 0;
+  conn->out_count = (conn->out[2].iov_base != NULL) ? 3 : 2;
+  conn->state = STATE_SEND;
+  conn->logging = server->log != NULL && web_log_sample(server->log);
+  if (conn->logging)
+    web_start_log(conn, status, length);
+
+  /* Nothing refers to the request any more; start on the next one */
+  conn->request_len -= conn->request_end;
+  memmove(conn->request, conn->request + conn->request_end,
+          conn->request_len);
+  conn->request_end = 0;
+  web_parse_init(&conn->req);
+  conn->more = conn->keep_alive &&
+      web_parse(&conn->req, conn->request, conn->request_len) ==
+      WEB_PARSE_DONE;
+}
+
+/* Once a response is sent, log it, drop the request, and either go
+ * on to the next one or finish. The connection is kept open unless
+ * the client asked otherwise, the server's limit on requests per
+ * connection was reached, or the request was so malformed that where
+ * the next one starts is unknown. */
+static void web_finish_response(web_conn_t *conn) {
+  if (conn->logging) {
+    conn->log.rec.duration = web_log_now() - conn->log.rec.time;
+    web_log_request(conn->server->log, &conn->log);
+    conn->logging = 0;
+  }
+  if (conn->entry != NULL) {
+    web_cache_release(conn->server->cache, conn->entry);
+    conn->entry = NULL;
+  }
+  if (!conn->keep_alive) {
+    conn->state = STATE_DONE;
+    return;
+  }
+
+  conn->file = -1;
+  conn->file_off = conn->file_end = 0;
+  conn->out[2].iov_base = NULL;
+  conn->state = STATE_READ_REQUEST;
+}
+
+/* Work out the actual filename to be fetched from disk from a parsed
+ * request, and whether the client wants the connection kept open */
+static status_t web_parse_request(const web_request_t *req, const char *request,
+                                  char *filename, size_t filename_len,
+                                  const char *docroot, int *keep_alive) {
+  const char *target = request + req->target.off, *slash;
+  size_t len = req->target.len;
+  web_span_t value;
+  int i;
+
+  /* HTTP/1.1 connections stay open unless the client says otherwise;
+   * older ones only if it asks */
+  *keep_alive = web_span_is(request, req->version, "HTTP/1.1", 0);
+  i = web_parse_header(req, request, "Connection");
+  if (i != -1) {
+    value = req->values[i];
+    if (value.len >= strlen("close") &&
+        strncasecmp(request + value.off, "close", strlen("close")) == 0)
+      *keep_alive = 0;
+    else if (value.len >= strlen("keep-alive") &&
+             strncasecmp(request + value.off, "keep-alive",
+                         strlen("keep-alive")) == 0)
+      *keep_alive = 1;
+  }
+
+  if (!web_span_is(request, req->method, "GET", 0))
+    /* We only support GET requests
+     * (not POST, nor any of the stranger types) */
+    return STATUS_405_METHOD_NOT_ALLOWED;
+
+  /* Requests may or may not include "http://servername:port/";
+   * if they do, take it off here. */
+  if (len >= strlen("http://") &&
+      strncmp(target, "http://", strlen("http://")) == 0) {
+    slash = memchr(target + strlen("http://"), '/',
+                   len - strlen("http://"));
+    if (slash == NULL)
+      return STATUS_400_BAD_REQUEST;
+    len -= slash - target;
+    target = slash;
+  }
+  if (target[0] != '/')
+    return STATUS_400_BAD_REQUEST;
+
+  /* If filename ends in '/', tack on the "index.html"
+   * This is a poor heuristic - should really check if the filename
+   * is a directory. */
+  snprintf(filename, filename_len, "%s%.*s%s", docroot, (int)len, target,
+           target[len - 1] == '/' ? INDEX_FILE : "");
+
+  return STATUS_200_OK;
+}
+
+/* Return nonzero if the client already has this version of the file:
+ * if the request's If-None-Match lists the entry's ETag, or else if
+ * its If-Modified-Since is the file's Last-Modified date. As with
+ * nginx, the date has to be exactly the file's; a client could only
+ * have some other date from some other server. */
+static int web_not_modified(const web_request_t *req, const char *request,
+                            const web_cache_entry_t *entry) {
+  int i;
+
+  i = web_parse_header(req, request, "If-None-Match");
+  if (i != -1)
+    return web_parse_etag_listed(request + req->values[i].off,
+                                 req->values[i].len, entry->etag);
+  i = web_parse_header(req, request, "If-Modified-Since");
+  if (i != -1)
+    return web_span_is(request, req->values[i], entry->last_modified, 0);
+  return 0;
+}
+
+/* Return the encodings that the request's Accept-Encoding allows, as
+ * a bit 1 << e for each web_encoding_t e. Of those the cache has the
+ * file in, brotli is sent if allowed, and gzip otherwise. */
+static unsigned int web_accepted_encodings(const web_request_t *req,
+                                           const char *request) {
+  unsigned int accept = 0;
+  web_encoding_t e;
+  int i;
+
+  i = web_parse_header(req, request, "Accept-Encoding");
+  if (i == -1)
+    return 0;
+  for (e = 0; e < WEB_NENCODINGS; e++)
+    if (web_parse_accepts(request + req->values[i].off, req->values[i].len,
+                          web_encoding_name(e)))
+      accept |= 1u << e;
+  return accept;
+}
+
+/* Parse the request's Range header, if it has one, into ranges of
+ * entry's file. Returns how many there are (0 if none of them are in
+ * the file), or -1 if the whole file should be sent: if there is no
+ * Range, it is malformed, or the file isn't the one named by If-Range.
+ * Like the ETag in If-None-Match, the If-Range date has to be exactly
+ * the file's; and a weak ETag never matches. */
+static int web_get_ranges(const web_request_t *req, const char *request,
+                          const web_cache_entry_t *entry, web_range_t *ranges) {
+  int i;
+
+  i = web_parse_header(req, request, "If-Range");
+  if (i != -1 &&
+      !web_span_is(request, req->values[i],
+                   request[req->values[i].off] == '"' ?
+                   entry->etag : entry->last_modified, 0))
+    return -1;
+  i = web_parse_header(req, request, "Range");
+  if (i == -1)
+    return -1;
+  return web_parse_range(request + req->values[i].off, req->values[i].len,
+                         entry->size, ranges);
+}
+
+/* Queue up the headers of a 206 response with the first nranges of
+ * conn->ranges in entry's file, and if there is just one range, the
+ * bytes in it. Several ranges make a multipart/byteranges response,
+ * whose parts are queued one at a time, as each is sent: a part's
+ * header, then its bytes, straight from the file like any other.
+ * Returns the length of the body. */
+static off_t web_start_ranges(web_conn_t *conn, web_cache_entry_t *entry,
+                              int nranges) {
+  const web_range_t *range = &conn->ranges[0];
+  off_t length;
+  int i, len;
+
+  conn->entry = entry;
+  conn->file = entry->fd;
+  if (nranges == 1) {
+    len = snprintf(conn->buf, BUFFER_SIZE,
+                   "%s %d %s\r\n"
+                   "Server: %s\r\n"
+                   "Content-Type: %s\r\n"
+                   "Content-Length: %lld\r\n"
+                   "Content-Range: bytes %lld-%lld/%lld\r\n"
+                   "Last-Modified: %s\r\n"
+                   "ETag: %s\r\n",
+                   HTTP_VERSION, STATUS_206_PARTIAL_CONTENT,
+                   web_get_status_string(STATUS_206_PARTIAL_CONTENT), SERVER,
+                   web_mime_type(entry->path),
+                   (long long)(range->last - range->first + 1),
+                   (long long)range->first, (long long)range->last,
+                   (long long)entry->size, entry->last_modified,
+                   entry->etag);
+    assert(len > 0 && len < BUFFER_SIZE);
+    len += web_format_encoding(conn->buf + len, BUFFER_SIZE - len, entry);
+    web_queue_range(conn, range, &conn->out[2]);
+    length = range->last - range->first + 1;
+  } else {
+    /* The boundary mustn't turn up in the parts; the ETag makes it
+     * unlikely to be in the file */
+    snprintf(conn->boundary, sizeof(conn->boundary), "sioux-%.*s",
+             (int)strlen(entry->etag) - 2, entry->etag + 1);
+    conn->nranges = nranges;
+    conn->next_range = 0;
+    length = 0;
+    for (i = 0; i <= nranges; i++) {
+      length += web_format_part(conn, i);
+      if (i < nranges)
+        length += conn->ranges[i].last - conn->ranges[i].first + 1;
+    }
+    len = snprintf(conn->buf, BUFFER_SIZE,
+                   "%s %d %s\r\n"
+                   "Server: %s\r\n"
+                   "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                   "Content-Length: %lld\r\n"
+                   "Last-Modified: %s\r\n"
+                   "ETag: %s\r\n",
+                   HTTP_VERSION, STATUS_206_PARTIAL_CONTENT,
+                   web_get_status_string(STATUS_206_PARTIAL_CONTENT), SERVER,
+                   conn->boundary, (long long)length, entry->last_modified,
+                   entry->etag);
+    assert(len > 0 && len < BUFFER_SIZE);
+    len += web_format_encoding(conn->buf + len, BUFFER_SIZE - len, entry);
+  }
+  conn->out[0].iov_base = conn->buf;
+  conn->out[0].iov_len = len;
+  return length;
+}
+
+/* Set up range of the file to be sent: into iov if the file is in
+ * memory (returning nonzero), otherwise as the part of the file left
+ * to send. */
+static int web_queue_range(web_conn_t *conn, const web_range_t *range,
+                           struct iovec *iov) {
+  if (conn->entry->data != NULL) {
+    iov->iov_base = (char *)conn->entry->data + range->first;
+    iov->iov_len = range->last - range->first + 1;
+    return 1;
+  }
+  conn->file_off = range->first;
+  conn->file_end = range->last + 1;
+  return 0;
+}
+
+/* Queue up the next part of a multipart response: its header and its
+ * range of the file, or after the last, the closing boundary. */
+static void web_queue_part(web_conn_t *conn) {
+  conn->out[0].iov_base = conn->part;
+  conn->out[0].iov_len = web_format_part(conn, conn->next_range);
+  conn->out_first = 0;
+  conn->out_count = 1;
+  if (conn->next_range == conn->nranges) {
+    conn->nranges = 0;
+    return;
+  }
+  if (web_queue_range(conn, &conn->ranges[conn->next_range], &conn->out[1]))
+    conn->out_count = 2;
+  conn->next_range++;
+}
+
+/* Format the header of part i of a multipart response into conn->part,
+ * or if i is past the last, the closing boundary, returning its
+ * length. */
+static size_t web_format_part(web_conn_t *conn, int i) {
+  int len;
+
+  if (i == conn->nranges)
+    len = snprintf(conn->part, PART_MAX, "\r\n--%s--\r\n", conn->boundary);
+  else
+    len = snprintf(conn->part, PART_MAX,
+                   "\r\n--%s\r\n"
+                   "Content-Type: %s\r\n"
+                   "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                   conn->boundary, web_mime_type(conn->entry->path),
+                   (long long)conn->ranges[i].first,
+                   (long long)conn->ranges[i].last,
+                   (long long)conn->entry->size);
+  assert(len > 0 && len < PART_MAX);
+  return len;
+}
+
+/* Fill in conn->log for the request just answered, with status and a
+ * body of length bytes, while the request is still there to copy from;
+ * web_finish_response logs it once the response is sent. The client's
+ * address is only looked up for the first request on the connection
+ * that is logged. */
+static void web_start_log(web_conn_t *conn, status_t status, off_t length) {
+  web_log_record_t *rec = &conn->log.rec;
+  const web_request_t *req = &conn->req;
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  size_t len;
+
+  if (!conn->addr_known) {
+    conn->addr = 0;
+    if (getpeername(conn->fd, (struct sockaddr *)&addr, &addr_len) == 0 &&
+        addr.sin_family == AF_INET)
+      conn->addr = addr.sin_addr.s_addr;
+    conn->addr_known = 1;
+  }
+
+  rec->time = web_log_now();
+  rec->bytes = length;
+  rec->duration = 0;
+  rec->addr = conn->addr;
+  rec->status = status;
+  rec->path_len = 0;
+  memset(rec->method, 0, sizeof(rec->method));
+  /* A malformed request might not have a method or target */
+  if (conn->malformed)
+    return;
+  len = req->method.len < sizeof(rec->method) ? req->method.len
+                                               : sizeof(rec->method);
+  memcpy(rec->method, conn->request + req->method.off, len);
+  len = req->target.len < WEB_LOG_PATH_MAX ? req->target.len
+                                           : WEB_LOG_PATH_MAX;
+  memcpy(conn->log.path, conn->request + req->target.off, len);
+  rec->path_len = len;
+}
+
+/* Every http response must begin with a set of headers, indicating
+ * at least the version of the protocol and code for what happened.
+ * Formats all of them but the Connection header (which ends them) into
+ * buf, returning their length.
+ */
+static size_t web_format_headers(char *buf, size_t size, status_t status,
+                                 off_t content_length) {
+  int len;
+
+  len = snprintf(buf, size,
+                 "%s %d %s\r\n"
+                 "Server: %s\r\n"
+                 "Content-Type: text/html\r\n"
+                 "Content-Length: %lld\r\n",
+                 HTTP_VERSION, status, web_get_status_string(status),
+                 SERVER, (long long)content_length);
+  assert(len > 0 && (size_t)len < size);
+  return len;
+}
+
+size_t web_conn_file_headers(char *buf, size_t size,
+                             const web_cache_entry_t *entry) {
+  int len;
+
+  len = snprintf(buf, size,
+                 "%s %d %s\r\n"
+                 "Server: %s\r\n"
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %lld\r\n"
+                 "Last-Modified: %s\r\n"
+                 "ETag: %s\r\n"
+                 "Accept-Ranges: bytes\r\n",
+                 HTTP_VERSION, STATUS_200_OK,
+                 web_get_status_string(STATUS_200_OK), SERVER,
+                 web_mime_type(entry->path), (long long)entry->size,
+                 entry->last_modified, entry->etag);
+  assert(len > 0 && (size_t)len < size);
+  return len + web_format_encoding(buf + len, size - len, entry);
+}
+
+/* Format the headers of a 304 response for entry into buf, returning
+ * their length; all but the Connection header, as for any other. */
+static size_t web_format_not_modified(char *buf, size_t size,
+                                      const web_cache_entry_t *entry) {
+  int len;
+
+  len = snprintf(buf, size,
+                 "%s %d %s\r\n"
+                 "Server: %s\r\n"
+                 "Last-Modified: %s\r\n"
+                 "ETag: %s\r\n",
+                 HTTP_VERSION, STATUS_304_NOT_MODIFIED,
+                 web_get_status_string(STATUS_304_NOT_MODIFIED), SERVER,
+                 entry->last_modified, entry->etag);
+  assert(len > 0 && (size_t)len < size);
+  if (entry->vary)
+    len += snprintf(buf + len, size - len, "Vary: Accept-Encoding\r\n");
+  assert((size_t)len < size);
+  return len;
+}
+
+/* Format the headers saying how entry is compressed, and whether it
+ * comes in other encodings, into buf, returning their length (0 if it
+ * is neither). */
+static size_t web_format_encoding(char *buf, size_t size,
+                                  const web_cache_entry_t *entry) {
+  int len = 0;
+
+  if (entry->encoding != NULL)
+    len += snprintf(buf, size, "Content-Encoding: %s\r\n", entry->encoding);
+  if (entry->vary)
+    len += snprintf(buf + len, size - len, "Vary: Accept-Encoding\r\n");
+  assert(len >= 0 && (size_t)len < size);
+  return len;
+}
+
+/* Send what is queued in conn->out, then the rest of the file (if
+ * any), each way in turn until one works; and so on for each part of
+ * a multipart response. A small file is mapped by the cache, and goes
+ * out with the headers in conn->out; anything else goes by sendfile,
+ * by splice, or as a last resort copied through conn->buf, with the
+ * headers sent ahead of it with MSG_MORE. Nothing more is read while
+ * the socket is full, so the file goes out only as fast as the client
+ * takes it. Returns WEB_CONN_DONE once everything is sent, or (with
+ * the connection not to be kept) on error. */
+static web_conn_status_t web_send_response(web_conn_t *conn) {
+  send_result_t result;
+
+  result = web_send_out(conn);
+  while (result == SENT_ALL) {
+    if (conn->file_off == conn->file_end && conn->pipe_len == 0) {
+      if (conn->nranges == 0)
+        break;
+      web_queue_part(conn);
+      result = web_send_out(conn);
+      continue;
+    }
+    switch (conn->method) {
+    case SEND_SENDFILE:
+      result = web_send_sendfile(conn);
+      break;
+    case SEND_SPLICE:
+      result = web_send_splice(conn);
+      break;
+    case SEND_COPY:
+      result = web_send_copy(conn);
+      break;
+    }
+    if (result == SENT_UNSUPPORTED) {
+      conn->method++;  /* copying always works */
+      result = SENT_ALL;
+    }
+  }
+
+  if (result == SENT_BLOCKED)
+    return WEB_CONN_WANT_WRITE;
+  if (result == SENT_ERROR) {
+    fprintf(stderr, "error sending file\n");
+    conn->keep_alive = 0;
+  }
+  return WEB_CONN_DONE;
+}
+
+/* Send the rest of conn->out in one go. If more of the file, another
+ * part, or another response follows, tell the kernel so, so that it
+ * doesn't send a short packet. */
+static send_result_t web_send_out(web_conn_t *conn) {
+  struct msghdr msg;
+  struct iovec *iov;
+  ssize_t count;
+  int flags;
+
+  flags = (conn->file_off < conn->file_end || conn->nranges > 0 ||
+           conn->more) ? MSG_MORE : 0;
+  memset(&msg, 0, sizeof(msg));
+  while (conn->out_count > 0) {
+    msg.msg_iov = &conn->out[conn->out_first];
+    msg.msg_iovlen = conn->out_count;
+    count = sendmsg(conn->fd, &msg, flags);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return SENT_BLOCKED;
+      return SENT_ERROR;
+    }
+    while (conn->out_count > 0) {
+      iov = &conn->out[conn->out_first];
+      if ((size_t)count < iov->iov_len) {
+        iov->iov_base = (char *)iov->iov_base + count;
+        iov->iov_len -= count;
+        break;
+      }
+      count -= iov->iov_len;
+      conn->out_first++;
+      conn->out_count--;
+    }
+  }
+  return SENT_ALL;
+}
+
+/* Send the rest of the file with sendfile, straight from the page
+ * cache to the socket. */
+static send_result_t web_send_sendfile(web_conn_t *conn) {
+#ifdef HAVE_SENDFILE
+  ssize_t count;
+
+  while (conn->file_off < conn->file_end) {
+    count = sendfile(conn->fd, conn->file, &conn->file_off,
+                     conn->file_end - conn->file_off);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return SENT_BLOCKED;
+      if (errno == EINVAL || errno == ENOSYS)
+        return SENT_UNSUPPORTED;
+      return SENT_ERROR;
+    }
+    if (count == 0)
+      return SENT_ERROR;  /* the file got shorter */
+  }
+  return SENT_ALL;
+#else
+  return SENT_UNSUPPORTED;
+#endif
+}
+
+/* Send the rest of the file by splicing it into a pipe, and from the
+ * pipe to the socket; the pages move by reference. */
+static send_result_t web_send_splice(web_conn_t *conn) {
+#ifdef WEB_HAVE_SPLICE
+  unsigned int flags;
+  ssize_t count;
+
+  if (conn->pipe[0] == -1 && pipe(conn->pipe) == -1)
+    return SENT_UNSUPPORTED;
+
+  while (conn->pipe_len > 0 || conn->file_off < conn->file_end) {
+    if (conn->pipe_len == 0) {
+      count = splice(conn->file, &conn->file_off, conn->pipe[1], NULL,
+                     conn->file_end - conn->file_off < SPLICE_SIZE ?
+                     conn->file_end - conn->file_off : SPLICE_SIZE,
+                     SPLICE_F_MOVE);
+      if (count == -1) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EINVAL || errno == ENOSYS)
+          return SENT_UNSUPPORTED;
+        return SENT_ERROR;
+      }
+      if (count == 0)
+        return SENT_ERROR;  /* the file got shorter */
+      conn->pipe_len = count;
+    }
+
+    flags = SPLICE_F_MOVE;
+    if (conn->file_off < conn->file_end || conn->nranges > 0 || conn->more)
+      flags |= SPLICE_F_MORE;
+    count = splice(conn->pipe[0], NULL, conn->fd, NULL, conn->pipe_len,
+                   flags);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return SENT_BLOCKED;
+      return SENT_ERROR;
+    }
+    conn->pipe_len -= count;
+  }
+  return SENT_ALL;
+#else
+  return SENT_UNSUPPORTED;
+#endif
+}
+/* Send the rest of the file a buffer at a time, copying it through
+ * conn->buf. */
+static send_result_t web_send_copy(web_conn_t *conn) {
+  send_result_t result;
+  ssize_t count;
+
+  for (;;) {
+    result = web_send_out(conn);
+    if (result != SENT_ALL || conn->file_off == conn->file_end)
+      return result;
+    do {
+      count = pread(conn->file, conn->buf,
+                    conn->file_end - conn->file_off < BUFFER_SIZE ?
+                    conn->file_end - conn->file_off : BUFFER_SIZE,
+                    conn->file_off);
+    } while (count == -1 && errno == EINTR);
+    if (count <= 0)
+      return SENT_ERROR;
+    conn->file_off += count;
+    conn->out[0].iov_base = conn->buf;
+    conn->out[0].iov_len = count;
+    conn->out_first = 0;
+    conn->out_count = 1;
+  }
+}
+
+/* Format an html document describing the error that occurred into
+ * buf, returning its length. */
+static size_t web_format_error_doc(char *buf, size_t size, status_t status) {
+  int len;
+
+  len = snprintf(buf, size,
+                 "<html><head><title>Error %d</title></head>\n"
+                 "<body><h1>Error %d: %s</h1></body></html>\n",
+                 status, status, web_get_status_string(status));
+  assert(len > 0 && (size_t)len < size);
+  return len;
+}
+
+/* Each status number has an associated string. Return it. */
+static const char *web_get_status_string(status_t status) {
+  switch (status) {
+  case STATUS_200_OK:
+    return "OK";
+  case STATUS_206_PARTIAL_CONTENT:
+    return "Partial Content";
+  case STATUS_304_NOT_MODIFIED:
+    return "Not Modified";
+  case STATUS_400_BAD_REQUEST:
+    return "Bad Request";
+  case STATUS_404_NOT_FOUND:
+    return "Not Found";
+  case STATUS_405_METHOD_NOT_ALLOWED:
+    return "Method Not Allowed";
+  case STATUS_416_RANGE_NOT_SATISFIABLE:
+    return "Range Not Satisfiable";
+  }
+  abort();
+  return NULL;
+}
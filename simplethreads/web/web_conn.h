@@ -0,0 +1,56 @@
+/*
+ * web_conn.h - One HTTP connection, handled as a state machine that
+ *              never blocks on a nonblocking socket.
+ *
+ */
+
+#ifndef WEB_CONN_H
+#define WEB_CONN_H 1
+
+#include <stddef.h>
+
+#include <web_cache.h>
+#include <web_log.h>
+
+typedef struct _web_conn web_conn_t;
+
+/* What every connection needs to know about the server */
+typedef struct {
+  const char *docroot;   /* where the files are */
+  web_cache_t *cache;    /* cache of the files */
+  int max_requests;      /* requests answered on one connection before it
+                          * is closed; 1 closes it after each */
+  int timeout;           /* seconds to wait for a client before giving
+                          * up on its connection (up to whoever drives
+                          * web_conn_run) */
+  web_log_t *log;        /* the access log, or NULL */
+} web_server_t;
+
+/* What web_conn_run stopped for */
+typedef enum {
+  WEB_CONN_WANT_READ,   /* run again once the socket is readable */
+  WEB_CONN_WANT_WRITE,  /* run again once the socket is writable */
+  WEB_CONN_DONE         /* finished; free the connection */
+} web_conn_status_t;
+
+/* Start handling the accepted socket fd for server. Returns NULL if
+ * out of memory. */
+web_conn_t *web_conn_create(int fd, const web_server_t *server);
+
+/* Read requests and send the responses, as far as possible without
+ * blocking, until the connection is finished with. On a blocking
+ * socket this only returns WEB_CONN_DONE. */
+web_conn_status_t web_conn_run(web_conn_t *conn);
+
+/* Return the connection's socket */
+int web_conn_fd(web_conn_t *conn);
+
+/* Close the connection's socket and free it. */
+void web_conn_free(web_conn_t *conn);
+
+/* Format the headers sent with a cached file; the web_cache_header_fn
+ * to create the cache with. */
+size_t web_conn_file_headers(char *buf, size_t size,
+                             const web_cache_entry_t *entry);
+
+#endif /* WEB_CONN_H */
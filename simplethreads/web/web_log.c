@@ -0,0 +1,553 @@
+/*
+ * web_log.c - The access log.
+ *
+ *    Each thread that answers requests logs them into a ring of its
+ *    own, which nothing but that thread adds to and nothing but the
+ *    writer thread takes from, so logging a request takes no lock and
+ *    no system call: it is a copy into the ring and a barrier. The
+ *    records are packed into the ring one after another, just as they
+ *    are laid out in a binary log, so a thread's records share cache
+ *    lines, and the writer writes a binary log straight out of the
+ *    rings, with an iovec or two for each. Text lines are formatted
+ *    into a buffer first, by the writer, off the threads answering
+ *    requests. Either way, all that has piled up in the rings goes out
+ *    in one writev.
+ *
+ *    The writer doesn't poll: once the rings are empty it sleeps, and
+ *    the next thread to log a request wakes it. Once woken, it waits a
+ *    while between batches, so that under load each batch holds many
+ *    records, and threads logging them hardly ever have to wake it;
+ *    under so much load that a ring would fill up in that while, it
+ *    doesn't wait at all.
+ *
+ *    If the writer falls so far behind that a thread's ring fills up,
+ *    that thread's records are dropped, rather than the thread being
+ *    held up, and the writer reports how many (at most once a second).
+ *
+ *    A thread's ring is made the first time it logs something, and
+ *    kept until the log is freed.
+ *
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sthread.h>
+
+#include <web_log.h>
+
+/* Bytes in each thread's ring; a power of two, and a multiple of
+ * WEB_LOG_ALIGN */
+#define RING_SIZE 262144
+#define RING_MASK (RING_SIZE - 1)
+
+/* Keeps what each side of a ring writes to on its own cache line */
+#define CACHE_LINE 64
+
+/* How long the writer waits between batches, in microseconds; unless a
+ * ring is half full, in which case it goes straight on to the next */
+#define BATCH_INTERVAL 10000
+#define BATCH_FULL (RING_SIZE / 2)
+
+/* Text lines are formatted into a buffer this big, which is written
+ * out when there isn't room for the longest line */
+#define TEXT_SIZE 65536
+#define LINE_MAX_SIZE \
+  ((WEB_LOG_PATH_MAX + sizeof(((web_log_record_t *)0)->method)) * 4 + 128)
+
+/* The length of a record with a target of path_len bytes */
+#define RECORD_SIZE(path_len) \
+  (sizeof(web_log_record_t) + \
+   (((path_len) + WEB_LOG_ALIGN - 1) & ~(WEB_LOG_ALIGN - 1)))
+
+/* What the writer found in the rings */
+typedef enum {
+  DRAINED_NOTHING,
+  DRAINED_SOME,
+  DRAINED_BEHIND   /* a ring was filling up */
+} drained_t;
+
+struct ring {
+  /* Written by the ring's thread */
+  volatile unsigned long head;   /* bytes ever added */
+  unsigned long seen;            /* requests since the last sampled */
+  unsigned long dropped;         /* records that didn't fit */
+  char pad[CACHE_LINE];
+  /* Written by the writer */
+  volatile unsigned long tail;   /* bytes written out, and so free */
+  unsigned long taken;           /* bytes in the batch being written */
+  struct ring *next;
+  char pad2[CACHE_LINE];
+  char bytes[RING_SIZE];
+};
+
+struct _web_log {
+  int fd;
+  web_log_format_t format;
+  int sample;
+  sthread_key_t key;             /* each thread's ring */
+  struct ring *volatile rings;   /* all of them, newest first */
+  sthread_mutex_t lock;
+  sthread_cond_t ready;          /* the writer has something to write */
+  volatile int asleep;           /* the writer is waiting for it */
+  int stopping;
+  sthread_t writer;
+
+  /* The writer's */
+  unsigned long dropped;         /* drops reported so far */
+  time_t reported;               /* when they last were */
+  struct iovec *iov;             /* two for each ring, for binary */
+  int niov, max_iov;
+  char *text;
+  size_t text_len;
+  web_log_entry_t entry;         /* the record being formatted */
+  time_t date_time;              /* the second date is for */
+  char date[48];
+  size_t date_len;
+};
+
+static struct ring *log_ring(web_log_t *log);
+static void ring_put(struct ring *ring, unsigned long off, const void *src,
+                     size_t len);
+static void ring_get(struct ring *ring, unsigned long off, void *dst,
+                     size_t len);
+static void *writer_main(void *arg);
+static drained_t log_drain(web_log_t *log);
+static int log_pending(web_log_t *log);
+static void log_pause(void);
+static void log_take(web_log_t *log, struct ring *ring, unsigned long head);
+static void log_flush(web_log_t *log);
+static size_t log_format(web_log_t *log, char *buf,
+                         const web_log_entry_t *entry);
+static char *put_escaped(char *p, const char *s, size_t len);
+static char *put_number(char *p, unsigned long long n);
+
+
+web_log_t *web_log_create(const char *path, web_log_format_t format,
+                          int sample) {
+  web_log_t *log;
+  int fd;
+
+  if (strcmp(path, "-") == 0)
+    fd = STDOUT_FILENO;
+  else
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "sioux: can't open access log %s: %s\n", path,
+            strerror(errno));
+    return NULL;
+  }
+  if (format == WEB_LOG_BINARY && lseek(fd, 0, SEEK_END) == 0 &&
+      write(fd, WEB_LOG_MAGIC, strlen(WEB_LOG_MAGIC)) == -1) {
+    fprintf(stderr, "sioux: can't write access log %s: %s\n", path,
+            strerror(errno));
+    if (fd != STDOUT_FILENO)
+      close(fd);
+    return NULL;
+  }
+
+  log = (web_log_t *)calloc(1, sizeof(web_log_t));
+  assert(log != NULL);
+  log->fd = fd;
+  log->format = format;
+  log->sample = (sample > 1) ? sample : 1;
+  log->key = sthread_key_create(NULL);
+  assert(log->key != -1);
+  log->lock = sthread_mutex_init();
+  log->ready = sthread_cond_init();
+  log->date_time = -1;
+  if (format == WEB_LOG_TEXT) {
+    log->text = (char *)malloc(TEXT_SIZE);
+    assert(log->text != NULL);
+  }
+  log->writer = sthread_create(writer_main, log, 1);
+  assert(log->writer != NULL);
+  return log;
+}
+
+void web_log_free(web_log_t *log) {
+  struct ring *ring;
+
+  sthread_mutex_lock(log->lock);
+  log->stopping = 1;
+  sthread_cond_signal(log->ready);
+  sthread_mutex_unlock(log->lock);
+  sthread_join(log->writer);
+
+  while ((ring = log->rings) != NULL) {
+    log->rings = ring->next;
+    free(ring);
+  }
+  sthread_cond_free(log->ready);
+  sthread_mutex_free(log->lock);
+  if (log->fd != STDOUT_FILENO)
+    close(log->fd);
+  free(log->iov);
+  free(log->text);
+  free(log);
+}
+
+int web_log_sample(web_log_t *log) {
+  struct ring *ring;
+
+  if (log->sample == 1)
+    return 1;
+  ring = log_ring(log);
+  if (ring == NULL || ++ring->seen < (unsigned long)log->sample)
+    return 0;
+  ring->seen = 0;
+  return 1;
+}
+
+void web_log_request(web_log_t *log, const web_log_entry_t *entry) {
+  static const char zeros[WEB_LOG_ALIGN];
+  struct ring *ring = log_ring(log);
+  size_t len = sizeof(entry->rec) + entry->rec.path_len;
+  size_t size = RECORD_SIZE(entry->rec.path_len);
+  unsigned long head;
+
+  if (ring == NULL)
+    return;
+  head = ring->head;
+  if (RING_SIZE - (head - ring->tail) < size) {
+    ring->dropped++;
+    return;
+  }
+  ring_put(ring, head, entry, len);
+  ring_put(ring, head + len, zeros, size - len);
+
+  /* The record has to be in place before the writer can see that it
+   * is; and this thread has to see whether the writer has gone to
+   * sleep only after that, or the writer could sleep on it. */
+  __sync_synchronize();
+  ring->head = head + size;
+  __sync_synchronize();
+  if (log->asleep && __sync_bool_compare_and_swap(&log->asleep, 1, 0)) {
+    sthread_mutex_lock(log->lock);
+    sthread_cond_signal(log->ready);
+    sthread_mutex_unlock(log->lock);
+  }
+}
+
+int web_log_busy(web_log_t *log) {
+  return log_pending(log);
+}
+
+uint64_t web_log_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Return the calling thread's ring, making it if it has none, or NULL
+ * if out of memory. */
+static struct ring *log_ring(web_log_t *log) {
+  struct ring *ring;
+
+  ring = (struct ring *)sthread_getspecific(log->key);
+  if (ring != NULL)
+    return ring;
+  ring = (struct ring *)calloc(1, sizeof(struct ring));
+  if (ring == NULL)
+    return NULL;
+  sthread_mutex_lock(log->lock);
+  ring->next = log->rings;
+  /* The writer walks the list without the lock */
+  __sync_synchronize();
+  log->rings = ring;
+  sthread_mutex_unlock(log->lock);
+  sthread_setspecific(log->key, ring);
+  return ring;
+}
+
+/* Copy len bytes from src into ring at off, wrapping around its end */
+static void ring_put(struct ring *ring, unsigned long off, const void *src,
+                     size_t len) {
+  size_t first = RING_SIZE - (off & RING_MASK);
+
+  if (len <= first) {
+    memcpy(ring->bytes + (off & RING_MASK), src, len);
+  } else {
+    memcpy(ring->bytes + (off & RING_MASK), src, first);
+    memcpy(ring->bytes, (const char *)src + first, len - first);
+  }
+}
+
+/* Copy len bytes from ring at off into dst, wrapping around its end */
+static void ring_get(struct ring *ring, unsigned long off, void *dst,
+                     size_t len) {
+  size_t first = RING_SIZE - (off & RING_MASK);
+
+  if (len <= first) {
+    memcpy(dst, ring->bytes + (off & RING_MASK), len);
+  } else {
+    memcpy(dst, ring->bytes + (off & RING_MASK), first);
+    memcpy((char *)dst + first, ring->bytes, len - first);
+  }
+}
+
+/* The writer thread: writes out what the rings hold, a batch at a
+ * time, sleeping while they are empty, until the log is freed. */
+static void *writer_main(void *arg) {
+  web_log_t *log = (web_log_t *)arg;
+  drained_t drained;
+
+  for (;;) {
+    drained = log_drain(log);
+    if (drained != DRAINED_NOTHING) {
+      if (drained == DRAINED_SOME)
+        log_pause();
+      continue;
+    }
+    sthread_mutex_lock(log->lock);
+    if (log->stopping) {
+      sthread_mutex_unlock(log->lock);
+      break;
+    }
+    log->asleep = 1;
+    /* As in web_log_request: either a thread logging a request sees
+     * that the writer is asleep, or the writer sees the request */
+    __sync_synchronize();
+    if (!log_pending(log))
+      sthread_cond_wait(log->ready, log->lock);
+    log->asleep = 0;
+    sthread_mutex_unlock(log->lock);
+  }
+  return NULL;
+}
+
+/* Write out every record in the rings, and say how many there were */
+static drained_t log_drain(web_log_t *log) {
+  drained_t drained = DRAINED_NOTHING;
+  unsigned long head, dropped = 0;
+  struct ring *rings = log->rings, *ring;
+  time_t now;
+  int nrings = 0;
+
+  /* Rings made from here on wait for the next batch */
+  for (ring = rings; ring != NULL; ring = ring->next)
+    nrings++;
+  if (log->format == WEB_LOG_BINARY && log->max_iov < 2 * nrings) {
+    free(log->iov);
+    log->max_iov = 2 * nrings;
+    log->iov = (struct iovec *)malloc(log->max_iov * sizeof(struct iovec));
+    assert(log->iov != NULL);
+  }
+
+  for (ring = rings; ring != NULL; ring = ring->next) {
+    dropped += ring->dropped;
+    head = ring->head;
+    /* Read the records only once they are all there */
+    __sync_synchronize();
+    if (head - ring->taken >= BATCH_FULL)
+      drained = DRAINED_BEHIND;
+    else if (head != ring->taken && drained == DRAINED_NOTHING)
+      drained = DRAINED_SOME;
+    log_take(log, ring, head);
+  }
+  if (log->niov > 0 || log->text_len > 0)
+    log_flush(log);
+
+  if (dropped != log->dropped && (now = time(NULL)) != log->reported) {
+    fprintf(stderr, "sioux: access log fell behind; %lu records "
+            "dropped\n", dropped - log->dropped);
+    log->dropped = dropped;
+    log->reported = now;
+  }
+  return drained;
+}
+
+/* Return nonzero if any of the rings has records to write */
+static int log_pending(web_log_t *log) {
+  struct ring *ring;
+
+  for (ring = log->rings; ring != NULL; ring = ring->next)
+    if (ring->head != ring->tail)
+      return 1;
+  return 0;
+}
+
+/* Give the threads a while to log more before the next batch. With
+ * user-level threads, sleeping would stop them all, so just let them
+ * run for a while. */
+static void log_pause(void) {
+  struct timespec ts;
+
+  if (sthread_get_impl() == STHREAD_USER_IMPL) {
+    sthread_yield();
+    return;
+  }
+  ts.tv_sec = 0;
+  ts.tv_nsec = BATCH_INTERVAL * 1000;
+  nanosleep(&ts, NULL);
+}
+
+/* Add ring's records, up to head, to the batch being written: for a
+ * binary log, as they are in the ring; for a text log, as lines in the
+ * buffer, writing it out whenever it fills up. */
+static void log_take(web_log_t *log, struct ring *ring, unsigned long head) {
+  web_log_entry_t *entry = &log->entry;
+  unsigned long off = ring->taken & RING_MASK, len = head - ring->taken;
+
+  if (log->format == WEB_LOG_BINARY) {
+    if (len == 0)
+      return;
+    log->iov[log->niov].iov_base = ring->bytes + off;
+    log->iov[log->niov].iov_len = (len <= RING_SIZE - off) ? len
+                                                          : RING_SIZE - off;
+    log->niov++;
+    if (len > RING_SIZE - off) {
+      log->iov[log->niov].iov_base = ring->bytes;
+      log->iov[log->niov].iov_len = len - (RING_SIZE - off);
+      log->niov++;
+    }
+    ring->taken = head;
+    return;
+  }
+
+  while (ring->taken != head) {
+    if (TEXT_SIZE - log->text_len < LINE_MAX_SIZE)
+      log_flush(log);
+    ring_get(ring, ring->taken, &entry->rec, sizeof(entry->rec));
+    ring_get(ring, ring->taken + sizeof(entry->rec), entry->path,
+             entry->rec.path_len);
+    log->text_len += log_format(log, log->text + log->text_len, entry);
+    ring->taken += RECORD_SIZE(entry->rec.path_len);
+  }
+}
+
+/* Write out the batch, and give the records in it back to the
+ * rings. */
+static void log_flush(web_log_t *log) {
+  struct iovec text, *iov = log->iov;
+  int n = log->niov;
+  struct ring *ring;
+  ssize_t count;
+
+  if (log->format == WEB_LOG_TEXT) {
+    text.iov_base = log->text;
+    text.iov_len = log->text_len;
+    iov = &text;
+    n = 1;
+  }
+  while (n > 0) {
+    count = writev(log->fd, iov, n);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("sioux: error writing access log");
+      break;
+    }
+    while (n > 0 && (size_t)count >= iov->iov_len) {
+      count -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + count;
+      iov->iov_len -= count;
+    }
+  }
+  log->niov = 0;
+  log->text_len = 0;
+
+  /* The records have to be read before their space is reused */
+  __sync_synchronize();
+  for (ring = log->rings; ring != NULL; ring = ring->next)
+    ring->tail = ring->taken;
+}
+
+/* Format entry into buf as a line of text, returning its length: the
+ * Common Log Format (but without the protocol version, and with "-"
+ * for a request line that couldn't be parsed), then how long the
+ * response took, in microseconds. */
+static size_t log_format(web_log_t *log, char *buf,
+                         const web_log_entry_t *entry) {
+  const web_log_record_t *rec = &entry->rec;
+  const unsigned char *addr = (const unsigned char *)&rec->addr;
+  time_t t = rec->time / 1000000;
+  char *p = buf;
+  struct tm tm;
+  size_t len;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    p = put_number(p, addr[i]);
+    *p++ = (i < 3) ? '.' : ' ';
+  }
+  /* The same few dates come up again and again */
+  if (t != log->date_time) {
+    gmtime_r(&t, &tm);
+    log->date_len = strftime(log->date, sizeof(log->date),
+                             "- - [%d/%b/%Y:%H:%M:%S +0000] \"", &tm);
+    log->date_time = t;
+  }
+  memcpy(p, log->date, log->date_len);
+  p += log->date_len;
+  for (len = 0; len < sizeof(rec->method) && rec->method[len] != '\0'; len++)
+    ;
+  if (len == 0) {
+    *p++ = '-';
+  } else {
+    p = put_escaped(p, rec->method, len);
+    *p++ = ' ';
+    p = put_escaped(p, entry->path, rec->path_len);
+  }
+  *p++ = '"';
+  *p++ = ' ';
+  p = put_number(p, rec->status);
+  *p++ = ' ';
+  p = put_number(p, rec->bytes);
+  *p++ = ' ';
+  p = put_number(p, rec->duration);
+  *p++ = '\n';
+  assert((size_t)(p - buf) <= LINE_MAX_SIZE);
+  return p - buf;
+}
+
+/* Copy len bytes of s to p, returning where they end; any that aren't
+ * printable, and any quotes or backslashes, are escaped as \xHH. */
+static char *put_escaped(char *p, const char *s, size_t len) {
+  static const char hex[] = "0123456789ABCDEF";
+  unsigned char c;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    c = s[i];
+    if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = 'x';
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 0xf];
+    } else {
+      *p++ = c;
+    }
+  }
+  return p;
+}
+
+/* Write n in decimal at p, returning where it ends */
+static char *put_number(char *p, unsigned long long n) {
+  char digits[20];
+  int i = 0;
+
+  do {
+    digits[i++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  while (i > 0)
+    *p++ = digits[--i];
+  return p;
+}
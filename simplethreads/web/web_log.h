@@ -0,0 +1,75 @@
+/*
+ * web_log.h - The access log: a record of each request answered, kept
+ *             by the threads answering them without holding each
+ *             other (or themselves) up.
+ *
+ */
+
+#ifndef WEB_LOG_H
+#define WEB_LOG_H 1
+
+#include <stdint.h>
+
+typedef struct _web_log web_log_t;
+
+/* How the log is written */
+typedef enum {
+  WEB_LOG_TEXT,    /* a line per request, like the Common Log Format */
+  WEB_LOG_BINARY   /* each record as it is below */
+} web_log_format_t;
+
+/* Most bytes of the request target logged; longer ones are cut short */
+#define WEB_LOG_PATH_MAX 216
+
+/* A binary log starts with these 8 bytes, and then has one record after
+ * another: the fields below, in the server's byte order, then path_len
+ * bytes of the target, padded with NULs to a multiple of
+ * WEB_LOG_ALIGN bytes. */
+#define WEB_LOG_MAGIC "SIOUXLG1"
+#define WEB_LOG_ALIGN 8
+
+typedef struct {
+  uint64_t time;       /* when the request was read, in microseconds
+                        * since the epoch */
+  uint64_t bytes;      /* the length of the response's body */
+  uint32_t duration;   /* microseconds from then until the response
+                        * was sent */
+  uint32_t addr;       /* the client's IPv4 address, in network byte
+                        * order; 0 if it isn't known */
+  uint16_t status;
+  uint16_t path_len;
+  char method[12];     /* padded with NULs, or cut short */
+} web_log_record_t;
+
+/* A record, with the target it is followed by */
+typedef struct {
+  web_log_record_t rec;
+  char path[WEB_LOG_PATH_MAX];
+} web_log_entry_t;
+
+/* Start logging to the file at path (appending to it), one request in
+ * every sample, and start the thread that writes it. Returns NULL (and
+ * reports why) if the file can't be opened. */
+web_log_t *web_log_create(const char *path, web_log_format_t format,
+                          int sample);
+
+/* Write out everything logged so far, stop the writer thread and
+ * close the file. */
+void web_log_free(web_log_t *log);
+
+/* Return nonzero if the request the calling thread is starting on is
+ * to be logged, as one request in every sample. */
+int web_log_sample(web_log_t *log);
+
+/* Log entry (copying it), without waiting for it to be written. If the
+ * writer has fallen so far behind that the calling thread's records
+ * fill its buffer, the record is dropped, and counted. */
+void web_log_request(web_log_t *log, const web_log_entry_t *entry);
+
+/* Return nonzero if the writer thread has records to write. */
+int web_log_busy(web_log_t *log);
+
+/* Return the time, in microseconds since the epoch, as logged */
+uint64_t web_log_now(void);
+
+#endif /* WEB_LOG_H */
@@ -0,0 +1,105 @@
+/*
+ * web_mime.c - Maps file names to MIME types, with a table of
+ *              extensions kept in order, so that it can be binary
+ *              searched.
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <web_mime.h>
+
+/* Longest extension in the table */
+#define EXTENSION_MAX 8
+
+struct mime_type {
+  const char *extension;
+  const char *type;
+  int compressible;    /* worth compressing; mostly text */
+};
+
+/* Sorted by extension (all in lower case) */
+static const struct mime_type mime_types[] = {
+  { "avif",  "image/avif",              0 },
+  { "bmp",   "image/bmp",               1 },
+  { "css",   "text/css",                1 },
+  { "csv",   "text/csv",                1 },
+  { "gif",   "image/gif",               0 },
+  { "gz",    "application/gzip",        0 },
+  { "htm",   "text/html",               1 },
+  { "html",  "text/html",               1 },
+  { "ico",   "image/x-icon",            1 },
+  { "jpeg",  "image/jpeg",              0 },
+  { "jpg",   "image/jpeg",              0 },
+  { "js",    "text/javascript",         1 },
+  { "json",  "application/json",        1 },
+  { "md",    "text/markdown",           1 },
+  { "mjs",   "text/javascript",         1 },
+  { "mp3",   "audio/mpeg",              0 },
+  { "mp4",   "video/mp4",               0 },
+  { "ogg",   "audio/ogg",               0 },
+  { "otf",   "font/otf",                1 },
+  { "pdf",   "application/pdf",         0 },
+  { "png",   "image/png",               0 },
+  { "svg",   "image/svg+xml",           1 },
+  { "tar",   "application/x-tar",       0 },
+  { "ttf",   "font/ttf",                1 },
+  { "txt",   "text/plain",              1 },
+  { "wasm",  "application/wasm",        1 },
+  { "webm",  "video/webm",              0 },
+  { "webp",  "image/webp",              0 },
+  { "woff",  "font/woff",               0 },
+  { "woff2", "font/woff2",              0 },
+  { "xml",   "application/xml",         1 },
+  { "zip",   "application/zip",         0 },
+};
+
+#define NTYPES (sizeof(mime_types) / sizeof(mime_types[0]))
+
+static const char DEFAULT_TYPE[] = "application/octet-stream";
+
+static const struct mime_type *find_type(const char *path);
+static int compare_extension(const void *key, const void *elem);
+
+
+const char *web_mime_type(const char *path) {
+  const struct mime_type *found = find_type(path);
+
+  return (found != NULL) ? found->type : DEFAULT_TYPE;
+}
+
+int web_mime_compressible(const char *path) {
+  const struct mime_type *found = find_type(path);
+
+  return found != NULL && found->compressible;
+}
+
+static int compare_extension(const void *key, const void *elem) {
+  return strcmp((const char *)key,
+                ((const struct mime_type *)elem)->extension);
+}
+
+/* Return the table's entry for path's extension, or NULL */
+static const struct mime_type *find_type(const char *path) {
+  char extension[EXTENSION_MAX + 1];
+  const char *dot;
+  size_t len, i;
+
+  dot = strrchr(path, '.');
+  if (dot == NULL || strchr(dot, '/') != NULL)
+    return NULL;
+  len = strlen(dot + 1);
+  if (len == 0 || len > EXTENSION_MAX)
+    return NULL;
+  for (i = 0; i < len; i++)
+    extension[i] = (dot[1 + i] >= 'A' && dot[1 + i] <= 'Z') ?
+                   dot[1 + i] - 'A' + 'a' : dot[1 + i];
+  extension[len] = '\0';
+
+  return (const struct mime_type *)bsearch(extension, mime_types, NTYPES,
+                                           sizeof(mime_types[0]),
+                                           compare_extension);
+}
@@ -0,0 +1,19 @@
+/*
+ * web_mime.h - Maps file names to the MIME types sent as their
+ *              Content-Type.
+ *
+ */
+
+#ifndef WEB_MIME_H
+#define WEB_MIME_H 1
+
+/* Return the MIME type for the file at path, going by its extension.
+ * Files with an extension that isn't known, or none, are sent as
+ * application/octet-stream. */
+const char *web_mime_type(const char *path);
+
+/* Return nonzero if the file at path is of a type that compresses
+ * well, going by its extension. */
+int web_mime_compressible(const char *path);
+
+#endif /* WEB_MIME_H */
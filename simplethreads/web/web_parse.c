@@ -0,0 +1,304 @@
+/*
+ * web_parse.c - An incremental HTTP request parser.
+ *
+ *    The request is parsed a line at a time. Between calls the parser
+ *    remembers where the current line starts and how much of it has
+ *    been searched for its end, so every byte is only looked at once,
+ *    however many pieces the request arrives in. Lines may end in CRLF
+ *    or a bare LF.
+ *
+ *    Finding the ends of lines and fields is most of the work, so on
+ *    CPUs with SSE2 it is done 16 bytes at a time.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <web_parse.h>
+
+enum {
+  PARSE_REQUEST_LINE,
+  PARSE_HEADERS,
+  PARSE_DONE
+};
+
+static const char *find_char(const char *p, const char *end, char c);
+static int parse_request_line(web_request_t *req, const char *buf,
+                              const char *line, size_t len);
+static int parse_header(web_request_t *req, const char *buf,
+                        const char *line, size_t len);
+static const char *parse_number(const char *p, const char *end,
+                                off_t *n);
+static int zero_weight(const char *p, const char *end);
+
+
+void web_parse_init(web_request_t *req) {
+  req->state = PARSE_REQUEST_LINE;
+  req->line = 0;
+  req->scanned = 0;
+  req->end = 0;
+  req->nheaders = 0;
+}
+
+web_parse_status_t web_parse(web_request_t *req, const char *buf,
+                             size_t len) {
+  const char *line, *eol, *end = buf + len;
+  size_t line_len;
+
+  while (req->state != PARSE_DONE) {
+    line = buf + req->line;
+    eol = find_char(buf + req->scanned, end, '\n');
+    if (eol == end) {
+      req->scanned = len;
+      return WEB_PARSE_INCOMPLETE;
+    }
+    line_len = eol - line;
+    if (line_len > 0 && line[line_len - 1] == '\r')
+      line_len--;
+    req->line = req->scanned = eol + 1 - buf;
+
+    if (req->state == PARSE_REQUEST_LINE) {
+      /* Blank lines before a request are allowed, and ignored */
+      if (line_len == 0)
+        continue;
+      if (!parse_request_line(req, buf, line, line_len))
+        return WEB_PARSE_ERROR;
+      req->state = PARSE_HEADERS;
+    } else if (line_len == 0) {
+      /* A blank line ends the headers */
+      req->state = PARSE_DONE;
+      req->end = req->line;
+    } else if (!parse_header(req, buf, line, line_len)) {
+      return WEB_PARSE_ERROR;
+    }
+  }
+  return WEB_PARSE_DONE;
+}
+
+int web_parse_header(const web_request_t *req, const char *buf,
+                     const char *name) {
+  int i;
+
+  for (i = 0; i < req->nheaders; i++)
+    if (web_span_is(buf, req->names[i], name, 1))
+      return i;
+  return -1;
+}
+
+int web_span_is(const char *buf, web_span_t span, const char *str,
+                int nocase) {
+  if (span.len != strlen(str))
+    return 0;
+  if (nocase)
+    return strncasecmp(buf + span.off, str, span.len) == 0;
+  return memcmp(buf + span.off, str, span.len) == 0;
+}
+
+int web_parse_range(const char *value, size_t len, off_t size,
+                    web_range_t *ranges) {
+  const char *p = value, *end = value + len;
+  off_t first, last;
+  int n = 0, suffix;
+
+  if (len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+    return -1;
+  p += 6;
+
+  for (;;) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    /* "first-last", "first-" (to the end), or "-n" (the last n) */
+    suffix = (p < end && *p == '-');
+    if (!suffix && (p = parse_number(p, end, &first)) == NULL)
+      return -1;
+    if (p == end || *p++ != '-')
+      return -1;
+    if (p < end && *p >= '0' && *p <= '9') {
+      if ((p = parse_number(p, end, &last)) == NULL)
+        return -1;
+      if (!suffix && last < first)
+        return -1;
+    } else if (suffix) {
+      return -1;
+    } else {
+      last = size - 1;
+    }
+    if (suffix) {
+      first = (last < size) ? size - last : 0;
+      last = size - 1;
+    } else if (last >= size) {
+      last = size - 1;
+    }
+
+    if (first <= last) {
+      if (n == WEB_MAX_RANGES)
+        return -1;
+      ranges[n].first = first;
+      ranges[n].last = last;
+      n++;
+    }
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    if (p == end)
+      return n;
+    if (*p++ != ',')
+      return -1;
+  }
+}
+
+/* Parse the decimal number at p into n, returning where it ends, or
+ * NULL if there isn't one there or it is too big. */
+static const char *parse_number(const char *p, const char *end, off_t *n) {
+  const char *start = p;
+
+  *n = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (p - start == 18)  /* any more might not fit in an off_t */
+      return NULL;
+    *n = *n * 10 + (*p++ - '0');
+  }
+  return (p == start) ? NULL : p;
+}
+
+int web_parse_accepts(const char *value, size_t len, const char *coding) {
+  const char *end = value + len, *item, *item_end, *name_end;
+  size_t coding_len = strlen(coding);
+  int star = 0;
+
+  for (item = value; item < end; item = item_end + 1) {
+    item_end = find_char(item, end, ',');
+    while (item < item_end && (*item == ' ' || *item == '\t'))
+      item++;
+    for (name_end = item; name_end < item_end && *name_end != ';' &&
+         *name_end != ' ' && *name_end != '\t'; name_end++)
+      ;
+    if ((size_t)(name_end - item) == coding_len &&
+        strncasecmp(item, coding, coding_len) == 0)
+      return !zero_weight(name_end, item_end);
+    if (name_end - item == 1 && *item == '*')
+      star = !zero_weight(name_end, item_end);
+  }
+  return star;
+}
+
+int web_parse_etag_listed(const char *value, size_t len, const char *etag) {
+  const char *end = value + len, *tag, *tag_end;
+  size_t etag_len = strlen(etag);
+
+  for (tag = value; tag < end; tag = tag_end + 1) {
+    tag_end = find_char(tag, end, ',');
+    while (tag < tag_end && (*tag == ' ' || *tag == '\t'))
+      tag++;
+    if (tag_end - tag >= 2 && tag[0] == 'W' && tag[1] == '/')
+      tag += 2;
+    len = tag_end - tag;
+    while (len > 0 && (tag[len - 1] == ' ' || tag[len - 1] == '\t'))
+      len--;
+    if ((len == 1 && tag[0] == '*') ||
+        (len == etag_len && memcmp(tag, etag, len) == 0))
+      return 1;
+  }
+  return 0;
+}
+
+/* Return nonzero if the parameters in [p, end), after the name of an
+ * item in a list, give it a weight of q=0: say not to use it. */
+static int zero_weight(const char *p, const char *end) {
+  for (;;) {
+    p = find_char(p, end, ';');
+    if (p == end)
+      return 0;
+    for (p++; p < end && (*p == ' ' || *p == '\t'); p++)
+      ;
+    if (end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+      p += 2;
+      if (p == end || *p != '0')
+        return 0;
+      for (p++; p < end && (*p == '.' || *p == '0'); p++)
+        ;
+      return p == end || *p == ' ' || *p == '\t' || *p == ';';
+    }
+  }
+}
+
+/* Return the first c in [p, end), or end if there is none. */
+static const char *find_char(const char *p, const char *end, char c) {
+#ifdef __SSE2__
+  __m128i want = _mm_set1_epi8(c);
+  int mask;
+
+  while (end - p >= 16) {
+    mask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), want));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != c)
+    p++;
+  return p;
+}
+
+/* Split "METHOD target version" into its fields. Returns 0 if it
+ * doesn't look like that. */
+static int parse_request_line(web_request_t *req, const char *buf,
+                              const char *line, size_t len) {
+  const char *end = line + len, *target, *version;
+
+  target = find_char(line, end, ' ');
+  if (target == line || target == end)
+    return 0;
+  target++;
+  version = find_char(target, end, ' ');
+  if (version == target || version == end)
+    return 0;
+  version++;
+  if (end - version < 5 || memcmp(version, "HTTP/", 5) != 0)
+    return 0;
+
+  req->method.off = line - buf;
+  req->method.len = target - 1 - line;
+  req->target.off = target - buf;
+  req->target.len = version - 1 - target;
+  req->version.off = version - buf;
+  req->version.len = end - version;
+  return 1;
+}
+
+/* Split "Name: value" into its name and value, without the white space
+ * around the value. Returns 0 if it doesn't look like that, or there
+ * are too many headers. */
+static int parse_header(web_request_t *req, const char *buf, const char *line,
+                        size_t len) {
+  const char *end = line + len, *colon, *value;
+
+  /* Headers continued onto more than one line are obsolete */
+  if (line[0] == ' ' || line[0] == '\t')
+    return 0;
+  colon = find_char(line, end, ':');
+  if (colon == line || colon == end)
+    return 0;
+  if (req->nheaders == WEB_MAX_HEADERS)
+    return 0;
+
+  for (value = colon + 1; value < end && (*value == ' ' || *value == '\t');
+       value++)
+    ;
+  while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+    end--;
+
+  req->names[req->nheaders].off = line - buf;
+  req->names[req->nheaders].len = colon - line;
+  req->values[req->nheaders].off = value - buf;
+  req->values[req->nheaders].len = end - value;
+  req->nheaders++;
+  return 1;
+}
@@ -0,0 +1,84 @@
+/*
+ * web_parse.h - An incremental HTTP request parser. It can be handed
+ *               the request as it arrives, a piece at a time, and
+ *               picks up where it left off; what it finds is recorded
+ *               as offsets into the caller's buffer, so it allocates
+ *               nothing and copies nothing.
+ *
+ */
+
+#ifndef WEB_PARSE_H
+#define WEB_PARSE_H 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Most headers a request may have */
+#define WEB_MAX_HEADERS 32
+
+/* Most byte ranges a Range header may ask for */
+#define WEB_MAX_RANGES 16
+
+/* Part of the buffer: len bytes starting at off */
+typedef struct {
+  size_t off, len;
+} web_span_t;
+
+typedef struct {
+  int state;
+  size_t line;           /* where the line being parsed starts */
+  size_t scanned;        /* how far it has been searched for its end */
+  size_t end;            /* length of the whole request, once parsed */
+  web_span_t method, target, version;
+  int nheaders;
+  web_span_t names[WEB_MAX_HEADERS], values[WEB_MAX_HEADERS];
+} web_request_t;
+
+typedef enum {
+  WEB_PARSE_DONE,        /* the request is complete */
+  WEB_PARSE_INCOMPLETE,  /* call again once there is more of it */
+  WEB_PARSE_ERROR        /* it is malformed */
+} web_parse_status_t;
+
+/* Get ready to parse a new request, at the start of the buffer. */
+void web_parse_init(web_request_t *req);
+
+/* Parse the first len bytes of buf, which hold the request so far:
+ * the same bytes as last time, and perhaps more. Bytes past the end of
+ * the request (the start of the next one) are left alone. */
+web_parse_status_t web_parse(web_request_t *req, const char *buf,
+                             size_t len);
+
+/* Return the index of the header named name (ignoring case) in a
+ * parsed request, or -1 if it has none. */
+int web_parse_header(const web_request_t *req, const char *buf,
+                     const char *name);
+
+/* Bytes first through last of a file */
+typedef struct {
+  off_t first, last;
+} web_range_t;
+
+/* Parse the len-byte value of a Range header for a file of size
+ * bytes into ranges, dropping those that start past the end, and
+ * return how many there are (0 if none can be satisfied). Returns -1
+ * if the header should be ignored, because it is malformed or asks for
+ * more than WEB_MAX_RANGES ranges. */
+int web_parse_range(const char *value, size_t len, off_t size,
+                    web_range_t *ranges);
+
+/* Return nonzero if the len-byte value of an Accept-Encoding header
+ * (or the like) accepts coding: if it lists coding, or else "*",
+ * without a weight of q=0. */
+int web_parse_accepts(const char *value, size_t len, const char *coding);
+
+/* Return nonzero if the len-byte value of an If-None-Match header (or
+ * the like), a comma-separated list of entity tags, is "*" or includes
+ * etag, weak (W/) or not. */
+int web_parse_etag_listed(const char *value, size_t len, const char *etag);
+
+/* Return nonzero if span is the string str (ignoring case if nocase) */
+int web_span_is(const char *buf, web_span_t span, const char *str,
+                int nocase);
+
+#endif /* WEB_PARSE_H */
@@ -1,5 +1,79 @@
 /*
- * web_queue.c - An empty file. Use it if you wish, don't if you don't.
- * 
+ * web_queue.c - A bounded queue of accepted connections: a ring buffer
+ *               of file descriptors protected by an sthread mutex, with
+ *               condition variables for waiting while it is full or
+ *               empty.
+ *
  */
 
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sthread.h>
+
+#include <web_queue.h>
+
+struct _web_queue {
+  sthread_mutex_t lock;
+  sthread_cond_t not_empty;
+  sthread_cond_t not_full;
+  int *conns;      /* ring buffer of capacity entries */
+  int capacity;
+  int head;        /* index of the oldest connection */
+  int count;
+};
+
+web_queue_t *web_queue_create(int capacity) {
+  web_queue_t *queue;
+
+  assert(capacity > 0);
+  queue = (web_queue_t *)malloc(sizeof(web_queue_t));
+  assert(queue != NULL);
+  queue->conns = (int *)malloc(capacity * sizeof(int));
+  assert(queue->conns != NULL);
+  queue->lock = sthread_mutex_init();
+  queue->not_empty = sthread_cond_init();
+  queue->not_full = sthread_cond_init();
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->count = 0;
+  return queue;
+}
+
+void web_queue_free(web_queue_t *queue) {
+  while (queue->count > 0) {
+    close(queue->conns[queue->head]);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+  }
+  sthread_cond_free(queue->not_full);
+  sthread_cond_free(queue->not_empty);
+  sthread_mutex_free(queue->lock);
+  free(queue->conns);
+  free(queue);
+}
+
+void web_queue_put(web_queue_t *queue, int conn) {
+  sthread_mutex_lock(queue->lock);
+  while (queue->count == queue->capacity)
+    sthread_cond_wait(queue->not_full, queue->lock);
+  queue->conns[(queue->head + queue->count) % queue->capacity] = conn;
+  queue->count++;
+  sthread_cond_signal(queue->not_empty);
+  sthread_mutex_unlock(queue->lock);
+}
+
+int web_queue_get(web_queue_t *queue) {
+  int conn;
+
+  sthread_mutex_lock(queue->lock);
+  while (queue->count == 0)
+    sthread_cond_wait(queue->not_empty, queue->lock);
+  conn = queue->conns[queue->head];
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+  sthread_cond_signal(queue->not_full);
+  sthread_mutex_unlock(queue->lock);
+  return conn;
+}
@@ -1,12 +1,25 @@
 /*
- * web_queue.h - An empty file. Use it if you wish, don't if you don't.
- * 
+ * web_queue.h - A bounded queue of accepted connections, handed from the
+ *               accept thread to the worker threads.
+ *
  */
 
 #ifndef WEB_QUEUE_H
 #define WEB_QUEUE_H 1
 
+typedef struct _web_queue web_queue_t;
 
-#endif /* WEB_QUEUE_H */
+/* Return a new, empty queue that holds up to capacity connections. */
+web_queue_t *web_queue_create(int capacity);
+
+/* Free a queue. Any connections still in it are closed. */
+void web_queue_free(web_queue_t *queue);
 
+/* Add conn to the queue, blocking while it is full. */
+void web_queue_put(web_queue_t *queue, int conn);
 
+/* Remove and return the oldest connection, blocking while the queue is
+ * empty. */
+int web_queue_get(web_queue_t *queue);
+
+#endif /* WEB_QUEUE_H */